@@ -29,11 +29,21 @@
 #include <uthash.h>
 #include <utlist.h>
 
+#ifdef USE_LIBEVENT
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/thread.h>
+#endif
+
 #include "compat.h"
 #include "deviceapi.h"
+#include "history.h"
 #ifdef USE_LIBMICROHTTPD
 #include "httpsrv.h"
 #endif
+#include "metrics.h"
 #include "miner.h"
 #include "util.h"
 #include "driver-cpu.h" /* for algo_names[], TODO: re-factor dependency */
@@ -55,7 +65,6 @@ static const char *UNAVAILABLE = " - API will not be available";
 static const char *MUNAVAILABLE = " - API multicast listener will not be available";
 
 static const char *BLANK = "";
-static const char *COMMA = ",";
 #define COMSTR ","
 static const char SEPARATOR = '|';
 #define SEPSTR "|"
@@ -185,6 +194,7 @@ static const char ISJSON = '{';
 
 static const char *JSON_COMMAND = "command";
 static const char *JSON_PARAMETER = "parameter";
+static const char *JSON_KEEPALIVE = "keepalive";
 
 #define MSG_INVGPU 1
 #define MSG_ALRENA 2
@@ -314,6 +324,8 @@ static const char *JSON_PARAMETER = "parameter";
 
 #define MSG_INVSTRATEGY 0x102
 #define MSG_FAILPORT 0x103
+#define MSG_NOWATCH 0x104
+#define MSG_DEVHISTORY 0x105
 
 #define USE_ALTMSG 0x4000
 
@@ -468,6 +480,8 @@ struct CODES {
  { SEVERITY_ERR,   MSG_INVNEG,	PARAM_BOTH,	"Invalid negative number (%d) for '%s'" },
  { SEVERITY_ERR,   MSG_INVSTRATEGY,	PARAM_STR,	"Invalid strategy for '%s'" },
  { SEVERITY_ERR,   MSG_FAILPORT,	PARAM_BOTH,	"Failed to set port (%d) for '%s'" },
+ { SEVERITY_ERR,   MSG_NOWATCH,	PARAM_NONE,	"Watch is only available as a single command on an event-driven API server" },
+ { SEVERITY_SUCC,  MSG_DEVHISTORY,PARAM_NONE,	"Device History" },
  { SEVERITY_SUCC,  MSG_SETQUOTA,PARAM_SET,	"Set pool '%s' to quota %d'" },
  { SEVERITY_ERR,   MSG_CONPAR,	PARAM_NONE,	"Missing config parameters 'name,N'" },
  { SEVERITY_ERR,   MSG_CONVAL,	PARAM_STR,	"Missing config value N for '%s,N'" },
@@ -499,8 +513,6 @@ static pthread_mutex_t quit_restart_lock;
 static bool do_a_quit;
 static bool do_a_restart;
 
-static time_t when = 0;	// when the request occurred
-static bool per_proc;
 
 struct IP4ACCESS {
 	in_addr_t ip;
@@ -531,6 +543,9 @@ struct io_data {
 	
 	// Whether to add various things
 	bool close;
+	
+	time_t when;  // when the request occurred
+	bool per_proc;
 };
 static struct io_data *rpc_io_data;
 
@@ -597,24 +612,59 @@ size_t io_flush(struct io_data *io_data, bool complete)
 	return sent;
 }
 
-static bool io_add(struct io_data *io_data, char *buf)
+static bool io_add(struct io_data *io_data, const char *buf)
 {
 	size_t len = strlen(buf);
-	if (bytes_len(&io_data->data) + len > RPC_SOCKBUFSIZ)
+	if (bytes_len(&io_data->data) + len > RPC_SOCKBUFSIZ && io_data->sock != INVSOCK)
 		io_flush(io_data, false);
 	bytes_append(&io_data->data, buf, len);
 	return true;
 }
 
+static void io_addf(struct io_data * const io_data, const char * const fmt, ...) FORMAT_SYNTAX_CHECK(printf, 2, 3);
+
+static void io_addf(struct io_data * const io_data, const char * const fmt, ...)
+{
+	va_list ap;
+	
+	va_start(ap, fmt);
+	bytes_vappendf(&io_data->data, fmt, ap);
+	va_end(ap);
+}
+
+// Like escape_string, but straight into the output
+static void io_add_escaped(struct io_data * const io_data, const char *str, const bool isjson)
+{
+	const char * const escapes = isjson ? "\"\\" : ",|=\\";
+	size_t len;
+	
+	while (true)
+	{
+		len = strcspn(str, escapes);
+		bytes_append(&io_data->data, str, len);
+		str += len;
+		if (!*str)
+			break;
+		bytes_append(&io_data->data, "\\", 1);
+		bytes_append(&io_data->data, str++, 1);
+	}
+}
+
 static void io_close(struct io_data *io_data)
 {
 	io_data->close = true;
 }
 
+static
+void sock_io_free(struct io_data * const io_data)
+{
+	bytes_free(&io_data->data);
+	free(io_data);
+}
+
 static void io_free()
 {
-	bytes_free(&rpc_io_data->data);
-	free(rpc_io_data);
+	sock_io_free(rpc_io_data);
 	rpc_io_data = NULL;
 }
 
@@ -707,46 +757,23 @@ static struct api_data *api_add_extra(struct api_data *root, struct api_data *ex
 	return root;
 }
 
+// The node, its name, and any copied data are all a single allocation
 static
 struct api_data *api_add_data_full(struct api_data *root, const char * const name, enum api_data_type type, const void *data, bool copy_data)
 {
 	struct api_data *api_data;
-
-	api_data = (struct api_data *)malloc(sizeof(struct api_data));
-
-	api_data->name = strdup(name);
-	api_data->type = type;
-
-	if (root == NULL) {
-		root = api_data;
-		root->prev = root;
-		root->next = root;
-	}
-	else {
-		api_data->prev = root->prev;
-		root->prev = api_data;
-		api_data->next = root;
-		api_data->prev->next = api_data;
-	}
-
-	api_data->data_was_malloc = copy_data;
+	const size_t namesz = strlen(name) + 1;
+	size_t datalen = 0;
 
 	// Avoid crashing on bad data
 	if (data == NULL) {
-		api_data->type = type = API_CONST;
+		type = API_CONST;
 		data = NULLSTR;
-		api_data->data_was_malloc = copy_data = false;
+		copy_data = false;
 	}
 
-	if (!copy_data)
+	if (copy_data)
 	{
-		api_data->data = data;
-		if (type == API_JSON)
-			json_incref((json_t *)data);
-	}
-	else
-	{
-		size_t datalen = 0;
 		switch(type) {
 			case API_ESCAPE:
 			case API_STRING:
@@ -799,22 +826,48 @@ struct api_data *api_add_data_full(struct api_data *root, const char * const nam
 				datalen = sizeof(float);
 				break;
 			case API_JSON:
-				api_data->data_was_malloc = false;
-				api_data->data = json_deep_copy((json_t *)data);
+				data = json_deep_copy((json_t *)data);
+				copy_data = false;
 				break;
 			default:
 				applog(LOG_ERR, "API: unknown1 data type %d ignored", type);
-				api_data->type = API_STRING;
-				api_data->data_was_malloc = false;
-				api_data->data = UNKNOWN;
+				type = API_STRING;
+				data = UNKNOWN;
+				copy_data = false;
 				break;
 		}
-		if (datalen)
-		{
-			void * const copied_data = malloc(datalen);
-			memcpy(copied_data, data, datalen);
-			api_data->data = copied_data;
-		}
+	}
+	else
+	if (type == API_JSON)
+		json_incref((json_t *)data);
+
+	// Copied data goes first, since it needs the alignment
+	api_data = malloc(sizeof(*api_data) + datalen + namesz);
+	if (unlikely(!api_data))
+		quithere(1, "OOM api_data");
+	api_data->type = type;
+	api_data->data_was_malloc = copy_data;
+	if (copy_data)
+	{
+		void * const copied_data = &api_data[1];
+		memcpy(copied_data, data, datalen);
+		api_data->data = copied_data;
+	}
+	else
+		api_data->data = data;
+	api_data->name = &((char *)&api_data[1])[datalen];
+	memcpy(api_data->name, name, namesz);
+
+	if (root == NULL) {
+		root = api_data;
+		root->prev = root;
+		root->next = root;
+	}
+	else {
+		api_data->prev = root->prev;
+		root->prev = api_data;
+		api_data->next = root;
+		api_data->prev->next = api_data;
 	}
 
 	return root;
@@ -946,134 +999,120 @@ struct api_data *api_add_percent(struct api_data * const root, const char * cons
 	return api_add_data_full(root, name, API_PERCENT, data, copy_data);
 }
 
-static struct api_data *print_data(struct api_data *root, char *buf, bool isjson, bool precom)
+static struct api_data *print_data(struct io_data * const io_data, struct api_data *root, bool isjson, bool precom)
 {
 	struct api_data *tmp;
 	bool first = true;
-	char *original, *escape;
-	char *quote;
+	char *escape;
+	const char *quote;
 
-	*buf = '\0';
-
-	if (precom) {
-		*(buf++) = *COMMA;
-		*buf = '\0';
-	}
+	if (precom)
+		io_add(io_data, COMSTR);
 
 	if (isjson) {
-		strcpy(buf, JSON0);
-		buf = strchr(buf, '\0');
+		io_add(io_data, JSON0);
 		quote = JSON1;
 	} else
-		quote = (char *)BLANK;
+		quote = BLANK;
 
 	while (root) {
 		if (!first)
-			*(buf++) = *COMMA;
+			io_add(io_data, COMSTR);
 		else
 			first = false;
 
-		sprintf(buf, "%s%s%s%s", quote, root->name, quote, isjson ? ":" : "=");
-
-		buf = strchr(buf, '\0');
+		io_addf(io_data, "%s%s%s%s", quote, root->name, quote, isjson ? ":" : "=");
 
 		switch(root->type) {
 			case API_STRING:
 			case API_CONST:
-				sprintf(buf, "%s%s%s", quote, (char *)(root->data), quote);
+				io_addf(io_data, "%s%s%s", quote, (char *)(root->data), quote);
 				break;
 			case API_ESCAPE:
-				original = (char *)(root->data);
-				escape = escape_string((char *)(root->data), isjson);
-				sprintf(buf, "%s%s%s", quote, escape, quote);
-				if (escape != original)
-					free(escape);
+				io_add(io_data, quote);
+				io_add_escaped(io_data, root->data, isjson);
+				io_add(io_data, quote);
 				break;
 			case API_UINT8:
-				sprintf(buf, "%u", *(uint8_t *)root->data);
+				io_addf(io_data, "%u", *(uint8_t *)root->data);
 				break;
 			case API_INT16:
-				sprintf(buf, "%d", *(int16_t *)root->data);
+				io_addf(io_data, "%d", *(int16_t *)root->data);
 				break;
 			case API_UINT16:
-				sprintf(buf, "%u", *(uint16_t *)root->data);
+				io_addf(io_data, "%u", *(uint16_t *)root->data);
 				break;
 			case API_INT:
-				sprintf(buf, "%d", *((int *)(root->data)));
+				io_addf(io_data, "%d", *((int *)(root->data)));
 				break;
 			case API_UINT:
-				sprintf(buf, "%u", *((unsigned int *)(root->data)));
+				io_addf(io_data, "%u", *((unsigned int *)(root->data)));
 				break;
 			case API_UINT32:
-				sprintf(buf, "%"PRIu32, *((uint32_t *)(root->data)));
+				io_addf(io_data, "%"PRIu32, *((uint32_t *)(root->data)));
 				break;
 			case API_UINT64:
-				sprintf(buf, "%"PRIu64, *((uint64_t *)(root->data)));
+				io_addf(io_data, "%"PRIu64, *((uint64_t *)(root->data)));
 				break;
 			case API_TIME:
-				sprintf(buf, "%lu", *((unsigned long *)(root->data)));
+				io_addf(io_data, "%lu", *((unsigned long *)(root->data)));
 				break;
 			case API_DOUBLE:
-				sprintf(buf, "%f", *((double *)(root->data)));
+				io_addf(io_data, "%f", *((double *)(root->data)));
 				break;
 			case API_ELAPSED:
-				sprintf(buf, "%.0f", *((double *)(root->data)));
+				io_addf(io_data, "%.0f", *((double *)(root->data)));
 				break;
 			case API_UTILITY:
 			case API_FREQ:
 			case API_MHS:
-				sprintf(buf, "%.3f", *((double *)(root->data)));
+				io_addf(io_data, "%.3f", *((double *)(root->data)));
 				break;
 			case API_VOLTS:
-				sprintf(buf, "%.3f", *((float *)(root->data)));
+				io_addf(io_data, "%.3f", *((float *)(root->data)));
 				break;
 			case API_MHTOTAL:
-				sprintf(buf, "%.4f", *((double *)(root->data)));
+				io_addf(io_data, "%.4f", *((double *)(root->data)));
 				break;
 			case API_HS:
-				sprintf(buf, "%.15f", *((double *)(root->data)));
+				io_addf(io_data, "%.15f", *((double *)(root->data)));
 				break;
 			case API_DIFF:
 			{
 				const double *fp = root->data;
 				if (fmod(*fp, 1.))
-					sprintf(buf, "%.8f", *fp);
+					io_addf(io_data, "%.8f", *fp);
 				else
-					sprintf(buf, "%.0f", *fp);
+					io_addf(io_data, "%.0f", *fp);
 				break;
 			}
 			case API_BOOL:
-				sprintf(buf, "%s", *((bool *)(root->data)) ? TRUESTR : FALSESTR);
+				io_add(io_data, *((bool *)(root->data)) ? TRUESTR : FALSESTR);
 				break;
 			case API_TIMEVAL:
-				sprintf(buf, "%"PRIu64".%06lu",
+				io_addf(io_data, "%"PRIu64".%06lu",
 					(uint64_t)((struct timeval *)(root->data))->tv_sec,
 					(unsigned long)((struct timeval *)(root->data))->tv_usec);
 				break;
 			case API_TEMP:
-				sprintf(buf, "%.2f", *((float *)(root->data)));
+				io_addf(io_data, "%.2f", *((float *)(root->data)));
 				break;
 			case API_JSON:
 				escape = json_dumps((json_t *)(root->data), JSON_COMPACT);
-				strcpy(buf, escape);
+				io_add(io_data, escape);
 				free(escape);
 				break;
 			case API_PERCENT:
-				sprintf(buf, "%.4f", *((double *)(root->data)) * 100.0);
+				io_addf(io_data, "%.4f", *((double *)(root->data)) * 100.0);
 				break;
 			default:
 				applog(LOG_ERR, "API: unknown2 data type %d ignored", root->type);
-				sprintf(buf, "%s%s%s", quote, UNKNOWN, quote);
+				io_addf(io_data, "%s%s%s", quote, UNKNOWN, quote);
 				break;
 		}
 
-		buf = strchr(buf, '\0');
-
-		free(root->name);
 		if (root->type == API_JSON)
 			json_decref((json_t *)root->data);
-		if (root->data_was_malloc)
-			free((void*)root->data);
 
 		if (root->next == root) {
 			free(root);
@@ -1087,20 +1126,20 @@ static struct api_data *print_data(struct api_data *root, char *buf, bool isjson
 		}
 	}
 
-	strcpy(buf, isjson ? JSON5 : SEPSTR);
+	io_add(io_data, isjson ? JSON5 : SEPSTR);
 
 	return root;
 }
 
 #ifdef HAVE_AN_FPGA
-static int numpgas()
+static int numpgas(const struct io_data * const io_data)
 {
 	int count = 0;
 	int i;
 
 	rd_lock(&devices_lock);
 	for (i = 0; i < total_devices; i++) {
-		if (devices[i]->device != devices[i] && !per_proc)
+		if (devices[i]->device != devices[i] && !io_data->per_proc)
 			continue;
 		++count;
 	}
@@ -1108,14 +1147,14 @@ static int numpgas()
 	return count;
 }
 
-static int pgadevice(int pgaid)
+static int pgadevice(const struct io_data * const io_data, int pgaid)
 {
 	int count = 0;
 	int i;
 
 	rd_lock(&devices_lock);
 	for (i = 0; i < total_devices; i++) {
-		if (devices[i]->device != devices[i] && !per_proc)
+		if (devices[i]->device != devices[i] && !io_data->per_proc)
 			continue;
 		++count;
 		if (count == (pgaid + 1))
@@ -1139,7 +1178,6 @@ static void message(struct io_data * const io_data, const int messageid2, const
 {
 	struct api_data *root = NULL;
 	char buf[TMPBUFSIZ];
-	char buf2[TMPBUFSIZ];
 	char severity[2];
 #ifdef HAVE_AN_FPGA
 	int pga;
@@ -1190,7 +1228,7 @@ static void message(struct io_data * const io_data, const int messageid2, const
 #endif
 #ifdef HAVE_AN_FPGA
 				case PARAM_PGAMAX:
-					pga = numpgas();
+					pga = numpgas(io_data);
 					sprintf(buf, codes[i].description, paramid, pga - 1);
 					break;
 #endif
@@ -1210,7 +1248,7 @@ static void message(struct io_data * const io_data, const int messageid2, const
 					sprintf(buf, codes[i].description, paramid, total_pools - 1);
 					break;
 				case PARAM_DMAX:
-					pga = numpgas();
+					pga = numpgas(io_data);
 
 					sprintf(buf, codes[i].description
 						, pga
@@ -1237,13 +1275,12 @@ static void message(struct io_data * const io_data, const int messageid2, const
 			}
 
 			root = api_add_string(root, _STATUS, severity, false);
-			root = api_add_time(root, "When", &when, false);
+			root = api_add_time(root, "When", &io_data->when, false);
 			root = api_add_int(root, "Code", &messageid, false);
 			root = api_add_escape(root, "Msg", buf, false);
 			root = api_add_escape(root, "Description", opt_api_description, false);
 
-			root = print_data(root, buf2, isjson, false);
-			io_add(io_data, buf2);
+			root = print_data(io_data, root, isjson, false);
 			if (isjson)
 				io_add(io_data, JSON_CLOSE);
 			return;
@@ -1251,15 +1288,14 @@ static void message(struct io_data * const io_data, const int messageid2, const
 	}
 
 	root = api_add_string(root, _STATUS, "F", false);
-	root = api_add_time(root, "When", &when, false);
+	root = api_add_time(root, "When", &io_data->when, false);
 	int id = -1;
 	root = api_add_int(root, "Code", &id, false);
 	sprintf(buf, "%d", messageid);
 	root = api_add_escape(root, "Msg", buf, false);
 	root = api_add_escape(root, "Description", opt_api_description, false);
 
-	root = print_data(root, buf2, isjson, false);
-	io_add(io_data, buf2);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson)
 		io_add(io_data, JSON_CLOSE);
 }
@@ -1267,7 +1303,6 @@ static void message(struct io_data * const io_data, const int messageid2, const
 static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	message(io_data, MSG_VERSION, 0, NULL, isjson);
@@ -1277,8 +1312,7 @@ static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	root = api_add_string(root, "CGMiner", bfgminer_ver, false);
 	root = api_add_const(root, "API", APIVERSION, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -1307,7 +1341,7 @@ static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 #endif
 
 #ifdef HAVE_AN_FPGA
-	pgacount = numpgas();
+	pgacount = numpgas(io_data);
 #endif
 
 	message(io_data, MSG_MINECONFIG, 0, NULL, isjson);
@@ -1355,8 +1389,7 @@ static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 		root = api_add_string(root, buf, configfile->filename, false);
 	}
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -1367,7 +1400,7 @@ bool2str(bool b)
 	return b ? YES : NO;
 }
 
-static const char *status2str(enum alive status)
+const char *status2str(enum alive status)
 {
 	switch (status) {
 		case LIFE_WELL:
@@ -1392,19 +1425,19 @@ static const char *status2str(enum alive status)
 }
 
 static
-struct api_data *api_add_device_identifier(struct api_data *root, struct cgpu_info *cgpu)
+struct api_data *api_add_device_identifier(const struct io_data * const io_data, struct api_data *root, struct cgpu_info *cgpu)
 {
 	root = api_add_string(root, "Name", cgpu->drv->name, false);
 	root = api_add_int(root, "ID", &(cgpu->device_id), false);
-	if (per_proc)
+	if (io_data->per_proc)
 		root = api_add_int(root, "ProcID", &(cgpu->proc_id), false);
 	return root;
 }
 
 static
-int find_index_by_cgpu(struct cgpu_info *cgpu)
+int find_index_by_cgpu(const struct io_data * const io_data, struct cgpu_info *cgpu)
 {
-	if (per_proc)
+	if (io_data->per_proc)
 		return cgpu->cgminer_id;
 	
 	int n = 0, i;
@@ -1426,16 +1459,15 @@ int find_index_by_cgpu(struct cgpu_info *cgpu)
 static void devdetail_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson, bool precom)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	int n;
 
 	cgpu_utility(cgpu);
 
-	n = find_index_by_cgpu(cgpu);
+	n = find_index_by_cgpu(io_data, cgpu);
 
 	root = api_add_int(root, "DEVDETAILS", &n, true);
-	root = api_add_device_identifier(root, cgpu);
-	if (!per_proc)
+	root = api_add_device_identifier(io_data, root, cgpu);
+	if (!io_data->per_proc)
 		root = api_add_int(root, "Processors", &cgpu->procs, false);
 	root = api_add_string(root, "Driver", cgpu->drv->dname, false);
 	if (cgpu->kname)
@@ -1454,11 +1486,10 @@ static void devdetail_an(struct io_data *io_data, struct cgpu_info *cgpu, bool i
 	root = api_add_int(root, "Target Temperature", &cgpu->targettemp, false);
 	root = api_add_int(root, "Cutoff Temperature", &cgpu->cutofftemp, false);
 
-	if ((per_proc || cgpu->procs <= 1) && cgpu->drv->get_api_extra_device_detail)
+	if ((io_data->per_proc || cgpu->procs <= 1) && cgpu->drv->get_api_extra_device_detail)
 		root = api_add_extra(root, cgpu->drv->get_api_extra_device_detail(cgpu));
 
-	root = print_data(root, buf, isjson, precom);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, precom);
 }
 
 static
@@ -1466,10 +1497,9 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 {
 	struct cgpu_info *proc;
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	int n;
 
-	n = find_index_by_cgpu(cgpu);
+	n = find_index_by_cgpu(io_data, cgpu);
 
 	double runtime = cgpu_runtime(cgpu);
 	bool enabled = false;
@@ -1482,7 +1512,7 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 	int last_share_pool = -1;
 	time_t last_share_pool_time = -1, last_device_valid_work = -1;
 	double last_share_diff = -1;
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = io_data->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
 		cgpu_utility(proc);
@@ -1512,12 +1542,12 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 		}
 		if (proc->last_device_valid_work > last_device_valid_work)
 			last_device_valid_work = proc->last_device_valid_work;
-		if (per_proc)
+		if (io_data->per_proc)
 			break;
 	}
 
 	root = api_add_int(root, "PGA", &n, true);
-	root = api_add_device_identifier(root, cgpu);
+	root = api_add_device_identifier(io_data, root, cgpu);
 	root = api_add_string(root, "Enabled", bool2str(enabled), false);
 	root = api_add_string(root, "Status", status2str(status), false);
 	if (temp > 0)
@@ -1558,11 +1588,10 @@ void devstatus_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson,
 			(double)(diff_rejected) / (double)(diff1) : 0;
 	root = api_add_percent(root, "Device Rejected%", &rejp, false);
 
-	if ((per_proc || cgpu->procs <= 1) && cgpu->drv->get_api_extra_device_status)
+	if ((io_data->per_proc || cgpu->procs <= 1) && cgpu->drv->get_api_extra_device_status)
 		root = api_add_extra(root, cgpu->drv->get_api_extra_device_status(cgpu));
 
-	root = print_data(root, buf, isjson, precom);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, precom);
 }
 
 #ifdef USE_OPENCL
@@ -1577,7 +1606,7 @@ static void gpustatus(struct io_data *io_data, int gpu, bool isjson, bool precom
 #ifdef HAVE_AN_FPGA
 static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom)
 {
-        int dev = pgadevice(pga);
+        int dev = pgadevice(io_data, pga);
         if (dev < 0) // Should never happen
                 return;
         devstatus_an(io_data, get_devices(dev), isjson, precom);
@@ -1612,7 +1641,7 @@ devinfo_internal(void (*func)(struct io_data *, struct cgpu_info*, bool, bool),
 
 	for (i = 0; i < total_devices; ++i) {
 		cgpu = get_devices(i);
-		if (per_proc || cgpu->device == cgpu)
+		if (io_data->per_proc || cgpu->device == cgpu)
 			func(io_data, cgpu, isjson, isjson && i > 0);
 	}
 
@@ -1625,6 +1654,84 @@ static void devdetail(struct io_data *io_data, SOCKETTYPE c, char *param, bool i
 	return devinfo_internal(devdetail_an, MSG_DEVDETAILS, io_data, c, param, isjson, group);
 }
 
+static
+json_t *api_history_level(const struct history_bucket * const total, const struct history_level * const level)
+{
+	json_t * const obj = json_object();
+	json_t * const hashes = json_array(), * const accepted = json_array(), * const rejected = json_array(), * const stale = json_array(), * const hw = json_array(), * const temp = json_array();
+	
+	for (unsigned i = 0; i < level->buckets; ++i)
+	{
+		json_array_append_new(hashes, json_integer(total[i].hashes));
+		json_array_append_new(accepted, json_real(total[i].diff_accepted));
+		json_array_append_new(rejected, json_real(total[i].diff_rejected));
+		json_array_append_new(stale, json_real(total[i].diff_stale));
+		json_array_append_new(hw, json_integer(total[i].hw_errors));
+		json_array_append_new(temp, json_real(total[i].max_temp));
+	}
+	json_object_set_new(obj, "Interval", json_integer(level->interval));
+	json_object_set_new(obj, "Hashes", hashes);
+	json_object_set_new(obj, "Difficulty Accepted", accepted);
+	json_object_set_new(obj, "Difficulty Rejected", rejected);
+	json_object_set_new(obj, "Difficulty Stale", stale);
+	json_object_set_new(obj, "Hardware Errors", hw);
+	json_object_set_new(obj, "Temperature", temp);
+	return obj;
+}
+
+static
+void devhistory_an(struct io_data *io_data, struct cgpu_info *cgpu, bool isjson, bool precom)
+{
+	struct history_bucket series[HISTORY_BUCKETS], total[HISTORY_BUCKETS];
+	struct history copy;
+	struct api_data *root = NULL;
+	struct cgpu_info *proc;
+	const time_t now = time(NULL);
+	int n, i;
+	
+	memset(total, 0, sizeof(total));
+	const int procs = io_data->per_proc ? 1 : cgpu->procs;
+	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
+	{
+		if (!history_copy(&copy, proc->history))
+			continue;
+		for (int res = 0; res < HISTORY_RESOLUTIONS; ++res)
+		{
+			const struct history_level * const level = &history_levels[res];
+			history_series(&series[level->offset], &copy, res, now);
+		}
+		for (int j = 0; j < HISTORY_BUCKETS; ++j)
+		{
+			total[j].hashes += series[j].hashes;
+			total[j].diff_accepted += series[j].diff_accepted;
+			total[j].diff_rejected += series[j].diff_rejected;
+			total[j].diff_stale += series[j].diff_stale;
+			total[j].hw_errors += series[j].hw_errors;
+			if (series[j].max_temp > total[j].max_temp)
+				total[j].max_temp = series[j].max_temp;
+		}
+	}
+	
+	n = find_index_by_cgpu(io_data, cgpu);
+	root = api_add_int(root, "HISTORY", &n, true);
+	root = api_add_device_identifier(io_data, root, cgpu);
+	root = api_add_time(root, "When", &now, true);
+	for (int res = 0; res < HISTORY_RESOLUTIONS; ++res)
+	{
+		const struct history_level * const level = &history_levels[res];
+		json_t * const obj = api_history_level(&total[level->offset], level);
+		root = api_add_json(root, level->name, obj, false);
+		json_decref(obj);
+	}
+	
+	root = print_data(io_data, root, isjson, precom);
+}
+
+static void devhistory(struct io_data *io_data, SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	return devinfo_internal(devhistory_an, MSG_DEVHISTORY, io_data, c, param, isjson, group);
+}
+
 static void devstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	return devinfo_internal(devstatus_an, MSG_DEVS, io_data, c, param, isjson, group);
@@ -1693,7 +1800,7 @@ static void devscan(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 static
 struct cgpu_info *get_pga_cgpu(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group, int *id_p, int *dev_p)
 {
-	int numpga = numpgas();
+	int numpga = numpgas(io_data);
 	
 	if (numpga == 0) {
 		message(io_data, MSG_PGANON, 0, NULL, isjson);
@@ -1711,7 +1818,7 @@ struct cgpu_info *get_pga_cgpu(struct io_data *io_data, __maybe_unused SOCKETTYP
 		return NULL;
 	}
 	
-	*dev_p = pgadevice(*id_p);
+	*dev_p = pgadevice(io_data, *id_p);
 	if (*dev_p < 0) { // Should never happen
 		message(io_data, MSG_INVPGA, *id_p, NULL, isjson);
 		return NULL;
@@ -1750,10 +1857,10 @@ static void pgaenable(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char
 		return;
 	
 	applog(LOG_DEBUG, "API: request to pgaenable %s id %d device %d %s",
-			per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
+			io_data->per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
 
 	already = true;
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = io_data->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
 		if (proc->deven == DEV_DISABLED)
@@ -1790,10 +1897,10 @@ static void pgadisable(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 		return;
 	
 	applog(LOG_DEBUG, "API: request to pgadisable %s id %d device %d %s",
-			per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
+			io_data->per_proc ? "proc" : "dev", id, dev, cgpu->proc_repr_ns);
 
 	already = true;
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = io_data->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
 		if (proc->deven != DEV_DISABLED)
@@ -1886,7 +1993,6 @@ static void cpudev(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open = false;
 	char *status, *lp;
 	int i;
@@ -1976,8 +2082,7 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 				(double)(pool->diff_stale) / (double)(pool->diff_accepted + pool->diff_rejected + pool->diff_stale) : 0;
 		root = api_add_percent(root, "Pool Stale%", &stalep, false);
 
-		root = print_data(root, buf, isjson, isjson && (i > 0));
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
 	}
 
 	if (isjson && io_open)
@@ -1987,7 +2092,6 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	double utility, mhs, work_utility;
 
@@ -2042,11 +2146,12 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 			(double)(total_diff_stale) / (double)(total_diff_accepted + total_diff_rejected + total_diff_stale) : 0;
 	root = api_add_percent(root, "Pool Stale%", &stalep, false);
 	root = api_add_time(root, "Last getwork", &last_getwork, false);
+	const uint64_t dropped_logs = log_dropped;
+	root = api_add_uint64(root, "Log Dropped", &dropped_logs, true);
 
 	mutex_unlock(&hash_lock);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2152,7 +2257,6 @@ static void gpurestart(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int numgpu = 0;
 
@@ -2165,8 +2269,7 @@ static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	root = api_add_int(root, "Count", &numgpu, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2174,12 +2277,11 @@ static void gpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int count = 0;
 
 #ifdef HAVE_AN_FPGA
-	count = numpgas();
+	count = numpgas(io_data);
 #endif
 
 	message(io_data, MSG_NUMPGA, 0, NULL, isjson);
@@ -2187,8 +2289,7 @@ static void pgacount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	root = api_add_int(root, "Count", &count, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2297,7 +2398,6 @@ static void cpurestart(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 static void cpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	int count = 0;
 
@@ -2310,8 +2410,7 @@ static void cpucount(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 
 	root = api_add_int(root, "Count", &count, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -2813,7 +2912,6 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 {
 	struct cgpu_info *proc;
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	char *reason;
 	
 	time_t last_not_well = 0;
@@ -2822,7 +2920,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	int dev_sick_idle_60_count = 0, dev_dead_idle_600_count = 0;
 	int dev_nostart_count = 0, dev_over_heat_count = 0, dev_thermal_cutoff_count = 0, dev_comms_error_count = 0, dev_throttle_count = 0;
 
-	int procs = per_proc ? 1 : cgpu->procs, i;
+	int procs = io_data->per_proc ? 1 : cgpu->procs, i;
 	for (i = 0, proc = cgpu; i < procs; ++i, proc = proc->next_proc)
 	{
 		if (proc->device_last_not_well > last_not_well)
@@ -2840,7 +2938,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 			dev_comms_error_count    += proc->dev_comms_error_count;
 			dev_throttle_count       += proc->dev_throttle_count;
 		}
-		if (per_proc)
+		if (io_data->per_proc)
 			break;
 	}
 	
@@ -2884,8 +2982,8 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	// ALL counters (and only counters) must start the name with a '*'
 	// Simplifies future external support for identifying new counters
 	root = api_add_int(root, "NOTIFY", &device, false);
-	root = api_add_device_identifier(root, cgpu);
-	if (per_proc)
+	root = api_add_device_identifier(io_data, root, cgpu);
+	if (io_data->per_proc)
 		root = api_add_time(root, "Last Well", &(cgpu->device_last_well), false);
 	root = api_add_time(root, "Last Not Well", &last_not_well, false);
 	root = api_add_string(root, "Reason Not Well", reason, false);
@@ -2900,8 +2998,7 @@ void notifystatus(struct io_data *io_data, int device, struct cgpu_info *cgpu, b
 	root = api_add_int(root, "*Dev Comms Error", &dev_comms_error_count, false);
 	root = api_add_int(root, "*Dev Throttle", &dev_throttle_count, false);
 
-	root = print_data(root, buf, isjson, isjson && (device > 0));
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, isjson && (device > 0));
 }
 
 static
@@ -2923,7 +3020,7 @@ void notify(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused
 
 	for (i = 0; i < total_devices; i++) {
 		cgpu = get_devices(i);
-		if (cgpu->device == cgpu || per_proc)
+		if (cgpu->device == cgpu || io_data->per_proc)
 			notifystatus(io_data, n++, cgpu, isjson, group);
 	}
 
@@ -2965,7 +3062,6 @@ void dosave(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, b
 static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_stats *stats, struct cgminer_pool_stats *pool_stats, struct api_data *extra, bool isjson)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	double elapsed;
 
 	root = api_add_int(root, "STATS", &i, false);
@@ -3004,12 +3100,52 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 	if (extra)
 		root = api_add_extra(root, extra);
 
-	root = print_data(root, buf, isjson, isjson && (i > 0));
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, isjson && (i > 0));
 
 	return ++i;
 }
 
+static
+struct api_data *api_add_queue_latency(struct api_data * const root, const char * const name, const struct queue_latency_histogram * const hist)
+{
+	char buf[QUEUE_LATENCY_BUCKETS * 11], *p = buf;
+	
+	for (int i = 0; i < QUEUE_LATENCY_BUCKETS; ++i)
+		p += sprintf(p, "%s%"PRIu32, i ? "," : "", hist->buckets[i]);
+	return api_add_string(root, name, buf, true);
+}
+
+// Upper bounds of the queue latency histogram buckets, in milliseconds
+static const char *queue_latency_bounds = "1,2,4,8,16,32,64,128,256,512,1024,2048,4096,8192,16384,32768,inf";
+
+static
+struct api_data *api_add_queue_stats(struct api_data *root, struct thr_info * const thr)
+{
+	struct queue_stats qs;
+	double first_nonce_avg, done_avg;
+	
+	if (!(thr && thr->queue_stats.enabled))
+		return root;
+	
+	mutex_lock(&thr->queue_stats.lock);
+	qs = thr->queue_stats;
+	mutex_unlock(&thr->queue_stats.lock);
+	first_nonce_avg = qs.first_nonce.count ? ((double)qs.first_nonce.total_ms / qs.first_nonce.count) : 0;
+	done_avg = qs.done.count ? ((double)qs.done.total_ms / qs.done.count) : 0;
+	
+	root = api_add_int(root, "Queue Outstanding", &qs.outstanding, true);
+	if (thr->queue_autotune)
+		root = api_add_int(root, "Queue Depth", &qs.autotune_depth, true);
+	root = api_add_uint32(root, "Queue Flushed", &qs.flushed, true);
+	root = api_add_const(root, "Queue Latency Buckets", queue_latency_bounds, false);
+	root = api_add_queue_latency(root, "Queue First Nonce Latency", &qs.first_nonce);
+	root = api_add_double(root, "Queue First Nonce Avg", &first_nonce_avg, true);
+	root = api_add_queue_latency(root, "Queue Done Latency", &qs.done);
+	root = api_add_double(root, "Queue Done Avg", &done_avg, true);
+	
+	return root;
+}
+
 static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 	struct cgpu_info *cgpu;
@@ -3032,6 +3168,8 @@ static void minerstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 				extra = cgpu->drv->get_api_stats(cgpu);
 			else
 				extra = NULL;
+			if (cgpu->thr)
+				extra = api_add_queue_stats(extra, cgpu->thr[0]);
 
 			i = itemstats(io_data, i, cgpu->proc_repr_ns, &(cgpu->cgminer_stats), NULL, extra, isjson);
 		}
@@ -3119,8 +3257,7 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 		
 		root = api_add_diff(root, "Difficulty Accepted", &goal->diff_accepted, false);
 		
-		root = print_data(root, buf, isjson, precom);
-		io_add(io_data, buf);
+		root = print_data(io_data, root, isjson, precom);
 		if (isjson)
 			io_add(io_data, JSON_CLOSE);
 	}
@@ -3129,7 +3266,6 @@ static void minecoin(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __may
 static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 
 	if (param == NULL)
@@ -3199,8 +3335,7 @@ static void debugstate(struct io_data *io_data, __maybe_unused SOCKETTYPE c, cha
 	root = api_add_bool(root, "PerDevice", &want_per_device_stats, false);
 	root = api_add_bool(root, "WorkTime", &opt_worktime, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
@@ -3296,7 +3431,7 @@ static void pgaset(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe
 {
 	struct cgpu_info *cgpu;
 	char buf[TMPBUFSIZ];
-	int numpga = numpgas();
+	int numpga = numpgas(io_data);
 
 	if (numpga == 0) {
 		message(io_data, MSG_PGANON, 0, NULL, isjson);
@@ -3322,7 +3457,7 @@ static void pgaset(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe
 		return;
 	}
 
-	int dev = pgadevice(id);
+	int dev = pgadevice(io_data, id);
 	if (dev < 0) { // Should never happen
 		message(io_data, MSG_INVPGA, id, NULL, isjson);
 		return;
@@ -3358,6 +3493,12 @@ static void pgaset(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe
 }
 #endif
 
+// The event-driven server handles watch itself; this only runs when it can't
+static void dowatch(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
+{
+	message(io_data, MSG_NOWATCH, 0, NULL, isjson);
+}
+
 static void dozero(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
 	if (param == NULL || *param == '\0') {
@@ -3469,6 +3610,8 @@ struct CMDS {
 	{ "procnotify",		notify,		false,	true },
 	{ "devdetails",		devdetail,	false,	true },
 	{ "procdetails",		devdetail,	false,	true },
+	{ "devhistory",		devhistory,	false,	true },
+	{ "prochistory",		devhistory,	false,	true },
 	{ "restart",		dorestart,	true,	false },
 	{ "stats",		minerstats,	false,	true },
 	{ "check",		checkcommand,	false,	false },
@@ -3481,13 +3624,13 @@ struct CMDS {
 	{ "procset",		pgaset,		true,	false },
 #endif
 	{ "zero",		dozero,		true,	false },
+	{ "watch",		dowatch,	false,	false },
 	{ NULL,			NULL,		false,	false }
 };
 
 static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, char group)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
 	bool io_open;
 	char cmdbuf[100];
 	bool found, access;
@@ -3518,16 +3661,13 @@ static void checkcommand(struct io_data *io_data, __maybe_unused SOCKETTYPE c, c
 	root = api_add_const(root, "Exists", found ? YES : NO, false);
 	root = api_add_const(root, "Access", access ? YES : NO, false);
 
-	root = print_data(root, buf, isjson, false);
-	io_add(io_data, buf);
+	root = print_data(io_data, root, isjson, false);
 	if (isjson && io_open)
 		io_close(io_data);
 }
 
 static void head_join(struct io_data *io_data, char *cmdptr, bool isjson, bool *firstjoin)
 {
-	char *ptr;
-
 	if (*firstjoin) {
 		if (isjson)
 			io_add(io_data, JSON0);
@@ -3538,20 +3678,15 @@ static void head_join(struct io_data *io_data, char *cmdptr, bool isjson, bool *
 	}
 
 	// External supplied string
-	ptr = escape_string(cmdptr, isjson);
-
 	if (isjson) {
 		io_add(io_data, JSON1);
-		io_add(io_data, ptr);
+		io_add_escaped(io_data, cmdptr, isjson);
 		io_add(io_data, JSON2);
 	} else {
 		io_add(io_data, JOIN_CMD);
-		io_add(io_data, ptr);
+		io_add_escaped(io_data, cmdptr, isjson);
 		io_add(io_data, BETWEEN_JOIN);
 	}
-
-	if (ptr != cmdptr)
-		free(ptr);
 }
 
 static void tail_join(struct io_data *io_data, bool isjson)
@@ -3583,6 +3718,10 @@ static void send_result(struct io_data *io_data, SOCKETTYPE c, bool isjson)
 	       bytes_buf(&io_data->data),
 	       bytes_len(&io_data->data) > 10 ? "..." : BLANK);
 	
+	// Event-driven connections send the reply themselves
+	if (io_data->sock == INVSOCK)
+		return;
+	
 	io_flush(io_data, true);
 	
 	if (bytes_len(&io_data->data))
@@ -3609,8 +3748,17 @@ void tidyup_socket(void * const arg)
 	mutex_unlock(&quit_restart_lock);
 }
 
+#ifdef USE_LIBEVENT
+static void api_workers_join(void);
+#endif
+
 static void tidyup(__maybe_unused void *arg)
 {
+#ifdef USE_LIBEVENT
+	// Before taking quit_restart_lock, which a worker may be waiting on
+	api_workers_join();
+#endif
+	
 	mutex_lock(&quit_restart_lock);
 
 	SOCKETTYPE *apisock = (SOCKETTYPE *)arg;
@@ -4095,32 +4243,682 @@ void mcast_init()
 		quit(1, "API mcast thread create failed");
 }
 
+struct api_request {
+	char *buf;
+	size_t n;
+	char group;
+	char connectaddr[0x10];
+	
+	bool isjson;
+	bool keepalive;
+	char *cmd;
+	char *param;
+	json_t *json_config;
+	char param_buf[0x200];
+	
+#ifdef USE_LIBEVENT
+	// For requests queued to a worker
+	struct api_conn *conn;
+	struct io_data *io_data;
+	struct api_request *prev, *next;
+#endif
+};
+
+// Takes ownership of buf, which must be null-terminated
+static
+struct api_request *api_request_new(char * const buf, const size_t n, const char group, const char * const connectaddr)
+{
+	struct api_request * const req = malloc(sizeof(*req));
+	if (unlikely(!req))
+		quithere(1, "OOM api_request");
+	*req = (struct api_request){
+		.buf = buf,
+		.n = n,
+		.group = group,
+	};
+	snprintf(req->connectaddr, sizeof(req->connectaddr), "%s", connectaddr);
+	return req;
+}
+
+static
+void api_request_free(struct api_request * const req)
+{
+	if (req->json_config)
+		json_decref(req->json_config);
+	free(req->buf);
+	free(req);
+}
+
+// Returns false if the request is invalid, in which case the reply is already complete
+static
+bool api_parse_request(struct io_data * const io_data, struct api_request * const req)
+{
+	char * const buf = req->buf;
+	json_error_t json_err;
+	json_t *json_val;
+	
+	if (opt_debug)
+		applog(LOG_DEBUG, "API: recv command: (%ld) '%s'", (long)req->n, buf);
+	
+	// the time of the request in now
+	io_data->when = time(NULL);
+	
+	if (*buf != ISJSON) {
+		req->isjson = false;
+		
+		req->param = strchr(buf, SEPARATOR);
+		if (req->param != NULL)
+			*(req->param++) = '\0';
+		
+		req->cmd = buf;
+		return true;
+	}
+	
+	req->isjson = true;
+	
+#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
+	req->json_config = json_loadb(buf, req->n, 0, &json_err);
+#elif JANSSON_MAJOR_VERSION > 1
+	req->json_config = json_loads(buf, 0, &json_err);
+#else
+	req->json_config = json_loads(buf, &json_err);
+#endif
+	
+	if (!json_is_object(req->json_config)) {
+		message(io_data, MSG_INVJSON, 0, NULL, true);
+		send_result(io_data, io_data->sock, true);
+		return false;
+	}
+	
+	json_val = json_object_get(req->json_config, JSON_COMMAND);
+	if (json_val == NULL) {
+		message(io_data, MSG_MISCMD, 0, NULL, true);
+		send_result(io_data, io_data->sock, true);
+		return false;
+	}
+	if (!json_is_string(json_val)) {
+		message(io_data, MSG_INVCMD, 0, NULL, true);
+		send_result(io_data, io_data->sock, true);
+		return false;
+	}
+	req->cmd = (char *)json_string_value(json_val);
+	
+	json_val = json_object_get(req->json_config, JSON_PARAMETER);
+	if (json_is_string(json_val))
+		req->param = (char *)json_string_value(json_val);
+	else if (json_is_integer(json_val)) {
+		snprintf(req->param_buf, sizeof(req->param_buf), "%d", (int)json_integer_value(json_val));
+		req->param = req->param_buf;
+	} else if (json_is_real(json_val)) {
+		snprintf(req->param_buf, sizeof(req->param_buf), "%f", (double)json_real_value(json_val));
+		req->param = req->param_buf;
+	}
+	
+	req->keepalive = json_is_true(json_object_get(req->json_config, JSON_KEEPALIVE));
+	
+	return true;
+}
+
+static
+bool api_request_is_writemode(const struct api_request * const req)
+{
+	int i;
+	
+	// Write mode commands are never joinable
+	if (strchr(req->cmd, CMDJOIN))
+		return false;
+	
+	for (i = 0; cmds[i].name != NULL; i++)
+		if (strcmp(req->cmd, cmds[i].name) == 0)
+			return cmds[i].iswritemode;
+	
+	return false;
+}
+
+static
+void api_execute_request(struct io_data * const io_data, struct api_request * const req)
+{
+	char cmdbuf[100];
+	char *cmd = req->cmd, *cmdptr, *cmdsbuf = NULL;
+	char *param = req->param;
+	const bool isjson = req->isjson;
+	const char group = req->group;
+	bool did, isjoin, firstjoin;
+	int i;
+	
+	firstjoin = isjoin = false;
+	
+	if (strchr(cmd, CMDJOIN)) {
+		firstjoin = isjoin = true;
+		// cmd + leading+tailing '|' + '\0'
+		cmdsbuf = malloc(strlen(cmd) + 3);
+		if (!cmdsbuf)
+			quithere(1, "OOM cmdsbuf");
+		strcpy(cmdsbuf, "|");
+		param = NULL;
+	}
+
+	cmdptr = cmd;
+	do {
+		did = false;
+		if (isjoin) {
+			cmd = strchr(cmdptr, CMDJOIN);
+			if (cmd)
+				*(cmd++) = '\0';
+			if (!*cmdptr)
+				goto inochi;
+		}
+
+		for (i = 0; cmds[i].name != NULL; i++) {
+			if (strcmp(cmdptr, cmds[i].name) == 0) {
+				sprintf(cmdbuf, "|%s|", cmdptr);
+				if (isjoin) {
+					if (strstr(cmdsbuf, cmdbuf)) {
+						did = true;
+						break;
+					}
+					strcat(cmdsbuf, cmdptr);
+					strcat(cmdsbuf, "|");
+					head_join(io_data, cmdptr, isjson, &firstjoin);
+					if (!cmds[i].joinable) {
+						message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+						did = true;
+						tail_join(io_data, isjson);
+						break;
+					}
+				}
+				if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
+				{
+					io_data->per_proc = !strncmp(cmds[i].name, "proc", 4);
+					(cmds[i].func)(io_data, io_data->sock, param, isjson, group);
+				}
+				else {
+					message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
+					applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", req->connectaddr, cmds[i].name);
+				}
+
+				did = true;
+				if (!isjoin)
+					send_result(io_data, io_data->sock, isjson);
+				else
+					tail_join(io_data, isjson);
+				break;
+			}
+		}
+
+		if (!did) {
+			if (isjoin)
+				head_join(io_data, cmdptr, isjson, &firstjoin);
+			message(io_data, MSG_INVCMD, 0, NULL, isjson);
+			if (isjoin)
+				tail_join(io_data, isjson);
+			else
+				send_result(io_data, io_data->sock, isjson);
+		}
+inochi:
+		if (isjoin)
+			cmdptr = cmd;
+	} while (isjoin && cmdptr);
+
+	if (isjoin) {
+		send_result(io_data, io_data->sock, isjson);
+		free(cmdsbuf);
+	}
+}
+
+#ifdef USE_LIBEVENT
+/* Event-driven server: the listener and all client I/O run on one event
+ * loop, so a slow or large reply never holds up other clients. Read-only
+ * commands are executed directly on the loop; write mode commands (which may
+ * block on devices, files, or pools) go to a small pool of worker threads.
+ * Clients sending a JSON request with "keepalive":true may send further
+ * requests on the same connection, each terminated by a newline. */
+
+// Idle clients are dropped after this long
+#define API_CONN_TIMEOUT_SECS  30
+#define API_WORKERS  2
+
+struct api_conn {
+	struct bufferevent *bev;
+	char group;
+	char connectaddr[0x10];
+	bool keepalive;
+	
+	// A worker has the current request
+	bool busy;
+	// Close once the reply has been sent
+	bool closing;
+	// Disconnected while busy; free once the worker is done
+	bool dead;
+	
+	// Periodic metrics updates, see api_conn_watch
+	struct event *watch_ev;
+	struct metrics_snapshot *watch_snap;
+	unsigned watch_ms;
+};
+
+static struct event_base *api_evbase;
+static struct io_data *api_ev_io_data;
+
+static pthread_mutex_t api_worker_mutex;
+static pthread_cond_t api_worker_cond;
+static struct api_request *api_worker_queue;
+static pthread_t api_worker_pth[API_WORKERS];
+static int api_workers;
+static bool api_workers_stop;
+
+// Write mode commands change pools, devices and config that other commands read, so each runs alone
+static pthread_rwlock_t api_exec_lock;
+
+static void api_conn_readcb(struct bufferevent *, void *);
+
+static
+void api_conn_free(struct api_conn * const conn)
+{
+	if (conn->watch_ev)
+		event_free(conn->watch_ev);
+	metrics_snapshot_put(conn->watch_snap);
+	bufferevent_free(conn->bev);
+	free(conn);
+}
+
+static
+void api_conn_reply(struct api_conn * const conn, struct io_data * const io_data, const bool keepalive)
+{
+	bufferevent_write(conn->bev, bytes_buf(&io_data->data), bytes_len(&io_data->data));
+	bytes_reset(&io_data->data);
+	
+	if (keepalive)
+		conn->keepalive = true;
+	if (!conn->keepalive || bye)
+	{
+		conn->closing = true;
+		bufferevent_disable(conn->bev, EV_READ);
+	}
+	if (bye)
+	{
+		// Give the reply a chance to go out first
+		struct timeval tv_flush = {1, 0};
+		event_base_loopexit(api_evbase, &tv_flush);
+	}
+}
+
+// Runs on the event loop once a worker has finished a request
+static
+void api_worker_done(__maybe_unused evutil_socket_t fd, __maybe_unused short what, void * const p)
+{
+	struct api_request * const req = p;
+	struct api_conn * const conn = req->conn;
+	
+	conn->busy = false;
+	if (conn->dead)
+		api_conn_free(conn);
+	else
+	{
+		api_conn_reply(conn, req->io_data, req->keepalive);
+		if (!conn->closing)
+		{
+			bufferevent_enable(conn->bev, EV_READ);
+			// Handle anything that arrived meanwhile
+			api_conn_readcb(conn->bev, conn);
+		}
+	}
+	
+	sock_io_free(req->io_data);
+	api_request_free(req);
+}
+
+static
+void *api_worker_thread(__maybe_unused void * const userp)
+{
+	struct api_request *req;
+	
+	RenameThread("api_worker");
+	
+	while (true)
+	{
+		mutex_lock(&api_worker_mutex);
+		while (!(api_worker_queue || api_workers_stop))
+			pthread_cond_wait(&api_worker_cond, &api_worker_mutex);
+		if (api_workers_stop)
+		{
+			mutex_unlock(&api_worker_mutex);
+			break;
+		}
+		req = api_worker_queue;
+		DL_DELETE(api_worker_queue, req);
+		mutex_unlock(&api_worker_mutex);
+		
+		wr_lock(&api_exec_lock);
+		api_execute_request(req->io_data, req);
+		wr_unlock(&api_exec_lock);
+		
+		if (event_base_once(api_evbase, -1, EV_TIMEOUT, api_worker_done, req, NULL))
+			applog(LOG_ERR, "API: %s failed", "event_base_once");
+	}
+	
+	return NULL;
+}
+
+// Requests still queued are dropped; one already running is finished first
+static
+void api_workers_join(void)
+{
+	if (!api_workers)
+		return;
+	mutex_lock(&api_worker_mutex);
+	api_workers_stop = true;
+	pthread_cond_broadcast(&api_worker_cond);
+	mutex_unlock(&api_worker_mutex);
+	for (int i = 0; i < api_workers; ++i)
+		pthread_join(api_worker_pth[i], NULL);
+	api_workers = 0;
+}
+
+#define API_WATCH_DEFAULT_SECS  5
+// Skip updates to watchers that are not reading them
+#define API_WATCH_MAX_BUFFERED  0x100000
+
+static
+bool api_conn_may(const struct api_conn * const conn, const char * const cmd)
+{
+	char cmdbuf[100];
+	
+	if (ISPRIVGROUP(conn->group))
+		return true;
+	snprintf(cmdbuf, sizeof(cmdbuf), "|%s|", cmd);
+	return strstr(COMMANDS(conn->group), cmdbuf);
+}
+
+static
+void api_watch_update(__maybe_unused evutil_socket_t fd, __maybe_unused short what, void * const p)
+{
+	struct api_conn * const conn = p;
+	struct metrics_snapshot *snap;
+	bytes_t out = BYTES_INIT;
+	
+	if (evbuffer_get_length(bufferevent_get_output(conn->bev)) > API_WATCH_MAX_BUFFERED)
+		// The next update will include these changes
+		return;
+	
+	// Half the interval, so a snapshot from the last update is never reused
+	snap = metrics_snapshot_get(conn->watch_ms / 2);
+	if (metrics_delta_json(&out, conn->watch_snap, snap))
+		bufferevent_write(conn->bev, bytes_buf(&out), bytes_len(&out));
+	bytes_free(&out);
+	metrics_snapshot_put(conn->watch_snap);
+	conn->watch_snap = snap;
+}
+
+/* Turns the connection into a stream of metrics updates: a full update
+ * immediately, then one line with only the changed fields every interval.
+ * Anything further sent by the client is ignored. */
+static
+void api_conn_watch(struct api_conn * const conn, const struct api_request * const req)
+{
+	struct timeval tv_interval = {API_WATCH_DEFAULT_SECS, 0};
+	int secs;
+	
+	if (req->param && (secs = atoi(req->param)) > 0)
+		tv_interval.tv_sec = secs;
+	conn->watch_ms = tv_interval.tv_sec * 1000;
+	applog(LOG_DEBUG, "API: %s watching every %d seconds", conn->connectaddr, (int)tv_interval.tv_sec);
+	
+	bufferevent_set_timeouts(conn->bev, NULL, NULL);
+	conn->watch_ev = event_new(api_evbase, -1, EV_PERSIST, api_watch_update, conn);
+	event_add(conn->watch_ev, &tv_interval);
+	api_watch_update(-1, 0, conn);
+}
+
+// Prometheus scrapers can use the API port directly
+static
+void api_conn_http(struct api_conn * const conn, const char * const buf)
+{
+	static const char * const http_notfound = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+	struct metrics_snapshot *snap;
+	bytes_t out = BYTES_INIT;
+	
+	if (!(strncmp(buf, "GET /metrics", 12) == 0 && (buf[12] == ' ' || buf[12] == '?') && api_conn_may(conn, "watch")))
+		bytes_append(&out, http_notfound, strlen(http_notfound));
+	else
+	{
+		snap = metrics_snapshot_get(1000);
+		metrics_prometheus(&out, snap);
+		metrics_snapshot_put(snap);
+		evbuffer_add_printf(bufferevent_get_output(conn->bev), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\n\r\n", (unsigned long)bytes_len(&out));
+	}
+	bufferevent_write(conn->bev, bytes_buf(&out), bytes_len(&out));
+	bytes_free(&out);
+	conn->closing = true;
+	bufferevent_disable(conn->bev, EV_READ);
+}
+
+static
+void api_conn_request(struct api_conn * const conn, char * const buf, const size_t n)
+{
+	struct io_data * const io_data = api_ev_io_data;
+	struct api_request * const req = api_request_new(buf, n, conn->group, conn->connectaddr);
+	
+	io_reinit(io_data);
+	if (!(conn->keepalive || strncmp(buf, "GET ", 4)))
+	{
+		api_conn_http(conn, buf);
+		api_request_free(req);
+		return;
+	}
+	if (api_parse_request(io_data, req))
+	{
+		if (!strcmp(req->cmd, "watch") && api_conn_may(conn, "watch"))
+		{
+			api_conn_watch(conn, req);
+			api_request_free(req);
+			return;
+		}
+		if (api_request_is_writemode(req))
+		{
+			conn->busy = true;
+			bufferevent_disable(conn->bev, EV_READ);
+			req->conn = conn;
+			req->io_data = sock_io_new();
+			req->io_data->when = io_data->when;
+			mutex_lock(&api_worker_mutex);
+			DL_APPEND(api_worker_queue, req);
+			pthread_cond_signal(&api_worker_cond);
+			mutex_unlock(&api_worker_mutex);
+			return;
+		}
+		// Not cancelled while holding the lock, which would leave the workers stuck
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		rd_lock(&api_exec_lock);
+		api_execute_request(io_data, req);
+		rd_unlock(&api_exec_lock);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	api_conn_reply(conn, io_data, req->keepalive);
+	api_request_free(req);
+}
+
+static
+void api_conn_readcb(struct bufferevent * const bev, void * const p)
+{
+	struct api_conn * const conn = p;
+	struct evbuffer * const input = bufferevent_get_input(bev);
+	char *buf;
+	size_t n;
+	
+	if (conn->watch_ev)
+	{
+		evbuffer_drain(input, evbuffer_get_length(input));
+		return;
+	}
+	
+	while (!(conn->busy || conn->closing || conn->watch_ev))
+	{
+		if (conn->keepalive)
+		{
+			buf = evbuffer_readln(input, &n, EVBUFFER_EOL_LF);
+			// Requests are capped at TMPBUFSIZ either way; don't buffer an endless line
+			if (unlikely(buf ? (n >= TMPBUFSIZ) : (evbuffer_get_length(input) >= TMPBUFSIZ)))
+			{
+				applog(LOG_DEBUG, "API: dropping connection from %s sending an overlong request", conn->connectaddr);
+				free(buf);
+				api_conn_free(conn);
+				return;
+			}
+			if (!buf)
+				break;
+			if (!n)
+			{
+				free(buf);
+				continue;
+			}
+		}
+		else
+		{
+			// Like the old blocking server, the first read is the whole request
+			n = evbuffer_get_length(input);
+			if (!n)
+				break;
+			if (n > TMPBUFSIZ - 1)
+				n = TMPBUFSIZ - 1;
+			buf = malloc(n + 1);
+			if (unlikely(!buf))
+				quithere(1, "OOM buf");
+			evbuffer_remove(input, buf, n);
+			buf[n] = '\0';
+		}
+		api_conn_request(conn, buf, n);
+	}
+}
+
+static
+void api_conn_writecb(struct bufferevent * const bev, void * const p)
+{
+	struct api_conn * const conn = p;
+	
+	if (conn->closing && !evbuffer_get_length(bufferevent_get_output(bev)))
+	{
+		api_conn_free(conn);
+		if (bye)
+			event_base_loopbreak(api_evbase);
+	}
+}
+
+static
+void api_conn_eventcb(__maybe_unused struct bufferevent * const bev, const short events, void * const p)
+{
+	struct api_conn * const conn = p;
+	
+	if (events & BEV_EVENT_TIMEOUT)
+		applog(LOG_DEBUG, "API: dropping idle connection from %s", conn->connectaddr);
+	
+	if (!(events & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT)))
+		return;
+	
+	if (conn->busy)
+		conn->dead = true;
+	else
+		api_conn_free(conn);
+}
+
+static
+void api_accept(__maybe_unused struct evconnlistener * const listener, const evutil_socket_t fd, struct sockaddr * const addr, __maybe_unused const int len, __maybe_unused void * const p)
+{
+	struct timeval tv_timeout = {API_CONN_TIMEOUT_SECS, 0};
+	struct api_conn *conn;
+	char *connectaddr;
+	char group;
+	bool addrok;
+	
+	addrok = check_connect((struct sockaddr_in *)addr, &connectaddr, &group);
+	applog(LOG_DEBUG, "API: connection from %s - %s",
+				connectaddr, addrok ? "Accepted" : "Ignored");
+	if (!addrok)
+	{
+		shutdown(fd, SHUT_RDWR);
+		CLOSESOCKET(fd);
+		return;
+	}
+	
+	conn = malloc(sizeof(*conn));
+	if (unlikely(!conn))
+		quithere(1, "OOM api_conn");
+	*conn = (struct api_conn){
+		.group = group,
+	};
+	snprintf(conn->connectaddr, sizeof(conn->connectaddr), "%s", connectaddr);
+	conn->bev = bufferevent_socket_new(api_evbase, fd, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(conn->bev, api_conn_readcb, api_conn_writecb, api_conn_eventcb, conn);
+	bufferevent_set_timeouts(conn->bev, &tv_timeout, &tv_timeout);
+	bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+}
+
+static
+void api_evloop(const SOCKETTYPE apisock, struct io_data * const io_data)
+{
+	struct evconnlistener *listener;
+	
+	if (-1
+#if EVTHREAD_USE_WINDOWS_THREADS_IMPLEMENTED
+	 && evthread_use_windows_threads()
+#endif
+#if EVTHREAD_USE_PTHREADS_IMPLEMENTED
+	 && evthread_use_pthreads()
+#endif
+	) {
+		applog(LOG_ERR, "API: %s failed%s", "event_use_*threads", UNAVAILABLE);
+		return;
+	}
+	
+	api_evbase = event_base_new();
+	if (!api_evbase) {
+		applog(LOG_ERR, "API: %s failed%s", "event_base_new", UNAVAILABLE);
+		return;
+	}
+	
+	evutil_make_socket_nonblocking(apisock);
+	listener = evconnlistener_new(api_evbase, api_accept, NULL, 0, 0, apisock);
+	if (!listener) {
+		applog(LOG_ERR, "API: %s failed%s", "evconnlistener_new", UNAVAILABLE);
+		return;
+	}
+	
+	api_ev_io_data = io_data;
+	mutex_init(&api_worker_mutex);
+	if (unlikely(pthread_cond_init(&api_worker_cond, bfg_condattr)))
+		quithere(1, "pthread_cond_init failed");
+	rwlock_init(&api_exec_lock);
+	for (api_workers = 0; api_workers < API_WORKERS; ++api_workers)
+		if (unlikely(pthread_create(&api_worker_pth[api_workers], NULL, api_worker_thread, NULL)))
+			quithere(1, "pthread_create failed");
+	
+	event_base_dispatch(api_evbase);
+	
+	// Workers may still be finishing requests, so the event base must remain
+	evconnlistener_free(listener);
+}
+#endif
+
 void api(int api_thr_id)
 {
 	struct io_data *io_data;
 	struct thr_info bye_thr;
-	char buf[TMPBUFSIZ];
-	char param_buf[TMPBUFSIZ];
-	SOCKETTYPE c;
-	int n, bound;
-	char *connectaddr;
+	int bound;
 	const char *binderror;
 	struct timeval bindstart;
 	short int port = opt_api_port;
 	struct sockaddr_in serv;
+#ifndef USE_LIBEVENT
+	struct api_request *req;
+	SOCKETTYPE c;
+	int n;
+	char *buf;
+	char *connectaddr;
 	struct sockaddr_in cli;
 	socklen_t clisiz;
-	char cmdbuf[100];
-	char *cmd = NULL, *cmdptr, *cmdsbuf;
-	char *param;
 	bool addrok;
 	char group;
-	json_error_t json_err;
-	json_t *json_config = NULL;
-	json_t *json_val;
-	bool isjson;
-	bool did, isjoin, firstjoin;
-	int i;
+#endif
 
 	SOCKETTYPE *apisock;
 
@@ -4223,6 +5021,9 @@ void api(int api_thr_id)
 	if (opt_api_mcast)
 		mcast_init();
 
+#ifdef USE_LIBEVENT
+	api_evloop(*apisock, io_data);
+#else
 	while (!bye) {
 		clisiz = sizeof(cli);
 		if (SOCKETFAIL(c = accept(*apisock, (struct sockaddr *)(&cli), &clisiz))) {
@@ -4235,170 +5036,32 @@ void api(int api_thr_id)
 					connectaddr, addrok ? "Accepted" : "Ignored");
 
 		if (addrok) {
+			buf = malloc(TMPBUFSIZ);
+			if (unlikely(!buf))
+				quithere(1, "OOM buf");
 			n = recv(c, &buf[0], TMPBUFSIZ-1, 0);
-			if (SOCKETFAIL(n))
-				buf[0] = '\0';
-			else
-				buf[n] = '\0';
-
-			if (opt_debug) {
-				if (SOCKETFAIL(n))
+			if (SOCKETFAIL(n)) {
+				if (opt_debug)
 					applog(LOG_DEBUG, "API: recv failed: %s", SOCKERRMSG);
-				else
-					applog(LOG_DEBUG, "API: recv command: (%d) '%s'", n, buf);
+				free(buf);
 			}
-
-			firstjoin = isjoin = false;
-			if (!SOCKETFAIL(n)) {
-				// the time of the request in now
-				when = time(NULL);
+			else {
+				buf[n] = '\0';
 				io_reinit(io_data);
 				io_data->sock = c;
 
-				did = false;
-
-				if (*buf != ISJSON) {
-					isjson = false;
-
-					param = strchr(buf, SEPARATOR);
-					if (param != NULL)
-						*(param++) = '\0';
-
-					cmd = buf;
-				}
-				else {
-					isjson = true;
-
-					param = NULL;
-
-#if JANSSON_MAJOR_VERSION > 2 || (JANSSON_MAJOR_VERSION == 2 && JANSSON_MINOR_VERSION > 0)
-					json_config = json_loadb(buf, n, 0, &json_err);
-#elif JANSSON_MAJOR_VERSION > 1
-					json_config = json_loads(buf, 0, &json_err);
-#else
-					json_config = json_loads(buf, &json_err);
-#endif
-
-					if (!json_is_object(json_config)) {
-						message(io_data, MSG_INVJSON, 0, NULL, isjson);
-						send_result(io_data, c, isjson);
-						did = true;
-					}
-					else {
-						json_val = json_object_get(json_config, JSON_COMMAND);
-						if (json_val == NULL) {
-							message(io_data, MSG_MISCMD, 0, NULL, isjson);
-							send_result(io_data, c, isjson);
-							did = true;
-						}
-						else {
-							if (!json_is_string(json_val)) {
-								message(io_data, MSG_INVCMD, 0, NULL, isjson);
-								send_result(io_data, c, isjson);
-								did = true;
-							}
-							else {
-								cmd = (char *)json_string_value(json_val);
-								json_val = json_object_get(json_config, JSON_PARAMETER);
-								if (json_is_string(json_val))
-									param = (char *)json_string_value(json_val);
-								else if (json_is_integer(json_val)) {
-									sprintf(param_buf, "%d", (int)json_integer_value(json_val));
-									param = param_buf;
-								} else if (json_is_real(json_val)) {
-									sprintf(param_buf, "%f", (double)json_real_value(json_val));
-									param = param_buf;
-								}
-							}
-						}
-					}
-				}
-
-				if (!did) {
-					if (strchr(cmd, CMDJOIN)) {
-						firstjoin = isjoin = true;
-						// cmd + leading+tailing '|' + '\0'
-						cmdsbuf = malloc(strlen(cmd) + 3);
-						if (!cmdsbuf)
-							quithere(1, "OOM cmdsbuf");
-						strcpy(cmdsbuf, "|");
-						param = NULL;
-					}
-
-					cmdptr = cmd;
-					do {
-						did = false;
-						if (isjoin) {
-							cmd = strchr(cmdptr, CMDJOIN);
-							if (cmd)
-								*(cmd++) = '\0';
-							if (!*cmdptr)
-								goto inochi;
-						}
-
-						for (i = 0; cmds[i].name != NULL; i++) {
-							if (strcmp(cmdptr, cmds[i].name) == 0) {
-								sprintf(cmdbuf, "|%s|", cmdptr);
-								if (isjoin) {
-									if (strstr(cmdsbuf, cmdbuf)) {
-										did = true;
-										break;
-									}
-									strcat(cmdsbuf, cmdptr);
-									strcat(cmdsbuf, "|");
-									head_join(io_data, cmdptr, isjson, &firstjoin);
-									if (!cmds[i].joinable) {
-										message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-										did = true;
-										tail_join(io_data, isjson);
-										break;
-									}
-								}
-								if (ISPRIVGROUP(group) || strstr(COMMANDS(group), cmdbuf))
-								{
-									per_proc = !strncmp(cmds[i].name, "proc", 4);
-									(cmds[i].func)(io_data, c, param, isjson, group);
-								}
-								else {
-									message(io_data, MSG_ACCDENY, 0, cmds[i].name, isjson);
-									applog(LOG_DEBUG, "API: access denied to '%s' for '%s' command", connectaddr, cmds[i].name);
-								}
-
-								did = true;
-								if (!isjoin)
-									send_result(io_data, c, isjson);
-								else
-									tail_join(io_data, isjson);
-								break;
-							}
-						}
-
-						if (!did) {
-							if (isjoin)
-								head_join(io_data, cmdptr, isjson, &firstjoin);
-							message(io_data, MSG_INVCMD, 0, NULL, isjson);
-							if (isjoin)
-								tail_join(io_data, isjson);
-							else
-								send_result(io_data, c, isjson);
-						}
-inochi:
-						if (isjoin)
-							cmdptr = cmd;
-					} while (isjoin && cmdptr);
-				}
-
-				if (isjson)
-					json_decref(json_config);
-
-				if (isjoin)
-					send_result(io_data, c, isjson);
+				req = api_request_new(buf, n, group, connectaddr);
+				if (api_parse_request(io_data, req))
+					api_execute_request(io_data, req);
+				api_request_free(req);
 			}
 		}
 		shutdown(c, SHUT_RDWR);
 		CLOSESOCKET(c);
 	}
+
 die:
+#endif
 	/* Blank line fix for older compilers since pthread_cleanup_pop is a
 	 * macro that gets confused by a label existing immediately before it
 	 */
@@ -0,0 +1,237 @@
+/*
+ * Copyright 2011-2014 Con Kolivas
+ * Copyright 2011-2014 Luke Dashjr
+ * Copyright 2014 Nate Woolls
+ * Copyright 2010-2011 Jeff Garzik
+ * Copyright 2012 Giel van Schijndel
+ * Copyright 2012 Gavin Andresen
+ * Copyright 2013 Lingchao Xu
+ * Copyright 2026 MassGridMiner developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc.h"
+#include "logging.h"
+#include "miner.h"
+
+/* Every CRC here is table driven, eight bytes at a time ("slice-by-8"):
+ * table[k][b] is the effect of byte b followed by k zero bytes, so the eight
+ * lookups for a word are independent of each other. None of these polynomials
+ * is one that CPU CRC instructions implement, and device packets are too short
+ * for carry-less multiply folding to pay off. */
+
+static uint8_t crc5usb_table[0x100];
+static uint8_t crc8ccitt_table[8][0x100];
+static uint16_t crc16_table[8][0x100];
+static uint16_t crc16modbus_table[8][0x100];
+
+// CRC-5 is kept in the top bits of a byte, so it can use a byte table too
+#define CRC5USB_POLY  (0x05 << 3)
+
+void bfg_init_checksums(void)
+{
+	for (int i = 0; i < 0x100; ++i)
+	{
+		uint8_t c5 = i, c8 = i;
+		uint16_t c16 = i << 8, cm = i;
+		for (int j = 0; j < 8; ++j)
+		{
+			c5 = (c5 << 1) ^ ((c5 & 0x80) ? CRC5USB_POLY : 0);
+			c8 = (c8 << 1) ^ ((c8 & 0x80) ? 0x07 : 0);
+			c16 = (c16 << 1) ^ ((c16 & 0x8000) ? 0x1021 : 0);
+			cm = (cm >> 1) ^ ((cm & 1) ? 0xa001 : 0);
+		}
+		crc5usb_table[i] = c5;
+		crc8ccitt_table[0][i] = c8;
+		crc16_table[0][i] = c16;
+		crc16modbus_table[0][i] = cm;
+	}
+	for (int k = 1; k < 8; ++k)
+		for (int i = 0; i < 0x100; ++i)
+		{
+			const uint8_t c8 = crc8ccitt_table[k - 1][i];
+			const uint16_t c16 = crc16_table[k - 1][i];
+			const uint16_t cm = crc16modbus_table[k - 1][i];
+			crc8ccitt_table[k][i] = crc8ccitt_table[0][c8];
+			crc16_table[k][i] = (c16 << 8) ^ crc16_table[0][c16 >> 8];
+			crc16modbus_table[k][i] = (cm >> 8) ^ crc16modbus_table[0][cm & 0xff];
+		}
+}
+
+uint8_t crc5usb(const void * const ptr, const uint8_t len)
+{
+	const uint8_t *p = ptr;
+	uint8_t crc = 0x1f << 3;
+	
+	for (int i = len / 8; i; --i)
+		crc = crc5usb_table[crc ^ *p++];
+	if (len % 8)
+	{
+		uint8_t b = *p;
+		for (int i = len % 8; i; --i, (b <<= 1))
+			crc = (crc << 1) ^ (((crc ^ b) & 0x80) ? CRC5USB_POLY : 0);
+	}
+	return crc >> 3;
+}
+
+uint8_t crc8ccitt(const void * const buf, size_t buflen)
+{
+	const uint8_t *p = buf;
+	uint8_t crc = 0xff;
+	
+	for ( ; buflen >= 8; buflen -= 8, (p += 8))
+		crc = crc8ccitt_table[7][crc ^ p[0]] ^ crc8ccitt_table[6][p[1]]
+		    ^ crc8ccitt_table[5][p[2]] ^ crc8ccitt_table[4][p[3]]
+		    ^ crc8ccitt_table[3][p[4]] ^ crc8ccitt_table[2][p[5]]
+		    ^ crc8ccitt_table[1][p[6]] ^ crc8ccitt_table[0][p[7]];
+	while (buflen--)
+		crc = crc8ccitt_table[0][crc ^ *p++];
+	return crc;
+}
+
+uint16_t crc16(const void * const buf, size_t sz, uint16_t crc)
+{
+	const uint8_t *p = buf;
+	
+	for ( ; sz >= 8; sz -= 8, (p += 8))
+	{
+		crc ^= (p[0] << 8) | p[1];
+		crc = crc16_table[7][crc >> 8] ^ crc16_table[6][crc & 0xff]
+		    ^ crc16_table[5][p[2]] ^ crc16_table[4][p[3]]
+		    ^ crc16_table[3][p[4]] ^ crc16_table[2][p[5]]
+		    ^ crc16_table[1][p[6]] ^ crc16_table[0][p[7]];
+	}
+	while (sz--)
+		crc = (crc << 8) ^ crc16_table[0][(crc >> 8) ^ *p++];
+	return crc;
+}
+
+uint16_t crc16modbus(const void * const buf, size_t sz)
+{
+	const uint8_t *p = buf;
+	uint16_t crc = 0xffff;
+	
+	for ( ; sz >= 8; sz -= 8, (p += 8))
+	{
+		crc ^= p[0] | (p[1] << 8);
+		crc = crc16modbus_table[7][crc & 0xff] ^ crc16modbus_table[6][crc >> 8]
+		    ^ crc16modbus_table[5][p[2]] ^ crc16modbus_table[4][p[3]]
+		    ^ crc16modbus_table[3][p[4]] ^ crc16modbus_table[2][p[5]]
+		    ^ crc16modbus_table[1][p[6]] ^ crc16modbus_table[0][p[7]];
+	}
+	while (sz--)
+		crc = (crc >> 8) ^ crc16modbus_table[0][(crc ^ *p++) & 0xff];
+	return crc;
+}
+
+// Bit at a time, as the table-driven versions replaced
+static
+uint8_t test_crc5usb_bitwise(const uint8_t *p, const unsigned len)
+{
+	uint8_t crc = 0x1f;
+	for (unsigned i = 0; i < len; ++i)
+	{
+		const bool fb = ((crc >> 4) ^ (p[i / 8] >> (7 - (i % 8)))) & 1;
+		crc = ((crc << 1) & 0x1f) ^ (fb ? 0x05 : 0);
+	}
+	return crc;
+}
+
+static
+uint16_t test_crc16_bitwise(const uint8_t * const p, const size_t sz, uint16_t crc, const bool reflected, const uint16_t poly)
+{
+	for (size_t i = 0; i < sz; ++i)
+	{
+		crc ^= reflected ? p[i] : (p[i] << 8);
+		for (int j = 0; j < 8; ++j)
+			if (reflected)
+				crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
+			else
+				crc = (crc << 1) ^ ((crc & 0x8000) ? poly : 0);
+	}
+	return crc;
+}
+
+static
+uint8_t test_crc8_bitwise(const uint8_t * const p, const size_t sz)
+{
+	uint8_t crc = 0xff;
+	for (size_t i = 0; i < sz; ++i)
+	{
+		crc ^= p[i];
+		for (int j = 0; j < 8; ++j)
+			crc = (crc << 1) ^ ((crc & 0x80) ? 0x07 : 0);
+	}
+	return crc;
+}
+
+void test_crc(void)
+{
+	static const char check[] = "123456789";
+	// Antminer voltage command, as built by driver-antminer
+	static const uint8_t antminer_cmd[] = {0xaa, 0xb0, 0x00, 0x00};
+	uint8_t buf[0x100];
+	uint32_t x = 0x2545f491;
+	
+	// Known answers for the standard check string
+	if (crc16xmodem(check, 9) != 0x31c3 || crc16ffff(check, 9) != 0x29b1)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "crc", "crc16");
+	}
+	if (crc16modbus(check, 9) != 0x4b37)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "crc", "crc16modbus");
+	}
+	if (crc8ccitt(check, 9) != 0xfb)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "crc", "crc8ccitt");
+	}
+	if (crc5usb(check, 72) != 0x0f || crc5usb(check, 67) != 0x1a || crc5usb(antminer_cmd, 27) != 0x06)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "crc", "crc5usb");
+	}
+	
+	// Every length and alignment agrees with computing a bit at a time
+	for (size_t i = 0; i < sizeof(buf); ++i)
+	{
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		buf[i] = x;
+	}
+	for (size_t off = 0; off < 8; ++off)
+		for (size_t sz = 0; off + sz <= 0x40; ++sz)
+		{
+			const uint8_t * const p = &buf[off];
+			if (crc16(p, sz, 0x1d0f) != test_crc16_bitwise(p, sz, 0x1d0f, false, 0x1021)
+			 || crc16modbus(p, sz) != test_crc16_bitwise(p, sz, 0xffff, true, 0xa001)
+			 || crc8ccitt(p, sz) != test_crc8_bitwise(p, sz))
+			{
+				++unittest_failures;
+				applog(LOG_WARNING, "%s test failed: %s (offset %d, size %d)", "crc", "slice-by-8", (int)off, (int)sz);
+				return;
+			}
+		}
+	for (unsigned len = 0; len <= 0xff; ++len)
+		if (crc5usb(buf, len) != test_crc5usb_bitwise(buf, len))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s (%u bits)", "crc", "crc5usb", len);
+			return;
+		}
+}
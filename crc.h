@@ -0,0 +1,23 @@
+#ifndef BFG_CRC_H
+#define BFG_CRC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Builds the tables; must be called before any of these are used
+extern void bfg_init_checksums(void);
+
+// len is in bits
+extern uint8_t crc5usb(const void *, uint8_t len);
+extern uint8_t crc8ccitt(const void *, size_t);
+
+extern uint16_t crc16(const void *, size_t, uint16_t init);
+#define crc16ffff(  DATA, SZ)  crc16(DATA, SZ, 0xffff)
+#define crc16xmodem(DATA, SZ)  crc16(DATA, SZ, 0)
+
+// Reflected 0xa001 polynomial, as used by Bitmain
+extern uint16_t crc16modbus(const void *, size_t);
+
+extern void test_crc(void);
+
+#endif
@@ -14,22 +14,33 @@
 #include "config.h"
 
 #include <ctype.h>
+#include <errno.h>
 #ifdef WIN32
 #include <winsock2.h>
 #else
+#include <fcntl.h>
 #include <sys/select.h>
+#include <termios.h>
 #endif
+#include <math.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include <utlist.h>
 
 #include "compat.h"
 #include "deviceapi.h"
+#include "history.h"
 #include "logging.h"
 #include "lowlevel.h"
 #ifdef NEED_BFG_LOWL_VCOM
@@ -142,7 +153,12 @@ bool hashes_done(struct thr_info *thr, int64_t hashes, struct timeval *tvp_hashe
 	else
 		thr->scanhash_working = true;
 	
+	thr_nonce_stats_flush(thr, true);
 	thr->hashes_done += hashes;
+	if (thr == cgpu->thr[0])
+		history_update(cgpu->history, cgpu, hashes, time(NULL));
+	else
+		history_add_hashes(cgpu->history, hashes);
 	if (hashes > cgpu->max_hashes)
 		cgpu->max_hashes = hashes;
 	
@@ -215,6 +231,192 @@ int restart_wait(struct thr_info *thr, unsigned int mstime)
 	}
 }
 
+#define QUEUE_PREFETCH_MAX  0x100
+
+/* Queue drivers refill their FIFOs in bursts: after a block change, every
+ * processor wants new work at once, and each get_work waits on the staged
+ * queue in turn. With the queue_prefetch option set (it is off by default), a
+ * helper thread per device keeps that many works per processor popped ahead of
+ * time, so a refill only takes them off a list. The helper fetches with
+ * get_work_for, so the miner thread's watchdog heartbeat stays its own. Works
+ * that went stale while waiting are dropped when the processor is flushed, and
+ * again when taken. Drivers' prepare_work still runs on the miner thread, as
+ * it may touch the device. */
+
+static
+int queue_prefetch_depth(const struct cgpu_info * const proc)
+{
+	return proc->queue_prefetch_user ? proc->queue_prefetch : proc->drv->queue_prefetch;
+}
+
+static
+bool queue_prefetch_wanted(const struct cgpu_info * const proc)
+{
+	const struct thr_info * const thr = proc->thr[0];
+	if (proc->deven != DEV_ENABLED || thr->pause)
+		return false;
+	return thr->_prefetch_count < queue_prefetch_depth(proc);
+}
+
+// These expect the device's _prefetch_mutex to be held
+static
+void _queue_prefetch_push(struct thr_info * const thr, struct work * const work)
+{
+	DL_APPEND(thr->_prefetch_list, work);
+	++thr->_prefetch_count;
+}
+
+static
+struct work *_queue_prefetch_take(struct thr_info * const thr, bool (* const is_stale)(struct work *))
+{
+	struct work *work;
+	
+	while ((work = thr->_prefetch_list))
+	{
+		DL_DELETE(thr->_prefetch_list, work);
+		--thr->_prefetch_count;
+		if (!is_stale(work))
+			break;
+		free_work(work);
+	}
+	return work;
+}
+
+static
+int _queue_prefetch_drop_stale(struct thr_info * const thr, bool (* const is_stale)(struct work *))
+{
+	struct work *work, *tmp;
+	int dropped = 0;
+	
+	DL_FOREACH_SAFE(thr->_prefetch_list, work, tmp)
+	{
+		if (!is_stale(work))
+			continue;
+		DL_DELETE(thr->_prefetch_list, work);
+		--thr->_prefetch_count;
+		free_work(work);
+		++dropped;
+	}
+	return dropped;
+}
+
+static
+bool queue_prefetch_stale(struct work * const work)
+{
+	return stale_work(work, false);
+}
+
+static
+void *queue_prefetch_thread(void * const userp)
+{
+	struct cgpu_info * const dev = userp, *proc, *best;
+	struct thr_info *mythr;
+	struct work *work;
+	char threadname[20];
+	
+	snprintf(threadname, sizeof(threadname), "%s/prefetch", dev->dev_repr);
+	RenameThread(threadname);
+	pthread_detach(pthread_self());
+	
+	mutex_lock(&dev->_prefetch_mutex);
+	while (likely(!dev->shutdown))
+	{
+		// Top up whichever processor is furthest behind
+		best = NULL;
+		for (proc = dev; proc; proc = proc->next_proc)
+			if (queue_prefetch_wanted(proc) && (!best || proc->thr[0]->_prefetch_count < best->thr[0]->_prefetch_count))
+				best = proc;
+		if (!best)
+		{
+			pthread_cond_wait(&dev->_prefetch_cond, &dev->_prefetch_mutex);
+			continue;
+		}
+		mutex_unlock(&dev->_prefetch_mutex);
+		
+		mythr = best->thr[0];
+		work = get_work_for(mythr);
+		
+		mutex_lock(&dev->_prefetch_mutex);
+		_queue_prefetch_push(mythr, work);
+	}
+	mutex_unlock(&dev->_prefetch_mutex);
+	return NULL;
+}
+
+static
+void queue_prefetch_start(struct cgpu_info * const dev)
+{
+	struct cgpu_info *proc;
+	pthread_t pth;
+	
+	mutex_init(&dev->_prefetch_mutex);
+	pthread_cond_init(&dev->_prefetch_cond, bfg_condattr);
+	if (unlikely(pthread_create(&pth, NULL, queue_prefetch_thread, dev)))
+	{
+		applog(LOG_WARNING, "%s: Failed to start work prefetch thread, fetching on demand", dev->dev_repr);
+		pthread_cond_destroy(&dev->_prefetch_cond);
+		pthread_mutex_destroy(&dev->_prefetch_mutex);
+		for (proc = dev; proc; proc = proc->next_proc)
+		{
+			proc->queue_prefetch = 0;
+			proc->queue_prefetch_user = true;
+		}
+		return;
+	}
+	dev->_prefetch_started = true;
+}
+
+static
+struct work *queue_prefetch_take(struct thr_info * const thr)
+{
+	struct cgpu_info * const dev = thr->cgpu->device;
+	struct work *work;
+	
+	if (!dev->_prefetch_started)
+		return NULL;
+	mutex_lock(&dev->_prefetch_mutex);
+	work = _queue_prefetch_take(thr, queue_prefetch_stale);
+	pthread_cond_signal(&dev->_prefetch_cond);
+	mutex_unlock(&dev->_prefetch_mutex);
+	return work;
+}
+
+// Frees works from before a work restart, and has the helper replace them now
+static
+void queue_prefetch_drop_stale(struct thr_info * const thr)
+{
+	struct cgpu_info * const dev = thr->cgpu->device;
+	
+	if (!dev->_prefetch_started)
+		return;
+	mutex_lock(&dev->_prefetch_mutex);
+	if (_queue_prefetch_drop_stale(thr, queue_prefetch_stale))
+		pthread_cond_signal(&dev->_prefetch_cond);
+	mutex_unlock(&dev->_prefetch_mutex);
+}
+
+static
+const char *proc_set_device_queue_prefetch(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, enum bfg_set_device_replytype * const out_success)
+{
+	struct cgpu_info * const dev = proc->device;
+	const int depth = atoi(newvalue);
+	
+	if (depth < 0 || depth > QUEUE_PREFETCH_MAX)
+		return "Invalid prefetch depth";
+	if (depth && !proc->drv->queue_append)
+		return "Device does not use minerloop_queue";
+	proc->queue_prefetch = depth;
+	proc->queue_prefetch_user = true;
+	if (dev->_prefetch_started)
+	{
+		// Wake the helper in case this processor wants more now
+		mutex_lock(&dev->_prefetch_mutex);
+		pthread_cond_signal(&dev->_prefetch_cond);
+		mutex_unlock(&dev->_prefetch_mutex);
+	}
+	return NULL;
+}
+
 static
 struct work *get_and_prepare_work(struct thr_info *thr)
 {
@@ -222,7 +424,9 @@ struct work *get_and_prepare_work(struct thr_info *thr)
 	struct device_drv *api = proc->drv;
 	struct work *work;
 	
-	work = get_work(thr);
+	work = queue_prefetch_take(thr);
+	if (!work)
+		work = get_work(thr);
 	if (!work)
 		return NULL;
 	if (api->prepare_work && !api->prepare_work(thr, work)) {
@@ -475,6 +679,130 @@ bool do_process_results(struct thr_info *mythr, struct timeval *tvp_now, struct
 	return true;
 }
 
+static
+void do_mutex_request(struct thr_info * const thr)
+{
+	struct cgpu_info * const cgpu = thr->cgpu;
+	
+	// FIXME: This can only handle one request at a time!
+	pthread_mutex_t *mutexp = &cgpu->device_mutex;
+	notifier_read(thr->mutex_request);
+	mutex_lock(mutexp);
+	pthread_cond_signal(&cgpu->device_cond);
+	pthread_cond_wait(&cgpu->device_cond, mutexp);
+	mutex_unlock(mutexp);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static
+void notifier_epoll_add(struct thr_info * const thr, const int fd, const uint32_t events)
+{
+	struct epoll_event ev = {
+		.events = events,
+		.data.fd = fd,
+	};
+	if (epoll_ctl(thr->_notifier_epollfd, EPOLL_CTL_ADD, fd, &ev) && errno != EEXIST)
+		applog(LOG_WARNING, "%"PRIpreprv": Failed to watch fd %d: %s",
+		       thr->cgpu->proc_repr, fd, bfg_strerror(errno, BST_ERRNO));
+}
+
+// Built the first time the thread waits, so later waits are one syscall instead of a new fd_set each time
+static
+bool notifier_epoll_setup(struct thr_info * const thr)
+{
+	if (thr->_notifier_epollfd != -1)
+		return true;
+	if (thr->_notifier_select)
+		return false;
+	thr->_notifier_epollfd = epoll_create(4);
+	if (unlikely(thr->_notifier_epollfd == -1))
+	{
+		applog(LOG_DEBUG, "%"PRIpreprv": Failed to create epoll, using select: %s",
+		       thr->cgpu->proc_repr, bfg_strerror(errno, BST_ERRNO));
+		thr->_notifier_select = true;
+		return false;
+	}
+	notifier_epoll_add(thr, thr->notifier[0], EPOLLIN);
+	notifier_epoll_add(thr, thr->work_restart_notifier[0], EPOLLIN);
+	// Never read, so it must be edge-triggered; work_restart was set before the wake
+	if (work_restart_broadcast[0] != INVSOCK)
+	{
+		notifier_epoll_add(thr, work_restart_broadcast[0], EPOLLIN | EPOLLET);
+		thr->work_restart_broadcast = true;
+	}
+	return true;
+}
+
+static
+void notifier_epoll_destroy(struct thr_info * const thr)
+{
+	if (thr->_notifier_epollfd == -1)
+		return;
+	// Direct wakes first, since nothing will see the broadcast anymore
+	thr->work_restart_broadcast = false;
+	close(thr->_notifier_epollfd);
+	thr->_notifier_epollfd = thr->_notifier_epoll_mutex_request = thr->_notifier_epoll_devfd = -1;
+}
+
+static
+void do_notifier_epoll(struct thr_info * const thr, const struct timeval * const tvp_timeout, const int devfd)
+{
+	struct cgpu_info * const cgpu = thr->cgpu;
+	struct epoll_event evs[5];
+	struct timeval tv_now;
+	bool mutex_request = false, notified = false, restarted = false, devready = false;
+	int i, n, timeout_ms;
+	
+	if (thr->mutex_request[1] != INVSOCK && thr->_notifier_epoll_mutex_request == -1)
+	{
+		notifier_epoll_add(thr, thr->mutex_request[0], EPOLLIN);
+		thr->_notifier_epoll_mutex_request = thr->mutex_request[0];
+	}
+	// A closed fd has already left the epoll set, and a reopen can return the same number, so always re-add
+	if (thr->_notifier_epoll_devfd != -1 && thr->_notifier_epoll_devfd != devfd)
+		epoll_ctl(thr->_notifier_epollfd, EPOLL_CTL_DEL, thr->_notifier_epoll_devfd, NULL);
+	thr->_notifier_epoll_devfd = devfd;
+	if (devfd != -1)
+		notifier_epoll_add(thr, devfd, EPOLLIN);
+	
+	timer_set_now(&tv_now);
+	if (!timer_isset(tvp_timeout))
+		timeout_ms = -1;
+	else
+	if (timer_passed(tvp_timeout, &tv_now))
+		timeout_ms = 0;
+	else
+		timeout_ms = (timer_remaining_us(tvp_timeout, &tv_now) + 999) / 1000;
+	
+	n = epoll_wait(thr->_notifier_epollfd, evs, sizeof(evs) / sizeof(*evs), timeout_ms);
+	for (i = 0; i < n; ++i)
+	{
+		const int fd = evs[i].data.fd;
+		if (fd == thr->_notifier_epoll_mutex_request)
+			mutex_request = true;
+		else
+		if (fd == thr->notifier[0])
+			notified = true;
+		else
+		if (fd == thr->work_restart_notifier[0])
+			restarted = true;
+		else
+		if (fd == devfd)
+			devready = true;
+	}
+	
+	// Same order as the select path
+	if (mutex_request)
+		do_mutex_request(thr);
+	if (notified)
+		notifier_read(thr->notifier);
+	if (restarted)
+		notifier_read(thr->work_restart_notifier);
+	if (devready)
+		cgpu->drv->reactor_read(thr);
+}
+#endif
+
 static
 void do_notifier_select(struct thr_info *thr, struct timeval *tvp_timeout)
 {
@@ -482,6 +810,17 @@ void do_notifier_select(struct thr_info *thr, struct timeval *tvp_timeout)
 	struct timeval tv_now;
 	int maxfd;
 	fd_set rfds;
+#ifndef WIN32
+	const int devfd = cgpu->drv->reactor_read ? cgpu->device_fd : -1;
+#endif
+	
+#ifdef HAVE_SYS_EPOLL_H
+	if (notifier_epoll_setup(thr))
+	{
+		do_notifier_epoll(thr, tvp_timeout, devfd);
+		return;
+	}
+#endif
 	
 	timer_set_now(&tv_now);
 	FD_ZERO(&rfds);
@@ -494,23 +833,26 @@ void do_notifier_select(struct thr_info *thr, struct timeval *tvp_timeout)
 		FD_SET(thr->mutex_request[0], &rfds);
 		set_maxfd(&maxfd, thr->mutex_request[0]);
 	}
+#ifndef WIN32
+	if (devfd != -1)
+	{
+		FD_SET(devfd, &rfds);
+		set_maxfd(&maxfd, devfd);
+	}
+#endif
 	if (select(maxfd + 1, &rfds, NULL, NULL, select_timeout(tvp_timeout, &tv_now)) < 0)
 		return;
 	if (thr->mutex_request[1] != INVSOCK && FD_ISSET(thr->mutex_request[0], &rfds))
-	{
-		// FIXME: This can only handle one request at a time!
-		pthread_mutex_t *mutexp = &cgpu->device_mutex;
-		notifier_read(thr->mutex_request);
-		mutex_lock(mutexp);
-		pthread_cond_signal(&cgpu->device_cond);
-		pthread_cond_wait(&cgpu->device_cond, mutexp);
-		mutex_unlock(mutexp);
-	}
+		do_mutex_request(thr);
 	if (FD_ISSET(thr->notifier[0], &rfds)) {
 		notifier_read(thr->notifier);
 	}
 	if (FD_ISSET(thr->work_restart_notifier[0], &rfds))
 		notifier_read(thr->work_restart_notifier);
+#ifndef WIN32
+	if (devfd != -1 && FD_ISSET(devfd, &rfds))
+		cgpu->drv->reactor_read(thr);
+#endif
 }
 
 void cgpu_setup_control_requests(struct cgpu_info * const cgpu)
@@ -535,8 +877,12 @@ void cgpu_release_control(struct cgpu_info * const cgpu)
 	struct thr_info * const thr = cgpu->thr[0];
 	if (pthread_equal(pthread_self(), thr->pth))
 		return;
+	++thr->_mutex_releases;
 	pthread_cond_signal(&cgpu->device_cond);
 	mutex_unlock(&cgpu->device_mutex);
+	// A reactor-driven device polls for the release; have it look now
+	if (thr->reactor_client)
+		notifier_wake(thr->notifier);
 }
 
 static
@@ -555,120 +901,1048 @@ void _minerloop_setup(struct thr_info *mythr)
 	}
 }
 
-void minerloop_async(struct thr_info *mythr)
+// One pass over the device's processors; tvp_timeout is reduced to the next timer due
+static
+void minerloop_async_step(struct thr_info * const thr, struct timeval * const tvp_timeout)
 {
-	struct thr_info *thr = mythr;
-	struct cgpu_info *cgpu = mythr->cgpu;
-	struct device_drv *api = cgpu->drv;
+	struct thr_info *mythr;
+	struct cgpu_info * const cgpu = thr->cgpu;
+	struct device_drv * const api = cgpu->drv;
 	struct timeval tv_now;
-	struct timeval tv_timeout;
 	struct cgpu_info *proc;
 	bool is_running, should_be_running;
 	
-	_minerloop_setup(mythr);
-	
-	while (likely(!cgpu->shutdown)) {
-		tv_timeout.tv_sec = -1;
-		timer_set_now(&tv_now);
-		for (proc = cgpu; proc; proc = proc->next_proc)
+	timer_set_now(&tv_now);
+	for (proc = cgpu; proc; proc = proc->next_proc)
+	{
+		mythr = proc->thr[0];
+		
+		// Nothing should happen while we're starting a job
+		if (unlikely(mythr->busy_state == TBS_STARTING_JOB) || mythr->async_passive)
+			goto defer_events;
+		
+		is_running = mythr->work;
+		should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
+		
+		if (should_be_running)
 		{
-			mythr = proc->thr[0];
-			
-			// Nothing should happen while we're starting a job
-			if (unlikely(mythr->busy_state == TBS_STARTING_JOB))
-				goto defer_events;
-			
-			is_running = mythr->work;
-			should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
-			
-			if (should_be_running)
+			if (unlikely(!(is_running || mythr->_job_transition_in_progress)))
 			{
-				if (unlikely(!(is_running || mythr->_job_transition_in_progress)))
-				{
-					mt_disable_finish(mythr);
-					goto djp;
-				}
-				if (unlikely(mythr->work_restart))
-					goto djp;
+				mt_disable_finish(mythr);
+				goto djp;
+			}
+			if (unlikely(mythr->work_restart))
+				goto djp;
+		}
+		else  // ! should_be_running
+		{
+			if (unlikely(mythr->_job_transition_in_progress && timer_isset(&mythr->tv_morework)))
+			{
+				// Really only happens at startup
+				applog(LOG_DEBUG, "%"PRIpreprv": Job transition in progress, with morework timer enabled: unsetting in-progress flag", proc->proc_repr);
+				mythr->_job_transition_in_progress = false;
 			}
-			else  // ! should_be_running
+			if (unlikely((is_running || !mythr->_mt_disable_called) && !mythr->_job_transition_in_progress))
 			{
-				if (unlikely(mythr->_job_transition_in_progress && timer_isset(&mythr->tv_morework)))
-				{
-					// Really only happens at startup
-					applog(LOG_DEBUG, "%"PRIpreprv": Job transition in progress, with morework timer enabled: unsetting in-progress flag", proc->proc_repr);
-					mythr->_job_transition_in_progress = false;
-				}
-				if (unlikely((is_running || !mythr->_mt_disable_called) && !mythr->_job_transition_in_progress))
-				{
 disabled: ;
-					if (is_running)
-					{
-						if (mythr->busy_state != TBS_GETTING_RESULTS)
-							do_get_results(mythr, false);
-						else
-							// Avoid starting job when pending result fetch completes
-							mythr->_proceed_with_new_job = false;
-					}
-					else  // !mythr->_mt_disable_called
-						mt_disable_start__async(mythr);
+				if (is_running)
+				{
+					if (mythr->busy_state != TBS_GETTING_RESULTS)
+						do_get_results(mythr, false);
+					else
+						// Avoid starting job when pending result fetch completes
+						mythr->_proceed_with_new_job = false;
 				}
-				
-				timer_unset(&mythr->tv_morework);
+				else  // !mythr->_mt_disable_called
+					mt_disable_start__async(mythr);
 			}
 			
-			if (timer_passed(&mythr->tv_morework, &tv_now))
-			{
+			timer_unset(&mythr->tv_morework);
+		}
+		
+		if (timer_passed(&mythr->tv_morework, &tv_now))
+		{
 djp: ;
-				if (!do_job_prepare(mythr, &tv_now))
-					goto disabled;
-			}
-			
+			if (!do_job_prepare(mythr, &tv_now))
+				goto disabled;
+		}
+		
 defer_events:
-			if (timer_passed(&mythr->tv_poll, &tv_now))
-				api->poll(mythr);
-			
-			if (timer_passed(&mythr->tv_watchdog, &tv_now))
-			{
-				timer_set_delay(&mythr->tv_watchdog, &tv_now, WATCHDOG_INTERVAL * 1000000);
-				bfg_watchdog(proc, &tv_now);
-			}
-			
-			reduce_timeout_to(&tv_timeout, &mythr->tv_morework);
-			reduce_timeout_to(&tv_timeout, &mythr->tv_poll);
-			reduce_timeout_to(&tv_timeout, &mythr->tv_watchdog);
+		if (timer_passed(&mythr->tv_poll, &tv_now))
+			api->poll(mythr);
+		
+		if (timer_passed(&mythr->tv_watchdog, &tv_now))
+		{
+			timer_set_delay(&mythr->tv_watchdog, &tv_now, WATCHDOG_INTERVAL * 1000000);
+			bfg_watchdog(proc, &tv_now);
 		}
 		
+		reduce_timeout_to(tvp_timeout, &mythr->tv_morework);
+		reduce_timeout_to(tvp_timeout, &mythr->tv_poll);
+		reduce_timeout_to(tvp_timeout, &mythr->tv_watchdog);
+	}
+}
+
+void minerloop_async(struct thr_info * const thr)
+{
+	struct cgpu_info * const cgpu = thr->cgpu;
+	struct timeval tv_timeout;
+	
+	_minerloop_setup(thr);
+	
+	while (likely(!cgpu->shutdown)) {
+		timer_unset(&tv_timeout);
+		minerloop_async_step(thr, &tv_timeout);
 		do_notifier_select(thr, &tv_timeout);
 	}
 }
 
 static
-void do_queue_flush(struct thr_info *mythr)
+void miner_thread_finish(struct thr_info * const mythr)
 {
-	struct cgpu_info *proc = mythr->cgpu;
-	struct device_drv *api = proc->drv;
+	struct cgpu_info * const cgpu = mythr->cgpu;
+	struct device_drv * const drv = cgpu->drv;
+	struct cgpu_info *proc = cgpu;
 	
-	api->queue_flush(mythr);
-	if (mythr->next_work)
+	do
 	{
-		free_work(mythr->next_work);
-		mythr->next_work = NULL;
+		proc->deven = DEV_DISABLED;
+		proc->status = LIFE_DEAD2;
 	}
+	while ( (proc = proc->next_proc) && !proc->threads);
+	mythr->getwork = 0;
+	mythr->has_pth = false;
+	cgsleep_ms(1);
+	
+	if (drv->thread_shutdown)
+		drv->thread_shutdown(mythr);
+
+#ifdef HAVE_SYS_EPOLL_H
+	notifier_epoll_destroy(mythr);
+#endif
+	notifier_destroy(mythr->notifier);
 }
 
-void minerloop_queue(struct thr_info *thr)
+#ifndef WIN32
+// Opens a raw pseudo-terminal pair, so tests can stand in for a serial device on the master side
+bool bfg_openpty(int * const out_master, int * const out_slave)
 {
-	struct thr_info *mythr;
-	struct cgpu_info *cgpu = thr->cgpu;
-	struct device_drv *api = cgpu->drv;
-	struct timeval tv_now;
-	struct timeval tv_timeout;
-	struct cgpu_info *proc;
-	bool should_be_running;
-	struct work *work;
+	struct termios tios;
+	const char *slavename;
+	int master, slave;
+	
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master == -1)
+		return false;
+	if (grantpt(master) || unlockpt(master) || !(slavename = ptsname(master)))
+		goto err;
+	slave = open(slavename, O_RDWR | O_NOCTTY);
+	if (slave == -1)
+		goto err;
+	if (!tcgetattr(slave, &tios))
+	{
+		cfmakeraw(&tios);
+		tcsetattr(slave, TCSANOW, &tios);
+	}
+	*out_master = master;
+	*out_slave = slave;
+	return true;
+
+err:
+	close(master);
+	return false;
+}
+#endif
+
+int opt_reactor_threads;
+
+#ifdef HAVE_SYS_EPOLL_H
+#define BFG_REACTOR_EVENTS  0x40
+
+struct bfg_reactor {
+	int id;
+	int epfd;
+	notifier_t wakeup;
+	pthread_t pth;
+	
+	pthread_mutex_t mutex;
+	struct bfg_reactor_client *pending;
+	bool stopping;
+	
+	// Only touched by the reactor thread
+	struct bfg_reactor_client *clients;
+	
+	// Protected by bfg_reactors_mutex
+	unsigned clientcount;
+};
+
+static pthread_mutex_t bfg_reactors_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct bfg_reactor *bfg_reactors;
+static int bfg_reactor_count;
+
+bool bfg_reactor_available(void)
+{
+	return opt_reactor_threads > 0;
+}
+
+void bfg_reactor_client_init(struct bfg_reactor_client * const client)
+{
+	*client = (struct bfg_reactor_client){
+		.fd_ready = NULL,
+	};
+	for (int i = 0; i < BFG_REACTOR_MAX_FDS; ++i)
+	{
+		client->_fds[i].client = client;
+		client->_fds[i].fd = -1;
+	}
+	timer_unset(&client->tv_timeout);
+}
+
+static
+void bfg_reactor_epoll_add(struct bfg_reactor * const reactor, struct bfg_reactor_fd * const rfd)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = rfd,
+	};
+	if (rfd->fd == -1)
+		return;
+	if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, rfd->fd, &ev) && errno != EEXIST)
+		applog(LOG_WARNING, "reactor%d: Failed to watch fd %d: %s",
+		       reactor->id, rfd->fd, bfg_strerror(errno, BST_ERRNO));
+}
+
+void bfg_reactor_set_fd(struct bfg_reactor_client * const client, const int slot, const int fd)
+{
+	struct bfg_reactor * const reactor = client->_reactor;
+	struct bfg_reactor_fd * const rfd = &client->_fds[slot];
+	
+	// A closed fd has already left the epoll set, and a reopen can return the same number, so always re-add
+	if (reactor && rfd->fd != -1)
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, rfd->fd, NULL);
+	rfd->fd = fd;
+	if (reactor)
+		bfg_reactor_epoll_add(reactor, rfd);
+}
+
+// Returns false once the reactor is stopping
+static
+bool bfg_reactor_adopt_pending(struct bfg_reactor * const reactor)
+{
+	struct bfg_reactor_client *client, *tmp;
+	bool rv;
+	
+	mutex_lock(&reactor->mutex);
+	DL_FOREACH_SAFE(reactor->pending, client, tmp)
+	{
+		DL_DELETE(reactor->pending, client);
+		DL_APPEND(reactor->clients, client);
+		client->_reactor = reactor;
+		for (int i = 0; i < BFG_REACTOR_MAX_FDS; ++i)
+			bfg_reactor_epoll_add(reactor, &client->_fds[i]);
+		client->_dirty = true;
+	}
+	rv = !reactor->stopping;
+	mutex_unlock(&reactor->mutex);
+	return rv;
+}
+
+static
+void *bfg_reactor_thread(void * const p)
+{
+	struct bfg_reactor * const reactor = p;
+	struct epoll_event evs[BFG_REACTOR_EVENTS];
+	struct bfg_reactor_client *client, *tmp;
+	struct bfg_reactor_fd *rfd;
+	struct timeval tv_now, tv_timeout;
+	char threadname[0x10];
+	bool dirty;
+	int i, n, timeout_ms;
+	
+	snprintf(threadname, sizeof(threadname), "reactor%d", reactor->id);
+	RenameThread(threadname);
+	
+	while (bfg_reactor_adopt_pending(reactor))
+	{
+		dirty = false;
+		timer_unset(&tv_timeout);
+		DL_FOREACH(reactor->clients, client)
+		{
+			if (client->_dirty)
+				dirty = true;
+			reduce_timeout_to(&tv_timeout, &client->tv_timeout);
+		}
+		timer_set_now(&tv_now);
+		if (dirty || timer_passed(&tv_timeout, &tv_now))
+			timeout_ms = 0;
+		else
+		if (!timer_isset(&tv_timeout))
+			timeout_ms = -1;
+		else
+			timeout_ms = (timer_remaining_us(&tv_timeout, &tv_now) + 999) / 1000;
+		
+		n = epoll_wait(reactor->epfd, evs, BFG_REACTOR_EVENTS, timeout_ms);
+		if (unlikely(n < 0))
+		{
+			if (errno != EINTR)
+			{
+				applog(LOG_ERR, "reactor%d: epoll_wait failed: %s",
+				       reactor->id, bfg_strerror(errno, BST_ERRNO));
+				cgsleep_ms(100);
+			}
+			n = 0;
+		}
+		
+		// Clients are only removed from run, so every rfd here is still valid
+		for (i = 0; i < n; ++i)
+		{
+			rfd = evs[i].data.ptr;
+			if (!rfd)
+			{
+				notifier_read(reactor->wakeup);
+				continue;
+			}
+			client = rfd->client;
+			client->_dirty = true;
+			client->fd_ready(client, rfd - client->_fds);
+		}
+		
+		timer_set_now(&tv_now);
+		DL_FOREACH_SAFE(reactor->clients, client, tmp)
+		{
+			if (!(client->_dirty || timer_passed(&client->tv_timeout, &tv_now)))
+				continue;
+			client->_dirty = false;
+			client->run(client, &tv_now);
+		}
+	}
+	
+	return NULL;
+}
+
+static
+bool bfg_reactor_start(struct bfg_reactor * const reactor, const int id)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = NULL,
+	};
+	
+	*reactor = (struct bfg_reactor){
+		.id = id,
+	};
+	mutex_init(&reactor->mutex);
+	reactor->epfd = epoll_create(BFG_REACTOR_EVENTS);
+	if (unlikely(reactor->epfd == -1))
+		applogr(false, LOG_ERR, "reactor%d: Failed to create epoll: %s",
+		        id, bfg_strerror(errno, BST_ERRNO));
+	notifier_init(reactor->wakeup);
+	if (unlikely(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->wakeup[0], &ev)))
+		goto err;
+	if (unlikely(pthread_create(&reactor->pth, NULL, bfg_reactor_thread, reactor)))
+		goto err;
+	return true;
+
+err:
+	applog(LOG_ERR, "reactor%d: Failed to start", id);
+	notifier_destroy(reactor->wakeup);
+	close(reactor->epfd);
+	return false;
+}
+
+// Only for reactors started directly; those bfg_reactor_add starts are detached and run until exit
+static
+void bfg_reactor_stop(struct bfg_reactor * const reactor)
+{
+	mutex_lock(&reactor->mutex);
+	reactor->stopping = true;
+	mutex_unlock(&reactor->mutex);
+	notifier_wake(reactor->wakeup);
+	pthread_join(reactor->pth, NULL);
+	close(reactor->epfd);
+	notifier_destroy(reactor->wakeup);
+	mutex_destroy(&reactor->mutex);
+}
+
+static
+void _bfg_reactor_add(struct bfg_reactor * const reactor, struct bfg_reactor_client * const client)
+{
+	mutex_lock(&reactor->mutex);
+	DL_APPEND(reactor->pending, client);
+	mutex_unlock(&reactor->mutex);
+	notifier_wake(reactor->wakeup);
+}
+
+bool bfg_reactor_add(struct bfg_reactor_client * const client)
+{
+	struct bfg_reactor *reactor = NULL;
+	
+	mutex_lock(&bfg_reactors_mutex);
+	if (!bfg_reactors)
+	{
+		bfg_reactors = calloc(opt_reactor_threads, sizeof(*bfg_reactors));
+		while (bfg_reactor_count < opt_reactor_threads && bfg_reactor_start(&bfg_reactors[bfg_reactor_count], bfg_reactor_count))
+			pthread_detach(bfg_reactors[bfg_reactor_count++].pth);
+		applog(LOG_DEBUG, "Started %d I/O reactor threads", bfg_reactor_count);
+	}
+	for (int i = 0; i < bfg_reactor_count; ++i)
+		if ((!reactor) || bfg_reactors[i].clientcount < reactor->clientcount)
+			reactor = &bfg_reactors[i];
+	if (reactor)
+		++reactor->clientcount;
+	mutex_unlock(&bfg_reactors_mutex);
+	
+	if (!reactor)
+		return false;
+	_bfg_reactor_add(reactor, client);
+	return true;
+}
+
+void bfg_reactor_remove(struct bfg_reactor_client * const client)
+{
+	struct bfg_reactor * const reactor = client->_reactor;
+	
+	for (int i = 0; i < BFG_REACTOR_MAX_FDS; ++i)
+		if (client->_fds[i].fd != -1)
+			epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, client->_fds[i].fd, NULL);
+	DL_DELETE(reactor->clients, client);
+	client->_reactor = NULL;
+	
+	mutex_lock(&bfg_reactors_mutex);
+	--reactor->clientcount;
+	mutex_unlock(&bfg_reactors_mutex);
+}
+
+enum minerloop_reactor_slot {
+	MRS_NOTIFIER,
+	MRS_WORK_RESTART,
+	MRS_MUTEX_REQUEST,
+	MRS_DEVICE,
+};
+
+static
+void minerloop_reactor_fd_ready(struct bfg_reactor_client * const client, const int slot)
+{
+	struct thr_info * const thr = client->userp;
+	
+	switch (slot)
+	{
+		case MRS_NOTIFIER:
+			notifier_read(thr->notifier);
+			break;
+		case MRS_WORK_RESTART:
+			notifier_read(thr->work_restart_notifier);
+			break;
+		case MRS_MUTEX_REQUEST:
+			// Blocking here would stall every device on this reactor; run hands the device over
+			notifier_read(thr->mutex_request);
+			thr->_mutex_request_pending = true;
+			break;
+		case MRS_DEVICE:
+			if (likely(!thr->_mutex_request_granted))
+				thr->cgpu->drv->reactor_read(thr);
+			break;
+	}
+}
+
+// Non-blocking counterpart of do_mutex_request; returns true when the device is ours to use
+static
+bool minerloop_reactor_mutex_poll(struct bfg_reactor_client * const client)
+{
+	struct thr_info * const thr = client->userp;
+	struct cgpu_info * const cgpu = thr->cgpu;
+	pthread_mutex_t * const mutexp = &cgpu->device_mutex;
+	
+	// The requester holds device_mutex except while waiting on device_cond
+	if (pthread_mutex_trylock(mutexp))
+		goto wait;
+	if (thr->_mutex_request_pending)
+	{
+		thr->_mutex_request_pending = false;
+		thr->_mutex_request_granted = true;
+		thr->_mutex_request_releases = thr->_mutex_releases;
+		pthread_cond_signal(&cgpu->device_cond);
+		mutex_unlock(mutexp);
+		goto wait;
+	}
+	if (thr->_mutex_request_releases == thr->_mutex_releases)
+	{
+		// Granted, but the requester has yet to take it
+		mutex_unlock(mutexp);
+		goto wait;
+	}
+	thr->_mutex_request_granted = false;
+	mutex_unlock(mutexp);
+	return true;
+
+wait:
+	if (client->_fds[MRS_DEVICE].fd != -1)
+		bfg_reactor_set_fd(client, MRS_DEVICE, -1);
+	timer_set_delay_from_now(&client->tv_timeout, 10000);
+	return false;
+}
+
+static
+void minerloop_reactor_run(struct bfg_reactor_client * const client, __maybe_unused struct timeval * const tvp_now)
+{
+	struct thr_info * const thr = client->userp;
+	struct cgpu_info * const cgpu = thr->cgpu;
+	
+	// cgpu_request_control uses this to recognise calls made from the device's own callbacks
+	if (unlikely(!pthread_equal(thr->pth, pthread_self())))
+		thr->pth = pthread_self();
+	
+	if (unlikely(thr->_mutex_request_pending || thr->_mutex_request_granted) && !minerloop_reactor_mutex_poll(client))
+		return;
+	
+	if (unlikely(cgpu->shutdown))
+	{
+		bfg_reactor_remove(client);
+		thr->reactor_client = NULL;
+		free(client);
+		__thr_being_msg(LOG_NOTICE, thr, "shutting down");
+		miner_thread_finish(thr);
+		return;
+	}
+	
+	timer_unset(&client->tv_timeout);
+	minerloop_async_step(thr, &client->tv_timeout);
+	if (cgpu->drv->reactor_read && client->_fds[MRS_DEVICE].fd != cgpu->device_fd)
+		bfg_reactor_set_fd(client, MRS_DEVICE, cgpu->device_fd);
+}
+
+void minerloop_reactor_fd_changed(struct thr_info * const thr)
+{
+	struct bfg_reactor_client * const client = thr->reactor_client;
+	
+	if (client)
+		bfg_reactor_set_fd(client, MRS_DEVICE, thr->cgpu->device_fd);
+}
+
+void minerloop_reactor(struct thr_info * const thr)
+{
+	struct cgpu_info * const cgpu = thr->cgpu;
+	struct bfg_reactor_client *client;
+	
+	if (!bfg_reactor_available())
+	{
+		minerloop_async(thr);
+		return;
+	}
+	
+	_minerloop_setup(thr);
+	
+	client = malloc(sizeof(*client));
+	bfg_reactor_client_init(client);
+	client->fd_ready = minerloop_reactor_fd_ready;
+	client->run = minerloop_reactor_run;
+	client->userp = thr;
+	client->_fds[MRS_NOTIFIER].fd = thr->notifier[0];
+	client->_fds[MRS_WORK_RESTART].fd = thr->work_restart_notifier[0];
+	if (thr->mutex_request[1] != INVSOCK)
+		client->_fds[MRS_MUTEX_REQUEST].fd = thr->mutex_request[0];
+	if (cgpu->drv->reactor_read)
+		client->_fds[MRS_DEVICE].fd = cgpu->device_fd;
+	
+	// From here on the reactor thread owns the device; nothing may cancel it through this thr
+	thr->reactor_client = client;
+	thr->has_pth = false;
+	if (unlikely(!bfg_reactor_add(client)))
+	{
+		applog(LOG_WARNING, "%s: No I/O reactor available, using a dedicated thread", cgpu->dev_repr);
+		thr->reactor_client = NULL;
+		thr->has_pth = true;
+		free(client);
+		minerloop_async(thr);
+		return;
+	}
+	
+	applog(LOG_DEBUG, "%s: Handed off to I/O reactor", cgpu->dev_repr);
+	pthread_detach(pthread_self());
+	pthread_exit(NULL);
+}
+
+struct test_bfg_reactor {
+	struct bfg_reactor_client client;
+	uint8_t buf[0x10];
+	volatile size_t buflen;
+	volatile int runs;
+	volatile bool stop;
+	volatile bool stopped;
+};
+
+static
+void _test_bfg_reactor_fd_ready(struct bfg_reactor_client * const client, __maybe_unused const int slot)
+{
+	struct test_bfg_reactor * const t = client->userp;
+	const ssize_t r = read(client->_fds[slot].fd, &t->buf[t->buflen], sizeof(t->buf) - t->buflen);
+	
+	if (r > 0)
+		t->buflen += r;
+}
+
+static
+void _test_bfg_reactor_run(struct bfg_reactor_client * const client, struct timeval * const tvp_now)
+{
+	struct test_bfg_reactor * const t = client->userp;
+	
+	++t->runs;
+	if (t->stop)
+	{
+		bfg_reactor_remove(client);
+		t->stopped = true;
+		return;
+	}
+	timer_set_delay(&client->tv_timeout, tvp_now, 2000);
+}
+
+#define _test_bfg_reactor_wait(cond)  do {  \
+	for (int _i = 0; _i < 1000 && !(cond); ++_i)  \
+		cgsleep_ms(1);  \
+} while (0)
+
+struct test_reactor_mutex {
+	struct cgpu_info *cgpu;
+	volatile bool have_control;
+	volatile bool release;
+};
+
+static
+void *_test_reactor_mutex_requester(void * const userp)
+{
+	struct test_reactor_mutex * const t = userp;
+	
+	cgpu_request_control(t->cgpu);
+	t->have_control = true;
+	_test_bfg_reactor_wait(t->release);
+	cgpu_release_control(t->cgpu);
+	return NULL;
+}
+
+// Polls like the reactor thread would, for at most ms
+static
+bool _test_reactor_mutex_poll_for(struct bfg_reactor_client * const client, const unsigned ms)
+{
+	for (unsigned i = 0; i < ms; ++i)
+	{
+		if (minerloop_reactor_mutex_poll(client))
+			return true;
+		cgsleep_ms(1);
+	}
+	return false;
+}
+
+static
+void _test_minerloop_reactor_mutex(void)
+{
+	struct cgpu_info cgpu = { .device_fd = -1 };
+	struct thr_info thr = { .cgpu = &cgpu }, *thrs[] = { &thr };
+	struct bfg_reactor_client client;
+	struct test_reactor_mutex t = { .cgpu = &cgpu };
+	bool early = false;
+	pthread_t pth;
+	
+	cgpu.thr = thrs;
+	thr.pth = pthread_self();
+	notifier_init_invalid(thr.notifier);
+	cgpu_setup_control_requests(&cgpu);
+	bfg_reactor_client_init(&client);
+	client.userp = &thr;
+	
+	if (unlikely(pthread_create(&pth, NULL, _test_reactor_mutex_requester, &t)))
+	{
+		applog(LOG_WARNING, "%s test skipped: %s", "reactor mutex", "pthread_create");
+		goto out;
+	}
+	minerloop_reactor_fd_ready(&client, MRS_MUTEX_REQUEST);
+	_test_bfg_reactor_wait((early = minerloop_reactor_mutex_poll(&client)) || t.have_control);
+	if (early || !t.have_control)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "reactor mutex", "control not handed over");
+	}
+	if (_test_reactor_mutex_poll_for(&client, 20))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "reactor mutex", "took device back while controlled");
+	}
+	t.release = true;
+	if (!_test_reactor_mutex_poll_for(&client, 1000))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "reactor mutex", "device not returned");
+	}
+	pthread_join(pth, NULL);
+
+out:
+	notifier_destroy(thr.mutex_request);
+	pthread_cond_destroy(&cgpu.device_cond);
+	pthread_mutex_destroy(&cgpu.device_mutex);
+}
+
+void test_bfg_reactor(void)
+{
+	struct bfg_reactor reactor;
+	struct test_bfg_reactor t;
+	int master, slave;
+	
+	memset(&t, 0, sizeof(t));
+	
+	_test_minerloop_reactor_mutex();
+	
+	if (!bfg_openpty(&master, &slave))
+	{
+		applog(LOG_WARNING, "%s test skipped: %s", "reactor", "no pty available");
+		return;
+	}
+	if (!bfg_reactor_start(&reactor, -1))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "reactor", "could not start");
+		goto out;
+	}
+	
+	bfg_reactor_client_init(&t.client);
+	t.client.fd_ready = _test_bfg_reactor_fd_ready;
+	t.client.run = _test_bfg_reactor_run;
+	t.client.userp = &t;
+	bfg_reactor_set_fd(&t.client, 0, slave);
+	_bfg_reactor_add(&reactor, &t.client);
+	
+	// Simulated device sends a reply
+	if (write(master, "\x01\x02\x03", 3) != 3)
+		applog(LOG_WARNING, "%s test failed: %s", "reactor", "pty write");
+	_test_bfg_reactor_wait(t.buflen >= 3);
+	if (t.buflen != 3 || memcmp(t.buf, "\x01\x02\x03", 3))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "reactor", "device data not delivered");
+	}
+	
+	_test_bfg_reactor_wait(t.runs >= 5);
+	if (t.runs < 5)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "reactor", "timeout not firing");
+	}
+	
+	t.stop = true;
+	_test_bfg_reactor_wait(t.stopped);
+	if (!t.stopped)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "reactor", "client not removed");
+	}
+	
+	bfg_reactor_stop(&reactor);
+
+out:
+	close(slave);
+	close(master);
+}
+#else
+void minerloop_reactor(struct thr_info * const thr)
+{
+	minerloop_async(thr);
+}
+
+void minerloop_reactor_fd_changed(__maybe_unused struct thr_info * const thr)
+{}
+
+bool bfg_reactor_available(void)
+{
+	return false;
+}
+
+void test_bfg_reactor(void)
+{}
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+// Waits in do_notifier_select for at most ms, returning how long it took
+static
+long _test_notifier_select_ms(struct thr_info * const thr, const unsigned ms)
+{
+	struct timeval tv_start, tv_timeout, tv_now;
+	
+	timer_set_now(&tv_start);
+	timer_set_delay(&tv_timeout, &tv_start, ms * 1000);
+	do_notifier_select(thr, &tv_timeout);
+	timer_set_now(&tv_now);
+	return ms_tdiff(&tv_now, &tv_start);
+}
+#endif
+
+void test_notifier(void)
+{
+	notifier_t n;
+	
+	notifier_init(n);
+	notifier_wake(n);
+	notifier_wake(n);
+	if (!notifier_wait_us(n, 0))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "notifier", "wake");
+	}
+	notifier_reset(n);
+	if (notifier_wait_us(n, 0))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "notifier", "reset");
+	}
+	notifier_destroy(n);
+	
+#ifdef HAVE_SYS_EPOLL_H
+	static struct device_drv drv = {
+		.dname = "test",
+		.name = "TST",
+	};
+	struct cgpu_info cgpu = {
+		.drv = &drv,
+		.proc_repr = "TST 0",
+	};
+	struct thr_info thr[2];
+	notifier_t saved;
+	int i;
+	
+	memcpy(saved, work_restart_broadcast, sizeof(saved));
+	if (!notifier_init_broadcast(work_restart_broadcast))
+	{
+		applog(LOG_WARNING, "%s test skipped: %s", "notifier", "no eventfd");
+		return;
+	}
+	memset(thr, 0, sizeof(thr));
+	for (i = 0; i < 2; ++i)
+	{
+		thr[i].cgpu = &cgpu;
+		notifier_init(thr[i].notifier);
+		notifier_init(thr[i].work_restart_notifier);
+		notifier_init_invalid(thr[i].mutex_request);
+		thr[i]._notifier_epollfd = thr[i]._notifier_epoll_mutex_request = thr[i]._notifier_epoll_devfd = -1;
+		// Builds the epoll set
+		_test_notifier_select_ms(&thr[i], 0);
+		if (!thr[i].work_restart_broadcast)
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "notifier", "not subscribed");
+		}
+	}
+	
+	// One wake reaches every thread, once each, every time
+	for (int round = 0; round < 2; ++round)
+	{
+		notifier_wake(work_restart_broadcast);
+		for (i = 0; i < 2; ++i)
+			if (_test_notifier_select_ms(&thr[i], 1000) > 500)
+			{
+				++unittest_failures;
+				applog(LOG_WARNING, "%s test failed: %s", "notifier", "broadcast missed");
+			}
+		for (i = 0; i < 2; ++i)
+			if (_test_notifier_select_ms(&thr[i], 20) < 10)
+			{
+				++unittest_failures;
+				applog(LOG_WARNING, "%s test failed: %s", "notifier", "broadcast repeated");
+			}
+	}
+	
+	// Direct notifiers still work, and are consumed by the wait
+	notifier_wake(thr[1].notifier);
+	if (_test_notifier_select_ms(&thr[1], 1000) > 500 || _test_notifier_select_ms(&thr[1], 20) < 10)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "notifier", "direct wake");
+	}
+	
+	for (i = 0; i < 2; ++i)
+	{
+		notifier_epoll_destroy(&thr[i]);
+		notifier_destroy(thr[i].notifier);
+		notifier_destroy(thr[i].work_restart_notifier);
+	}
+	notifier_destroy(work_restart_broadcast);
+	memcpy(work_restart_broadcast, saved, sizeof(saved));
+#endif
+}
+
+#define QUEUE_AUTOTUNE_INITIAL_DEPTH  2
+#define QUEUE_AUTOTUNE_MAX_DEPTH  0x100
+// Never queue more than the processor gets through in this long, so work restarts discard little
+#define QUEUE_AUTOTUNE_MAX_WAIT_MS  1000
+#define QUEUE_AUTOTUNE_EWMA_WEIGHT  0.125
+
+int queue_latency_bucket(const long ms)
+{
+	int i;
+	for (i = 0; i < QUEUE_LATENCY_BUCKETS - 1; ++i)
+		if (ms < (1L << i))
+			break;
+	return i;
+}
+
+static
+void queue_latency_add(struct queue_latency_histogram * const hist, const long ms)
+{
+	++hist->buckets[queue_latency_bucket(ms)];
+	++hist->count;
+	hist->total_ms += ms;
+}
+
+static
+void queue_ewma_add(double * const avg, const double sample)
+{
+	if (*avg > 0)
+		*avg += (sample - *avg) * QUEUE_AUTOTUNE_EWMA_WEIGHT;
+	else
+		*avg = sample;
+}
+
+// Deep enough that work queued to an idle processor gets going before the work ahead of it is done
+int queue_autotune_calc(const double idle_latency_ms, const double done_interval_ms)
+{
+	double depth, max_depth;
+	
+	if (!(done_interval_ms > 0 && idle_latency_ms > 0))
+		return QUEUE_AUTOTUNE_INITIAL_DEPTH;
+	depth = 1 + ceil(idle_latency_ms / done_interval_ms);
+	max_depth = 1 + ceil(QUEUE_AUTOTUNE_MAX_WAIT_MS / done_interval_ms);
+	if (depth > max_depth)
+		depth = max_depth;
+	if (depth > QUEUE_AUTOTUNE_MAX_DEPTH)
+		depth = QUEUE_AUTOTUNE_MAX_DEPTH;
+	return depth;
+}
+
+static
+void queue_stats_init(struct thr_info * const thr)
+{
+	struct queue_stats * const qs = &thr->queue_stats;
+	
+	if (qs->enabled)
+		return;
+	mutex_init(&qs->lock);
+	qs->autotune_depth = QUEUE_AUTOTUNE_INITIAL_DEPTH;
+	qs->enabled = true;
+}
+
+static
+void queue_work_appending(struct thr_info * const thr, struct work * const work, const struct timeval * const tvp_now)
+{
+	struct queue_stats * const qs = &thr->queue_stats;
+	
+	mutex_lock(&qs->lock);
+	work->queued_idle = !qs->outstanding;
+	++qs->outstanding;
+	mutex_unlock(&qs->lock);
+	work->queue_thr = thr;
+	work->tv_queued = *tvp_now;
+	work->queue_nonce_found = false;
+}
+
+static
+void queue_work_unappend(struct thr_info * const thr, struct work * const work)
+{
+	struct queue_stats * const qs = &thr->queue_stats;
+	
+	mutex_lock(&qs->lock);
+	--qs->outstanding;
+	mutex_unlock(&qs->lock);
+	work->queue_thr = NULL;
+}
+
+void queue_work_nonce_found(struct work * const work)
+{
+	struct thr_info * const thr = work->queue_thr;
+	struct queue_stats * const qs = &thr->queue_stats;
+	const double ms = timer_elapsed_us(&work->tv_queued, NULL) / 1e3;
+	
+	if (work->queue_nonce_found)
+		return;
+	work->queue_nonce_found = true;
+	
+	mutex_lock(&qs->lock);
+	queue_latency_add(&qs->first_nonce, ms);
+	if (work->queued_idle)
+	{
+		// Nothing was ahead of it, so this is the latency queueing needs to hide
+		queue_ewma_add(&qs->idle_latency_ms, ms);
+		qs->autotune_depth = queue_autotune_calc(qs->idle_latency_ms, qs->done_interval_ms);
+	}
+	mutex_unlock(&qs->lock);
+}
+
+void queue_work_released(struct work * const work)
+{
+	struct thr_info * const thr = work->queue_thr;
+	struct queue_stats * const qs = &thr->queue_stats;
+	struct timeval tv_now;
+	
+	work->queue_thr = NULL;
+	timer_set_now(&tv_now);
+	
+	mutex_lock(&qs->lock);
+	--qs->outstanding;
+	if (timercmp(&work->tv_queued, &qs->tv_flushed, <))
+		++qs->flushed;
+	else
+	{
+		queue_latency_add(&qs->done, timer_elapsed_us(&work->tv_queued, &tv_now) / 1000);
+		if (timer_isset(&qs->tv_last_done))
+			queue_ewma_add(&qs->done_interval_ms, timer_elapsed_us(&qs->tv_last_done, &tv_now) / 1e3);
+		qs->tv_last_done = tv_now;
+		qs->autotune_depth = queue_autotune_calc(qs->idle_latency_ms, qs->done_interval_ms);
+	}
+	mutex_unlock(&qs->lock);
+}
+
+static
+bool queue_is_full(struct thr_info * const thr)
+{
+	if (thr->queue_full)
+		return true;
+	if (!thr->queue_autotune)
+		return false;
+	// Unlocked: a stale value only moves the next append to a later pass
+	return thr->queue_stats.outstanding >= thr->queue_stats.autotune_depth;
+}
+
+static
+void do_queue_flush(struct thr_info *mythr)
+{
+	struct cgpu_info *proc = mythr->cgpu;
+	struct device_drv *api = proc->drv;
+	struct queue_stats * const qs = &mythr->queue_stats;
+	
+	if (qs->enabled)
+	{
+		mutex_lock(&qs->lock);
+		timer_set_now(&qs->tv_flushed);
+		mutex_unlock(&qs->lock);
+	}
+	api->queue_flush(mythr);
+	if (mythr->next_work)
+	{
+		free_work(mythr->next_work);
+		mythr->next_work = NULL;
+	}
+	queue_prefetch_drop_stale(mythr);
+}
+
+void minerloop_queue(struct thr_info *thr)
+{
+	struct thr_info *mythr;
+	struct cgpu_info *cgpu = thr->cgpu;
+	struct device_drv *api = cgpu->drv;
+	struct timeval tv_now;
+	struct timeval tv_timeout;
+	struct cgpu_info *proc;
+	bool should_be_running;
+	struct work *work;
 	
 	_minerloop_setup(thr);
+	for (proc = cgpu; proc; proc = proc->next_proc)
+		queue_stats_init(proc->thr[0]);
 	
 	while (likely(!cgpu->shutdown)) {
 		tv_timeout.tv_sec = -1;
@@ -684,13 +1958,16 @@ redo:
 				if (unlikely(mythr->_mt_disable_called))
 					mt_disable_finish(mythr);
 				
+				if (unlikely(!cgpu->_prefetch_started) && queue_prefetch_depth(proc))
+					queue_prefetch_start(cgpu);
+				
 				if (unlikely(mythr->work_restart))
 				{
 					mythr->work_restart = false;
 					do_queue_flush(mythr);
 				}
 				
-				while (!mythr->queue_full)
+				while (!queue_is_full(mythr))
 				{
 					if (mythr->next_work)
 					{
@@ -705,8 +1982,13 @@ redo:
 					}
 					if (!work)
 						break;
+					timer_set_now(&tv_now);
+					queue_work_appending(mythr, work, &tv_now);
 					if (!api->queue_append(mythr, work))
+					{
+						queue_work_unappend(mythr, work);
 						mythr->next_work = work;
+					}
 				}
 			}
 			else
@@ -726,7 +2008,7 @@ redo:
 			}
 			
 			should_be_running = (proc->deven == DEV_ENABLED && !mythr->pause);
-			if (should_be_running && !mythr->queue_full)
+			if (should_be_running && !queue_is_full(mythr))
 				goto redo;
 			
 			reduce_timeout_to(&tv_timeout, &mythr->tv_poll);
@@ -740,6 +2022,192 @@ redo:
 	}
 }
 
+void test_queue_stats(void)
+{
+	static const struct {
+		long ms;
+		int bucket;
+	} bucket_tests[] = {
+		{0, 0}, {1, 1}, {2, 2}, {3, 2}, {1000, 10}, {32767, 15}, {32768, 16}, {1L << 20, 16},
+	};
+	static const struct {
+		double latency;
+		double interval;
+		int depth;
+	} autotune_tests[] = {
+		{0, 0, QUEUE_AUTOTUNE_INITIAL_DEPTH},  // no data yet
+		{0, 10, QUEUE_AUTOTUNE_INITIAL_DEPTH},
+		{1, 100, 2},
+		{50, 10, 6},
+		{5000, 10, 101},  // capped by QUEUE_AUTOTUNE_MAX_WAIT_MS
+		{1e6, 0.001, QUEUE_AUTOTUNE_MAX_DEPTH},
+	};
+	struct thr_info thr = {
+		.id = -1,
+	};
+	struct queue_stats * const qs = &thr.queue_stats;
+	struct timeval tv_now;
+	struct work *work;
+	
+	for (unsigned i = 0; i < sizeof(bucket_tests) / sizeof(*bucket_tests); ++i)
+		if (queue_latency_bucket(bucket_tests[i].ms) != bucket_tests[i].bucket)
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %ld ms in bucket %d (expected %d)", "queue_latency_bucket", bucket_tests[i].ms, queue_latency_bucket(bucket_tests[i].ms), bucket_tests[i].bucket);
+		}
+	for (unsigned i = 0; i < sizeof(autotune_tests) / sizeof(*autotune_tests); ++i)
+		if (queue_autotune_calc(autotune_tests[i].latency, autotune_tests[i].interval) != autotune_tests[i].depth)
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: latency %g ms, interval %g ms gave depth %d (expected %d)", "queue_autotune_calc", autotune_tests[i].latency, autotune_tests[i].interval, queue_autotune_calc(autotune_tests[i].latency, autotune_tests[i].interval), autotune_tests[i].depth);
+		}
+	
+	queue_stats_init(&thr);
+	
+	// Queued to an idle processor, finds a nonce, completes
+	work = calloc(1, sizeof(struct work));
+	timer_set_now(&tv_now);
+	queue_work_appending(&thr, work, &tv_now);
+	if (!(work->queued_idle && qs->outstanding == 1))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queue_stats", "append not tracked");
+	}
+	queue_work_nonce_found(work);
+	queue_work_nonce_found(work);
+	free_work(work);
+	if (!(qs->outstanding == 0 && qs->first_nonce.count == 1 && qs->done.count == 1 && !qs->flushed && timer_isset(&qs->tv_last_done)))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queue_stats", "completion not tracked");
+	}
+	
+	// Queued behind another, then flushed; copies are not tracked
+	struct work * const work_ahead = calloc(1, sizeof(struct work));
+	queue_work_appending(&thr, work_ahead, &tv_now);
+	work = calloc(1, sizeof(struct work));
+	queue_work_appending(&thr, work, &tv_now);
+	struct work * const work_copy = copy_work(work);
+	free_work(work_copy);
+	if (work->queued_idle || qs->outstanding != 2)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queue_stats", "busy append or copy miscounted");
+	}
+	timer_set_delay(&qs->tv_flushed, &tv_now, 1);
+	free_work(work);
+	free_work(work_ahead);
+	if (!(qs->outstanding == 0 && qs->flushed == 2 && qs->done.count == 1))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queue_stats", "flush not tracked");
+	}
+	
+	// Rejected by the driver
+	work = calloc(1, sizeof(struct work));
+	queue_work_appending(&thr, work, &tv_now);
+	queue_work_unappend(&thr, work);
+	free_work(work);
+	if (qs->outstanding || qs->flushed != 2)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queue_stats", "unappend miscounted");
+	}
+	
+	thr.queue_autotune = true;
+	qs->autotune_depth = 1;
+	qs->outstanding = 1;
+	if (!queue_is_full(&thr))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queue_stats", "autotuned depth not enforced");
+	}
+	
+	pthread_mutex_destroy(&qs->lock);
+}
+
+static unsigned char test_queue_prefetch_restart_id;
+
+static
+bool test_queue_prefetch_stale(struct work * const work)
+{
+	return work->work_restart_id != test_queue_prefetch_restart_id;
+}
+
+void test_queue_prefetch(void)
+{
+	struct device_drv drv = {
+		.queue_prefetch = 3,
+	};
+	struct cgpu_info proc = {
+		.drv = &drv,
+		.device = &proc,
+		.deven = DEV_ENABLED,
+	};
+	struct thr_info thr = {
+		.id = -1,
+		.cgpu = &proc,
+	};
+	struct thr_info *thrp = &thr;
+	struct work *works[4];
+	char replybuf[0x100];
+	enum bfg_set_device_replytype success;
+	
+	proc.thr = &thrp;
+	test_queue_prefetch_restart_id = 0;
+	for (int i = 0; i < 4; ++i)
+		works[i] = calloc(1, sizeof(struct work));
+	
+	for (int i = 0; i < 3; ++i)
+	{
+		if (!queue_prefetch_wanted(&proc))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "queue_prefetch", "stopped short of depth");
+		}
+		_queue_prefetch_push(&thr, works[i]);
+	}
+	if (queue_prefetch_wanted(&proc))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queue_prefetch", "went past depth");
+	}
+	
+	// A work restart drops only works from before it
+	++test_queue_prefetch_restart_id;
+	works[2]->work_restart_id = test_queue_prefetch_restart_id;
+	_queue_prefetch_push(&thr, works[3]);
+	works[3]->work_restart_id = test_queue_prefetch_restart_id;
+	if (_queue_prefetch_drop_stale(&thr, test_queue_prefetch_stale) != 2 || thr._prefetch_count != 2 || !queue_prefetch_wanted(&proc))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queue_prefetch", "stale works not dropped");
+	}
+	
+	// Taken in order fetched, skipping any that went stale since
+	++test_queue_prefetch_restart_id;
+	works[3]->work_restart_id = test_queue_prefetch_restart_id;
+	if (_queue_prefetch_take(&thr, test_queue_prefetch_stale) != works[3] || thr._prefetch_count
+	 || _queue_prefetch_take(&thr, test_queue_prefetch_stale))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queue_prefetch", "take order");
+	}
+	free_work(works[3]);
+	
+	proc_set_device_queue_prefetch(&proc, "queue-prefetch", "0", replybuf, &success);
+	if (queue_prefetch_depth(&proc) || queue_prefetch_wanted(&proc))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queue_prefetch", "disabling");
+	}
+	if (!proc_set_device_queue_prefetch(&proc, "queue-prefetch", "-1", replybuf, &success))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queue_prefetch", "negative depth accepted");
+	}
+}
+
 void *miner_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
@@ -774,23 +2242,8 @@ void *miner_thread(void *userdata)
 		minerloop_scanhash(mythr);
 	__thr_being_msg(LOG_NOTICE, mythr, "shutting down");
 
-out: ;
-	struct cgpu_info *proc = cgpu;
-	do
-	{
-		proc->deven = DEV_DISABLED;
-		proc->status = LIFE_DEAD2;
-	}
-	while ( (proc = proc->next_proc) && !proc->threads);
-	mythr->getwork = 0;
-	mythr->has_pth = false;
-	cgsleep_ms(1);
-	
-	if (drv->thread_shutdown)
-		drv->thread_shutdown(mythr);
-
-	notifier_destroy(mythr->notifier);
-
+out:
+	miner_thread_finish(mythr);
 	return NULL;
 }
 
@@ -808,6 +2261,7 @@ bool _add_cgpu(struct cgpu_info *cgpu)
 	
 	cgpu->dev_repr = malloc(6);
 	cgpu->dev_repr_ns = malloc(6);
+	cgpu->history = history_new();
 	
 #ifdef NEED_BFG_LOWL_VCOM
 	maybe_strdup_if_null(&cgpu->dev_manufacturer, detectone_meta_info.manufacturer);
@@ -829,6 +2283,7 @@ bool _add_cgpu(struct cgpu_info *cgpu)
 			slave = malloc(sizeof(*slave));
 			*slave = *cgpu;
 			slave->proc_id = i;
+			slave->history = history_new();
 			slave->threads = tpp;
 			devices_new[total_devices_new++] = slave;
 			*nlp_p = slave;
@@ -999,6 +2454,14 @@ const char *proc_set_device(struct cgpu_info * const proc, char * const optname,
 			else
 			if (!strcasecmp(optname, "temp-target") || !strcasecmp(optname, "temp_target"))
 				return proc_set_device_temp_target(proc, optname, newvalue, replybuf, out_success);
+			else
+			if (!strcasecmp(optname, "queue-prefetch") || !strcasecmp(optname, "queue_prefetch"))
+			{
+				*out_success = SDR_AUTO;
+				const char * const rv = proc_set_device_queue_prefetch(proc, optname, newvalue, replybuf, out_success);
+				_set_auto_sdr(out_success, rv, optname);
+				return rv;
+			}
 		default:
 			break;
 	}
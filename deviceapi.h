@@ -43,6 +43,7 @@ extern float common_scrypt_min_nonce_diff(struct cgpu_info *, const struct minin
 
 extern void request_work(struct thr_info *);
 extern struct work *get_work(struct thr_info *);
+extern struct work *get_work_for(struct thr_info *);
 extern bool hashes_done(struct thr_info *, int64_t hashes, struct timeval *tvp_hashes, uint32_t *max_nonce);
 extern bool hashes_done2(struct thr_info *, int64_t hashes, uint32_t *max_nonce);
 extern void mt_disable_start(struct thr_info *);
@@ -64,7 +65,55 @@ extern void job_start_abort(struct thr_info *, bool failure);
 extern bool do_process_results(struct thr_info *, struct timeval *tvp_now, struct work *, bool stopping);
 extern void minerloop_async(struct thr_info *);
 
+// Shared epoll I/O reactor: a few threads service many devices' fds and timers
+#define BFG_REACTOR_MAX_FDS  4
+struct bfg_reactor;
+struct bfg_reactor_client;
+struct bfg_reactor_fd {
+	struct bfg_reactor_client *client;
+	int fd;
+};
+struct bfg_reactor_client {
+	// Called from the reactor thread when the fd in slot is readable; must consume the data
+	void (*fd_ready)(struct bfg_reactor_client *, int slot);
+	// Called after fd_ready, or once tv_timeout passes; may reset tv_timeout, or remove the client
+	void (*run)(struct bfg_reactor_client *, struct timeval *tvp_now);
+	void *userp;
+	struct timeval tv_timeout;
+	
+	// Private to the reactor
+	struct bfg_reactor *_reactor;
+	struct bfg_reactor_fd _fds[BFG_REACTOR_MAX_FDS];
+	bool _dirty;
+	struct bfg_reactor_client *prev;
+	struct bfg_reactor_client *next;
+};
+extern int opt_reactor_threads;
+extern bool bfg_reactor_available(void);
+extern void bfg_reactor_client_init(struct bfg_reactor_client *);
+extern bool bfg_reactor_add(struct bfg_reactor_client *);
+// Only from the reactor thread, or before bfg_reactor_add
+extern void bfg_reactor_set_fd(struct bfg_reactor_client *, int slot, int fd);
+// Only from the client's own run callback
+extern void bfg_reactor_remove(struct bfg_reactor_client *);
+
+// minerloop_async on a reactor thread; uses drv->reactor_read for device_fd
+extern void minerloop_reactor(struct thr_info *);
+// Call after (re)opening device_fd from a reactor_read/poll/job callback
+extern void minerloop_reactor_fd_changed(struct thr_info *);
+#ifndef WIN32
+extern bool bfg_openpty(int *out_master, int *out_slave);
+#endif
+extern void test_bfg_reactor(void);
+extern void test_notifier(void);
+
+extern int queue_latency_bucket(long ms);
+extern int queue_autotune_calc(double idle_latency_ms, double done_interval_ms);
+extern void queue_work_nonce_found(struct work *);
+extern void queue_work_released(struct work *);
 extern void minerloop_queue(struct thr_info *);
+extern void test_queue_stats(void);
+extern void test_queue_prefetch(void);
 
 // Establishes a simple way for external threads to directly communicate with device
 extern void cgpu_setup_control_requests(struct cgpu_info *);
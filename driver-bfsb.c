@@ -138,7 +138,7 @@ bool bfsb_init(struct thr_info *thr)
 		bitfury_init_chip(proc);
 		bitfury->osc6_bits = 53;
 		bitfury_send_reinit(bitfury->spi, bitfury->slot, bitfury->fasync, bitfury->osc6_bits);
-		bitfury_init_freq_stat(&bitfury->chip_stat, 52, 56);
+		bitfury_init_dclk(proc, 52, 56);
 		
 		if (proc->proc_id == proc->procs - 1)
 			free(devicelist);
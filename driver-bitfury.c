@@ -24,6 +24,7 @@
 
 #include "config.h"
 
+#include <ctype.h>
 #include <limits.h>
 #include "miner.h"
 #include <unistd.h>
@@ -240,11 +241,23 @@ void bitfury_enable(struct thr_info * const thr)
 		timer_set_now(&master_thr->tv_poll);
 }
 
+// Stops the helper thread bitfury_do_io starts for devices with more than one bus
+void bitfury_txrx_async_free(struct cgpu_info * const dev)
+{
+	struct bitfury_device * const bitfury = dev->device_data;
+	
+	if (!bitfury->txrx_async)
+		return;
+	spi_txrx_async_free(bitfury->txrx_async);
+	bitfury->txrx_async = NULL;
+}
+
 void bitfury_shutdown(struct thr_info *thr) {
 	struct cgpu_info *cgpu = thr->cgpu, *proc;
 	struct bitfury_device *bitfury;
 	
 	applog(LOG_INFO, "INFO bitfury_shutdown");
+	bitfury_txrx_async_free(cgpu);
 	for (proc = cgpu; proc; proc = proc->next_proc)
 	{
 		bitfury = proc->device_data;
@@ -275,94 +288,66 @@ bool bitfury_job_prepare(struct thr_info *thr, struct work *work, __maybe_unused
 static
 bool fudge_nonce(struct work * const work, uint32_t *nonce_p) {
 	static const uint32_t offsets[] = {0, 0xffc00000, 0xff800000, 0x02800000, 0x02C00000, 0x00400000};
-	uint32_t nonce;
+	uint32_t nonces[6], found;
 	int i;
 	
 	if (unlikely(!work))
 		return false;
 	
 	for (i = 0; i < 6; ++i)
-	{
-		nonce = *nonce_p + offsets[i];
-		if (test_nonce(work, nonce, false))
-		{
-			*nonce_p = nonce;
-			return true;
-		}
-	}
-	return false;
+		nonces[i] = *nonce_p + offsets[i];
+	found = test_nonces(work, nonces, 6);
+	if (!found)
+		return false;
+	*nonce_p = nonces[__builtin_ctz(found)];
+	return true;
 }
 
 void bitfury_noop_job_start(struct thr_info __maybe_unused * const thr)
 {
 }
 
-// freq_stat->{mh,s} are allocated such that [osc6_min] is the first valid index and [0] falls outside the allocation
-
-void bitfury_init_freq_stat(struct freq_stat * const c, const int osc6_min, const int osc6_max)
+static
+bool bitfury_dclk_set_freq(struct dclk_chip * const chip, const int osc6_bits)
 {
-	const int osc6_values = (osc6_max + 1 - osc6_min);
-	void * const p = calloc(osc6_values, (sizeof(*c->mh) + sizeof(*c->s)));
-	c->mh = p - (sizeof(*c->mh) * osc6_min);
-	c->s = p + (sizeof(*c->mh) * osc6_values) - (sizeof(*c->s) * osc6_min);
-	c->osc6_min = osc6_min;
-	c->osc6_max = osc6_max;
+	struct cgpu_info * const proc = chip->userp;
+	struct bitfury_device * const bitfury = proc->device_data;
+	
+	applog(LOG_DEBUG, "%"PRIpreprv": Changing osc6_bits to %d",
+	       proc->proc_repr, osc6_bits);
+	bitfury->osc6_bits = osc6_bits;
+	bitfury_send_freq(bitfury->spi, bitfury->slot, bitfury->fasync, bitfury->osc6_bits);
+	return true;
 }
 
-void bitfury_clean_freq_stat(struct freq_stat * const c)
+static const struct dclk_chip_funcs bitfury_dclk_funcs = {
+	.set_freq = bitfury_dclk_set_freq,
+};
+
+// Called once the chip is running at its initial osc6_bits
+void bitfury_init_dclk(struct cgpu_info * const proc, const int osc6_min, const int osc6_max)
 {
-	free(&c->mh[c->osc6_min]);
+	struct bitfury_device * const bitfury = proc->device_data;
+	const struct cgpu_info * const dev = proc->device;
+	const char * const id = dev->dev_serial ?: dev->device_path;
+	char key[64];
+	
+	// proc_repr_ns depends on enumeration order, so key saved state on where the chip is instead
+	snprintf(key, sizeof(key), "%s:%s:%lu:%u", proc->drv->name, id ?: "", (unsigned long)bitfury->slot, bitfury->fasync);
+	for (char *p = key; *p; ++p)
+		if (isspace((unsigned char)*p))
+			*p = '_';
+	dclk_chip_init(&bitfury->dclk, &bitfury_dclk_funcs, proc, proc->proc_repr, key, osc6_min, osc6_max, bitfury->osc6_bits);
 }
 
-#define HOP_DONE 600
-
 typedef uint32_t bitfury_inp_t[0x11];
 
-static
-int bitfury_select_freq(struct bitfury_device *bitfury, struct cgpu_info *proc) {
-	int freq;
-	int random;
-	int i;
-	bool all_done;
-	struct freq_stat *c;
-	
-	c = &bitfury->chip_stat;
-	
-	if (c->best_done) {
-		freq = c->best_osc;
-	} else {
-		random = (int)(bitfury->mhz * 1000.0) & 1;
-		freq = (bitfury->osc6_bits == c->osc6_max) ? c->osc6_min : bitfury->osc6_bits + random;
-		all_done = true;
-		for (i = c->osc6_min; i <= c->osc6_max; ++i)
-			if (c->s[i] <= HOP_DONE)
-			{
-				all_done = false;
-				break;
-			}
-		if (all_done)
-		{
-			double mh_max = 0.0;
-			
-			for (i = c->osc6_min; i <= c->osc6_max; ++i)
-			{
-				const double mh_actual = c->mh[i] / c->s[i];
-				if (mh_max >= mh_actual)
-					continue;
-				mh_max = mh_actual;
-				freq = i;
-			}
-			c->best_done = 1;
-			c->best_osc = freq;
-			applog(LOG_DEBUG, "%"PRIpreprv": best_osc = %d",
-			       proc->proc_repr, freq);
-		}
-	}
-	applog(LOG_DEBUG, "%"PRIpreprv": Changing osc6_bits to %d",
-	       proc->proc_repr, freq);
-	bitfury->osc6_bits = freq;
-	bitfury_send_freq(bitfury->spi, bitfury->slot, bitfury->fasync, bitfury->osc6_bits);
-	return 0;
+// Chip IO while processing results must wait for the transfer of the next bus to finish
+static inline
+void bitfury_io_quiesce(struct spi_txrx_async * const async)
+{
+	if (async)
+		spi_txrx_async_wait(async);
 }
 
 void bitfury_do_io(struct thr_info * const master_thr)
@@ -370,7 +355,6 @@ void bitfury_do_io(struct thr_info * const master_thr)
 	struct cgpu_info *proc;
 	struct thr_info *thr;
 	struct bitfury_device *bitfury;
-	struct freq_stat *c;
 	const uint32_t *inp;
 	int n, i, j;
 	bool newjob;
@@ -381,6 +365,8 @@ void bitfury_do_io(struct thr_info * const master_thr)
 	struct timeval tv_now;
 	uint32_t counter;
 	struct timeval *tvp_stat;
+	int n_buses = 0, bus;
+	struct spi_txrx_async *async = NULL;
 	
 	for (proc = master_thr->cgpu; proc; proc = proc->next_proc)
 		++n_chips;
@@ -388,6 +374,8 @@ void bitfury_do_io(struct thr_info * const master_thr)
 	struct cgpu_info *procs[n_chips];
 	void *rxbuf[n_chips];
 	bitfury_inp_t rxbuf_copy[n_chips];
+	struct spi_port *buses[n_chips];
+	int bus_first_chip[n_chips + 1];
 	
 	// NOTE: This code assumes:
 	// 1) that chips on the same SPI bus are grouped together
@@ -404,9 +392,9 @@ void bitfury_do_io(struct thr_info * const master_thr)
 		{
 			if (spi != bitfury->spi)
 			{
-				if (spi)
-					spi_txrx(spi);
 				spi = bitfury->spi;
+				buses[n_buses] = spi;
+				bus_first_chip[n_buses++] = n_chips;
 				spi_clear_buf(spi);
 				spi_emit_break(spi);
 				lastchip = 0;
@@ -426,22 +414,42 @@ void bitfury_do_io(struct thr_info * const master_thr)
 		timer_unset(&master_thr->tv_poll);
 		return;
 	}
-	timer_set_now(&tv_now);
-	spi_txrx(spi);
+	bus_first_chip[n_buses] = n_chips;
 	
-	for (j = 0; j < n_chips; ++j)
+	// With more than one bus, each one's results are processed while the next transfers
+	if (n_buses > 1)
 	{
-		swap32tole(rxbuf_copy[j], rxbuf[j], 0x11);
-		rxbuf[j] = rxbuf_copy[j];
+		bitfury = master_thr->cgpu->device_data;
+		if (!bitfury->txrx_async)
+			bitfury->txrx_async = spi_txrx_async_new();
+		async = bitfury->txrx_async;
 	}
 	
-	for (j = 0; j < n_chips; ++j)
+	timer_set_now(&tv_now);
+	if (async)
+		spi_txrx_async_start(async, buses[0]);
+	
+	for (j = 0, bus = 0; j < n_chips; ++j)
 	{
+		if (j == bus_first_chip[bus])
+		{
+			if (async)
+				spi_txrx_async_wait(async);
+			else
+				spi_txrx(buses[bus]);
+			for (i = j; i < bus_first_chip[bus + 1]; ++i)
+			{
+				swap32tole(rxbuf_copy[i], rxbuf[i], 0x11);
+				rxbuf[i] = rxbuf_copy[i];
+			}
+			if (++bus < n_buses)
+				spi_txrx_async_start(async, buses[bus]);
+		}
+		
 		proc = procs[j];
 		thr = proc->thr[0];
 		bitfury = proc->device_data;
 		tvp_stat = &bitfury->tv_stat;
-		c = &bitfury->chip_stat;
 		uint32_t * const newbuf = &bitfury->newbuf[0];
 		uint32_t * const oldbuf = &bitfury->oldbuf[0];
 		
@@ -455,6 +463,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 		
 		if (unlikely(bitfury->desync_counter == 99))
 		{
+			bitfury_io_quiesce(async);
 			bitfury_init_oldbuf(proc, inp);
 			goto out;
 		}
@@ -474,6 +483,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 			{
 				applog(LOG_WARNING, "%"PRIpreprv": Previous nonce mismatch (4th try), recalibrating",
 				       proc->proc_repr);
+				bitfury_io_quiesce(async);
 				bitfury_init_oldbuf(proc, inp);
 				continue;
 			}
@@ -499,6 +509,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 				inc_hw_errors2(thr, NULL, NULL);
 				applog(LOG_DEBUG, "%"PRIpreprv": Full result match, reinitialising",
 				       proc->proc_repr);
+				bitfury_io_quiesce(async);
 				bitfury_send_reinit(bitfury->spi, bitfury->slot, bitfury->fasync, bitfury->osc6_bits);
 				bitfury->desync_counter = 99;
 				goto out;
@@ -549,46 +560,6 @@ void bitfury_do_io(struct thr_info * const master_thr)
 			}
 		}
 		
-		if (c->osc6_max)
-		{
-			if (stat_elapsed_secs >= 60)
-			{
-				double mh_diff, s_diff;
-				const int osc = bitfury->osc6_bits;
-				
-				// Copy current statistics
-				mh_diff = bitfury->counter2 - c->omh;
-				s_diff = total_secs - c->os;
-				applog(LOG_DEBUG, "%"PRIpreprv": %.0f completed in %f seconds",
-				       proc->proc_repr, mh_diff, s_diff);
-				if (osc >= c->osc6_min && osc <= c->osc6_max)
-				{
-					c->mh[osc] += mh_diff;
-					c->s[osc] += s_diff;
-				}
-				c->omh = bitfury->counter2;
-				c->os = total_secs;
-				if (opt_debug && !c->best_done)
-				{
-					char logbuf[0x100];
-					logbuf[0] = '\0';
-					for (i = c->osc6_min; i <= c->osc6_max; ++i)
-						tailsprintf(logbuf, sizeof(logbuf), " %d=%.3f/%3.0fs",
-						            i, c->mh[i] / c->s[i], c->s[i]);
-					applog(LOG_DEBUG, "%"PRIpreprv":%s",
-					       proc->proc_repr, logbuf);
-				}
-				
-				// Change freq;
-				if (!c->best_done) {
-					bitfury_select_freq(bitfury, proc);
-				} else {
-					applog(LOG_DEBUG, "%"PRIpreprv": Stable freq, osc6_bits: %d",
-					       proc->proc_repr, bitfury->osc6_bits);
-				}
-			}
-		}
-		
 		if (n)
 		{
 			for (i = 0; i < n; ++i)
@@ -619,7 +590,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 					applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (work=%p)",
 					       proc->proc_repr, i, (unsigned long)nonce, thr->work);
 					submit_nonce(thr, thr->work, nonce);
-					bitfury->counter2 += 1;
+					dclk_chip_nonces(&bitfury->dclk, 1, 0);
 				}
 				else
 				if (!thr->prev_work)
@@ -631,11 +602,12 @@ void bitfury_do_io(struct thr_info * const master_thr)
 					applog(LOG_DEBUG, "%"PRIpreprv": nonce %x = %08lx (prev work=%p)",
 					       proc->proc_repr, i, (unsigned long)nonce, thr->prev_work);
 					submit_nonce(thr, thr->prev_work, nonce);
-					bitfury->counter2 += 1;
+					dclk_chip_nonces(&bitfury->dclk, 1, 0);
 				}
 				else
 				{
 					inc_hw_errors(thr, thr->work, nonce);
+					dclk_chip_nonces(&bitfury->dclk, 0, 1);
 					++bitfury->sample_hwe;
 					bitfury->strange_counter += 1;
 				}
@@ -645,6 +617,7 @@ void bitfury_do_io(struct thr_info * const master_thr)
 					{
 						applog(LOG_WARNING, "%"PRIpreprv": %d of the last %d results were bad, reinitialising",
 						       proc->proc_repr, bitfury->sample_hwe, bitfury->sample_tot);
+						bitfury_io_quiesce(async);
 						bitfury_send_reinit(bitfury->spi, bitfury->slot, bitfury->fasync, bitfury->osc6_bits);
 						bitfury->desync_counter = 99;
 					}
@@ -673,6 +646,7 @@ out:
 		{
 			applog(LOG_DEBUG, "%"PRIpreprv": Forcing reinitialisation",
 			       proc->proc_repr);
+			bitfury_io_quiesce(async);
 			bitfury_send_reinit(bitfury->spi, bitfury->slot, bitfury->fasync, bitfury->osc6_bits);
 			bitfury->desync_counter = 99;
 			bitfury->mhz_last = 0;
@@ -680,7 +654,14 @@ out:
 			bitfury->force_reinit = false;
 		}
 		if (stat_elapsed_secs >= 60)
+		{
+			if (bitfury->dclk.funcs)
+			{
+				bitfury_io_quiesce(async);
+				dclk_chip_sample(&bitfury->dclk, stat_elapsed_secs, proc->temp);
+			}
 			copy_time(tvp_stat, &tv_now);
+		}
 	}
 	
 	timer_set_delay(&master_thr->tv_poll, &tv_now, 10000);
@@ -760,7 +741,6 @@ const char *bitfury_set_osc6_bits(struct cgpu_info * const proc, const char * co
 {
 	struct bitfury_device * const bitfury = proc->device_data;
 	uint32_t newval;
-	struct freq_stat * const c = &bitfury->chip_stat;
 	
 	newval = bitfury->osc6_bits;
 	if (!_bitfury_set_device_parse_setting(&newval, setting, replybuf, BITFURY_MAX_OSC6_BITS))
@@ -768,7 +748,8 @@ const char *bitfury_set_osc6_bits(struct cgpu_info * const proc, const char * co
 	
 	bitfury->osc6_bits = newval;
 	bitfury->force_reinit = true;
-	c->osc6_max = 0;
+	// A manual setting sticks
+	bitfury->dclk.funcs = NULL;
 	
 	return NULL;
 }
@@ -796,7 +777,6 @@ const char *bitfury_tui_handle_choice(struct cgpu_info *cgpu, int input)
 	{
 		case 'o': case 'O':
 		{
-			struct freq_stat * const c = &bitfury->chip_stat;
 			int val;
 			char *intvar;
 			
@@ -811,7 +791,7 @@ const char *bitfury_tui_handle_choice(struct cgpu_info *cgpu, int input)
 			
 			bitfury->osc6_bits = val;
 			bitfury->force_reinit = true;
-			c->osc6_max = 0;
+			bitfury->dclk.funcs = NULL;
 			
 			return "Oscillator bits changing\n";
 		}
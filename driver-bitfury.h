@@ -16,8 +16,7 @@ extern const char *bitfury_set_osc6_bits(struct cgpu_info *, const char *, const
 
 extern bool bitfury_prepare(struct thr_info *);
 extern bool bitfury_init_chip(struct cgpu_info *);
-extern void bitfury_init_freq_stat(struct freq_stat *, int osc6_min, int osc6_max);
-extern void bitfury_clean_freq_stat(struct freq_stat *);
+extern void bitfury_init_dclk(struct cgpu_info *, int osc6_min, int osc6_max);
 
 extern bool bitfury_job_prepare(struct thr_info *, struct work *, uint64_t max_nonce);
 extern void bitfury_noop_job_start(struct thr_info *);
@@ -32,5 +31,6 @@ extern void bitfury_wlogprint_status(struct cgpu_info *);
 extern void bitfury_disable(struct thr_info *);
 extern void bitfury_enable(struct thr_info *);
 extern void bitfury_shutdown(struct thr_info *);
+extern void bitfury_txrx_async_free(struct cgpu_info *);
 
 #endif
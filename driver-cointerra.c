@@ -933,6 +933,11 @@ static bool cta_prepare(struct thr_info *thr)
 	cgtime(&info->core_hash_start);
 	
 	usb_ep_set_timeouts_ms(info->ep, COINTERRA_USB_TIMEOUT, COINTERRA_USB_TIMEOUT);
+	/* Optionally keep reads posted so nonces are queued for the recv
+	 * thread as soon as they arrive */
+	if (info->usb_async_reads && !usb_submit_read(info->ep, info->usb_async_reads, NULL, NULL))
+		applog(LOG_DEBUG, "%s: Failed to post USB reads, reading synchronously",
+		       cointerra->dev_repr);
 	timer_set_now(&thr->tv_poll);
 
 	return true;
@@ -989,9 +994,10 @@ bool cointerra_queue_append(struct thr_info * const thr, struct work * const wor
 	
 // 	HASH_ADD_INT(master_thr->work, device_id, work);
 	{
-		++dev->queued_count;
 		timer_set_now(&work->tv_work_start);
-		HASH_ADD_INT(dev->queued_work, id, work);
+		wr_lock(&dev->qlock);
+		__add_queued(dev, work);
+		wr_unlock(&dev->qlock);
 	}
 	++devstate->work_id;
 	if (!--devstate->requested)
@@ -1348,8 +1354,23 @@ const char *cointerra_set_load(struct cgpu_info *proc, const char *optname, cons
 	return NULL;
 }
 
+static
+const char *cointerra_set_usb_async_reads(struct cgpu_info *proc, const char *optname, const char *newvalue, char *replybuf, enum bfg_set_device_replytype *out_success)
+{
+	struct cointerra_info * const devstate = proc->device_data;
+	
+	const int nv = atoi(newvalue);
+	if (nv < 0 || nv > 0x10)
+		return "Invalid number of USB reads";
+	
+	devstate->usb_async_reads = nv;
+	
+	return NULL;
+}
+
 static const struct bfg_set_device_definition cointerra_set_device_funcs[] = {
 	{"load", cointerra_set_load, "power stepping (1-255)"},
+	{"usb_async_reads", cointerra_set_usb_async_reads, "USB reads kept posted (0 to read synchronously)"},
 	{NULL},
 };
 
@@ -142,6 +142,7 @@ struct cointerra_info {
 	struct libusb_device_handle *usbh;
 	struct lowl_usb_endpoint *ep;
 	uint8_t set_load;
+	uint8_t usb_async_reads;
 	
 	/* Info data */
 	uint16_t hwrev;
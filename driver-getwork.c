@@ -138,9 +138,11 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 		// NOTE: expecting hex2bin to fail since we only parse 80 of the 128
 		hex2bin(hdr, submit, 80);
 		nonce = le32toh(*(uint32_t *)&hdr[76]);
-		HASH_FIND(hh, client->work, hdr, 76, work);
+		mutex_lock(&client->worklog_mutex);
+		work = __proxy_worklog_find(client, hdr);
 		if (!work)
 		{
+			mutex_unlock(&client->worklog_mutex);
 			inc_hw_errors2(thr, NULL, &nonce);
 			rejreason = "unknown-work";
 		}
@@ -156,6 +158,7 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 			
 			if (hashes_done == -1)
 				hashes_done = (double)0x100000000 * work->nonce_diff;
+			mutex_unlock(&client->worklog_mutex);
 		}
 		
 		reply = malloc(36 + idstr_sz);
@@ -212,8 +215,7 @@ int handle_getwork(struct MHD_Connection *conn, bytes_t *upbuf)
 		}
 #endif
 		
-		timer_set_now(&work->tv_work_start);
-		HASH_ADD_KEYPTR(hh, client->work, work->data, 76, work);
+		proxy_worklog_add(client, work);
 		
 		resp = MHD_create_response_from_buffer(replysz, reply, MHD_RESPMEM_MUST_FREE);
 		getwork_prepare_resp(resp, conn);
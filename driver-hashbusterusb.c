@@ -300,7 +300,7 @@ bool hashbusterusb_init(struct thr_info * const thr)
 		bitfury_init_chip(proc);
 		bitfury->osc6_bits = 53;
 		bitfury_send_reinit(bitfury->spi, bitfury->slot, bitfury->fasync, bitfury->osc6_bits);
-		bitfury_init_freq_stat(&bitfury->chip_stat, 52, 56);
+		bitfury_init_dclk(proc, 52, 56);
 		
 		if (proc->proc_id == proc->procs - 1)
 			free(devicelist);
@@ -386,6 +386,8 @@ void hashbusterusb_shutdown(struct thr_info *thr)
 	struct spi_port * const spi = bitfury->spi;
 	struct lowl_usb_endpoint * const h = spi->userp;
 	
+	bitfury_txrx_async_free(cgpu);
+	
 	// Shutdown PSU
 	unsigned char OUTPacket[64] = { 0x10 };
 	unsigned char INPacket[64];
@@ -20,6 +20,7 @@
 #include "deviceapi.h"
 #include "logging.h"
 #include "lowlevel.h"
+#include "lowl-frame.h"
 #include "lowl-vcom.h"
 #include "util.h"
 
@@ -186,37 +187,45 @@ bool hashfast_send_msg(const int fd, uint8_t * const buf, const uint8_t opcode,
 	return (buflen == hashfast_write(fd, buf, buflen));
 }
 
+static const struct lowl_frame_desc hashfast_frame_desc = {
+	.name = "hashfast",
+	.magic = "\xaa",
+	.magicsz = 1,
+	.hdrsz = HASHFAST_HEADER_SIZE,
+	.maxsz = HASHFAST_HEADER_SIZE + HASHFAST_MAX_DATA,
+	.len_offset = 6,
+	.len_size = 1,
+	.len_mult = 4,
+	.len_add = HASHFAST_HEADER_SIZE,
+	// Only the header is covered by the CRC-8
+	.check = LFC_CRC8CCITT,
+	.check_start = 1,
+	.check_offset = 7,
+};
+
 static
-bool hashfast_parse_msg(const int fd, struct hashfast_parsed_msg * const out_msg)
+ssize_t hashfast_frame_read(void * const userp, void * const buf, const size_t bufsz)
 {
-	uint8_t buf[HASHFAST_HEADER_SIZE];
-startover:
-	if (HASHFAST_HEADER_SIZE != hashfast_read(fd, buf, HASHFAST_HEADER_SIZE))
-		return false;
-	uint8_t *p = memchr(buf, '\xaa', HASHFAST_HEADER_SIZE);
-	if (p != buf)
-	{
-ignoresome:
-		if (!p)
-			goto startover;
-		int moreneeded = p - buf;
-		int alreadyhave = HASHFAST_HEADER_SIZE - moreneeded;
-		memmove(buf, p, alreadyhave);
-		if (moreneeded != hashfast_read(fd, &buf[alreadyhave], moreneeded))
+	const int * const fdp = userp;
+	return hashfast_read(*fdp, buf, bufsz);
+}
+
+// Partial messages stay in the framer until the next call
+static
+bool hashfast_parse_msg(struct lowl_framer * const framer, int fd, struct hashfast_parsed_msg * const out_msg)
+{
+	struct lowl_frame frame;
+	while (!lowl_framer_next(framer, &frame))
+		if (lowl_framer_fill(framer, hashfast_frame_read, &fd) <= 0)
 			return false;
-	}
-	const uint8_t correct_crc8 = crc8ccitt(&buf[1], 6);
-	if (buf[7] != correct_crc8)
-	{
-		p = memchr(&buf[1], '\xaa', HASHFAST_HEADER_SIZE - 1);
-		goto ignoresome;
-	}
+	const uint8_t * const buf = frame.data;
 	out_msg->opcode   = buf[1];
 	out_msg->chipaddr = buf[2];
 	out_msg->coreaddr = buf[3];
 	out_msg->hdata    = (uint16_t)buf[4] | ((uint16_t)buf[5] << 8);
-	out_msg->datalen  = buf[6] * 4;
-	return (out_msg->datalen == hashfast_read(fd, &out_msg->data[0], out_msg->datalen));
+	out_msg->datalen  = frame.sz - HASHFAST_HEADER_SIZE;
+	memcpy(out_msg->data, &buf[HASHFAST_HEADER_SIZE], out_msg->datalen);
+	return true;
 }
 
 static
@@ -255,18 +264,22 @@ bool hashfast_detect_one(const char * const devpath)
 		return false;
 	}
 	struct hashfast_parsed_msg * const pmsg = malloc(sizeof(*pmsg));
+	struct lowl_framer framer;
+	lowl_framer_init(&framer, &hashfast_frame_desc);
 	drv_set_defaults(&hashfast_ums_drv, hashfast_set_device_funcs_probe, &clock, devpath, detectone_meta_info.serial, 1);
 	hashfast_send_msg(fd, buf, HFOP_USB_INIT, 0, 0, clock, 0);
 	do {
-		if (!hashfast_parse_msg(fd, pmsg))
+		if (!hashfast_parse_msg(&framer, fd, pmsg))
 		{
 			applog(LOG_DEBUG, "%s: Failed to parse response on %s",
 			        __func__, devpath);
 			serial_close(fd);
+			lowl_framer_free(&framer);
 			goto err;
 		}
 	} while (pmsg->opcode != HFOP_USB_INIT);
 	serial_close(fd);
+	lowl_framer_free(&framer);
 	const int expectlen = 0x20 + (pmsg->chipaddr * pmsg->coreaddr) / 8;
 	if (pmsg->datalen < expectlen)
 	{
@@ -324,6 +337,7 @@ bool hashfast_lowl_probe(const struct lowlevel_device_info * const info)
 struct hashfast_dev_state {
 	uint8_t cores_per_chip;
 	int fd;
+	struct lowl_framer framer;
 	struct hashfast_chip_state *chipstates;
 	uint16_t fwrev;
 };
@@ -438,6 +452,7 @@ bool hashfast_init(struct thr_info * const master_thr)
 		.fd = serial_open(dev->device_path, 0, 1, true),
 		.fwrev = upk_u16le(pmsg->data, 0),
 	};
+	lowl_framer_init(&devstate->framer, &hashfast_frame_desc);
 	
 	const uint16_t clock = pmsg->hdata;
 	
@@ -599,7 +614,7 @@ bool hashfast_poll_msg(struct thr_info * const master_thr)
 	const int fd = devstate->fd;
 	
 	struct hashfast_parsed_msg msg;
-	if (!hashfast_parse_msg(fd, &msg))
+	if (!hashfast_parse_msg(&devstate->framer, fd, &msg))
 		return false;
 	
 	switch (msg.opcode)
@@ -643,14 +658,18 @@ bool hashfast_poll_msg(struct thr_info * const master_thr)
 				hashfast_submit_nonce(thr, work, nonce, false);
 				if (search)
 				{
-					for (int noffset = 1; noffset <= 0x80; ++noffset)
+					uint32_t nonces[32], found;
+					for (int noffset = 1; noffset <= 0x80; noffset += 32)
 					{
-						const uint32_t nonce2 = nonce + noffset;
-						if (test_nonce(work, nonce2, false))
-						{
-							hashfast_submit_nonce(thr, work, nonce2, true);
-							++nonces_found;
-						}
+						for (int i = 0; i < 32; ++i)
+							nonces[i] = nonce + noffset + i;
+						found = test_nonces(work, nonces, 32);
+						for (int i = 0; i < 32; ++i)
+							if (found & ((uint32_t)1 << i))
+							{
+								hashfast_submit_nonce(thr, work, nonces[i], true);
+								++nonces_found;
+							}
 					}
 					if (!nonces_found)
 					{
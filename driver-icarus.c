@@ -795,6 +795,7 @@ bool icarus_job_prepare(struct thr_info *thr, struct work *work, __maybe_unused
 		ob_bin[56] = 0;
 	}
 	
+	work->blk.nonce = 0xffffffff;
 	return true;
 }
 
@@ -1311,6 +1312,298 @@ out:
 	return hash_count;
 }
 
+// Reactor mode: with --reactor-threads, plain Icarus devices run as minerloop_async state machines on
+// the shared I/O reactor instead of a blocking scanhash thread each. Timing calibration, dynclock and
+// the subclass hooks still need the scanhash loop, so those devices keep their own thread.
+
+static
+bool icarus_reactor_usable(const struct cgpu_info * const icarus)
+{
+	const struct ICARUS_INFO * const info = icarus->device_data;
+	
+	return bfg_reactor_available()
+	    && icarus->drv == &icarus_drv
+	    && info->job_start_func == icarus_job_start
+	    && !(info->dclk.freqM || info->do_icarus_timing);
+}
+
+static
+void icarus_minerloop(struct thr_info * const thr)
+{
+	struct cgpu_info * const icarus = thr->cgpu;
+	struct ICARUS_INFO * const info = icarus->device_data;
+	struct icarus_state * const state = thr->cgpu_data;
+	
+	if (!icarus_reactor_usable(icarus))
+	{
+		minerloop_scanhash(thr);
+		return;
+	}
+	
+	if (info->do_default_detection)
+	{
+		applog(LOG_DEBUG, "%s: Speed autodetection is not available in reactor mode", icarus->dev_repr);
+		info->do_default_detection = 0;
+	}
+	BFGINIT(state->reactor_buf, malloc(info->read_size));
+	// Nonce ranges are split between processors, but the device runs one job
+	for_each_managed_proc(proc, icarus)
+		if (proc != icarus)
+			proc->thr[0]->async_passive = true;
+	minerloop_reactor(thr);
+}
+
+static
+bool icarus_reactor_reopen(struct thr_info * const thr)
+{
+	struct cgpu_info * const icarus = thr->cgpu;
+	struct icarus_state * const state = thr->cgpu_data;
+	int fd;
+	
+	state->reactor_buflen = 0;
+	if (!icarus_reopen(icarus, state, &fd))
+		return false;
+	minerloop_reactor_fd_changed(thr);
+	return true;
+}
+
+// Collects whatever the device has sent; ICA_GETS_OK once a whole read_size reply is buffered
+static
+int icarus_reactor_fill(const char * const repr, const struct ICARUS_INFO * const info, struct icarus_state * const state, const int fd)
+{
+	uint8_t * const buf = &state->reactor_buf[state->reactor_buflen];
+	const ssize_t r = read(fd, buf, info->read_size - state->reactor_buflen);
+	
+	if (unlikely(r <= 0))
+	{
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			return ICA_GETS_TIMEOUT;
+		// Only called when readable, so nothing at all means EOF
+		return ICA_GETS_ERROR;
+	}
+	if (opt_dev_protocol && opt_debug)
+		icarus_log_protocol(repr, buf, r, "RECV");
+	state->reactor_buflen += r;
+	if (state->reactor_buflen < info->read_size)
+		return ICA_GETS_TIMEOUT;
+	state->reactor_buflen = 0;
+	return ICA_GETS_OK;
+}
+
+static
+void icarus_reactor_read(struct thr_info * const thr)
+{
+	struct cgpu_info * const icarus = thr->cgpu;
+	struct ICARUS_INFO * const info = icarus->device_data;
+	struct icarus_state * const state = thr->cgpu_data;
+	struct work *work;
+	uint32_t nonce;
+	
+	switch (icarus_reactor_fill(icarus->dev_repr, info, state, icarus->device_fd))
+	{
+		case ICA_GETS_OK:
+			break;
+		case ICA_GETS_ERROR:
+			do_icarus_close(thr);
+			applog(LOG_ERR, "%s: Comms error (rerr)", icarus->dev_repr);
+			dev_error(icarus, REASON_DEV_COMMS_ERROR);
+			// Reopen from poll
+			timer_set_now(&thr->tv_poll);
+			// fallthru
+		default:
+			return;
+	}
+	
+	memcpy(&nonce, state->reactor_buf, sizeof(nonce));
+	nonce = icarus_nonce32toh(info, nonce);
+	const struct cgpu_info * const proc = icarus_proc_for_nonce(icarus, nonce);
+	
+	// A nonce can still arrive for the previous job just after the next one was sent
+	if (thr->work && test_nonce(thr->work, nonce, false))
+		work = thr->work;
+	else
+	if (thr->prev_work && test_nonce(thr->prev_work, nonce, false))
+		work = thr->prev_work;
+	else
+	{
+		inc_hw_errors(proc->thr[0], thr->work ?: thr->prev_work, nonce);
+		return;
+	}
+	submit_nonce(proc->thr[0], work, nonce);
+}
+
+static
+void icarus_reactor_job_start(struct thr_info * const thr)
+{
+	struct cgpu_info * const icarus = thr->cgpu;
+	struct ICARUS_INFO * const info = icarus->device_data;
+	struct icarus_state * const state = thr->cgpu_data;
+	const bool idle = state->identify;
+	struct timeval tv_now;
+	
+	if (unlikely(icarus->device_fd == -1) && !icarus_reactor_reopen(thr))
+		goto fail;
+	
+	if (unlikely(idle))
+	{
+		// Identify: leave the device without a job (and its LED blinking) for a few seconds
+		applog(LOG_DEBUG, "%s: Identify: Leaving idle for 3 seconds", icarus->dev_repr);
+		state->identify = false;
+		cgtime(&state->tv_workstart);
+	}
+	else
+	if (!icarus_job_start(thr))
+		goto fail;
+	
+	mt_job_transition(thr);
+	job_start_complete(thr);
+	state->idle_job = idle;
+	
+	timer_set_now(&tv_now);
+	timer_set_delay(&thr->tv_morework, &tv_now, (idle ? 3000 : info->read_timeout_ms) * 1000);
+	return;
+
+fail:
+	job_start_abort(thr, true);
+}
+
+static
+int64_t icarus_reactor_job_process_results(struct thr_info * const thr, __maybe_unused struct work * const work, __maybe_unused const bool stopping)
+{
+	struct cgpu_info * const icarus = thr->cgpu;
+	struct ICARUS_INFO * const info = icarus->device_data;
+	struct icarus_state * const state = thr->cgpu_data;
+	double estimate_hashes;
+	int64_t hash_count;
+	
+	if (state->idle_job)
+		return 0;
+	
+	// The device reports no progress, so estimate from how long the job ran
+	estimate_hashes = timer_elapsed_us(&thr->tv_results_jobstart, NULL) / 1e6 / info->Hs;
+	if (unlikely(estimate_hashes > 0xffffffff))
+		estimate_hashes = 0xffffffff;
+	if (unlikely(estimate_hashes < 0))
+		estimate_hashes = 0;
+	hash_count = estimate_hashes;
+	
+	// The master thread's share is accounted by do_process_results
+	const int64_t hash_count_per_proc = hash_count / icarus->procs;
+	if (hash_count_per_proc > 0)
+	{
+		for_each_managed_proc(proc, icarus)
+		{
+			if (proc == icarus)
+				continue;
+			hashes_done2(proc->thr[0], hash_count_per_proc, NULL);
+			hash_count -= hash_count_per_proc;
+		}
+	}
+	
+	return hash_count;
+}
+
+static
+void icarus_reactor_poll(struct thr_info * const thr)
+{
+	struct cgpu_info * const icarus = thr->cgpu;
+	struct ICARUS_INFO * const info = icarus->device_data;
+	struct timeval tv_now;
+	
+	timer_unset(&thr->tv_poll);
+	if (unlikely(info->reopen_now || (icarus->device_fd == -1 && icarus->deven == DEV_ENABLED)))
+	{
+		info->reopen_now = false;
+		if (!icarus_reactor_reopen(thr))
+		{
+			timer_set_now(&tv_now);
+			timer_set_delay(&thr->tv_poll, &tv_now, 1000000);
+		}
+	}
+}
+
+#ifndef WIN32
+static
+bool _test_icarus_readable(const int fd)
+{
+	struct timeval tv_timeout = { .tv_sec = 1, };
+	fd_set rfds;
+	
+	FD_ZERO(&rfds);
+	FD_SET(fd, &rfds);
+	return select(fd + 1, &rfds, NULL, NULL, &tv_timeout) > 0;
+}
+
+static
+void _test_icarus_reactor_fill(const char * const desc, const struct ICARUS_INFO * const info, struct icarus_state * const state, const int fd, const int expect)
+{
+	int rv = -2;
+	
+	if (_test_icarus_readable(fd))
+		rv = icarus_reactor_fill("test", info, state, fd);
+	if (rv != expect)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s (got %d, expected %d)", "icarus reactor", desc, rv, expect);
+	}
+}
+#endif
+
+// Drives the reactor-mode read path against a simulated Icarus on a pty
+void test_icarus_reactor(void)
+{
+#ifndef WIN32
+	struct ICARUS_INFO info = {
+		.read_size = ICARUS_DEFAULT_READ_SIZE,
+	};
+	uint8_t nonce_bin[ICARUS_DEFAULT_READ_SIZE];
+	struct icarus_state state = {
+		.reactor_buf = nonce_bin,
+	};
+	uint8_t ob_bin[64], devbuf[64];
+	size_t devlen = 0;
+	ssize_t r;
+	int master, slave;
+	
+	if (!bfg_openpty(&master, &slave))
+	{
+		applog(LOG_WARNING, "%s test skipped: %s", "icarus reactor", "no pty available");
+		return;
+	}
+	
+	// Job goes out through the normal write path, and the device receives it whole
+	for (int i = 0; i < sizeof(ob_bin); ++i)
+		ob_bin[i] = i;
+	if (icarus_write("test", slave, ob_bin, sizeof(ob_bin)))
+		applog(LOG_WARNING, "%s test failed: %s", "icarus reactor", "write");
+	while (devlen < sizeof(devbuf) && _test_icarus_readable(master) && (r = read(master, &devbuf[devlen], sizeof(devbuf) - devlen)) > 0)
+		devlen += r;
+	if (devlen != sizeof(ob_bin) || memcmp(devbuf, ob_bin, sizeof(ob_bin)))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "icarus reactor", "job not received by device");
+	}
+	
+	// Device answers with the nonce split across two writes
+	if (write(master, "\x00\x01", 2) != 2)
+		applog(LOG_WARNING, "%s test failed: %s", "icarus reactor", "pty write");
+	_test_icarus_reactor_fill("partial nonce", &info, &state, slave, ICA_GETS_TIMEOUT);
+	if (write(master, "\x87\xa2", 2) != 2)
+		applog(LOG_WARNING, "%s test failed: %s", "icarus reactor", "pty write");
+	_test_icarus_reactor_fill("complete nonce", &info, &state, slave, ICA_GETS_OK);
+	if (memcmp(nonce_bin, "\x00\x01\x87\xa2", 4) || state.reactor_buflen)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "icarus reactor", "nonce reassembly");
+	}
+	
+	// Device unplugged
+	close(master);
+	_test_icarus_reactor_fill("hangup", &info, &state, slave, ICA_GETS_ERROR);
+	close(slave);
+#endif
+}
+
 static struct api_data *icarus_drv_stats(struct cgpu_info *cgpu)
 {
 	struct api_data *root = NULL;
@@ -1417,7 +1710,10 @@ const char *icarus_set_reopen(struct cgpu_info * const proc, const char * const
 
 static void icarus_shutdown(struct thr_info *thr)
 {
+	struct icarus_state * const state = thr->cgpu_data;
+	
 	do_icarus_close(thr);
+	free(state->reactor_buf);
 	free(thr->cgpu_data);
 }
 
@@ -1449,8 +1745,13 @@ struct device_drv icarus_drv = {
 	.get_api_stats = icarus_drv_stats,
 	.thread_prepare = icarus_prepare,
 	.thread_init = icarus_init,
+	.minerloop = icarus_minerloop,
 	.scanhash = icarus_scanhash,
 	.job_prepare = icarus_job_prepare,
+	.job_start = icarus_reactor_job_start,
+	.job_process_results = icarus_reactor_job_process_results,
+	.poll = icarus_reactor_poll,
+	.reactor_read = icarus_reactor_read,
 	.thread_disable = close_device_fd,
 	.thread_shutdown = icarus_shutdown,
 };
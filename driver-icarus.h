@@ -155,6 +155,11 @@ struct icarus_state {
 	bool identify;
 	
 	uint8_t *ob_bin;
+	
+	// Reactor mode only
+	uint8_t *reactor_buf;
+	int reactor_buflen;
+	bool idle_job;
 };
 
 extern struct cgpu_info *icarus_detect_custom(const char *devpath, struct device_drv *, struct ICARUS_INFO *);
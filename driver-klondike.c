@@ -1015,8 +1015,10 @@ static void klondike_check_nonce(struct cgpu_info *klncgpu, KLIST *kitem)
 	if (work) {
 		if (unlikely(!klninfo->nonce_offset))
 		{
-			bool test_c0  = test_nonce(work, nonce -  0xc0, false);
-			bool test_180 = test_nonce(work, nonce - 0x180, false);
+			const uint32_t nonces[] = {nonce - 0xc0, nonce - 0x180};
+			const uint32_t found = test_nonces(work, nonces, 2);
+			bool test_c0  = found & 1;
+			bool test_180 = found & 2;
 			if (test_c0)
 			{
 				if (unlikely(test_180))
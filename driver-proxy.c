@@ -14,6 +14,7 @@
 #include <pthread.h>
 
 #include <uthash.h>
+#include <utlist.h>
 
 #include "deviceapi.h"
 #include "driver-proxy.h"
@@ -26,29 +27,102 @@ static const struct bfg_set_device_definition proxy_set_device_funcs[];
 static
 struct proxy_client *proxy_clients;
 static
-pthread_mutex_t proxy_clients_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_rwlock_t proxy_clients_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Width of each worklog bucket, such that the whole expiry window (with a bucket to spare) fits in the ring
+static
+int proxy_worklog_bucket_secs(void)
+{
+	const int secs = (opt_expiry + PROXY_WORKLOG_BUCKETS - 3) / (PROXY_WORKLOG_BUCKETS - 2);
+	return (secs > 0) ? secs : 1;
+}
+
+static
+void __proxy_worklog_expire_bucket(struct proxy_client * const client, struct proxy_worklog_bucket * const bucket)
+{
+	struct work *work, *tmp;
+	
+	LL_FOREACH_SAFE(bucket->works, work, tmp)
+	{
+		HASH_DEL(client->work, work);
+		free_work(work);
+	}
+	bucket->works = NULL;
+}
+
+// Drops whole buckets from the tail of the ring once their newest work has expired
+static
+void __proxy_worklog_prune(struct proxy_client * const client, const struct timeval * const tvp_now)
+{
+	struct proxy_worklog_bucket *bucket;
+	
+	while (true)
+	{
+		bucket = &client->worklog[client->worklog_tail];
+		if (bucket->works && timer_elapsed(&bucket->tv_newest, tvp_now) <= opt_expiry)
+			break;
+		__proxy_worklog_expire_bucket(client, bucket);
+		if (client->worklog_tail == client->worklog_head)
+			break;
+		client->worklog_tail = (client->worklog_tail + 1) % PROXY_WORKLOG_BUCKETS;
+	}
+}
+
+void proxy_worklog_add(struct proxy_client * const client, struct work * const work)
+{
+	struct proxy_worklog_bucket *bucket;
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	work->tv_work_start = tv_now;
+	
+	mutex_lock(&client->worklog_mutex);
+	__proxy_worklog_prune(client, &tv_now);
+	bucket = &client->worklog[client->worklog_head];
+	if (bucket->works && timer_elapsed(&bucket->tv_start, &tv_now) >= proxy_worklog_bucket_secs())
+	{
+		client->worklog_head = (client->worklog_head + 1) % PROXY_WORKLOG_BUCKETS;
+		if (client->worklog_head == client->worklog_tail)
+		{
+			// Only possible if expiry was changed at runtime; sacrifice the oldest bucket
+			__proxy_worklog_expire_bucket(client, &client->worklog[client->worklog_tail]);
+			client->worklog_tail = (client->worklog_tail + 1) % PROXY_WORKLOG_BUCKETS;
+		}
+		bucket = &client->worklog[client->worklog_head];
+	}
+	if (!bucket->works)
+		bucket->tv_start = tv_now;
+	bucket->tv_newest = tv_now;
+	LL_PREPEND(bucket->works, work);
+	HASH_ADD_KEYPTR(hh, client->work, work->data, 76, work);
+	mutex_unlock(&client->worklog_mutex);
+}
+
+// Caller must hold client->worklog_mutex for as long as it uses the returned work
+struct work *__proxy_worklog_find(struct proxy_client * const client, const void * const hdr)
+{
+	struct work *work;
+	
+	HASH_FIND(hh, client->work, hdr, 76, work);
+	return work;
+}
 
 static
 void prune_worklog()
 {
 	struct proxy_client *client, *tmp;
-	struct work *work, *tmp2;
 	struct timeval tv_now;
 	
 	timer_set_now(&tv_now);
 	
-	mutex_lock(&proxy_clients_mutex);
+	rd_lock(&proxy_clients_rwlock);
 	HASH_ITER(hh, proxy_clients, client, tmp)
 	{
-		HASH_ITER(hh, client->work, work, tmp2)
-		{
-			if (timer_elapsed(&work->tv_work_start, &tv_now) <= opt_expiry)
-				break;
-			HASH_DEL(client->work, work);
-			free_work(work);
-		}
+		mutex_lock(&client->worklog_mutex);
+		__proxy_worklog_prune(client, &tv_now);
+		mutex_unlock(&client->worklog_mutex);
 	}
-	mutex_unlock(&proxy_clients_mutex);
+	rd_unlock(&proxy_clients_rwlock);
 }
 
 static
@@ -92,7 +166,14 @@ struct proxy_client *proxy_find_or_create_client(const char *username)
 	if (!username)
 		return NULL;
 	
-	mutex_lock(&proxy_clients_mutex);
+	rd_lock(&proxy_clients_rwlock);
+	HASH_FIND_STR(proxy_clients, username, client);
+	rd_unlock(&proxy_clients_rwlock);
+	if (client)
+		goto found;
+	
+	wr_lock(&proxy_clients_rwlock);
+	// Another thread may have created it while we were unlocked
 	HASH_FIND_STR(proxy_clients, username, client);
 	if (!client)
 	{
@@ -109,6 +190,7 @@ struct proxy_client *proxy_find_or_create_client(const char *username)
 		timer_set_now(&cgpu->cgminer_stats.start_tv);
 		if (unlikely(!create_new_cgpus(add_cgpu_live, cgpu)))
 		{
+			wr_unlock(&proxy_clients_rwlock);
 			free(client);
 			free(cgpu);
 			free(user);
@@ -119,10 +201,11 @@ struct proxy_client *proxy_find_or_create_client(const char *username)
 			.cgpu = cgpu,
 			.desired_share_pdiff = 0.,
 		};
+		mutex_init(&client->worklog_mutex);
 		
 		b = HASH_COUNT(proxy_clients);
 		HASH_ADD_KEYPTR(hh, proxy_clients, client->username, strlen(user), client);
-		mutex_unlock(&proxy_clients_mutex);
+		wr_unlock(&proxy_clients_rwlock);
 		
 		if (!b)
 			proxy_first_client(cgpu);
@@ -130,10 +213,10 @@ struct proxy_client *proxy_find_or_create_client(const char *username)
 		cgpu_set_defaults(cgpu);
 	}
 	else
-	{
-		mutex_unlock(&proxy_clients_mutex);
-		cgpu = client->cgpu;
-	}
+		wr_unlock(&proxy_clients_rwlock);
+	
+found:
+	cgpu = client->cgpu;
 	thread_reportin(cgpu->thr[0]);
 	return client;
 }
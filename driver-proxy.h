@@ -1,6 +1,9 @@
 #ifndef BFG_DRIVER_PROXY_H
 #define BFG_DRIVER_PROXY_H
 
+#include <pthread.h>
+#include <sys/time.h>
+
 #include <uthash.h>
 
 #include "miner.h"
@@ -11,10 +14,28 @@ struct stratumsrv_conn_userlist;
 
 extern struct device_drv proxy_drv;
 
+// Number of time buckets in each client's worklog ring
+#define PROXY_WORKLOG_BUCKETS  0x20
+
+struct proxy_worklog_bucket {
+	// Linked through work->next
+	struct work *works;
+	struct timeval tv_start;
+	struct timeval tv_newest;
+};
+
 struct proxy_client {
 	char *username;
 	struct cgpu_info *cgpu;
+	
+	// Protects work, worklog, and the worklog ring indexes
+	pthread_mutex_t worklog_mutex;
+	// Index of logged work, keyed by the first 76 bytes of the header
 	struct work *work;
+	struct proxy_worklog_bucket worklog[PROXY_WORKLOG_BUCKETS];
+	unsigned worklog_head;
+	unsigned worklog_tail;
+	
 	struct timeval tv_hashes_done;
 	float desired_share_pdiff;
 	
@@ -26,6 +47,8 @@ struct proxy_client {
 };
 
 extern struct proxy_client *proxy_find_or_create_client(const char *user);
+extern void proxy_worklog_add(struct proxy_client *, struct work *);
+extern struct work *__proxy_worklog_find(struct proxy_client *, const void *hdr);
 
 #ifdef USE_LIBEVENT
 extern void stratumsrv_client_changed_diff(struct proxy_client *);
@@ -0,0 +1,947 @@
+/*
+ * Copyright 2026 MassGridMiner developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <uthash.h>
+#include <utlist.h>
+
+#include "deviceapi.h"
+#include "logging.h"
+#include "miner.h"
+#include "sha2.h"
+#include "util.h"
+
+#define SIM_MAX_PROCS  0x10000
+#define SIM_POLL_US  100000
+// Give up on a brute force search after this many times the expected number of hashes
+#define SIM_BRUTE_GIVEUP_FACTOR  0x20
+
+BFG_REGISTER_DRIVER(sim_drv)
+static const struct bfg_set_device_definition sim_set_device_funcs[];
+
+enum sim_restart_mode {
+	SRM_FLUSH,
+	SRM_IGNORE,
+};
+
+// Pre-mined nonces for one header, keyed by the first 76 bytes of work->data
+struct sim_table_entry {
+	uint8_t data[76];
+	uint32_t *nonces;
+	int nonces_count;
+	int next_nonce;
+	UT_hash_handle hh;
+};
+
+struct sim_device {
+	double hashrate;  // per processor, in hashes per second
+	// Per processor, in nonces per second; 0 follows from hashrate and nonce_diff, but costs as much CPU as the hashrate simulated
+	double nonce_rate;
+	float nonce_diff;
+	int latency_ms;
+	int queue_depth;  // 0 lets minerloop_queue autotune it
+	double hwerr_rate;
+	enum sim_restart_mode restart_mode;
+	int restart_delay_ms;
+	bool async;
+	struct sim_table_entry *table;
+};
+
+struct sim_report {
+	struct work *work;
+	uint32_t nonce;
+	// Reports the work finished, rather than a nonce; the work is freed on delivery
+	bool work_done;
+	// Otherwise the work is still queued, so the queue statistics see the nonce
+	bool work_copied;
+	struct timeval tv_due;
+	struct sim_report *prev;
+	struct sim_report *next;
+};
+
+struct sim_state {
+	uint32_t rng;
+	uint64_t scanpos;
+	struct timeval tv_lastscan;
+	double nonce_credit;
+	int queued;
+	struct timeval tv_flush;
+	struct sim_report *reports;
+	
+	uint64_t nonces_found;
+	uint64_t nonces_corrupted;
+	uint64_t table_hits;
+	uint64_t brute_hashes;
+	uint64_t brute_failures;
+};
+
+// work->data is byte-swapped per 32-bit word from the real block header
+static
+void sim_prepare_header(sha256_ctx * const out_midctx, uint8_t * const out_hdr, const uint8_t * const data)
+{
+	swap32yes(out_hdr, data, 80 / 4);
+	sha256_init(out_midctx);
+	sha256_update(out_midctx, out_hdr, 64);
+}
+
+static
+void sim_hash_nonce(uint8_t * const out_hash, const sha256_ctx * const midctx, uint8_t * const hdr, const uint32_t nonce)
+{
+	sha256_ctx ctx = *midctx;
+	uint8_t hash1[32];
+	
+	// Nonces are submitted in work->data byte order, so they appear big endian in the header
+	pk_u32be(hdr, 76, nonce);
+	sha256_update(&ctx, &hdr[64], 16);
+	sha256_final(&ctx, hash1);
+	sha256(hash1, 32, out_hash);
+}
+
+// Same check as test_hash in miner.c
+static
+bool sim_hash_meets_diff(const uint8_t * const hash, const float diff)
+{
+	const uint32_t hash7 = upk_u32le(hash, 28);
+	if (diff >= 1.)
+		return !hash7;
+	return hash7 <= (uint32_t)ceil((1. / diff) - 1);
+}
+
+static
+bool sim_brute_nonce(const uint8_t * const data, const float diff, uint32_t nonce, const uint64_t max_tries, uint32_t * const out_nonce, uint64_t * const out_tries)
+{
+	sha256_ctx midctx;
+	uint8_t hdr[80], hash[32];
+	uint64_t tries;
+	
+	sim_prepare_header(&midctx, hdr, data);
+	for (tries = 1; tries <= max_tries; ++tries, ++nonce)
+	{
+		sim_hash_nonce(hash, &midctx, hdr, nonce);
+		if (sim_hash_meets_diff(hash, diff))
+		{
+			*out_nonce = nonce;
+			*out_tries = tries;
+			return true;
+		}
+	}
+	*out_tries = max_tries;
+	return false;
+}
+
+static
+uint64_t sim_brute_max_tries(const float diff)
+{
+	const double expected = (diff >= 1.) ? 0x100000000 : (diff * 0x100000000);
+	const double max_tries = expected * SIM_BRUTE_GIVEUP_FACTOR;
+	return (max_tries > 0x100000000) ? 0x100000000 : (uint64_t)max_tries;
+}
+
+static
+uint32_t sim_rand(struct sim_state * const state)
+{
+	// xorshift32
+	uint32_t x = state->rng;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return state->rng = x;
+}
+
+static
+bool sim_table_add(struct sim_table_entry ** const table, const uint8_t * const data, const uint32_t nonce)
+{
+	struct sim_table_entry *te;
+	
+	HASH_FIND(hh, *table, data, 76, te);
+	if (!te)
+	{
+		te = malloc(sizeof(*te));
+		if (unlikely(!te))
+			return false;
+		*te = (struct sim_table_entry){
+			.nonces = NULL,
+		};
+		memcpy(te->data, data, 76);
+		HASH_ADD(hh, *table, data, 76, te);
+	}
+	uint32_t * const nonces = realloc(te->nonces, sizeof(*nonces) * (te->nonces_count + 1));
+	if (unlikely(!nonces))
+		return false;
+	nonces[te->nonces_count++] = nonce;
+	te->nonces = nonces;
+	return true;
+}
+
+static
+bool sim_table_lookup(struct sim_table_entry * const table, const uint8_t * const data, uint32_t * const out_nonce)
+{
+	struct sim_table_entry *te;
+	
+	HASH_FIND(hh, table, data, 76, te);
+	if (!te)
+		return false;
+	*out_nonce = te->nonces[te->next_nonce];
+	te->next_nonce = (te->next_nonce + 1) % te->nonces_count;
+	return true;
+}
+
+/* Accepts either bare 80-byte headers in hex, in block header byte order, or
+ * the CSV written by --noncelog, whose data is already in work->data order
+ * (each 32-bit word byte-swapped) like the table keys. */
+static
+const char *sim_table_load(struct sim_table_entry ** const table, const char * const filename, int * const out_count)
+{
+	char line[0x400], *p, *q;
+	uint8_t data[80];
+	int count = 0;
+	FILE * const F = fopen(filename, "r");
+	
+	if (!F)
+		return "Failed to open nonce table";
+	while (fgets(line, sizeof(line), F))
+	{
+		p = line;
+		// timestamp,proc,hash,data,midstate
+		for (int i = 0; i < 3 && (q = strchr(p, ',')); ++i)
+			p = &q[1];
+		if (strspn(p, "0123456789abcdefABCDEF") < 160)
+			continue;
+		// hex2bin wants the hex to end the string
+		p[160] = '\0';
+		if (!hex2bin(data, p, 80))
+			continue;
+		if (p == line)
+			swap32yes(data, data, 80 / 4);
+		if (!sim_table_add(table, data, upk_u32le(data, 76)))
+			break;
+		++count;
+	}
+	fclose(F);
+	*out_count = count;
+	return NULL;
+}
+
+static
+void sim_table_free(struct sim_table_entry ** const table)
+{
+	struct sim_table_entry *te, *tmp;
+	
+	HASH_ITER(hh, *table, te, tmp)
+	{
+		HASH_DEL(*table, te);
+		free(te->nonces);
+		free(te);
+	}
+}
+
+static
+bool sim_detect_one(const char * const devpath)
+{
+	struct sim_device * const simdev = malloc(sizeof(*simdev));
+	struct cgpu_info *cgpu;
+	char *endptr;
+	const long procs = strtol(devpath, &endptr, 10);
+	
+	if (procs < 1 || procs > SIM_MAX_PROCS || *endptr)
+	{
+		free(simdev);
+		applogr(false, LOG_ERR, "%s: Invalid processor count: %s", sim_drv.dname, devpath);
+	}
+	
+	*simdev = (struct sim_device){
+		.hashrate = 1e9,
+		.nonce_rate = 1,
+		.nonce_diff = 1. / 0x100000,
+		.latency_ms = 10,
+		.queue_depth = 2,
+		.restart_mode = SRM_FLUSH,
+	};
+	drv_set_defaults(&sim_drv, sim_set_device_funcs, simdev, devpath, NULL, 1);
+	
+	cgpu = malloc(sizeof(*cgpu));
+	*cgpu = (struct cgpu_info){
+		.drv = &sim_drv,
+		.device_path = strdup(devpath),
+		.device_data = simdev,
+		.set_device_funcs = sim_set_device_funcs,
+		.deven = DEV_ENABLED,
+		.procs = procs,
+		.threads = 1,
+	};
+	cgpu->device_fd = -1;
+	
+	return add_cgpu(cgpu);
+}
+
+static
+void sim_detect(void)
+{
+	generic_detect(&sim_drv, sim_detect_one, NULL, GDF_REQUIRE_DNAME | GDF_DEFAULT_NOAUTO);
+}
+
+static
+bool sim_thread_init(struct thr_info * const master_thr)
+{
+	struct cgpu_info * const dev = master_thr->cgpu;
+	const struct sim_device * const simdev = dev->device_data;
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	for_each_managed_proc(proc, dev)
+	{
+		struct thr_info * const thr = proc->thr[0];
+		struct sim_state * const state = malloc(sizeof(*state));
+		if (unlikely(!state))
+			applogr(false, LOG_ERR, "%s: Failed to allocate state", dev->dev_repr);
+		*state = (struct sim_state){
+			// xorshift must never be seeded with zero
+			.rng = (tv_now.tv_usec ^ ((uint32_t)proc->device_id << 16) ^ proc->proc_id) | 1,
+			.tv_lastscan = tv_now,
+		};
+		thr->cgpu_data = state;
+		thr->queue_autotune = !simdev->queue_depth;
+		timer_set_now(&thr->tv_poll);
+	}
+	return true;
+}
+
+static
+struct work *sim_current_work(struct thr_info * const thr)
+{
+	const struct sim_device * const simdev = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	
+	if (state->scanpos >= 0x100000000)
+		return NULL;
+	return simdev->async ? thr->work : thr->work_list;
+}
+
+static
+void sim_report_nonce(struct thr_info * const thr, struct work * const work, uint32_t nonce, const struct timeval * const tvp_now)
+{
+	const struct sim_device * const simdev = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	struct sim_report * const report = malloc(sizeof(*report));
+	
+	if (simdev->hwerr_rate > 0 && sim_rand(state) < simdev->hwerr_rate * UINT32_MAX)
+	{
+		sha256_ctx midctx;
+		uint8_t hdr[80], hash[32];
+		
+		// Flip bits until the nonce no longer meets the target, like a miscalculating chip would
+		sim_prepare_header(&midctx, hdr, work->data);
+		for (int i = 0; i < 0x40; ++i)
+		{
+			nonce ^= (uint32_t)1 << (sim_rand(state) % 32);
+			sim_hash_nonce(hash, &midctx, hdr, nonce);
+			if (!sim_hash_meets_diff(hash, work->nonce_diff))
+				break;
+		}
+		++state->nonces_corrupted;
+	}
+	
+	// minerloop_async frees jobs on its own schedule, so those need a copy
+	*report = (struct sim_report){
+		.work = simdev->async ? copy_work(work) : work,
+		.nonce = nonce,
+		.work_copied = simdev->async,
+	};
+	timer_set_delay(&report->tv_due, tvp_now, simdev->latency_ms * 1000);
+	DL_APPEND(state->reports, report);
+}
+
+static
+void sim_report_work_done(struct thr_info * const thr, struct work * const work, const struct timeval * const tvp_now)
+{
+	const struct sim_device * const simdev = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	struct sim_report * const report = malloc(sizeof(*report));
+	
+	*report = (struct sim_report){
+		.work = work,
+		.work_done = true,
+	};
+	timer_set_delay(&report->tv_due, tvp_now, simdev->latency_ms * 1000);
+	DL_APPEND(state->reports, report);
+}
+
+static
+void sim_free_report(struct sim_report * const report)
+{
+	if (report->work_done || report->work_copied)
+		free_work(report->work);
+	free(report);
+}
+
+static
+void sim_find_nonces(struct thr_info * const thr, struct work * const work, const uint64_t span, const struct timeval * const tvp_now)
+{
+	const struct sim_device * const simdev = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	const double nonces_per_hash = simdev->nonce_rate ? (simdev->nonce_rate / simdev->hashrate) : (1. / (work->nonce_diff * 0x100000000));
+	uint32_t nonce;
+	uint64_t tries;
+	
+	state->nonce_credit += span * nonces_per_hash;
+	while (state->nonce_credit >= 1)
+	{
+		state->nonce_credit -= 1;
+		if (simdev->table && sim_table_lookup(simdev->table, work->data, &nonce))
+			++state->table_hits;
+		else
+		{
+			const uint32_t start = state->scanpos + (sim_rand(state) % span);
+			const bool found = sim_brute_nonce(work->data, work->nonce_diff, start, sim_brute_max_tries(work->nonce_diff), &nonce, &tries);
+			state->brute_hashes += tries;
+			if (unlikely(!found))
+			{
+				++state->brute_failures;
+				continue;
+			}
+		}
+		++state->nonces_found;
+		sim_report_nonce(thr, work, nonce, tvp_now);
+	}
+}
+
+// Scans the current work forward to tvp_now at the configured hashrate
+static
+void sim_advance(struct thr_info * const thr, const struct timeval * const tvp_now)
+{
+	struct cgpu_info * const proc = thr->cgpu;
+	const struct sim_device * const simdev = proc->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	double hashes = timer_elapsed_us(&state->tv_lastscan, tvp_now) * simdev->hashrate / 1e6;
+	struct work *work;
+	uint64_t span;
+	
+	state->tv_lastscan = *tvp_now;
+	if (proc->deven != DEV_ENABLED || thr->pause)
+		return;
+	
+	while (hashes >= 1 && (work = sim_current_work(thr)))
+	{
+		span = 0x100000000 - state->scanpos;
+		if (span > hashes)
+			span = hashes;
+		sim_find_nonces(thr, work, span, tvp_now);
+		state->scanpos += span;
+		hashes -= span;
+		// Accounted as they happen in both modes, since async jobs can take minutes
+		hashes_done2(thr, span, NULL);
+		if (state->scanpos >= 0x100000000 && !simdev->async)
+		{
+			// Nonce range exhausted; move on to the next queued work
+			DL_DELETE(thr->work_list, work);
+			sim_report_work_done(thr, work, tvp_now);
+			--state->queued;
+			state->scanpos = 0;
+			thr->queue_full = false;
+		}
+	}
+}
+
+static
+void sim_deliver_reports(struct thr_info * const thr, const struct timeval * const tvp_now)
+{
+	struct sim_state * const state = thr->cgpu_data;
+	struct sim_report *report, *tmp;
+	
+	DL_FOREACH_SAFE(state->reports, report, tmp)
+	{
+		if (!timer_passed(&report->tv_due, tvp_now))
+			break;
+		DL_DELETE(state->reports, report);
+		if (!report->work_done)
+			submit_nonce(thr, report->work, report->nonce);
+		sim_free_report(report);
+	}
+}
+
+static
+void sim_flush(struct thr_info * const thr, const struct timeval * const tvp_now)
+{
+	struct sim_state * const state = thr->cgpu_data;
+	struct sim_report *report;
+	struct work *work, *tmp;
+	
+	sim_advance(thr, tvp_now);
+	DL_FOREACH_SAFE(thr->work_list, work, tmp)
+	{
+		// Nonces already found still get reported, like a real device would
+		DL_FOREACH(state->reports, report)
+			if (report->work == work)
+			{
+				report->work = copy_work(work);
+				report->work_copied = true;
+			}
+		DL_DELETE(thr->work_list, work);
+		free_work(work);
+	}
+	state->queued = 0;
+	state->scanpos = 0;
+	timer_unset(&state->tv_flush);
+	thr->queue_full = false;
+}
+
+static
+bool sim_queue_append(struct thr_info * const thr, struct work * const work)
+{
+	const struct sim_device * const simdev = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	struct timeval tv_now;
+	
+	if ((simdev->queue_depth && state->queued >= simdev->queue_depth) || timer_isset(&state->tv_flush))
+	{
+		thr->queue_full = true;
+		return false;
+	}
+	
+	timer_set_now(&tv_now);
+	// Don't credit the time spent idle to the new work
+	sim_advance(thr, &tv_now);
+	
+	work->nonce_diff = work->work_difficulty;
+	if (work->nonce_diff > simdev->nonce_diff)
+		work->nonce_diff = simdev->nonce_diff;
+	DL_APPEND(thr->work_list, work);
+	++state->queued;
+	if (simdev->queue_depth && state->queued >= simdev->queue_depth)
+		thr->queue_full = true;
+	return true;
+}
+
+static
+void sim_queue_flush(struct thr_info * const thr)
+{
+	const struct sim_device * const simdev = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	struct timeval tv_now;
+	
+	if (simdev->restart_mode == SRM_IGNORE)
+		return;
+	
+	timer_set_now(&tv_now);
+	if (simdev->restart_delay_ms)
+	{
+		// Keep working on the old queue until the simulated device gets around to flushing it
+		if (!timer_isset(&state->tv_flush))
+			timer_set_delay(&state->tv_flush, &tv_now, simdev->restart_delay_ms * 1000);
+		thr->queue_full = true;
+		reduce_timeout_to(&thr->tv_poll, &state->tv_flush);
+	}
+	else
+		sim_flush(thr, &tv_now);
+}
+
+static
+bool sim_job_prepare(struct thr_info * const thr, struct work * const work, __maybe_unused const uint64_t max_nonce)
+{
+	const struct sim_device * const simdev = thr->cgpu->device_data;
+	
+	work->nonce_diff = work->work_difficulty;
+	if (work->nonce_diff > simdev->nonce_diff)
+		work->nonce_diff = simdev->nonce_diff;
+	return true;
+}
+
+static
+void sim_job_start(struct thr_info * const thr)
+{
+	const struct sim_device * const simdev = thr->cgpu->device_data;
+	struct sim_state * const state = thr->cgpu_data;
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	sim_advance(thr, &tv_now);
+	mt_job_transition(thr);
+	state->scanpos = 0;
+	job_start_complete(thr);
+	
+	timer_set_delay(&thr->tv_morework, &tv_now, (int64_t)(0x100000000 / simdev->hashrate * 1e6));
+}
+
+static
+int64_t sim_job_process_results(struct thr_info * const thr, __maybe_unused struct work * const work, const bool stopping)
+{
+	struct timeval tv_now;
+	
+	if (stopping)
+	{
+		timer_set_now(&tv_now);
+		sim_advance(thr, &tv_now);
+	}
+	// Already accounted by sim_advance
+	return 0;
+}
+
+static
+void sim_poll(struct thr_info * const thr)
+{
+	struct sim_state * const state = thr->cgpu_data;
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	if (timer_passed(&state->tv_flush, &tv_now))
+		sim_flush(thr, &tv_now);
+	sim_advance(thr, &tv_now);
+	sim_deliver_reports(thr, &tv_now);
+	
+	timer_set_delay(&thr->tv_poll, &tv_now, SIM_POLL_US);
+	if (state->reports)
+		reduce_timeout_to(&thr->tv_poll, &state->reports->tv_due);
+	reduce_timeout_to(&thr->tv_poll, &state->tv_flush);
+}
+
+static
+void sim_minerloop(struct thr_info * const thr)
+{
+	const struct sim_device * const simdev = thr->cgpu->device_data;
+	
+	if (simdev->async)
+		minerloop_reactor(thr);
+	else
+		minerloop_queue(thr);
+}
+
+static
+void sim_thread_shutdown(struct thr_info * const master_thr)
+{
+	struct cgpu_info * const dev = master_thr->cgpu;
+	struct sim_device * const simdev = dev->device_data;
+	struct sim_report *report, *tmp;
+	struct work *work, *tmpwork;
+	
+	for_each_managed_proc(proc, dev)
+	{
+		struct thr_info * const thr = proc->thr[0];
+		struct sim_state * const state = thr->cgpu_data;
+		if (!state)
+			continue;
+		DL_FOREACH_SAFE(state->reports, report, tmp)
+		{
+			DL_DELETE(state->reports, report);
+			sim_free_report(report);
+		}
+		if (!simdev->async)
+			DL_FOREACH_SAFE(thr->work_list, work, tmpwork)
+			{
+				DL_DELETE(thr->work_list, work);
+				free_work(work);
+			}
+		free(state);
+		thr->cgpu_data = NULL;
+	}
+	sim_table_free(&simdev->table);
+}
+
+static
+struct api_data *sim_api_device_status(struct cgpu_info * const proc)
+{
+	struct sim_state * const state = proc->thr[0]->cgpu_data;
+	struct api_data *root = NULL;
+	
+	if (!state)
+		return NULL;
+	root = api_add_int(root, "Queued", &state->queued, true);
+	root = api_add_uint64(root, "Nonces Found", &state->nonces_found, true);
+	root = api_add_uint64(root, "Nonces Corrupted", &state->nonces_corrupted, true);
+	root = api_add_uint64(root, "Table Hits", &state->table_hits, true);
+	root = api_add_uint64(root, "Brute Force Hashes", &state->brute_hashes, true);
+	root = api_add_uint64(root, "Brute Force Failures", &state->brute_failures, true);
+	
+	return root;
+}
+
+static
+const char *sim_set_hashrate(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, enum bfg_set_device_replytype * const out_success)
+{
+	struct sim_device * const simdev = proc->device_data;
+	const double mhashes = atof(newvalue);
+	if (!(mhashes > 0))
+		return "Invalid hashrate";
+	simdev->hashrate = mhashes * 1e6;
+	return NULL;
+}
+
+static
+const char *sim_set_nonce_rate(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, enum bfg_set_device_replytype * const out_success)
+{
+	struct sim_device * const simdev = proc->device_data;
+	const double nonce_rate = atof(newvalue);
+	if (!(nonce_rate >= 0))
+		return "Invalid nonce rate";
+	simdev->nonce_rate = nonce_rate;
+	return NULL;
+}
+
+static
+const char *sim_set_diff(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, enum bfg_set_device_replytype * const out_success)
+{
+	struct sim_device * const simdev = proc->device_data;
+	const double nonce_diff = atof(newvalue);
+	// Below this, nearly every nonce meets the target and HW errors can't be simulated
+	if (!(nonce_diff >= 1. / 0x1000000))
+		return "Invalid difficulty: must be at least 0.00000006 (1/2^24)";
+	simdev->nonce_diff = nonce_diff;
+	return NULL;
+}
+
+static
+const char *sim_set_latency(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, enum bfg_set_device_replytype * const out_success)
+{
+	struct sim_device * const simdev = proc->device_data;
+	const int latency_ms = atoi(newvalue);
+	if (latency_ms < 0)
+		return "Invalid latency";
+	simdev->latency_ms = latency_ms;
+	return NULL;
+}
+
+static
+const char *sim_set_queue(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, enum bfg_set_device_replytype * const out_success)
+{
+	struct sim_device * const simdev = proc->device_data;
+	if (!strcasecmp(newvalue, "auto"))
+	{
+		if (proc->thr && proc->thr[0] && proc->thr[0]->cgpu_data)
+			return "Queue autotuning cannot be enabled at runtime";
+		simdev->queue_depth = 0;
+		return NULL;
+	}
+	const int queue_depth = atoi(newvalue);
+	if (queue_depth < 1)
+		return "Invalid queue depth";
+	if (!simdev->queue_depth && proc->thr && proc->thr[0] && proc->thr[0]->cgpu_data)
+		return "Queue autotuning cannot be disabled at runtime";
+	simdev->queue_depth = queue_depth;
+	return NULL;
+}
+
+static
+const char *sim_set_hwerr(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, enum bfg_set_device_replytype * const out_success)
+{
+	struct sim_device * const simdev = proc->device_data;
+	const double percent = atof(newvalue);
+	if (!(percent >= 0 && percent <= 100))
+		return "Invalid HW error rate: must be a percentage";
+	simdev->hwerr_rate = percent / 100;
+	return NULL;
+}
+
+static
+const char *sim_set_restart(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, enum bfg_set_device_replytype * const out_success)
+{
+	struct sim_device * const simdev = proc->device_data;
+	if (!strcasecmp(newvalue, "flush"))
+		simdev->restart_mode = SRM_FLUSH;
+	else
+	if (!strcasecmp(newvalue, "ignore"))
+		simdev->restart_mode = SRM_IGNORE;
+	else
+		return "Invalid restart mode: must be flush or ignore";
+	return NULL;
+}
+
+static
+const char *sim_set_restart_delay(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, enum bfg_set_device_replytype * const out_success)
+{
+	struct sim_device * const simdev = proc->device_data;
+	const int restart_delay_ms = atoi(newvalue);
+	if (restart_delay_ms < 0)
+		return "Invalid restart delay";
+	simdev->restart_delay_ms = restart_delay_ms;
+	return NULL;
+}
+
+static
+const char *sim_set_mode(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, enum bfg_set_device_replytype * const out_success)
+{
+	struct sim_device * const simdev = proc->device_data;
+	// Only meaningful before the miner thread has started
+	if (proc->thr && proc->thr[0] && proc->thr[0]->cgpu_data)
+		return "Mode cannot be changed at runtime";
+	if (!strcasecmp(newvalue, "queue"))
+		simdev->async = false;
+	else
+	if (!strcasecmp(newvalue, "async"))
+		simdev->async = true;
+	else
+		return "Invalid mode: must be queue or async";
+	return NULL;
+}
+
+static
+const char *sim_set_table(struct cgpu_info * const proc, const char * const optname, const char * const newvalue, char * const replybuf, enum bfg_set_device_replytype * const out_success)
+{
+	struct sim_device * const simdev = proc->device_data;
+	struct sim_table_entry *table = NULL;
+	const char *err;
+	int count;
+	
+	if (proc->thr && proc->thr[0] && proc->thr[0]->cgpu_data)
+		return "Nonce table cannot be changed at runtime";
+	err = sim_table_load(&table, newvalue, &count);
+	if (err)
+		return err;
+	sim_table_free(&simdev->table);
+	simdev->table = table;
+	applog(LOG_DEBUG, "%s: Loaded %d pre-mined nonces (%u headers) from %s",
+	       sim_drv.dname, count, HASH_COUNT(table), newvalue);
+	return NULL;
+}
+
+static const struct bfg_set_device_definition sim_set_device_funcs[] = {
+	{"hashrate", sim_set_hashrate, "simulated hashrate per processor, in Mh/s (default: 1000)"},
+	{"diff", sim_set_diff, "difficulty of nonces found (default: 1/2^20)"},
+	{"nonce_rate", sim_set_nonce_rate, "nonces found per second per processor, or 0 for whatever hashrate implies at diff (default: 1)"},
+	{"latency", sim_set_latency, "milliseconds before a nonce found or work finished is reported (default: 10)"},
+	{"queue", sim_set_queue, "work items queued per processor in queue mode, or auto (default: 2)"},
+	{"hwerr", sim_set_hwerr, "percentage of nonces reported corrupted (default: 0)"},
+	{"restart", sim_set_restart, "queue mode work restarts: flush or ignore (default: flush)"},
+	{"restart_delay", sim_set_restart_delay, "milliseconds before a queue mode flush takes effect (default: 0)"},
+	{"mode", sim_set_mode, "queue (minerloop_queue) or async (minerloop_async, or the I/O reactor) (default: queue)"},
+	{"table", sim_set_table, "file of pre-mined headers (hex, or --noncelog CSV) to take nonces from"},
+	{NULL},
+};
+
+struct device_drv sim_drv = {
+	.dname = "sim",
+	.name = "SIM",
+	.drv_detect = sim_detect,
+	
+	.thread_init = sim_thread_init,
+	.thread_shutdown = sim_thread_shutdown,
+	
+	.minerloop = sim_minerloop,
+	.queue_append = sim_queue_append,
+	.queue_flush = sim_queue_flush,
+	.job_prepare = sim_job_prepare,
+	.job_start = sim_job_start,
+	.job_process_results = sim_job_process_results,
+	.poll = sim_poll,
+	
+	.get_api_extra_device_status = sim_api_device_status,
+};
+
+// The genesis block header, which has a well-known nonce and hash
+static const char *sim_test_genesis_hex =
+	"01000000" "0000000000000000000000000000000000000000000000000000000000000000"
+	"3ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4a"
+	"29ab5f49" "ffff001d" "1dac2b7c";
+static const char *sim_test_genesis_hash_hex =
+	"6fe28c0ab6f1b372c1a6a246ae63f74f931e8365e15a089c68d6190000000000";
+
+void test_sim(void)
+{
+	uint8_t hdr[80], data[80], hash[32], expected_hash[32];
+	struct sim_table_entry *table = NULL;
+	sha256_ctx midctx;
+	uint32_t nonce, genesis_nonce;
+	uint64_t tries;
+	
+	hex2bin(hdr, sim_test_genesis_hex, 80);
+	hex2bin(expected_hash, sim_test_genesis_hash_hex, 32);
+	swap32yes(data, hdr, 80 / 4);
+	genesis_nonce = upk_u32le(data, 76);
+	
+	sim_prepare_header(&midctx, hdr, data);
+	sim_hash_nonce(hash, &midctx, hdr, genesis_nonce);
+	if (memcmp(hash, expected_hash, 32))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "sim", "genesis block hash mismatch");
+	}
+	if (!sim_hash_meets_diff(hash, 1.))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "sim", "genesis block hash does not meet difficulty 1");
+	}
+	
+	if (!(sim_brute_nonce(data, 1., genesis_nonce - 0x100, 0x200, &nonce, &tries) && nonce == genesis_nonce && tries == 0x101))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "sim", "brute force did not find the genesis nonce");
+	}
+	if (sim_brute_nonce(data, 1., genesis_nonce + 1, 0x100, &nonce, &tries))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "sim", "brute force found a bogus nonce");
+	}
+	
+	// Easy targets: whatever is found must really meet the target
+	const float easy_diff = 1. / 0x10000;
+	if (sim_brute_nonce(data, easy_diff, 0, sim_brute_max_tries(easy_diff), &nonce, &tries))
+	{
+		sim_hash_nonce(hash, &midctx, hdr, nonce);
+		if (!sim_hash_meets_diff(hash, easy_diff) || upk_u32le(hash, 28) > 0xffff)
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "sim", "brute force returned a nonce not meeting an easy target");
+		}
+	}
+	else
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "sim", "brute force found nothing at an easy target");
+	}
+	
+	sim_table_add(&table, data, genesis_nonce);
+	sim_table_add(&table, data, nonce);
+	uint32_t got1 = 0, got2 = 0, got3 = 0;
+	if (!(sim_table_lookup(table, data, &got1) && sim_table_lookup(table, data, &got2) && sim_table_lookup(table, data, &got3) && got1 == genesis_nonce && got2 == nonce && got3 == genesis_nonce))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "sim", "nonce table lookup");
+	}
+	data[0] ^= 1;
+	if (sim_table_lookup(table, data, &got1))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "sim", "nonce table matched the wrong header");
+	}
+	sim_table_free(&table);
+	data[0] ^= 1;
+	
+#ifndef WIN32
+	{
+		// A bare header and a --noncelog line for it must both load as work->data
+		char filename[] = "/tmp/bfgsimtable-XXXXXX", datahex[161];
+		const int fd = mkstemp(filename);
+		FILE * const F = (fd != -1) ? fdopen(fd, "w") : NULL;
+		int count = 0;
+		
+		bin2hex(datahex, data, 80);
+		if (F)
+		{
+			fprintf(F, "%s\n", sim_test_genesis_hex);
+			fprintf(F, "1400000000,PGA0,%s,%s,%s\n", sim_test_genesis_hash_hex, datahex, sim_test_genesis_hash_hex);
+			fclose(F);
+			sim_table_load(&table, filename, &count);
+		}
+		if (!(count == 2 && HASH_COUNT(table) == 1 && sim_table_lookup(table, data, &got1) && got1 == genesis_nonce))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "sim", "nonce table load");
+		}
+		sim_table_free(&table);
+		unlink(filename);
+	}
+#endif
+}
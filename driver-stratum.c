@@ -36,23 +36,31 @@
 
 #define _ssm_client_octets     work2d_xnonce1sz
 #define _ssm_client_xnonce2sz  work2d_xnonce2sz
-static char *_ssm_notify, *_ssm_setgoal;
-static int _ssm_notify_sz, _ssm_setgoal_sz;
+
+// Limits on what a client may send us
+#define SSM_MAX_LINE_LEN  0x4000
+#define SSM_MAX_USERNAME_LEN  0x100
+static char *_ssm_notify, *_ssm_notify_batch, *_ssm_setgoal;
+static int _ssm_notify_sz, _ssm_notify_batch_sz, _ssm_setgoal_sz;
 static struct stratumsrv_job *_ssm_last_ssj;
 static struct event *ev_notify;
 static notifier_t _ssm_update_notifier;
 
 struct stratumsrv_job {
 	char *my_job_id;
+	uint32_t batch_handle;
 	
 	struct timeval tv_prepared;
 	struct stratum_work swork;
 	float job_pdiff[WORK2D_MAX_DIVISIONS+1];
 	
 	UT_hash_handle hh;
+	UT_hash_handle hh_batch;
 };
 
 static struct stratumsrv_job *_ssm_jobs;
+// Same jobs as _ssm_jobs, keyed by batch_handle
+static struct stratumsrv_job *_ssm_jobs_batch;
 static struct work _ssm_cur_job_work;
 static uint64_t _ssm_jobid;
 
@@ -71,6 +79,7 @@ enum stratumsrv_conn_capability {
 	SCC_NOTIFY    = 1 << 0,
 	SCC_SET_DIFF  = 1 << 1,
 	SCC_SET_GOAL  = 1 << 2,
+	SCC_BATCH     = 1 << 3,
 };
 typedef uint8_t stratumsrv_conn_capabilities_t;
 
@@ -90,6 +99,15 @@ struct stratumsrv_conn {
 
 static struct stratumsrv_conn *_ssm_connections;
 
+static
+void stratumsrv_send_notify(struct stratumsrv_conn * const conn)
+{
+	if (conn->capabilities & SCC_BATCH)
+		bufferevent_write(conn->bev, _ssm_notify_batch, _ssm_notify_batch_sz);
+	else
+		bufferevent_write(conn->bev, _ssm_notify, _ssm_notify_sz);
+}
+
 static
 void stratumsrv_send_set_difficulty(struct stratumsrv_conn * const conn, const float share_pdiff)
 {
@@ -112,7 +130,7 @@ float stratumsrv_choose_share_pdiff(const struct stratumsrv_conn * const conn, c
 }
 
 static void stratumsrv_boot_all_subscribed(const char *);
-static void _ssj_free(struct stratumsrv_job *);
+static void _ssj_del(struct stratumsrv_job *);
 static void stratumsrv_job_pruner();
 
 static
@@ -181,6 +199,7 @@ fail:
 	size_t n2padx = n2pad * 2;
 	size_t coinb1_lenx = coinb1in_lenx + n2padx;
 	size_t coinb2_lenx = coinb2_len * 2;
+	const uint32_t batch_handle = _ssm_jobid;
 	sprintf(my_job_id, "%"PRIx64"-%"PRIx64, (uint64_t)time(NULL), _ssm_jobid++);
 	// NOTE: The buffer has up to 2 extra/unused bytes:
 	// NOTE: - If clean is "true", we spare the extra needed for "false"
@@ -211,6 +230,32 @@ fail:
 	bin2hex(ntime, &ntime_n, 4);
 	p += sprintf(p, "],\"%s\",\"%s\",\"%s\",%s],\"method\":\"mining.notify\",\"id\":null}\n", version, nbits, ntime, clean ? "true" : "false");
 	
+	// Same job for "bfg.batch" peers
+	const size_t coinb1_len = swork->nonce2_offset + n2pad;
+	const size_t batchbinsz = BFG_BATCH_JOB_HDRSZ + (swork->merkles * 32) + coinb1_len + coinb2_len;
+	uint8_t batchbin[batchbinsz], *bp;
+	pk_u32le(batchbin, 0, batch_handle);
+	batchbin[4] = clean;
+	memcpy(&batchbin[5], &swork->header1[0], 4);
+	memcpy(&batchbin[9], swork->diffbits, 4);
+	memcpy(&batchbin[0xd], &ntime_n, 4);
+	memcpy(&batchbin[0x11], &swork->header1[4], 32);
+	batchbin[0x31] = swork->merkles;
+	pk_u16le(batchbin, 0x32, coinb1_len);
+	pk_u16le(batchbin, 0x34, coinb2_len);
+	bp = &batchbin[BFG_BATCH_JOB_HDRSZ];
+	memcpy(bp, bytes_buf(&swork->merkle_bin), swork->merkles * 32);
+	bp += swork->merkles * 32;
+	memcpy(bp, bytes_buf(&swork->coinbase), swork->nonce2_offset);
+	bp = work2d_pad_xnonce(&bp[swork->nonce2_offset], swork, false);
+	memcpy(bp, &bytes_buf(&swork->coinbase)[coinb2_offset], coinb2_len);
+	const size_t batchbufsz = 2 + (batchbinsz * 2) + 1;
+	char * const batchbuf = malloc(batchbufsz + 1);
+	batchbuf[0] = '!';
+	batchbuf[1] = BBLT_JOB;
+	bin2hex(&batchbuf[2], batchbin, batchbinsz);
+	strcpy(&batchbuf[batchbufsz - 1], "\n");
+	
 	const size_t setgoalbufsz = 49 + strlen(pool->goal->name) + (pool->goalname ? (1 + strlen(pool->goalname)) : 0) + 12 + strlen(pool->goal->malgo->name) + 5 + 1;
 	char * const setgoalbuf = malloc(setgoalbufsz);
 	snprintf(setgoalbuf, setgoalbufsz, "{\"method\":\"mining.set_goal\",\"id\":null,\"params\":[\"%s%s%s\",{\"malgo\":\"%s\"}]}\n", pool->goal->name, pool->goalname ? "/" : "", pool->goalname ?: "", pool->goal->malgo->name);
@@ -218,6 +263,7 @@ fail:
 	ssj = malloc(sizeof(*ssj));
 	*ssj = (struct stratumsrv_job){
 		.my_job_id = strdup(my_job_id),
+		.batch_handle = batch_handle,
 	};
 	ssj->tv_prepared = tv_now;
 	stratum_work_cpy(&ssj->swork, swork);
@@ -231,14 +277,14 @@ fail:
 		applog(LOG_DEBUG, "SSM: Current replacing job stale, pruning all jobs");
 		HASH_ITER(hh, _ssm_jobs, ssj, tmp)
 		{
-			HASH_DEL(_ssm_jobs, ssj);
-			_ssj_free(ssj);
+			_ssj_del(ssj);
 		}
 	}
 	else
 		stratumsrv_job_pruner();
 	
 	HASH_ADD_KEYPTR(hh, _ssm_jobs, ssj->my_job_id, strlen(ssj->my_job_id), ssj);
+	HASH_ADD(hh_batch, _ssm_jobs_batch, batch_handle, sizeof(ssj->batch_handle), ssj);
 	
 	if (likely(_ssm_cur_job_work.pool))
 		clean_work(&_ssm_cur_job_work);
@@ -248,6 +294,9 @@ fail:
 	assert(_ssm_notify_sz <= bufsz);
 	free(_ssm_notify);
 	_ssm_notify = buf;
+	_ssm_notify_batch_sz = batchbufsz;
+	free(_ssm_notify_batch);
+	_ssm_notify_batch = batchbuf;
 	const bool setgoal_changed = _ssm_setgoal ? strcmp(setgoalbuf, _ssm_setgoal) : true;
 	if (setgoal_changed)
 	{
@@ -278,7 +327,7 @@ fail:
 				stratumsrv_send_set_difficulty(conn, conn_pdiff);
 		}
 		if (likely(conn->capabilities & SCC_NOTIFY))
-			bufferevent_write(conn->bev, _ssm_notify, _ssm_notify_sz);
+			stratumsrv_send_notify(conn);
 	}
 	
 	return true;
@@ -318,8 +367,10 @@ void stratumsrv_client_changed_diff(struct proxy_client * const client)
 }
 
 static
-void _ssj_free(struct stratumsrv_job * const ssj)
+void _ssj_del(struct stratumsrv_job * const ssj)
 {
+	HASH_DEL(_ssm_jobs, ssj);
+	HASH_DELETE(hh_batch, _ssm_jobs_batch, ssj);
 	free(ssj->my_job_id);
 	stratum_work_clean(&ssj->swork);
 	free(ssj);
@@ -337,9 +388,8 @@ void stratumsrv_job_pruner()
 	{
 		if (timer_elapsed(&ssj->tv_prepared, &tv_now) <= opt_expiry)
 			break;
-		HASH_DEL(_ssm_jobs, ssj);
 		applog(LOG_DEBUG, "SSM: Pruning job_id %s", ssj->my_job_id);
-		_ssj_free(ssj);
+		_ssj_del(ssj);
 	}
 }
 
@@ -374,6 +424,8 @@ void stratumsrv_boot_all_subscribed(const char * const msg)
 	
 	free(_ssm_notify);
 	_ssm_notify = NULL;
+	free(_ssm_notify_batch);
+	_ssm_notify_batch = NULL;
 	_ssm_last_ssj = NULL;
 	
 	// Boot all connections
@@ -485,6 +537,13 @@ void stratumsrv_mining_capabilities(struct bufferevent * const bev, json_t * con
 			else
 			if (!strcasecmp(s, "set_goal"))
 				conn->capabilities |= SCC_SET_GOAL;
+			else
+			if (!strcasecmp(s, "bfg.batch"))
+			{
+				json_t * const batchopts = json_object_iter_value(iter);
+				if (json_integer_value(json_object_get(batchopts, "version")) == BFG_BATCH_VERSION)
+					conn->capabilities |= SCC_BATCH;
+			}
 		}
 	}
 	
@@ -517,6 +576,11 @@ void stratumsrv_mining_subscribe(struct bufferevent * const bev, json_t * const
 	bufsz = sprintf(buf, "{\"id\":%s,\"result\":[[[\"mining.set_difficulty\",\"x\"],[\"mining.notify\",\"%s\"]],\"%s\",%d],\"error\":null}\n", idstr, xnonce1x, xnonce1x, _ssm_client_xnonce2sz);
 	bufferevent_write(bev, buf, bufsz);
 	
+	if (conn->capabilities & SCC_BATCH)
+	{
+		bufsz = sprintf(buf, "{\"params\":[%d],\"id\":null,\"method\":\"mining.bfg_batch\"}\n", BFG_BATCH_VERSION);
+		bufferevent_write(bev, buf, bufsz);
+	}
 	if (conn->capabilities & SCC_SET_GOAL)
 		bufferevent_write(conn->bev, _ssm_setgoal, _ssm_setgoal_sz);
 	if (likely(conn->capabilities & SCC_SET_DIFF))
@@ -532,7 +596,7 @@ void stratumsrv_mining_subscribe(struct bufferevent * const bev, json_t * const
 		stratumsrv_send_set_difficulty(conn, pdiff);
 	}
 	if (likely(conn->capabilities & SCC_NOTIFY))
-		bufferevent_write(bev, _ssm_notify, _ssm_notify_sz);
+		stratumsrv_send_notify(conn);
 }
 
 static
@@ -573,20 +637,49 @@ void stratumsrv_mining_authorize(struct bufferevent * const bev, json_t * const
 }
 
 static
-void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const char *idstr, struct stratumsrv_conn * const conn)
+enum bfg_batch_result stratumsrv_submit_share(struct stratumsrv_conn * const conn, struct thr_info * const thr, struct stratumsrv_job * const ssj, const void * const xnonce2, const uint32_t ntime_n, const uint32_t nonce_n)
 {
 	uint32_t * const xnonce1_p = &conn->xnonce1_le;
+	enum bfg_batch_result rv;
+	bool is_stale;
+	
+	float nonce_diff = ssj->job_pdiff[*xnonce1_p];
+	if (unlikely(nonce_diff <= 0))
+	{
+		applog(LOG_WARNING, "Unknown share difficulty for SSM job %s", ssj->my_job_id);
+		nonce_diff = conn->current_share_pdiff;
+	}
+	
+	if (!work2d_submit_nonce(thr, &ssj->swork, &ssj->tv_prepared, xnonce2, *xnonce1_p, nonce_n, ntime_n, &is_stale, nonce_diff))
+		rv = BBR_HIGH_HASH;
+	else
+	if (is_stale)
+		rv = BBR_STALE;
+	else
+		rv = BBR_ACCEPTED;
+	
+	if (!conn->hashes_done_ext)
+	{
+		struct timeval tv_now, tv_delta;
+		timer_set_now(&tv_now);
+		timersub(&tv_now, &conn->tv_hashes_done, &tv_delta);
+		conn->tv_hashes_done = tv_now;
+		const uint64_t hashes = (float)0x100000000 * nonce_diff;
+		hashes_done(thr, hashes, &tv_delta, NULL);
+	}
+	
+	return rv;
+}
+
+static
+void stratumsrv_mining_submit_strs(struct bufferevent * const bev, const char * const idstr, struct stratumsrv_conn * const conn, const char * const username, const char * const job_id, const char * const extranonce2, const char * const ntime, const char * const nonce)
+{
 	struct stratumsrv_job *ssj;
-	struct proxy_client *client = stratumsrv_find_or_create_client(__json_array_string(params, 0));
+	struct proxy_client *client = stratumsrv_find_or_create_client(username);
 	struct cgpu_info *cgpu;
 	struct thr_info *thr;
-	const char * const job_id = __json_array_string(params, 1);
-	const char * const extranonce2 = __json_array_string(params, 2);
-	const char * const ntime = __json_array_string(params, 3);
-	const char * const nonce = __json_array_string(params, 4);
 	uint8_t xnonce2[work2d_xnonce2sz];
 	uint32_t ntime_n, nonce_n;
-	bool is_stale;
 	
 	if (unlikely(!client))
 		return_stratumsrv_failure(20, "Failed creating new cgpu");
@@ -607,13 +700,6 @@ void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const cha
 	if (!ssj)
 		return_stratumsrv_failure(21, "Job not found");
 	
-	float nonce_diff = ssj->job_pdiff[*xnonce1_p];
-	if (unlikely(nonce_diff <= 0))
-	{
-		applog(LOG_WARNING, "Unknown share difficulty for SSM job %s", ssj->my_job_id);
-		nonce_diff = conn->current_share_pdiff;
-	}
-	
 	hex2bin(xnonce2, extranonce2, work2d_xnonce2sz);
 	
 	// Submit nonce
@@ -621,23 +707,80 @@ void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const cha
 	ntime_n = be32toh(ntime_n);
 	hex2bin((void*)&nonce_n, nonce, 4);
 	nonce_n = le32toh(nonce_n);
-	if (!work2d_submit_nonce(thr, &ssj->swork, &ssj->tv_prepared, xnonce2, *xnonce1_p, nonce_n, ntime_n, &is_stale, nonce_diff))
-		_stratumsrv_failure(bev, idstr, 23, "H-not-zero");
+	switch (stratumsrv_submit_share(conn, thr, ssj, xnonce2, ntime_n, nonce_n))
+	{
+		case BBR_HIGH_HASH:
+			_stratumsrv_failure(bev, idstr, 23, "H-not-zero");
+			break;
+		case BBR_STALE:
+			_stratumsrv_failure(bev, idstr, 21, "stale");
+			break;
+		default:
+			_stratumsrv_success(bev, idstr);
+	}
+}
+
+static
+void stratumsrv_mining_submit(struct bufferevent *bev, json_t *params, const char *idstr, struct stratumsrv_conn * const conn)
+{
+	stratumsrv_mining_submit_strs(bev, idstr, conn, __json_array_string(params, 0), __json_array_string(params, 1), __json_array_string(params, 2), __json_array_string(params, 3), __json_array_string(params, 4));
+}
+
+// Handles mining.submit without jansson; returns false to fall back to it
+static
+bool stratumsrv_process_line_fast(struct bufferevent * const bev, const char * const ln, struct stratumsrv_conn * const conn)
+{
+	struct stratum_fast_msg msg;
+	const struct stratum_fast_tok *strtoks[5];
+	size_t bufsz = 0;
+	long long id;
+	
+	if (!stratum_fast_parse(&msg, ln))
+		return false;
+	if (!stratum_fast_strcaseeq(&msg.method, "mining.submit"))
+		return false;
+	for (int i = 0; i < 5; ++i)
+	{
+		if (!(strtoks[i] = stratum_fast_param(&msg, i, SFT_STRING)))
+			return false;
+		bufsz += strtoks[i]->len + 1;
+	}
+	
+	// The id must be echoed exactly as json_dumps_ANY would
+	const struct stratum_fast_tok * const idtok = &msg.id;
+	if (idtok->type == SFT_STRING)
+		bufsz += idtok->len + 3;
 	else
-	if (is_stale)
-		_stratumsrv_failure(bev, idstr, 21, "stale");
+	if (stratum_fast_int(idtok, &id) && !(idtok->len > 1 && idtok->s[0] == '-' && idtok->s[1] == '0'))
+		bufsz += idtok->len + 1;
 	else
-		_stratumsrv_success(bev, idstr);
+	if (!(idtok->type == SFT_NULL || idtok->type == SFT_MISSING))
+		return false;
 	
-	if (!conn->hashes_done_ext)
+	applog(LOG_DEBUG, "SSM: RECV: %s", ln);
+	
+	char buf[bufsz + 1], *p = buf, *strs[5], *idstr = NULL;
+	for (int i = 0; i < 5; ++i)
 	{
-		struct timeval tv_now, tv_delta;
-		timer_set_now(&tv_now);
-		timersub(&tv_now, &conn->tv_hashes_done, &tv_delta);
-		conn->tv_hashes_done = tv_now;
-		const uint64_t hashes = (float)0x100000000 * nonce_diff;
-		hashes_done(thr, hashes, &tv_delta, NULL);
+		strs[i] = p;
+		memcpy(p, strtoks[i]->s, strtoks[i]->len);
+		p += strtoks[i]->len;
+		(p++)[0] = '\0';
+	}
+	if (idtok->type == SFT_STRING)
+	{
+		idstr = p;
+		sprintf(p, "\"%.*s\"", (int)idtok->len, idtok->s);
+	}
+	else
+	if (idtok->type == SFT_NUMBER)
+	{
+		idstr = p;
+		sprintf(p, "%.*s", (int)idtok->len, idtok->s);
 	}
+	
+	stratumsrv_mining_submit_strs(bev, idstr, conn, strs[0], strs[1], strs[2], strs[3], strs[4]);
+	return true;
 }
 
 static
@@ -667,6 +810,96 @@ void stratumsrv_mining_hashes_done(struct bufferevent * const bev, json_t * cons
 	conn->hashes_done_ext = true;
 }
 
+// Handles a "bfg.batch" shares line, replying with a single results line
+static
+bool stratumsrv_process_batch_line(struct bufferevent * const bev, const char * const ln, struct stratumsrv_conn * const conn)
+{
+	struct proxy_client *client;
+	struct stratumsrv_job *ssj;
+	struct thr_info *thr = NULL;
+	
+	if (ln[1] != BBLT_SHARES)
+	{
+		applog(LOG_ERR, "SSM: Unknown batch line type: %s", ln);
+		return false;
+	}
+	
+	const char *hex = strrchr(ln, ' ');
+	if (!hex)
+	{
+		applog(LOG_ERR, "SSM: Batch line missing username: %s", ln);
+		return false;
+	}
+	const size_t usernamelen = hex - &ln[2];
+	if (usernamelen > SSM_MAX_USERNAME_LEN)
+	{
+		applog(LOG_ERR, "SSM: Batch line username too long");
+		return false;
+	}
+	char username[SSM_MAX_USERNAME_LEN + 1];
+	memcpy(username, &ln[2], usernamelen);
+	username[usernamelen] = '\0';
+	++hex;
+	
+	const size_t recsz = BFG_BATCH_SHARE_HDRSZ + _ssm_client_xnonce2sz;
+	const size_t hexlen = strlen(hex);
+	const size_t count = hexlen / (recsz * 2);
+	if (hexlen % (recsz * 2) || !count || count > BFG_BATCH_MAX_RECORDS)
+	{
+		applog(LOG_ERR, "SSM: Malformed batch of shares: %s", ln);
+		return false;
+	}
+	uint8_t * const bin = malloc(count * recsz);
+	if (!bin)
+		quithere(1, "Failed to malloc %s", "bin");
+	if (!hex2bin(bin, hex, count * recsz))
+	{
+		applog(LOG_ERR, "SSM: Malformed batch of shares: %s", ln);
+		free(bin);
+		return false;
+	}
+	
+	applog(LOG_DEBUG, "SSM: RECV: %s", ln);
+	
+	client = stratumsrv_find_or_create_client(username);
+	if (likely(client))
+		thr = client->cgpu->thr[0];
+	
+	uint8_t results[BFG_BATCH_MAX_RECORDS * BFG_BATCH_RESULT_SZ];
+	const size_t resultssz = count * BFG_BATCH_RESULT_SZ;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const uint8_t * const rec = &bin[i * recsz];
+		uint8_t * const res = &results[i * BFG_BATCH_RESULT_SZ];
+		const uint32_t handle = upk_u32le(rec, 4);
+		
+		memcpy(res, rec, 4);
+		if (unlikely(!thr))
+		{
+			res[4] = BBR_OTHER;
+			continue;
+		}
+		HASH_FIND(hh_batch, _ssm_jobs_batch, &handle, sizeof(handle), ssj);
+		if (!ssj)
+		{
+			res[4] = BBR_JOB_NOT_FOUND;
+			continue;
+		}
+		res[4] = stratumsrv_submit_share(conn, thr, ssj, &rec[BFG_BATCH_SHARE_HDRSZ], upk_u32be(rec, 8), upk_u32le(rec, 0xc));
+	}
+	free(bin);
+	
+	char reply[2 + sizeof(results) * 2 + 2];
+	const size_t replysz = 2 + resultssz * 2 + 1;
+	reply[0] = '!';
+	reply[1] = BBLT_RESULTS;
+	bin2hex(&reply[2], results, resultssz);
+	strcpy(&reply[replysz - 1], "\n");
+	bufferevent_write(bev, reply, replysz);
+	
+	return true;
+}
+
 static
 bool stratumsrv_process_line(struct bufferevent * const bev, const char * const ln, void * const p)
 {
@@ -676,6 +909,11 @@ bool stratumsrv_process_line(struct bufferevent * const bev, const char * const
 	const char *method;
 	char *idstr;
 	
+	if (ln[0] == '!' && (conn->capabilities & SCC_BATCH))
+		return stratumsrv_process_batch_line(bev, ln, conn);
+	if (stratumsrv_process_line_fast(bev, ln, conn))
+		return true;
+	
 	json = JSON_LOADS(ln, &jerr);
 	if (!json)
 	{
@@ -751,18 +989,33 @@ void stratumsrv_read(struct bufferevent *bev, void *p)
 {
 	struct evbuffer *input = bufferevent_get_input(bev);
 	char *ln;
+	size_t lnlen;
 	bool rv;
 	
-	while ( (ln = evbuffer_readln(input, NULL, EVBUFFER_EOL_ANY)) )
+	while ( (ln = evbuffer_readln(input, &lnlen, EVBUFFER_EOL_ANY)) )
 	{
+		if (unlikely(lnlen > SSM_MAX_LINE_LEN))
+		{
+			applog(LOG_ERR, "SSM: Line too long (%lu bytes)", (unsigned long)lnlen);
+			free(ln);
+			stratumsrv_client_close(p);
+			return;
+		}
 		rv = stratumsrv_process_line(bev, ln, p);
 		free(ln);
 		if (unlikely(!rv))
 		{
 			stratumsrv_client_close(p);
-			break;
+			return;
 		}
 	}
+	
+	// Don't buffer an endless line waiting for its end
+	if (unlikely(evbuffer_get_length(input) > SSM_MAX_LINE_LEN))
+	{
+		applog(LOG_ERR, "SSM: Line too long (over %d bytes)", SSM_MAX_LINE_LEN);
+		stratumsrv_client_close(p);
+	}
 }
 
 static
@@ -10,11 +10,19 @@
 
 #include "config.h"
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utlist.h>
 
 #include "dynclock.h"
+#include "logging.h"
 #include "miner.h"
+#include "util.h"
 
 void dclk_prepare(struct dclk_data *data)
 {
@@ -120,3 +128,508 @@ void dclk_preUpdate(struct dclk_data *data)
 	if (data->errorRate[data->freqM] > data->maxErrorRate[data->freqM])
 		data->maxErrorRate[data->freqM] = data->errorRate[data->freqM];
 }
+
+// History of chips no longer (or not yet) running, keyed as in the state file
+struct dclk_saved {
+	char *key;
+	int step;
+	bool cur;
+	struct dclk_chip_step st;
+	struct dclk_saved *next;
+};
+
+// Protects both lists, and the history of every chip with a key
+static pthread_mutex_t dclk_chips_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct dclk_chip *dclk_chips;
+static struct dclk_saved *dclk_saved;
+
+static
+void dclk_saved_free(struct dclk_saved * const saved)
+{
+	free(saved->key);
+	free(saved);
+}
+
+// Replaces any saved history for the chip with what it has now
+static
+void dclk_chip_stash(const struct dclk_chip * const chip)
+{
+	struct dclk_saved *saved, *tmp;
+	
+	LL_FOREACH_SAFE(dclk_saved, saved, tmp)
+		if (!strcmp(saved->key, chip->key))
+		{
+			LL_DELETE(dclk_saved, saved);
+			dclk_saved_free(saved);
+		}
+	for (int i = chip->min_step; i <= chip->max_step; ++i)
+	{
+		if (i != chip->step && !chip->hist[i].secs)
+			continue;
+		saved = malloc(sizeof(*saved));
+		if (!saved)
+			quithere(1, "Failed to malloc %s", "saved");
+		*saved = (struct dclk_saved){
+			.key = strdup(chip->key),
+			.step = i,
+			.cur = (i == chip->step),
+			.st = chip->hist[i],
+		};
+		LL_APPEND(dclk_saved, saved);
+	}
+}
+
+void dclk_chip_init(struct dclk_chip * const chip, const struct dclk_chip_funcs * const funcs, void * const userp, const char * const repr, const char * const key, const int min_step, const int max_step, const int step)
+{
+	struct dclk_chip_step *hist;
+	struct dclk_saved *saved;
+	int restore = step;
+	
+	hist = calloc(max_step + 1 - min_step, sizeof(*hist));
+	if (!hist)
+		quithere(1, "Failed to malloc %s", "hist");
+	*chip = (struct dclk_chip){
+		.funcs = funcs,
+		.userp = userp,
+		.repr = repr,
+		.key = key ? strdup(key) : NULL,
+		.step = step,
+		.min_step = min_step,
+		.max_step = max_step,
+		.max_jump = 1,
+		.min_secs = DCLK_CHIP_MINSECS,
+		.max_hw_rate = DCLK_MAXMAXERRORRATE,
+		.hist = &hist[-min_step],
+	};
+	if (!key)
+		return;
+	
+	mutex_lock(&dclk_chips_mutex);
+	LL_FOREACH(dclk_saved, saved)
+	{
+		if (strcmp(saved->key, key) || saved->step < min_step || saved->step > max_step)
+			continue;
+		chip->hist[saved->step] = saved->st;
+		if (saved->cur)
+			restore = saved->step;
+	}
+	DL_APPEND(dclk_chips, chip);
+	mutex_unlock(&dclk_chips_mutex);
+	
+	if (restore != step && funcs->set_freq(chip, restore))
+	{
+		applog(LOG_DEBUG, "%"PRIpreprv": Restored clock step %d from dynclock state",
+		       repr, restore);
+		chip->step = restore;
+	}
+}
+
+void dclk_chip_free(struct dclk_chip * const chip)
+{
+	if (!chip->hist)
+		return;
+	if (chip->key)
+	{
+		mutex_lock(&dclk_chips_mutex);
+		dclk_chip_stash(chip);
+		DL_DELETE(dclk_chips, chip);
+		mutex_unlock(&dclk_chips_mutex);
+		free(chip->key);
+	}
+	free(&chip->hist[chip->min_step]);
+	chip->hist = NULL;
+}
+
+static
+bool dclk_chip_known(const struct dclk_chip * const chip, const int step)
+{
+	return chip->hist[step].secs >= chip->min_secs;
+}
+
+static
+bool dclk_chip_bad(const struct dclk_chip * const chip, const int step)
+{
+	const struct dclk_chip_step * const h = &chip->hist[step];
+	
+	if (chip->temp_limit && h->temp > chip->temp_limit)
+		return true;
+	if (!dclk_chip_known(chip, step))
+		return false;
+	return h->hw > (h->good + h->hw) * chip->max_hw_rate;
+}
+
+static
+double dclk_chip_score(const struct dclk_chip * const chip, const int step)
+{
+	const struct dclk_chip_step * const h = &chip->hist[step];
+	double r = h->good / h->secs;
+	
+	if (chip->funcs->watts)
+	{
+		const double watts = chip->funcs->watts(chip, step);
+		if (watts > 0)
+			r /= watts;
+	}
+	return r;
+}
+
+static
+int dclk_chip_choose(const struct dclk_chip * const chip, const float temp)
+{
+	const int step = chip->step;
+	int i, ceiling, best, target;
+	double bestR, r;
+	
+	// Overheating is acted on at once, without waiting for a full sample
+	if (chip->temp_limit && temp > chip->temp_limit)
+		target = chip->min_step;
+	else
+	{
+		// Nothing above the slowest step to error too often or run too hot is considered
+		ceiling = chip->max_step;
+		for (i = chip->min_step; i <= chip->max_step; ++i)
+			if (dclk_chip_bad(chip, i))
+			{
+				ceiling = (i > chip->min_step) ? (i - 1) : chip->min_step;
+				break;
+			}
+		
+		if (step > ceiling)
+			target = ceiling;
+		else
+		if (!dclk_chip_known(chip, step))
+			return step;
+		else
+		{
+			// The current step gets a small "bonus" in comparison, as hysteresis
+			best = step;
+			bestR = dclk_chip_score(chip, step) * (1 + DCLK_CHIP_HYSTERESIS);
+			for (i = chip->min_step; i <= ceiling; ++i)
+			{
+				if (i == step || !dclk_chip_known(chip, i))
+					continue;
+				r = dclk_chip_score(chip, i);
+				if (r > bestR)
+				{
+					best = i;
+					bestR = r;
+				}
+			}
+			
+			if (best != step)
+				target = best;
+			else
+			// Already the best known, so try untried neighbours, faster first
+			if (step < ceiling && !dclk_chip_known(chip, step + 1))
+				target = step + 1;
+			else
+			if (step > chip->min_step && !dclk_chip_known(chip, step - 1))
+				target = step - 1;
+			else
+				target = step;
+		}
+	}
+	
+	if (target > step + chip->max_jump)
+		target = step + chip->max_jump;
+	else
+	if (target < step - chip->max_jump)
+		target = step - chip->max_jump;
+	return target;
+}
+
+int dclk_chip_sample(struct dclk_chip * const chip, const double secs, const float temp)
+{
+	struct dclk_chip_step * const h = &chip->hist[chip->step];
+	int target;
+	
+	mutex_lock(&dclk_chips_mutex);
+	h->good += chip->cur_good;
+	h->hw += chip->cur_hw;
+	h->secs += secs;
+	chip->cur_good = chip->cur_hw = 0;
+	if (h->secs > DCLK_CHIP_WINDOW)
+	{
+		const double scale = DCLK_CHIP_WINDOW / h->secs;
+		h->good *= scale;
+		h->hw *= scale;
+		h->secs = DCLK_CHIP_WINDOW;
+	}
+	if (temp > 0)
+		h->temp = h->temp ? (h->temp * 0.8 + temp * 0.2) : temp;
+	target = dclk_chip_choose(chip, temp);
+	mutex_unlock(&dclk_chips_mutex);
+	
+	if (target == chip->step)
+		return target;
+	if (!chip->funcs->set_freq(chip, target))
+	{
+		applog(LOG_WARNING, "%"PRIpreprv": Failed to change clock step from %d to %d",
+		       chip->repr, chip->step, target);
+		return chip->step;
+	}
+	mutex_lock(&dclk_chips_mutex);
+	chip->step = target;
+	mutex_unlock(&dclk_chips_mutex);
+	return target;
+}
+
+// One line per step with history: key, step, '*' if the chip was at it, secs, good, hw, temperature
+bool dclk_state_load(FILE * const F)
+{
+	struct dclk_saved *list = NULL, *saved, *tmp;
+	char line[0x100], key[0x40], cur;
+	struct dclk_chip_step st;
+	int step;
+	
+	while (fgets(line, sizeof(line), F))
+	{
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (7 != sscanf(line, "%63s %d %c %lf %lf %lf %f", key, &step, &cur, &st.secs, &st.good, &st.hw, &st.temp))
+		{
+			LL_FOREACH_SAFE(list, saved, tmp)
+				dclk_saved_free(saved);
+			return false;
+		}
+		saved = malloc(sizeof(*saved));
+		if (!saved)
+			quithere(1, "Failed to malloc %s", "saved");
+		*saved = (struct dclk_saved){
+			.key = strdup(key),
+			.step = step,
+			.cur = (cur == '*'),
+			.st = st,
+		};
+		LL_APPEND(list, saved);
+	}
+	
+	mutex_lock(&dclk_chips_mutex);
+	LL_FOREACH_SAFE(dclk_saved, saved, tmp)
+		dclk_saved_free(saved);
+	dclk_saved = list;
+	mutex_unlock(&dclk_chips_mutex);
+	return true;
+}
+
+bool dclk_state_save(FILE * const F)
+{
+	struct dclk_chip *chip;
+	struct dclk_saved *saved;
+	
+	mutex_lock(&dclk_chips_mutex);
+	DL_FOREACH(dclk_chips, chip)
+		dclk_chip_stash(chip);
+	fputs("# key step current secs good hw temp\n", F);
+	LL_FOREACH(dclk_saved, saved)
+		fprintf(F, "%s %d %c %f %f %f %.1f\n",
+		        saved->key, saved->step, saved->cur ? '*' : '-',
+		        saved->st.secs, saved->st.good, saved->st.hw, saved->st.temp);
+	mutex_unlock(&dclk_chips_mutex);
+	return !ferror(F);
+}
+
+// A chip whose results, errors and temperature all follow from its clock alone
+struct test_dclk_sim {
+	int step;
+	int max_jump;
+};
+
+static
+double test_dclk_sim_mhz(const int step)
+{
+	return 100 + 25 * step;
+}
+
+static
+double test_dclk_sim_hwfrac(const int step)
+{
+	return (step <= 14) ? 0.002 : (0.002 + (step - 14) * 0.02);
+}
+
+static
+float test_dclk_sim_temp(const int step)
+{
+	return 40 + 2 * step;
+}
+
+static
+bool test_dclk_sim_set_freq(struct dclk_chip * const chip, const int step)
+{
+	struct test_dclk_sim * const sim = chip->userp;
+	const int jump = abs(step - sim->step);
+	
+	if (jump > sim->max_jump)
+		sim->max_jump = jump;
+	sim->step = step;
+	return true;
+}
+
+// Leakage keeps slow clocks inefficient, and voltage makes fast ones expensive
+static
+double test_dclk_sim_watts(const struct dclk_chip * const chip, const int step)
+{
+	const double x = test_dclk_sim_mhz(step) / 100;
+	return 3 + x * x * x * x / 81;
+}
+
+static const struct dclk_chip_funcs test_dclk_sim_funcs = {
+	.set_freq = test_dclk_sim_set_freq,
+};
+
+static const struct dclk_chip_funcs test_dclk_sim_watts_funcs = {
+	.set_freq = test_dclk_sim_set_freq,
+	.watts = test_dclk_sim_watts,
+};
+
+static
+int test_dclk_sim_run(struct dclk_chip * const chip, const int periods)
+{
+	struct test_dclk_sim * const sim = chip->userp;
+	
+	for (int i = 0; i < periods; ++i)
+	{
+		const double nonces = test_dclk_sim_mhz(sim->step) / 100 * 60;
+		const double hw = nonces * test_dclk_sim_hwfrac(sim->step);
+		dclk_chip_nonces(chip, nonces - hw, hw);
+		dclk_chip_sample(chip, 60, test_dclk_sim_temp(sim->step));
+	}
+	if (chip->step != sim->step)
+		return -1;
+	return chip->step;
+}
+
+// The step a controller with perfect knowledge would pick
+static
+int test_dclk_sim_best(const struct dclk_chip * const chip)
+{
+	int best = chip->min_step;
+	double bestR = 0;
+	
+	for (int i = chip->min_step; i <= chip->max_step; ++i)
+	{
+		if (test_dclk_sim_hwfrac(i) > chip->max_hw_rate)
+			continue;
+		if (chip->temp_limit && test_dclk_sim_temp(i) > chip->temp_limit)
+			continue;
+		double r = test_dclk_sim_mhz(i) * (1 - test_dclk_sim_hwfrac(i));
+		if (chip->funcs->watts)
+			r /= chip->funcs->watts(chip, i);
+		if (r > bestR)
+		{
+			best = i;
+			bestR = r;
+		}
+	}
+	return best;
+}
+
+static
+void test_dclk_chip_converge(const char * const desc, struct dclk_chip * const chip, const struct test_dclk_sim * const sim)
+{
+	const int best = test_dclk_sim_best(chip);
+	const int step = test_dclk_sim_run(chip, 1000);
+	
+	if (step != best)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s (settled on %d, not %d)", "dclk_chip", desc, step, best);
+	}
+	if (sim->max_jump > chip->max_jump)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s (jumped %d steps)", "dclk_chip", desc, sim->max_jump);
+	}
+}
+
+void test_dclk_chip(void)
+{
+	struct test_dclk_sim sim, sim2;
+	struct dclk_chip chip, chip2;
+	FILE *F;
+	
+	// Up to the fastest step within the error limit, and never far into the errors
+	sim = (struct test_dclk_sim){ .step = 8, };
+	dclk_chip_init(&chip, &test_dclk_sim_funcs, &sim, "TST 0a", "TST0a", 0, 20, sim.step);
+	test_dclk_chip_converge("hw errors", &chip, &sim);
+	if (chip.hist[18].secs || chip.hist[19].secs)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "dclk_chip", "tried steps beyond a bad one");
+	}
+	
+	// Held below the temperature limit, backing off at once when it is crossed
+	sim2 = (struct test_dclk_sim){ .step = 8, };
+	dclk_chip_init(&chip2, &test_dclk_sim_funcs, &sim2, "TST 0b", NULL, 0, 20, sim2.step);
+	chip2.temp_limit = 65;
+	chip2.max_jump = 2;
+	test_dclk_chip_converge("temperature", &chip2, &sim2);
+	dclk_chip_free(&chip2);
+	
+	// Efficiency peaks in the middle of the range, from below
+	sim2 = (struct test_dclk_sim){ .step = 2, };
+	dclk_chip_init(&chip2, &test_dclk_sim_watts_funcs, &sim2, "TST 0b", NULL, 0, 20, sim2.step);
+	test_dclk_chip_converge("watts", &chip2, &sim2);
+	dclk_chip_free(&chip2);
+	
+	// ...and from above, starting where results are all errors
+	sim2 = (struct test_dclk_sim){ .step = 20, };
+	dclk_chip_init(&chip2, &test_dclk_sim_watts_funcs, &sim2, "TST 0b", NULL, 0, 20, sim2.step);
+	test_dclk_chip_converge("watts from above", &chip2, &sim2);
+	dclk_chip_free(&chip2);
+	
+	// History survives a restart, putting the chip straight back where it was
+	F = tmpfile();
+	if (!F)
+	{
+		applog(LOG_WARNING, "%s test skipped: %s", "dclk_chip", "tmpfile failed");
+		dclk_chip_free(&chip);
+		return;
+	}
+	if (!dclk_state_save(F))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "dclk_chip", "save");
+	}
+	dclk_chip_free(&chip);
+	rewind(F);
+	if (!dclk_state_load(F))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "dclk_chip", "load");
+	}
+	sim2 = (struct test_dclk_sim){ .step = 8, };
+	dclk_chip_init(&chip2, &test_dclk_sim_funcs, &sim2, "TST 0a", "TST0a", 0, 20, sim2.step);
+	if (sim2.step != 16 || test_dclk_sim_run(&chip2, 30) != 16 || sim2.max_jump != 8)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s (at %d)", "dclk_chip", "restore", sim2.step);
+	}
+	dclk_chip_free(&chip2);
+	sim2 = (struct test_dclk_sim){ .step = 8, };
+	dclk_chip_init(&chip2, &test_dclk_sim_funcs, &sim2, "TST 0b", "TST0b", 0, 20, sim2.step);
+	if (sim2.step != 8 || chip2.hist[16].secs)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "dclk_chip", "restored the wrong chip");
+	}
+	dclk_chip_free(&chip2);
+	
+	rewind(F);
+	fputs("TST0a sixteen\n", F);
+	rewind(F);
+	if (dclk_state_load(F))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "dclk_chip", "loaded a bad state file");
+	}
+	fclose(F);
+	
+	// Leave no test history to be saved
+	F = tmpfile();
+	if (F)
+	{
+		dclk_state_load(F);
+		fclose(F);
+	}
+}
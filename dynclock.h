@@ -13,6 +13,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 struct thr_info;
 
@@ -70,4 +71,82 @@ extern void dclk_preUpdate(struct dclk_data *data);
 // Called after a sampling period is completed, and error rate updated, to make actual clock adjustments
 extern bool dclk_updateFreq(struct dclk_data *, dclk_change_clock_func_t changeclock, struct thr_info *);
 
+// Per-chip controller: steps are whatever unit the driver clocks its chips in,
+// slow to fast, and the chip is kept on the step with the best valid results
+// per watt that neither errors too often nor runs too hot
+
+#define DCLK_CHIP_MINSECS 600
+#define DCLK_CHIP_WINDOW 3600
+#define DCLK_CHIP_HYSTERESIS 0.005
+
+struct dclk_chip;
+
+struct dclk_chip_funcs {
+	// Called to move the chip to a new step; false leaves it where it was
+	bool (*set_freq)(struct dclk_chip *, int step);
+	
+	// Estimated watts drawn at a step (NULL maximises valid results alone)
+	double (*watts)(const struct dclk_chip *, int step);
+};
+
+struct dclk_chip_step {
+	// Valid results, HW errors, and seconds, over about the last DCLK_CHIP_WINDOW seconds at this step
+	double good;
+	double hw;
+	double secs;
+	
+	// Average temperature at this step (0 if unknown)
+	float temp;
+};
+
+struct dclk_chip {
+	const struct dclk_chip_funcs *funcs;
+	void *userp;
+	const char *repr;
+	
+	// Identifies the chip in the state file, if not NULL
+	char *key;
+	
+	int step;
+	int min_step;
+	int max_step;
+	
+	// Tunables, given defaults by dclk_chip_init
+	int max_jump;
+	double min_secs;
+	double max_hw_rate;
+	float temp_limit;
+	
+	// Results since the last dclk_chip_sample
+	double cur_good;
+	double cur_hw;
+	
+	// [min_step] is the first valid index
+	struct dclk_chip_step *hist;
+	
+	struct dclk_chip *prev;
+	struct dclk_chip *next;
+};
+
+// Called to initialize dclk_chip at startup, with the chip already running at step; if history for key was loaded, the chip may be moved to its last step at once
+extern void dclk_chip_init(struct dclk_chip *, const struct dclk_chip_funcs *, void *userp, const char *repr, const char *key, int min_step, int max_step, int step);
+extern void dclk_chip_free(struct dclk_chip *);
+
+// Called for results as they come in (difficulty-1 units)
+static inline
+void dclk_chip_nonces(struct dclk_chip * const chip, const double good, const double hw)
+{
+	chip->cur_good += good;
+	chip->cur_hw += hw;
+}
+
+// Called at the end of each sampling period (temp 0 if unknown) to record it and make clock adjustments; returns the new step
+extern int dclk_chip_sample(struct dclk_chip *, double secs, float temp);
+
+// History of every chip with a key, so it survives restarts
+extern bool dclk_state_load(FILE *);
+extern bool dclk_state_save(FILE *);
+
+extern void test_dclk_chip(void);
+
 #endif
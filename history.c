@@ -0,0 +1,238 @@
+/*
+ * Copyright 2026 MassGridMiner developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "history.h"
+#include "logging.h"
+#include "miner.h"
+#include "util.h"
+
+/* Each processor keeps a fixed ring of buckets at three resolutions. Only the
+ * thread owning the processor (its first mining thread) writes the ring: it
+ * folds in hashes, and the growth of the lifetime share and error counters
+ * since its previous update, from hashes_done. Other mining threads of the
+ * same processor only add to pending_hashes atomically. Readers copy the ring
+ * under a sequence count instead of a lock, retrying if it changed, so neither
+ * side ever blocks the other. */
+
+const struct history_level history_levels[HISTORY_RESOLUTIONS] = {
+	[HR_SECOND] = {"Seconds",    1, 60,   0},
+	[HR_MINUTE] = {"Minutes",   60, 60,  60},
+	[HR_HOUR]   = {"Hours",   3600, 24, 120},
+};
+
+struct history *history_new(void)
+{
+	struct history * const hist = calloc(1, sizeof(*hist));
+	if (unlikely(!hist))
+		quithere(1, "OOM history");
+	return hist;
+}
+
+void history_add_hashes(struct history * const hist, const int64_t hashes)
+{
+	__sync_fetch_and_add(&hist->pending_hashes, hashes);
+}
+
+// Lifetime counters can go back to zero with the zero API command
+static
+double history_delta(const double now, double * const lastp)
+{
+	const double delta = (now >= *lastp) ? (now - *lastp) : now;
+	*lastp = now;
+	return delta;
+}
+
+static
+struct history_bucket *history_advance(struct history * const hist, const enum history_resolution res, const time_t now)
+{
+	const struct history_level * const level = &history_levels[res];
+	struct history_bucket * const buckets = &hist->bucket[level->offset];
+	const time_t period = now / level->interval;
+	time_t i;
+	
+	if (period > hist->period[res])
+	{
+		// Clear every bucket skipped over, but at most one full lap
+		i = hist->period[res] + 1;
+		if (period - i >= level->buckets)
+			i = period - level->buckets + 1;
+		for ( ; i <= period; ++i)
+			memset(&buckets[i % level->buckets], 0, sizeof(*buckets));
+		hist->period[res] = period;
+	}
+	// If the clock went backward, keep adding to the newest bucket
+	return &buckets[hist->period[res] % level->buckets];
+}
+
+void history_update(struct history * const hist, const struct cgpu_info * const proc, int64_t hashes, const time_t now)
+{
+	struct history_bucket *b;
+	
+	hashes += __sync_fetch_and_and(&hist->pending_hashes, 0);
+	const double diff_accepted = history_delta(proc->diff_accepted, &hist->last_diff_accepted);
+	const double diff_rejected = history_delta(proc->diff_rejected, &hist->last_diff_rejected);
+	const double diff_stale = history_delta(proc->diff_stale, &hist->last_diff_stale);
+	const int hw_errors = (proc->hw_errors >= hist->last_hw_errors) ? (proc->hw_errors - hist->last_hw_errors) : proc->hw_errors;
+	hist->last_hw_errors = proc->hw_errors;
+	const float temp = proc->temp;
+	
+	++hist->seq;
+	__sync_synchronize();
+	for (int res = 0; res < HISTORY_RESOLUTIONS; ++res)
+	{
+		b = history_advance(hist, res, now);
+		b->hashes += hashes;
+		b->diff_accepted += diff_accepted;
+		b->diff_rejected += diff_rejected;
+		b->diff_stale += diff_stale;
+		b->hw_errors += hw_errors;
+		if (temp > b->max_temp)
+			b->max_temp = temp;
+	}
+	__sync_synchronize();
+	++hist->seq;
+}
+
+// Returns false if the owning thread kept the ring busy for every attempt
+bool history_copy(struct history * const out, const struct history * const hist)
+{
+	unsigned seq;
+	
+	for (int tries = 0; tries < 0x100; ++tries)
+	{
+		seq = hist->seq;
+		if (seq & 1)
+			continue;
+		__sync_synchronize();
+		memcpy(out, hist, sizeof(*out));
+		__sync_synchronize();
+		if (hist->seq == seq)
+			return true;
+	}
+	return false;
+}
+
+// Fills the level's buckets oldest first, ending with the one containing now
+void history_series(struct history_bucket * const out, const struct history * const hist, const enum history_resolution res, const time_t now)
+{
+	const struct history_level * const level = &history_levels[res];
+	const time_t newest = hist->period[res];
+	time_t period = now / level->interval - level->buckets + 1;
+	
+	for (unsigned i = 0; i < level->buckets; ++i, ++period)
+	{
+		if (period <= newest && period > newest - level->buckets)
+			out[i] = hist->bucket[level->offset + (period % level->buckets)];
+		else
+			memset(&out[i], 0, sizeof(out[i]));
+	}
+}
+
+void test_history(void)
+{
+	struct history * const hist = history_new();
+	struct history copy;
+	struct history_bucket series[60];
+	struct cgpu_info proc = {
+		.temp = 40,
+	};
+	const time_t base = 1400000000 / 3600 * 3600;
+	
+	if (history_levels[HR_HOUR].offset + history_levels[HR_HOUR].buckets != HISTORY_BUCKETS)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "history", "level layout");
+	}
+	
+	history_update(hist, &proc, 1000, base);
+	history_add_hashes(hist, 500);
+	proc.diff_accepted = 4;
+	proc.hw_errors = 1;
+	proc.temp = 45;
+	history_update(hist, &proc, 1000, base);
+	proc.temp = 42;
+	history_update(hist, &proc, 7, base + 2);
+	if (!history_copy(&copy, hist))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "history", "copy");
+	}
+	history_series(series, &copy, HR_SECOND, base + 2);
+	if (series[57].hashes != 2500 || series[58].hashes || series[59].hashes != 7
+	 || series[57].diff_accepted != 4 || series[57].hw_errors != 1 || series[57].max_temp != 45
+	 || series[59].max_temp != 42)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "history", "seconds");
+	}
+	history_series(series, &copy, HR_MINUTE, base + 2);
+	if (series[59].hashes != 2507 || series[59].diff_accepted != 4 || series[59].max_temp != 45)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "history", "minutes");
+	}
+	
+	// Buckets age out of the series without any update
+	history_series(series, &copy, HR_SECOND, base + 61);
+	if (series[0].hashes != 7 || series[59].hashes)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "history", "aging");
+	}
+	history_series(series, &copy, HR_SECOND, base + 62);
+	if (series[0].hashes)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "history", "aging");
+	}
+	
+	// Skipping more than a lap clears everything, including the slot reused
+	proc.diff_accepted = 1;  // zeroed and one more share since
+	history_update(hist, &proc, 3, base + 120);
+	history_copy(&copy, hist);
+	history_series(series, &copy, HR_SECOND, base + 120);
+	for (int i = 0; i < 59; ++i)
+		if (series[i].hashes)
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "history", "lap");
+			break;
+		}
+	if (series[59].hashes != 3 || series[59].diff_accepted != 1 || series[59].hw_errors)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "history", "counter reset");
+	}
+	history_series(series, &copy, HR_MINUTE, base + 120);
+	if (series[57].hashes != 2507 || series[58].hashes || series[59].hashes != 3)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "history", "minute lap");
+	}
+	
+	// A clock stepping backward keeps adding to the newest bucket
+	history_update(hist, &proc, 4, base + 100);
+	history_copy(&copy, hist);
+	history_series(series, &copy, HR_SECOND, base + 120);
+	if (series[59].hashes != 7)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "history", "clock step");
+	}
+	
+	free(hist);
+}
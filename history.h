@@ -0,0 +1,57 @@
+#ifndef BFG_HISTORY_H
+#define BFG_HISTORY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+struct cgpu_info;
+
+enum history_resolution {
+	HR_SECOND,
+	HR_MINUTE,
+	HR_HOUR,
+};
+#define HISTORY_RESOLUTIONS  3
+
+struct history_bucket {
+	uint64_t hashes;
+	double diff_accepted;
+	double diff_rejected;
+	double diff_stale;
+	uint32_t hw_errors;
+	float max_temp;
+};
+
+struct history_level {
+	const char *name;
+	unsigned interval;  // seconds per bucket
+	unsigned buckets;
+	unsigned offset;
+};
+
+extern const struct history_level history_levels[HISTORY_RESOLUTIONS];
+#define HISTORY_BUCKETS  (60 + 60 + 24)
+
+struct history {
+	volatile unsigned seq;
+	volatile int64_t pending_hashes;
+	// Lifetime counters as of the previous update
+	double last_diff_accepted;
+	double last_diff_rejected;
+	double last_diff_stale;
+	int last_hw_errors;
+	// Newest period (time / interval) stored at each resolution
+	time_t period[HISTORY_RESOLUTIONS];
+	struct history_bucket bucket[HISTORY_BUCKETS];
+};
+
+extern struct history *history_new(void);
+extern void history_add_hashes(struct history *, int64_t hashes);
+extern void history_update(struct history *, const struct cgpu_info *, int64_t hashes, time_t now);
+extern bool history_copy(struct history *out, const struct history *);
+extern void history_series(struct history_bucket *out, const struct history *, enum history_resolution, time_t now);
+
+extern void test_history(void);
+
+#endif
@@ -18,6 +18,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef WIN32
 #include <sys/types.h>
@@ -28,6 +29,7 @@
 #include <microhttpd.h>
 
 #include "logging.h"
+#include "metrics.h"
 #include "miner.h"
 #include "util.h"
 
@@ -40,9 +42,34 @@ void httpsrv_prepare_resp(struct MHD_Response *resp)
 	MHD_add_response_header(resp, MHD_HTTP_HEADER_SERVER, bfgminer_name_slash_ver);
 }
 
+// Prometheus scrapes share the same cached snapshot as API watchers
+#define HTTPSRV_METRICS_MAX_AGE_MS  1000
+
+static
+int httpsrv_handle_metrics(struct MHD_Connection *conn)
+{
+	struct metrics_snapshot * const snap = metrics_snapshot_get(HTTPSRV_METRICS_MAX_AGE_MS);
+	struct MHD_Response *resp;
+	bytes_t out = BYTES_INIT;
+	int ret;
+	
+	metrics_prometheus(&out, snap);
+	metrics_snapshot_put(snap);
+	
+	resp = MHD_create_response_from_buffer(bytes_len(&out), bytes_buf(&out), MHD_RESPMEM_MUST_FREE);
+	httpsrv_prepare_resp(resp);
+	MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE, "text/plain; version=0.0.4");
+	ret = MHD_queue_response(conn, 200, resp);
+	MHD_destroy_response(resp);
+	return ret;
+}
+
 static
 int httpsrv_handle_req(struct MHD_Connection *conn, const char *url, const char *method, bytes_t *upbuf)
 {
+	// The HTTP server has no access control of its own, so /metrics is opt-in
+	if (opt_http_metrics && !strcmp(url, "/metrics"))
+		return httpsrv_handle_metrics(conn);
 	return handle_getwork(conn, upbuf);
 }
 
@@ -0,0 +1,593 @@
+/*
+ * Copyright 2026 MassGridMiner developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include "journal.h"
+#include "logging.h"
+#include "miner.h"
+#include "util.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/* Binary share and nonce journals: an append-only file of fixed-size records,
+ * little endian, following a 16 byte header (magic, version, record size).
+ * Records are queued in memory and written by a thread per journal, which
+ * syncs the file every few seconds and rotates it once it reaches
+ * --journal-rotate MiB. --sharelog-dump converts a journal back to the CSV
+ * layout that --sharelog and --noncelog write. */
+
+#define JOURNAL_MAGIC        "BFGjrnl"
+#define JOURNAL_VERSION      1
+#define JOURNAL_HDRSZ        0x10
+#define JOURNAL_RECSZ        0x180
+#define JOURNAL_FSYNC_SECS   5
+#define JOURNAL_REOPEN_SECS  5
+// Records kept in memory while the file cannot be reopened
+#define JOURNAL_MAX_BACKLOG  (0x1000 * JOURNAL_RECSZ)
+
+#define JRT_SHARE  'S'
+#define JRT_NONCE  'N'
+
+// Common to all records
+#define JO_TYPE         0x00
+#define JO_THR_ID       0x04
+#define JO_TIMESTAMP    0x08
+#define JO_PROC         0x10
+#define JO_PROC_SZ      0x10
+// Share records
+#define JO_DISPOSITION  0x20
+#define JO_DISPOSITION_SZ  0x28
+#define JO_URL          0x48
+#define JO_URL_SZ       0x78
+#define JO_S_TARGET     0xc0
+#define JO_S_HASH       0xe0
+#define JO_S_DATA       0x100
+// Nonce records
+#define JO_N_HASH       0x20
+#define JO_N_DATA       0x40
+#define JO_N_MIDSTATE   0x90
+
+int opt_journal_rotate_mb = 64;
+
+struct journal {
+	char *filename;
+	const char *purpose;
+	int fd;
+	uint64_t filesz;
+	
+	pthread_mutex_t mutex;
+	bytes_t pending;
+	notifier_t notifier;
+	bool stopping;
+	pthread_t pth;
+};
+
+// Copies a string into a fixed field, always leaving it null-terminated
+static
+void journal_pack_str(uint8_t * const rec, const int offset, const size_t fieldsz, const char * const s)
+{
+	strncpy((char *)&rec[offset], s, fieldsz - 1);
+}
+
+static
+const char *journal_upk_str(uint8_t * const rec, const int offset, const size_t fieldsz)
+{
+	rec[offset + fieldsz - 1] = '\0';
+	return (const char *)&rec[offset];
+}
+
+static
+void journal_pack_share(uint8_t * const rec, const struct journal_share * const js)
+{
+	memset(rec, 0, JOURNAL_RECSZ);
+	rec[JO_TYPE] = JRT_SHARE;
+	pk_u32le(rec, JO_THR_ID, js->thr_id);
+	pk_u64le(rec, JO_TIMESTAMP, js->timestamp);
+	journal_pack_str(rec, JO_PROC, JO_PROC_SZ, js->proc);
+	journal_pack_str(rec, JO_DISPOSITION, JO_DISPOSITION_SZ, js->disposition);
+	journal_pack_str(rec, JO_URL, JO_URL_SZ, js->url);
+	memcpy(&rec[JO_S_TARGET], js->target, 32);
+	memcpy(&rec[JO_S_HASH], js->hash, 32);
+	memcpy(&rec[JO_S_DATA], js->data, 128);
+}
+
+// The result points into rec
+static
+void journal_upk_share(struct journal_share * const js, uint8_t * const rec)
+{
+	*js = (struct journal_share){
+		.timestamp = upk_u64le(rec, JO_TIMESTAMP),
+		.thr_id = upk_u32le(rec, JO_THR_ID),
+		.proc = journal_upk_str(rec, JO_PROC, JO_PROC_SZ),
+		.disposition = journal_upk_str(rec, JO_DISPOSITION, JO_DISPOSITION_SZ),
+		.url = journal_upk_str(rec, JO_URL, JO_URL_SZ),
+		.target = &rec[JO_S_TARGET],
+		.hash = &rec[JO_S_HASH],
+		.data = &rec[JO_S_DATA],
+	};
+}
+
+static
+void journal_pack_nonce(uint8_t * const rec, const struct journal_nonce * const jn)
+{
+	memset(rec, 0, JOURNAL_RECSZ);
+	rec[JO_TYPE] = JRT_NONCE;
+	pk_u64le(rec, JO_TIMESTAMP, jn->timestamp);
+	journal_pack_str(rec, JO_PROC, JO_PROC_SZ, jn->proc);
+	memcpy(&rec[JO_N_HASH], jn->hash, 32);
+	memcpy(&rec[JO_N_DATA], jn->data, 80);
+	memcpy(&rec[JO_N_MIDSTATE], jn->midstate, 32);
+}
+
+static
+void journal_upk_nonce(struct journal_nonce * const jn, uint8_t * const rec)
+{
+	*jn = (struct journal_nonce){
+		.timestamp = upk_u64le(rec, JO_TIMESTAMP),
+		.proc = journal_upk_str(rec, JO_PROC, JO_PROC_SZ),
+		.hash = &rec[JO_N_HASH],
+		.data = &rec[JO_N_DATA],
+		.midstate = &rec[JO_N_MIDSTATE],
+	};
+}
+
+void journal_share_csv(bytes_t * const out, const struct journal_share * const js)
+{
+	char target[65], hash[65], data[257];
+	
+	bin2hex(target, js->target, 32);
+	bin2hex(hash, js->hash, 32);
+	bin2hex(data, js->data, 128);
+	
+	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
+	bytes_appendf(out, "%lu,%s,%s,%s,%s,%u,%s,%s\n", (unsigned long)js->timestamp, js->disposition, target, js->url, js->proc, (unsigned)js->thr_id, hash, data);
+}
+
+void journal_nonce_csv(bytes_t * const out, const struct journal_nonce * const jn)
+{
+	char hash[65], data[161], midstate[65];
+	
+	bin2hex(hash, jn->hash, 32);
+	bin2hex(data, jn->data, 80);
+	bin2hex(midstate, jn->midstate, 32);
+	
+	// timestamp,proc,hash,data,midstate
+	bytes_appendf(out, "%lu,%s,%s,%s,%s\n", (unsigned long)jn->timestamp, jn->proc, hash, data, midstate);
+}
+
+static
+bool journal_write_all(struct journal * const j, const void * const buf, const size_t bufsz)
+{
+	const uint8_t *p = buf;
+	size_t remaining = bufsz;
+	ssize_t n;
+	
+	while (remaining)
+	{
+		n = write(j->fd, p, remaining);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			applog(LOG_ERR, "Error writing %s %s: %s", j->purpose, j->filename, bfg_strerror(errno, BST_ERRNO));
+			return false;
+		}
+		p += n;
+		remaining -= n;
+	}
+	j->filesz += bufsz;
+	return true;
+}
+
+static
+bool journal_check_header(const uint8_t * const hdr)
+{
+	return !memcmp(hdr, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC))
+	    && upk_u32le(hdr, 8) == JOURNAL_VERSION
+	    && upk_u32le(hdr, 12) == JOURNAL_RECSZ;
+}
+
+static
+bool journal_open_file(struct journal * const j)
+{
+	uint8_t hdr[JOURNAL_HDRSZ];
+	struct stat st;
+	
+	j->fd = open(j->filename, O_RDWR | O_CREAT | O_APPEND | O_BINARY, 0644);
+	if (j->fd < 0)
+		applogr(false, LOG_ERR, "Failed to open %s %s: %s", j->purpose, j->filename, bfg_strerror(errno, BST_ERRNO));
+	if (fstat(j->fd, &st))
+		st.st_size = 0;
+	j->filesz = st.st_size;
+	
+	if (!j->filesz)
+	{
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+		pk_u32le(hdr, 8, JOURNAL_VERSION);
+		pk_u32le(hdr, 12, JOURNAL_RECSZ);
+		if (!journal_write_all(j, hdr, sizeof(hdr)))
+			goto err;
+		return true;
+	}
+	
+	if (pread(j->fd, hdr, sizeof(hdr), 0) != sizeof(hdr) || !journal_check_header(hdr))
+	{
+		applog(LOG_ERR, "%s %s exists, but is not a compatible journal", j->purpose, j->filename);
+		goto err;
+	}
+	if ((j->filesz - JOURNAL_HDRSZ) % JOURNAL_RECSZ)
+	{
+		// Drop a record torn by a crash, so the rest stay aligned
+		applog(LOG_WARNING, "%s %s ends with a partial record, truncating it", j->purpose, j->filename);
+		j->filesz -= (j->filesz - JOURNAL_HDRSZ) % JOURNAL_RECSZ;
+		if (ftruncate(j->fd, j->filesz))
+			goto err;
+	}
+	return true;
+
+err:
+	close(j->fd);
+	j->fd = -1;
+	return false;
+}
+
+static
+void journal_rotate(struct journal * const j)
+{
+	const size_t newnamesz = strlen(j->filename) + 0x16;
+	char * const newname = malloc(newnamesz);
+	
+	if (unlikely(!newname))
+		quithere(1, "Failed to malloc %s", "newname");
+	snprintf(newname, newnamesz, "%s.%lu", j->filename, (unsigned long)time(NULL));
+	fsync(j->fd);
+	close(j->fd);
+	j->fd = -1;
+	if (rename(j->filename, newname))
+		applog(LOG_ERR, "Failed to rotate %s %s: %s", j->purpose, j->filename, bfg_strerror(errno, BST_ERRNO));
+	else
+		applog(LOG_DEBUG, "Rotated %s to %s", j->purpose, newname);
+	free(newname);
+	// If this fails, journal_thread keeps records in memory and retries
+	journal_open_file(j);
+}
+
+static
+void *journal_thread(void * const userp)
+{
+	struct journal * const j = userp;
+	const uint64_t rotatesz = (uint64_t)opt_journal_rotate_mb << 20;
+	struct timeval tv_now, tv_fsync, tv_reopen;
+	bytes_t writing = BYTES_INIT;
+	bool dirty = false, stopping;
+	
+	RenameThread("journal");
+	
+	timer_unset(&tv_fsync);
+	timer_unset(&tv_reopen);
+	while (true)
+	{
+		mutex_lock(&j->mutex);
+		if (bytes_len(&writing))
+		{
+			// Still holding records from while the file was closed
+			bytes_cat(&writing, &j->pending);
+			bytes_reset(&j->pending);
+		}
+		else
+			bytes_assimilate(&writing, &j->pending);
+		stopping = j->stopping;
+		mutex_unlock(&j->mutex);
+		
+		timer_set_now(&tv_now);
+		if (j->fd == -1 && bytes_len(&writing) && (stopping || !timercmp(&tv_now, &tv_reopen, <)))
+		{
+			if (journal_open_file(j))
+			{
+				applog(LOG_NOTICE, "Reopened %s %s", j->purpose, j->filename);
+				timer_unset(&tv_reopen);
+			}
+			else
+				timer_set_delay(&tv_reopen, &tv_now, JOURNAL_REOPEN_SECS * 1000000);
+		}
+		
+		if (j->fd == -1)
+		{
+			if (bytes_len(&writing) > JOURNAL_MAX_BACKLOG)
+			{
+				applog(LOG_ERR, "%s %s is not open, dropping %lu records", j->purpose, j->filename, (unsigned long)((bytes_len(&writing) - JOURNAL_MAX_BACKLOG) / JOURNAL_RECSZ));
+				bytes_shift(&writing, bytes_len(&writing) - JOURNAL_MAX_BACKLOG);
+			}
+			if (stopping && bytes_len(&writing))
+				applog(LOG_ERR, "%s %s is not open, lost %lu records", j->purpose, j->filename, (unsigned long)(bytes_len(&writing) / JOURNAL_RECSZ));
+		}
+		else
+		if (bytes_len(&writing))
+		{
+			if (journal_write_all(j, bytes_buf(&writing), bytes_len(&writing)) && !dirty)
+			{
+				dirty = true;
+				timer_set_delay_from_now(&tv_fsync, JOURNAL_FSYNC_SECS * 1000000);
+			}
+			if (rotatesz && j->filesz >= rotatesz)
+			{
+				// Rotation syncs the old file
+				journal_rotate(j);
+				dirty = false;
+				timer_unset(&tv_fsync);
+			}
+			bytes_reset(&writing);
+		}
+		
+		timer_set_now(&tv_now);
+		if (dirty && (stopping || !timercmp(&tv_now, &tv_fsync, <)))
+		{
+			fsync(j->fd);
+			dirty = false;
+			timer_unset(&tv_fsync);
+		}
+		if (stopping)
+			break;
+		
+		// Without anything to sync or retry, sleep until there is more to write
+		if (notifier_wait(j->notifier, (j->fd == -1 && bytes_len(&writing)) ? &tv_reopen : &tv_fsync))
+			notifier_read(j->notifier);
+	}
+	
+	bytes_free(&writing);
+	return NULL;
+}
+
+struct journal *journal_open(const char * const filename, const char * const purpose)
+{
+	struct journal * const j = malloc(sizeof(*j));
+	if (unlikely(!j))
+		quithere(1, "OOM journal");
+	*j = (struct journal){
+		.filename = strdup(filename),
+		.purpose = purpose,
+		.pending = BYTES_INIT,
+	};
+	if (!journal_open_file(j))
+	{
+		free(j->filename);
+		free(j);
+		return NULL;
+	}
+	mutex_init(&j->mutex);
+	notifier_init(j->notifier);
+	if (unlikely(pthread_create(&j->pth, NULL, journal_thread, j)))
+		quithere(1, "pthread_create failed");
+	return j;
+}
+
+// Writes out everything queued, syncs, and closes
+void journal_close(struct journal * const j)
+{
+	if (!j)
+		return;
+	mutex_lock(&j->mutex);
+	j->stopping = true;
+	mutex_unlock(&j->mutex);
+	notifier_wake(j->notifier);
+	pthread_join(j->pth, NULL);
+	
+	if (j->fd != -1)
+		close(j->fd);
+	notifier_destroy(j->notifier);
+	mutex_destroy(&j->mutex);
+	bytes_free(&j->pending);
+	free(j->filename);
+	free(j);
+}
+
+static
+void journal_add(struct journal * const j, const uint8_t * const rec)
+{
+	bool wake;
+	
+	mutex_lock(&j->mutex);
+	wake = !bytes_len(&j->pending);
+	bytes_append(&j->pending, rec, JOURNAL_RECSZ);
+	mutex_unlock(&j->mutex);
+	if (wake)
+		notifier_wake(j->notifier);
+}
+
+void journal_add_share(struct journal * const j, const struct journal_share * const js)
+{
+	uint8_t rec[JOURNAL_RECSZ];
+	journal_pack_share(rec, js);
+	journal_add(j, rec);
+}
+
+void journal_add_nonce(struct journal * const j, const struct journal_nonce * const jn)
+{
+	uint8_t rec[JOURNAL_RECSZ];
+	journal_pack_nonce(rec, jn);
+	journal_add(j, rec);
+}
+
+static
+bool journal_dump_file(FILE * const in, const char * const filename, FILE * const out)
+{
+	uint8_t hdr[JOURNAL_HDRSZ], rec[JOURNAL_RECSZ];
+	struct journal_share js;
+	struct journal_nonce jn;
+	bytes_t csv = BYTES_INIT;
+	size_t n;
+	bool rv = false;
+	
+	if (fread(hdr, sizeof(hdr), 1, in) != 1 || !journal_check_header(hdr))
+		return_via_applog(out, , LOG_ERR, "%s is not a compatible journal", filename);
+	
+	while ((n = fread(rec, 1, sizeof(rec), in)) == sizeof(rec))
+	{
+		switch (rec[JO_TYPE])
+		{
+			case JRT_SHARE:
+				journal_upk_share(&js, rec);
+				journal_share_csv(&csv, &js);
+				break;
+			case JRT_NONCE:
+				journal_upk_nonce(&jn, rec);
+				journal_nonce_csv(&csv, &jn);
+				break;
+			default:
+				applog(LOG_WARNING, "Skipping journal record of unknown type 0x%02x", (unsigned)rec[JO_TYPE]);
+				continue;
+		}
+		if (fwrite(bytes_buf(&csv), bytes_len(&csv), 1, out) != 1)
+			return_via_applog(out, , LOG_ERR, "Error writing CSV");
+		bytes_reset(&csv);
+	}
+	if (n)
+		applog(LOG_WARNING, "%s ends with a partial record", filename);
+	rv = true;
+
+out:
+	bytes_free(&csv);
+	return rv;
+}
+
+bool journal_dump(const char * const filename, FILE * const out)
+{
+	FILE * const in = fopen(filename, "rb");
+	bool rv;
+	
+	if (!in)
+		applogr(false, LOG_ERR, "Failed to open %s: %s", filename, bfg_strerror(errno, BST_ERRNO));
+	rv = journal_dump_file(in, filename, out);
+	fclose(in);
+	return rv && !fflush(out);
+}
+
+static
+void _test_journal_csv(const bytes_t * const got, const bytes_t * const expect, const char * const what)
+{
+	if (bytes_eq(got, expect))
+		return;
+	++unittest_failures;
+	applog(LOG_WARNING, "%s test failed: %s mismatch (%d vs %d bytes)", "journal", what, (int)bytes_len(got), (int)bytes_len(expect));
+}
+
+void test_journal()
+{
+	uint8_t target[32], hash[32], data[128], midstate[32], rec[JOURNAL_RECSZ];
+	const struct journal_share js = {
+		.timestamp = 1400000000,
+		.disposition = "reject:duplicate",
+		.url = "stratum+tcp://pool.example.com:3333",
+		.proc = "PGA12c",
+		.thr_id = 17,
+		.target = target,
+		.hash = hash,
+		.data = data,
+	};
+	const struct journal_nonce jn = {
+		.timestamp = 1400000001,
+		.proc = "PGA12c",
+		.hash = hash,
+		.data = data,
+		.midstate = midstate,
+	};
+	struct journal_share js2;
+	struct journal_nonce jn2;
+	bytes_t expect = BYTES_INIT, got = BYTES_INIT;
+	
+	for (int i = 0; i < 128; ++i)
+	{
+		data[i] = i * 7;
+		if (i < 32)
+		{
+			target[i] = 0xff - i;
+			hash[i] = i;
+			midstate[i] = i ^ 0x5a;
+		}
+	}
+	
+	journal_share_csv(&expect, &js);
+	journal_pack_share(rec, &js);
+	journal_upk_share(&js2, rec);
+	journal_share_csv(&got, &js2);
+	_test_journal_csv(&got, &expect, "share");
+	
+	bytes_reset(&expect);
+	bytes_reset(&got);
+	journal_nonce_csv(&expect, &jn);
+	journal_pack_nonce(rec, &jn);
+	journal_upk_nonce(&jn2, rec);
+	journal_nonce_csv(&got, &jn2);
+	_test_journal_csv(&got, &expect, "nonce");
+	
+	// Overlong strings must be truncated, but still terminated
+	js2 = js;
+	js2.url = "stratum+tcp://a.very.long.pool.name.example.com:3333/"
+	          "with/a/path/that/keeps/going/and/going/and/going/until/it/no/longer/fits";
+	journal_pack_share(rec, &js2);
+	journal_upk_share(&js2, rec);
+	if (strlen(js2.url) != JO_URL_SZ - 1)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "journal", "long URL not truncated");
+	}
+	
+#ifndef WIN32
+	{
+		// Round trip through a journal file
+		char filename[] = "/tmp/bfgjournal-XXXXXX";
+		const int fd = mkstemp(filename);
+		struct journal *j;
+		FILE *dumped;
+		
+		bytes_reset(&expect);
+		journal_share_csv(&expect, &js);
+		journal_nonce_csv(&expect, &jn);
+		bytes_reset(&got);
+		if (fd != -1)
+			close(fd);
+		if (fd != -1 && (j = journal_open(filename, "test journal")) && (dumped = tmpfile()))
+		{
+			journal_add_share(j, &js);
+			journal_add_nonce(j, &jn);
+			journal_close(j);
+			if (journal_dump(filename, dumped))
+			{
+				rewind(dumped);
+				bytes_resize(&got, bytes_len(&expect) + 1);
+				bytes_resize(&got, fread(bytes_buf(&got), 1, bytes_len(&got), dumped));
+			}
+			fclose(dumped);
+		}
+		_test_journal_csv(&got, &expect, "dump");
+		unlink(filename);
+	}
+#endif
+	
+	bytes_free(&expect);
+	bytes_free(&got);
+}
@@ -0,0 +1,44 @@
+#ifndef BFG_JOURNAL_H
+#define BFG_JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util.h"
+
+struct journal;
+
+struct journal_share {
+	uint64_t timestamp;
+	const char *disposition;
+	const char *url;
+	const char *proc;
+	uint32_t thr_id;
+	const uint8_t *target;  // 32 bytes
+	const uint8_t *hash;    // 32 bytes
+	const uint8_t *data;    // 128 bytes
+};
+
+struct journal_nonce {
+	uint64_t timestamp;
+	const char *proc;
+	const uint8_t *hash;      // 32 bytes
+	const uint8_t *data;      // 80 bytes
+	const uint8_t *midstate;  // 32 bytes
+};
+
+extern int opt_journal_rotate_mb;
+
+extern struct journal *journal_open(const char *filename, const char *purpose);
+extern void journal_close(struct journal *);
+extern void journal_add_share(struct journal *, const struct journal_share *);
+extern void journal_add_nonce(struct journal *, const struct journal_nonce *);
+
+extern void journal_share_csv(bytes_t *out, const struct journal_share *);
+extern void journal_nonce_csv(bytes_t *out, const struct journal_nonce *);
+extern bool journal_dump(const char *filename, FILE *out);
+
+extern void test_journal();
+
+#endif
@@ -27,6 +27,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -34,7 +35,7 @@
 #include "miner.h"
 #include "libbitfury.h"
 #include "lowl-spi.h"
-#include "sha2.h"
+#include "malgo/sha256d.h"
 
 #include <time.h>
 
@@ -321,63 +322,20 @@ uint32_t bitfury_decnonce(uint32_t in)
 	return out;
 }
 
-static
-int libbitfury_rehash(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t nnonce) {
-	uint8_t in[16];
-	uint32_t *in32 = (uint32_t *)in;
-	const uint32_t *mid32 = midstate;
-	uint32_t out32[8];
-	uint8_t *out = (uint8_t *) out32;
-#ifdef BITFURY_REHASH_DEBUG
-	static uint32_t history[512];
-	static uint32_t history_p;
-#endif
-	sha256_ctx ctx;
-
-
-	memset( &ctx, 0, sizeof( sha256_ctx ) );
-	memcpy(ctx.h, mid32, 8*4);
-	ctx.tot_len = 64;
-	ctx.len = 0;
-
-	in32[0] = bswap_32(m7);
-	in32[1] = bswap_32(ntime);
-	in32[2] = bswap_32(nbits);
-	in32[3] = bswap_32(nnonce);
-
-	sha256_update(&ctx, in, 16);
-	sha256_final(&ctx, out);
-	sha256(out, 32, out);
-
-	if (out32[7] == 0) {
-#ifdef BITFURY_REHASH_DEBUG
-		char hex[65];
-		bin2hex(hex, out, 32);
-		applog(LOG_INFO, "! MS0: %08x, m7: %08x, ntime: %08x, nbits: %08x, nnonce: %08x", mid32[0], m7, ntime, nbits, nnonce);
-		applog(LOG_INFO, " out: %s", hex);
-		history[history_p] = nnonce;
-		history_p++; history_p &= 512 - 1;
-#endif
-		return 1;
-	}
-	return 0;
-}
-
 bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t *nonce_p) {
 	static const uint32_t offsets[] = {0, 0xffc00000, 0xff800000, 0x02800000, 0x02C00000, 0x00400000};
-	uint32_t nonce;
+	const uint32_t tail[4] = {m7, ntime, nbits, 0};
+	uint32_t nonces[6], found;
 	int i;
 	
 	for (i = 0; i < 6; ++i)
-	{
-		nonce = *nonce_p + offsets[i];
-		if (libbitfury_rehash(midstate, m7, ntime, nbits, nonce))
-		{
-			*nonce_p = nonce;
-			return true;
-		}
-	}
-	return false;
+		nonces[i] = *nonce_p + offsets[i];
+	found = sha256d_test_nonces(midstate, tail, nonces, 6);
+	if (!found)
+		return false;
+	// Lowest offset index wins, as when they were tried in turn
+	*nonce_p = nonces[__builtin_ctz(found)];
+	return true;
 }
 
 void work_to_bitfury_payload(struct bitfury_payload *p, struct work *w) {
@@ -395,3 +353,80 @@ void bitfury_payload_to_atrvec(uint32_t *atrvec, struct bitfury_payload *p)
 	memcpy(atrvec, p, 20*4);
 	libbitfury_ms3_compute(atrvec);
 }
+
+void test_bitfury_spi_sched(void)
+{
+	struct spi_port * const ports = calloc(3, sizeof(*ports));
+	struct spi_mock mocks[3];
+	struct spi_mock_response responses[3];
+	unsigned char rx[3][0x100];
+	struct bitfury_device chips[6];
+	uint32_t *rxp[6];
+	struct spi_txrx_async *async;
+	int i, b;
+	size_t bufsz[3];
+	
+	memset(chips, 0, sizeof(chips));
+	for (i = 0; i < 6; ++i)
+	{
+		chips[i].spi = &ports[i / 2];
+		chips[i].fasync = i % 2;
+		memset(chips[i].atrvec, i, sizeof(chips[i].atrvec));
+	}
+	
+	for (b = 0; b < 3; ++b)
+	{
+		spi_clear_buf(&ports[b]);
+		spi_emit_break(&ports[b]);
+		for (i = b * 2; i < b * 2 + 2; ++i)
+		{
+			spi_emit_fasync(&ports[b], chips[i].fasync - ((i % 2) ? chips[i - 1].fasync : 0));
+			rxp[i] = spi_emit_data(&ports[b], 0x3000, &chips[i].atrvec[0], 19 * 4);
+		}
+		bufsz[b] = spi_getbufsz(&ports[b]);
+		
+		// Recorded response: each chip reads back its own index
+		memset(rx[b], 0xff, sizeof(rx[b]));
+		for (i = b * 2; i < b * 2 + 2; ++i)
+			memset(&rx[b][(char *)rxp[i] - ports[b].spibuf_rx], i, 0x11 * 4);
+		responses[b] = (struct spi_mock_response){
+			.rx = rx[b],
+			.rxsz = bufsz[b],
+		};
+		mocks[b] = (struct spi_mock){
+			.responses = &responses[b],
+			.responses_count = 1,
+		};
+		ports[b].txrx = spi_mock_txrx;
+		ports[b].userp = &mocks[b];
+	}
+	
+	// One bus transfers while another's results are looked at, in order
+	async = spi_txrx_async_new();
+	spi_txrx_async_start(async, &ports[0]);
+	for (b = 0; b < 3; ++b)
+	{
+		if (!spi_txrx_async_wait(async))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "bitfury_spi_sched", "txrx");
+		}
+		if (b < 2)
+			spi_txrx_async_start(async, &ports[b + 1]);
+		for (i = b * 2; i < b * 2 + 2; ++i)
+			if (rxp[i][0] != (uint32_t)0x01010101 * i || rxp[i][0x10] != rxp[i][0])
+			{
+				++unittest_failures;
+				applog(LOG_WARNING, "%s test failed: %s %d", "bitfury_spi_sched", "readback", i);
+			}
+	}
+	spi_txrx_async_free(async);
+	for (b = 0; b < 3; ++b)
+		if (mocks[b].txrx_count != 1 || mocks[b].tx_bytes != bufsz[b])
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "bitfury_spi_sched", "mock count");
+		}
+	
+	free(ports);
+}
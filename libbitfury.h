@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "dynclock.h"
 #include "lowl-spi.h"
 #include "miner.h"
 
@@ -20,17 +21,6 @@ struct bitfury_payload {
 	uint32_t nnonce;
 };
 
-struct freq_stat {
-	double *mh;
-	double *s;
-	int osc6_min;
-	int osc6_max;
-	double omh;
-	double os;
-	int best_osc;
-	int best_done;
-};
-
 struct bitfury_device {
 	struct spi_port *spi;
 	uint8_t osc6_bits;
@@ -42,10 +32,11 @@ struct bitfury_device {
 	int chipgen_probe;
 	uint32_t atrvec[20];
 	struct bitfury_payload payload;
-	struct freq_stat chip_stat;
+	// osc6_bits tuning, if funcs is set
+	struct dclk_chip dclk;
 	struct timeval timer1;
 	struct timeval tv_stat;
-	uint32_t counter1, counter2;
+	uint32_t counter1;
 	double mhz;
 	int mhz_last;
 	int mhz_best;
@@ -56,6 +47,8 @@ struct bitfury_device {
 	int desync_counter;
 	int sample_hwe;
 	int sample_tot;
+	// Only used on the first chip of a device with more than one SPI bus
+	struct spi_txrx_async *txrx_async;
 };
 
 extern void work_to_bitfury_payload(struct bitfury_payload *, struct work *);
@@ -67,4 +60,6 @@ extern int libbitfury_detectChips1(struct spi_port *);
 extern uint32_t bitfury_decnonce(uint32_t);
 extern bool bitfury_fudge_nonce(const void *midstate, const uint32_t m7, const uint32_t ntime, const uint32_t nbits, uint32_t *nonce_p);
 
+extern void test_bitfury_spi_sched(void);
+
 #endif /* __LIBBITFURY_H__ */
@@ -12,11 +12,24 @@
 #include "config.h"
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifndef WIN32
+#include <sys/uio.h>
+#endif
+
+#include <pthread.h>
+#include <utlist.h>
+
 #include "compat.h"
 #include "logging.h"
 #include "miner.h"
+#include "util.h"
 
 bool opt_debug = false;
 bool opt_debug_console = false;  // Only used if opt_debug is also enabled
@@ -41,6 +54,518 @@ static void _my_log_curses(int prio, const char *datetime, const char *str)
 	}
 }
 
+static
+bool _applog_writetocon(const int prio)
+{
+	return (opt_debug_console || (opt_log_output && prio != LOG_DEBUG) || prio <= LOG_NOTICE)
+	    && !(opt_quiet && prio != LOG_ERR);
+}
+
+static
+void _applog_datestamp(char * const datetime, const size_t datetimesz, const struct timeval * const tvp)
+{
+	struct tm tm;
+	
+	localtime_r(&tvp->tv_sec, &tm);
+	snprintf(datetime, datetimesz, "[%d-%02d-%02d %02d:%02d:%02d.%06ld]",
+		tm.tm_year + 1900,
+		tm.tm_mon + 1,
+		tm.tm_mday,
+		tm.tm_hour,
+		tm.tm_min,
+		tm.tm_sec,
+		(long)tvp->tv_usec);
+}
+
+static
+void _applog_sync(int prio, const char *str)
+{
+	bool writetocon = _applog_writetocon(prio);
+	bool writetofile = !isatty(fileno((FILE *)stderr));
+	if (!(writetocon || writetofile))
+		return;
+
+	char datetime[64];
+
+	if (opt_log_microseconds)
+	{
+		struct timeval tv;
+		
+		bfg_gettimeofday(&tv);
+		_applog_datestamp(datetime, sizeof(datetime), &tv);
+	}
+	else
+		get_now_datestamp(datetime, sizeof(datetime));
+
+	bfg_console_lock();
+	
+	/* Only output to stderr if it's not going to the screen as well */
+	if (writetofile) {
+		fprintf(stderr, " %s %s\n", datetime, str);	/* atomic write to stderr */
+		fflush(stderr);
+	}
+
+	if (writetocon)
+		_my_log_curses(prio, datetime, str);
+	
+	bfg_console_unlock();
+}
+
+/* Asynchronous logging: each thread formats its messages straight into a ring
+ * of its own, which only that thread writes and only the logging thread
+ * reads, so logging never waits on the console or stderr. The logging thread
+ * merges the rings back into order and writes them out in batches. If a ring
+ * is full, the message is dropped and counted instead of stalling the caller.
+ * Errors are still waited for, so they are out before a possible exit. */
+
+#define LOGRING_SIZE   0x10000
+#define LOGRING_ALIGN  8
+#define LOGRING_WRAP   UINT32_MAX
+#define LOG_BATCH      0x40
+
+struct logrec {
+	// Length of str (excluding null), or LOGRING_WRAP to continue at the start
+	uint32_t len;
+	int prio;
+	unsigned long seq;
+	struct timeval tv;
+	char str[];
+};
+
+struct logring {
+	uint8_t *buf;
+	// Only written by the owning thread
+	volatile size_t head;
+	// Only written by the logging thread
+	volatile size_t tail;
+	// Logging thread's read position within the current batch
+	size_t rd;
+	// Owning thread has exited; free once empty
+	volatile bool orphaned;
+	
+	struct logring *next;
+};
+
+volatile unsigned long log_dropped;
+
+static pthread_key_t key_logring;
+static pthread_mutex_t logrings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct logring *logrings;
+static pthread_t logging_pth;
+static notifier_t logging_notifier;
+static volatile bool logging_async, logging_stopping, logging_idle;
+static volatile bool logging_writetofile;
+static volatile unsigned long logging_seq;
+
+static
+void logring_orphan(void * const p)
+{
+	struct logring * const ring = p;
+	ring->orphaned = true;
+}
+
+static
+struct logring *logring_get()
+{
+	struct logring *ring = pthread_getspecific(key_logring);
+	if (likely(ring))
+		return ring;
+	
+	ring = malloc(sizeof(*ring));
+	if (unlikely(!ring))
+		return NULL;
+	*ring = (struct logring){
+		.buf = malloc(LOGRING_SIZE),
+	};
+	if (unlikely(!ring->buf))
+	{
+		free(ring);
+		return NULL;
+	}
+	mutex_lock(&logrings_lock);
+	LL_PREPEND(logrings, ring);
+	mutex_unlock(&logrings_lock);
+	pthread_setspecific(key_logring, ring);
+	return ring;
+}
+
+// Returns the ring position following the new record, or 0 if it was dropped
+static
+size_t logring_vprintf(struct logring * const ring, const int prio, const char * const fmt, va_list ap)
+{
+	const size_t hdrsz = sizeof(struct logrec);
+	size_t head = ring->head, pos = head % LOGRING_SIZE;
+	const size_t avail = LOGRING_SIZE - (head - ring->tail);
+	const size_t contig = LOGRING_SIZE - pos;
+	size_t space = (contig < avail) ? contig : avail;
+	struct logrec *rec;
+	int n;
+	
+	if (space < hdrsz + LOGBUFSIZ && avail - space > space)
+	{
+		// There is more room at the start of the ring
+		rec = (void*)&ring->buf[pos];
+		rec->len = LOGRING_WRAP;
+		head += contig;
+		pos = 0;
+		space = avail - contig;
+	}
+	if (space <= hdrsz)
+		goto drop;
+	space -= hdrsz;
+	
+	rec = (void*)&ring->buf[pos];
+	n = vsnprintf(rec->str, space, fmt, ap);
+	if (unlikely(n < 0))
+		goto drop;
+	if (n >= space && space < LOGBUFSIZ)
+		goto drop;
+	if (n >= LOGBUFSIZ)
+	{
+		// Truncate the same as a LOGBUFSIZ buffer would
+		n = LOGBUFSIZ - 1;
+		rec->str[n] = '\0';
+	}
+	rec->len = n;
+	rec->prio = prio;
+	bfg_gettimeofday(&rec->tv);
+	rec->seq = __sync_fetch_and_add(&logging_seq, 1);
+	head += (hdrsz + n + 1 + LOGRING_ALIGN - 1) & ~(size_t)(LOGRING_ALIGN - 1);
+	
+	__sync_synchronize();
+	ring->head = head;
+	if (logging_idle)
+		notifier_wake(logging_notifier);
+	return head;
+
+drop:
+	__sync_fetch_and_add(&log_dropped, 1);
+	return 0;
+}
+
+static
+struct logrec *logring_peek(struct logring * const ring)
+{
+	struct logrec *rec;
+	
+	while (ring->rd != ring->head)
+	{
+		__sync_synchronize();
+		rec = (void*)&ring->buf[ring->rd % LOGRING_SIZE];
+		if (rec->len != LOGRING_WRAP)
+			return rec;
+		ring->rd += LOGRING_SIZE - (ring->rd % LOGRING_SIZE);
+	}
+	return NULL;
+}
+
+static
+void logring_skip(struct logring * const ring, const struct logrec * const rec)
+{
+	ring->rd += (sizeof(*rec) + rec->len + 1 + LOGRING_ALIGN - 1) & ~(size_t)(LOGRING_ALIGN - 1);
+}
+
+// Formats the time for the logging thread, redoing the date only once a second
+static
+size_t logging_datestamp(char * const buf, const size_t bufsz, const struct timeval * const tvp)
+{
+	static time_t cached_sec = -1;
+	static char cached[0x20];
+	static size_t cachedlen;
+	
+	if (tvp->tv_sec != cached_sec)
+	{
+		cached_sec = tvp->tv_sec;
+		get_datestamp(cached, sizeof(cached), cached_sec);
+		// Without the trailing ]
+		cachedlen = strlen(cached) - 1;
+	}
+	memcpy(buf, cached, cachedlen);
+	if (opt_log_microseconds)
+		return cachedlen + snprintf(&buf[cachedlen], bufsz - cachedlen, ".%06ld]", (long)tvp->tv_usec);
+	buf[cachedlen] = ']';
+	buf[cachedlen + 1] = '\0';
+	return cachedlen + 1;
+}
+
+static
+void logging_write_file(const struct iovec * const iov, const int iovcnt)
+{
+#ifndef WIN32
+	IGNORE_RETURN_VALUE(writev(fileno((FILE *)stderr), iov, iovcnt));
+#else
+	for (int i = 0; i < iovcnt; ++i)
+		fwrite(iov[i].iov_base, 1, iov[i].iov_len, stderr);
+	fflush(stderr);
+#endif
+}
+
+// Writes out one batch of records in order; returns false if there were none
+static
+bool logging_write_batch()
+{
+	static unsigned long dropped_reported;
+	struct logrec *recs[LOG_BATCH], *rec;
+	char stamps[LOG_BATCH][0x30];
+	struct iovec iov[LOG_BATCH * 5];
+	struct logring *ring, *minring, *tmp;
+	const bool writetofile = !isatty(fileno((FILE *)stderr));
+	int count = 0, iovcnt = 0, i;
+	unsigned long dropped;
+	
+	logging_writetofile = writetofile;
+	
+	mutex_lock(&logrings_lock);
+	LL_FOREACH(logrings, ring)
+		ring->rd = ring->tail;
+	while (count < LOG_BATCH)
+	{
+		minring = NULL;
+		LL_FOREACH(logrings, ring)
+		{
+			rec = logring_peek(ring);
+			if (rec && !(minring && (long)(rec->seq - recs[count]->seq) > 0))
+			{
+				minring = ring;
+				recs[count] = rec;
+			}
+		}
+		if (!minring)
+			break;
+		logring_skip(minring, recs[count]);
+		++count;
+	}
+	mutex_unlock(&logrings_lock);
+	
+	dropped = log_dropped;
+	if (!count && dropped == dropped_reported)
+		return false;
+	
+	for (i = 0; i < count; ++i)
+	{
+		rec = recs[i];
+		logging_datestamp(stamps[i], sizeof(stamps[i]), &rec->tv);
+		if (!writetofile)
+			continue;
+		iov[iovcnt++] = (struct iovec){ .iov_base = " ", .iov_len = 1 };
+		iov[iovcnt++] = (struct iovec){ .iov_base = stamps[i], .iov_len = strlen(stamps[i]) };
+		iov[iovcnt++] = (struct iovec){ .iov_base = " ", .iov_len = 1 };
+		iov[iovcnt++] = (struct iovec){ .iov_base = rec->str, .iov_len = rec->len };
+		iov[iovcnt++] = (struct iovec){ .iov_base = "\n", .iov_len = 1 };
+	}
+	
+	bfg_console_lock();
+	if (iovcnt)
+		logging_write_file(iov, iovcnt);
+	for (i = 0; i < count; ++i)
+		if (_applog_writetocon(recs[i]->prio))
+			_my_log_curses(recs[i]->prio, stamps[i], recs[i]->str);
+	bfg_console_unlock();
+	
+	// Only now can the threads reuse the space
+	mutex_lock(&logrings_lock);
+	LL_FOREACH_SAFE(logrings, ring, tmp)
+	{
+		ring->tail = ring->rd;
+		if (ring->orphaned && ring->tail == ring->head)
+		{
+			LL_DELETE(logrings, ring);
+			free(ring->buf);
+			free(ring);
+		}
+	}
+	mutex_unlock(&logrings_lock);
+	
+	if (dropped != dropped_reported)
+	{
+		char buf[0x40];
+		snprintf(buf, sizeof(buf), "Logging dropped %lu messages", dropped - dropped_reported);
+		dropped_reported = dropped;
+		_applog_sync(LOG_WARNING, buf);
+	}
+	
+	return true;
+}
+
+static
+void *logging_thread(__maybe_unused void * const userp)
+{
+	struct timeval tv_timeout;
+	
+	RenameThread("logging");
+	
+	while (true)
+	{
+		if (logging_write_batch())
+			continue;
+		if (logging_stopping)
+			break;
+		logging_idle = true;
+		__sync_synchronize();
+		if (!logging_write_batch())
+		{
+			timer_set_delay_from_now(&tv_timeout, 100000);
+			if (notifier_wait(logging_notifier, &tv_timeout))
+				notifier_read(logging_notifier);
+		}
+		logging_idle = false;
+	}
+	
+	return NULL;
+}
+
+void logging_async_start()
+{
+	static bool initialised;
+	
+	if (logging_async)
+		return;
+	if (!initialised)
+	{
+		if (pthread_key_create(&key_logring, logring_orphan))
+			quithere(1, "pthread_key_create failed");
+		notifier_init(logging_notifier);
+		initialised = true;
+	}
+	logging_writetofile = !isatty(fileno((FILE *)stderr));
+	logging_stopping = false;
+	if (unlikely(pthread_create(&logging_pth, NULL, logging_thread, NULL)))
+		applog(LOG_WARNING, "Failed to start logging thread, logging synchronously");
+	else
+		logging_async = true;
+}
+
+// Writes out everything queued, then goes back to logging synchronously
+void logging_async_stop()
+{
+	if (!logging_async || pthread_equal(pthread_self(), logging_pth))
+		return;
+	logging_stopping = true;
+	notifier_wake(logging_notifier);
+	pthread_join(logging_pth, NULL);
+	logging_async = false;
+}
+
+static
+void _applog_async(const int prio, const char * const fmt, va_list ap)
+{
+	struct logring * const ring = logring_get();
+	struct timeval tv_timeout, tv_now;
+	size_t end;
+	
+	if (unlikely(!ring))
+	{
+		__sync_fetch_and_add(&log_dropped, 1);
+		return;
+	}
+	end = logring_vprintf(ring, prio, fmt, ap);
+	if (end && prio <= LOG_ERR)
+	{
+		// Errors often precede an exit, so make sure this one is out
+		notifier_wake(logging_notifier);
+		timer_set_delay_from_now(&tv_timeout, 1000000);
+		while ((long)(end - ring->tail) > 0 && logging_async)
+		{
+			timer_set_now(&tv_now);
+			if (timercmp(&tv_now, &tv_timeout, >))
+				break;
+			cgsleep_ms(1);
+		}
+	}
+}
+
+static
+bool _applog_use_async(const int prio)
+{
+	if (!logging_async || pthread_equal(pthread_self(), logging_pth))
+		return false;
+	return logging_writetofile || _applog_writetocon(prio);
+}
+
+static
+size_t _test_logring_printf(struct logring * const ring, const char * const fmt, ...)
+{
+	va_list ap;
+	size_t rv;
+	
+	va_start(ap, fmt);
+	rv = logring_vprintf(ring, LOG_NOTICE, fmt, ap);
+	va_end(ap);
+	return rv;
+}
+
+static
+bool _test_logring_read(struct logring * const ring, const int expect)
+{
+	struct logrec * const rec = logring_peek(ring);
+	
+	if (!(rec && atoi(rec->str) == expect && rec->len == strlen(rec->str)))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: expected record %d, got %s", "logring", expect, rec ? rec->str : "none");
+		return false;
+	}
+	logring_skip(ring, rec);
+	return true;
+}
+
+void test_logring()
+{
+	struct logring ring = {
+		.buf = malloc(LOGRING_SIZE),
+	};
+	const unsigned long dropped = log_dropped;
+	char msg[0x200], bigmsg[LOGBUFSIZ * 2];
+	struct logrec *rec;
+	int filled, more, i;
+	
+	memset(msg, 'x', sizeof(msg) - 1);
+	msg[sizeof(msg) - 1] = '\0';
+	for (filled = 0; _test_logring_printf(&ring, "%d %s", filled, msg); ++filled)
+	{}
+	if (log_dropped != dropped + 1 || filled < 2)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %d fit, %lu dropped", "logring", filled, log_dropped - dropped);
+	}
+	
+	// Free the first half, so more must wrap around to the start
+	ring.rd = ring.tail;
+	for (i = 0; i < filled / 2; ++i)
+		if (!_test_logring_read(&ring, i))
+			break;
+	ring.tail = ring.rd;
+	for (more = 0; _test_logring_printf(&ring, "%d %s", filled + more, msg); ++more)
+	{}
+	if (more < filled / 4)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: only %d fit after wrapping", "logring", more);
+	}
+	for ( ; i < filled + more; ++i)
+		if (!_test_logring_read(&ring, i))
+			break;
+	if (logring_peek(&ring))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "logring", "extra records");
+	}
+	ring.tail = ring.rd;
+	
+	// Long messages are truncated as applog always did
+	memset(bigmsg, 'y', sizeof(bigmsg) - 1);
+	bigmsg[sizeof(bigmsg) - 1] = '\0';
+	_test_logring_printf(&ring, "%s", bigmsg);
+	rec = logring_peek(&ring);
+	if (!(rec && rec->len == LOGBUFSIZ - 1 && strlen(rec->str) == LOGBUFSIZ - 1))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "logring", "long message not truncated");
+	}
+	
+	free(ring.buf);
+}
+
 /* high-level logging function, based on global opt_log_level */
 
 /*
@@ -55,50 +580,32 @@ void _applog(int prio, const char *str)
 #else
 	if (0) {}
 #endif
-	else {
-		bool writetocon =
-			(opt_debug_console || (opt_log_output && prio != LOG_DEBUG) || prio <= LOG_NOTICE)
-		 && !(opt_quiet && prio != LOG_ERR);
-		bool writetofile = !isatty(fileno((FILE *)stderr));
-		if (!(writetocon || writetofile))
-			return;
-
-		char datetime[64];
-
-		if (opt_log_microseconds)
-		{
-			struct timeval tv;
-			struct tm tm;
-			
-			bfg_gettimeofday(&tv);
-			localtime_r(&tv.tv_sec, &tm);
-			
-			snprintf(datetime, sizeof(datetime), "[%d-%02d-%02d %02d:%02d:%02d.%06ld]",
-				tm.tm_year + 1900,
-				tm.tm_mon + 1,
-				tm.tm_mday,
-				tm.tm_hour,
-				tm.tm_min,
-				tm.tm_sec,
-				(long)tv.tv_usec);
-		}
-		else
-			get_now_datestamp(datetime, sizeof(datetime));
-
-		if (writetofile || writetocon)
-		{
-			bfg_console_lock();
-			
-			/* Only output to stderr if it's not going to the screen as well */
-			if (writetofile) {
-				fprintf(stderr, " %s %s\n", datetime, str);	/* atomic write to stderr */
-				fflush(stderr);
-			}
+	else if (_applog_use_async(prio))
+		_applogf(prio, "%s", str);
+	else
+		_applog_sync(prio, str);
+}
 
-			if (writetocon)
-				_my_log_curses(prio, datetime, str);
-			
-			bfg_console_unlock();
-		}
+void _applogf(int prio, const char *fmt, ...)
+{
+	va_list ap;
+	
+#ifdef HAVE_SYSLOG_H
+	if (use_syslog) {
+		va_start(ap, fmt);
+		vsyslog(prio, fmt, ap);
+		va_end(ap);
+		return;
+	}
+#endif
+	va_start(ap, fmt);
+	if (_applog_use_async(prio))
+		_applog_async(prio, fmt, ap);
+	else
+	{
+		char tmp42[LOGBUFSIZ];
+		vsnprintf(tmp42, sizeof(tmp42), fmt, ap);
+		_applog_sync(prio, tmp42);
 	}
+	va_end(ap);
 }
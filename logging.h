@@ -51,14 +51,20 @@ extern int opt_log_level;
 #define LOGBUFSIZ 0x1000
 
 extern void _applog(int prio, const char *str);
+extern void _applogf(int prio, const char *fmt, ...) FORMAT_SYNTAX_CHECK(printf, 2, 3);
+
+// Messages dropped because a thread's log ring was full
+extern volatile unsigned long log_dropped;
+
+extern void logging_async_start();
+extern void logging_async_stop();
+extern void test_logring();
 
 #define IN_FMT_FFL " in %s %s():%d"
 
 #define applog(prio, fmt, ...) do { \
 	if (opt_debug || prio != LOG_DEBUG) { \
-			char tmp42[LOGBUFSIZ]; \
-			snprintf(tmp42, sizeof(tmp42), fmt, ##__VA_ARGS__); \
-			_applog(prio, tmp42); \
+			_applogf(prio, fmt, ##__VA_ARGS__); \
 	} \
 } while (0)
 
@@ -0,0 +1,490 @@
+/*
+ * Copyright 2026 MassGridMiner developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "logging.h"
+#include "lowl-capture.h"
+#include "miner.h"
+#include "util.h"
+
+/* A capture file is an 8 byte header followed by records of: a type byte, then
+ * the channel, the microseconds since the previous record and the data size as
+ * LEB128 varints, then the data. Each opening of a device gets a new channel,
+ * whose first record is an LCR_OPEN naming it. Replay loads the whole file, and
+ * hands each channel to the first opening of a device by the same name, in
+ * order, so probing and reopening see the same sequence they did live. */
+
+static const uint8_t lowl_capture_magic[8] = {'B', 'F', 'G', 'C', 'A', 'P', '\0', '\1'};
+
+// Largest encoding of a record, besides its data
+#define LOWL_CAPTURE_REC_HDRMAX  (1 + 5 + 10 + 10)
+
+enum lowl_capture_mode lowl_capture_mode;
+float lowl_replay_speed = 1;
+
+static pthread_mutex_t lowl_capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *lowl_capture_file;
+static struct timeval lowl_capture_tv_start;
+static uint64_t lowl_capture_prev_us;
+static unsigned lowl_capture_next_chan;
+
+static uint8_t *lowl_replay_buf;
+static struct lowl_replay_chan *lowl_replay_chans;
+static unsigned lowl_replay_chans_count;
+static unsigned lowl_replay_unfinished;
+
+static
+size_t lowl_capture_put_varint(uint8_t * const out, uint64_t v)
+{
+	size_t i = 0;
+	for ( ; v >= 0x80; v >>= 7)
+		out[i++] = (v & 0x7f) | 0x80;
+	out[i++] = v;
+	return i;
+}
+
+// Returns the bytes used, or 0 if the buffer ends first or it is too long
+static
+size_t lowl_capture_get_varint(uint64_t * const out, const uint8_t * const buf, const size_t bufsz)
+{
+	uint64_t v = 0;
+	for (size_t i = 0; i < bufsz && i < 10; ++i)
+	{
+		v |= (uint64_t)(buf[i] & 0x7f) << (7 * i);
+		if (!(buf[i] & 0x80))
+		{
+			*out = v;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+static
+size_t lowl_capture_put_hdr(uint8_t * const out, const struct lowl_capture_rec * const rec, const uint64_t prev_us)
+{
+	size_t pos = 0;
+	out[pos++] = rec->type;
+	pos += lowl_capture_put_varint(&out[pos], rec->chan);
+	pos += lowl_capture_put_varint(&out[pos], (rec->us > prev_us) ? (rec->us - prev_us) : 0);
+	pos += lowl_capture_put_varint(&out[pos], rec->sz);
+	return pos;
+}
+
+size_t lowl_capture_encode(uint8_t * const out, const struct lowl_capture_rec * const rec, const uint64_t prev_us)
+{
+	const size_t pos = lowl_capture_put_hdr(out, rec, prev_us);
+	if (rec->sz)
+		memcpy(&out[pos], rec->data, rec->sz);
+	return pos + rec->sz;
+}
+
+// Returns the bytes used, 0 if the buffer ends first, or -1 if it is invalid
+ssize_t lowl_capture_decode(struct lowl_capture_rec * const out, const uint8_t * const buf, const size_t bufsz, const uint64_t prev_us)
+{
+	uint64_t chan, delta, sz;
+	size_t pos = 1, n;
+	
+	if (!bufsz)
+		return 0;
+	if (buf[0] > LCR_CLOSE)
+		return -1;
+	if (!(n = lowl_capture_get_varint(&chan, &buf[pos], bufsz - pos)))
+		return 0;
+	pos += n;
+	if (!(n = lowl_capture_get_varint(&delta, &buf[pos], bufsz - pos)))
+		return 0;
+	pos += n;
+	if (!(n = lowl_capture_get_varint(&sz, &buf[pos], bufsz - pos)))
+		return 0;
+	pos += n;
+	if (chan > UINT_MAX)
+		return -1;
+	if (sz > bufsz - pos)
+		return 0;
+	*out = (struct lowl_capture_rec){
+		.type = buf[0],
+		.chan = chan,
+		.us = prev_us + delta,
+		.sz = sz,
+		.data = &buf[pos],
+	};
+	return pos + sz;
+}
+
+bool lowl_capture_start(FILE * const F)
+{
+	if (fwrite(lowl_capture_magic, sizeof(lowl_capture_magic), 1, F) != 1)
+		return false;
+	mutex_lock(&lowl_capture_mutex);
+	lowl_capture_file = F;
+	timer_set_now(&lowl_capture_tv_start);
+	lowl_capture_prev_us = 0;
+	lowl_capture_next_chan = 0;
+	mutex_unlock(&lowl_capture_mutex);
+	lowl_capture_mode = LCM_CAPTURE;
+	return true;
+}
+
+static
+void _lowl_capture_record(const unsigned chan, const enum lowl_capture_rectype type, const void * const data, const size_t sz)
+{
+	struct timeval tv_now;
+	uint8_t hdr[LOWL_CAPTURE_REC_HDRMAX];
+	struct lowl_capture_rec rec = {
+		.type = type,
+		.chan = chan,
+		.sz = sz,
+	};
+	size_t hdrsz;
+	
+	if (!lowl_capture_file)
+		return;
+	timer_set_now(&tv_now);
+	rec.us = timer_elapsed_us(&lowl_capture_tv_start, &tv_now);
+	// The data is written separately, so it is not copied
+	hdrsz = lowl_capture_put_hdr(hdr, &rec, lowl_capture_prev_us);
+	if (rec.us > lowl_capture_prev_us)
+		lowl_capture_prev_us = rec.us;
+	if (fwrite(hdr, hdrsz, 1, lowl_capture_file) != 1 || (sz && fwrite(data, sz, 1, lowl_capture_file) != 1))
+	{
+		applog(LOG_ERR, "Failed to write capture file, stopping capture");
+		lowl_capture_file = NULL;
+	}
+}
+
+unsigned lowl_capture_open_chan(const char * const name)
+{
+	unsigned chan;
+	
+	mutex_lock(&lowl_capture_mutex);
+	chan = lowl_capture_next_chan++;
+	_lowl_capture_record(chan, LCR_OPEN, name, strlen(name));
+	mutex_unlock(&lowl_capture_mutex);
+	return chan;
+}
+
+void lowl_capture_record(const unsigned chan, const enum lowl_capture_rectype type, const void * const data, const size_t sz)
+{
+	mutex_lock(&lowl_capture_mutex);
+	_lowl_capture_record(chan, type, data, sz);
+	mutex_unlock(&lowl_capture_mutex);
+}
+
+void lowl_capture_stop(void)
+{
+	lowl_capture_mode = LCM_OFF;
+	mutex_lock(&lowl_capture_mutex);
+	if (lowl_capture_file)
+		fflush(lowl_capture_file);
+	lowl_capture_file = NULL;
+	mutex_unlock(&lowl_capture_mutex);
+}
+
+bool lowl_replay_load(FILE * const F)
+{
+	struct lowl_capture_rec *recs = NULL, rec;
+	unsigned recs_count = 0, recs_alloc = 0, max_chan = 0;
+	size_t bufsz = 0, bufalloc = 0x10000, pos;
+	uint64_t prev_us = 0;
+	ssize_t r;
+	size_t n;
+	
+	lowl_replay_unload();
+	lowl_replay_buf = malloc(bufalloc);
+	if (unlikely(!lowl_replay_buf))
+		quithere(1, "OOM replay buffer");
+	while ((n = fread(&lowl_replay_buf[bufsz], 1, bufalloc - bufsz, F)) > 0)
+	{
+		bufsz += n;
+		if (bufsz == bufalloc)
+		{
+			bufalloc *= 2;
+			lowl_replay_buf = realloc(lowl_replay_buf, bufalloc);
+			if (unlikely(!lowl_replay_buf))
+				quithere(1, "OOM replay buffer");
+		}
+	}
+	if (bufsz < sizeof(lowl_capture_magic) || memcmp(lowl_replay_buf, lowl_capture_magic, sizeof(lowl_capture_magic)))
+		applogr(false, LOG_ERR, "Replay file is not a capture");
+	
+	for (pos = sizeof(lowl_capture_magic); pos < bufsz; pos += r)
+	{
+		r = lowl_capture_decode(&rec, &lowl_replay_buf[pos], bufsz - pos, prev_us);
+		if (r <= 0)
+		{
+			// A capture cut short by a crash is still usable up to there
+			applog(LOG_WARNING, "Replay file %s at byte %lu, ignoring the rest", r ? "invalid" : "truncated", (unsigned long)pos);
+			break;
+		}
+		prev_us = rec.us;
+		if (recs_count == recs_alloc)
+		{
+			recs_alloc = recs_alloc ? (recs_alloc * 2) : 0x100;
+			recs = realloc(recs, sizeof(*recs) * recs_alloc);
+			if (unlikely(!recs))
+				quithere(1, "OOM replay records");
+		}
+		recs[recs_count++] = rec;
+		if (rec.chan > max_chan)
+			max_chan = rec.chan;
+	}
+	
+	if (recs_count)
+	{
+		lowl_replay_chans_count = max_chan + 1;
+		lowl_replay_chans = calloc(lowl_replay_chans_count, sizeof(*lowl_replay_chans));
+		if (unlikely(!lowl_replay_chans))
+			quithere(1, "OOM replay channels");
+		for (unsigned i = 0; i < recs_count; ++i)
+			++lowl_replay_chans[recs[i].chan].count;
+		for (unsigned i = 0; i < lowl_replay_chans_count; ++i)
+		{
+			struct lowl_replay_chan * const chan = &lowl_replay_chans[i];
+			chan->recs = malloc(sizeof(*chan->recs) * (chan->count ?: 1));
+			if (unlikely(!chan->recs))
+				quithere(1, "OOM replay channels");
+			chan->count = 0;
+		}
+		for (unsigned i = 0; i < recs_count; ++i)
+		{
+			struct lowl_replay_chan * const chan = &lowl_replay_chans[recs[i].chan];
+			if (!chan->count && recs[i].type != LCR_OPEN)
+				continue;
+			if (!chan->count)
+				chan->name = strndup((const char *)recs[i].data, recs[i].sz);
+			chan->recs[chan->count++] = recs[i];
+		}
+		// Channels never opened cannot be claimed, so do not wait on them
+		for (unsigned i = 0; i < lowl_replay_chans_count; ++i)
+			if (lowl_replay_chans[i].count)
+				++lowl_replay_unfinished;
+			else
+				lowl_replay_chans[i].finished = true;
+	}
+	free(recs);
+	
+	applog(LOG_DEBUG, "Loaded %u records on %u channels to replay", recs_count, lowl_replay_unfinished);
+	lowl_capture_mode = LCM_REPLAY;
+	return true;
+}
+
+void lowl_replay_unload(void)
+{
+	if (lowl_capture_mode == LCM_REPLAY)
+		lowl_capture_mode = LCM_OFF;
+	for (unsigned i = 0; i < lowl_replay_chans_count; ++i)
+	{
+		free((void*)lowl_replay_chans[i].name);
+		free(lowl_replay_chans[i].recs);
+	}
+	free(lowl_replay_chans);
+	lowl_replay_chans = NULL;
+	lowl_replay_chans_count = lowl_replay_unfinished = 0;
+	free(lowl_replay_buf);
+	lowl_replay_buf = NULL;
+}
+
+bool lowl_replay_claim(struct lowl_replay_cursor * const cur, const char * const name)
+{
+	struct lowl_replay_chan *chan = NULL;
+	
+	mutex_lock(&lowl_capture_mutex);
+	for (unsigned i = 0; i < lowl_replay_chans_count; ++i)
+		if (lowl_replay_chans[i].name && !lowl_replay_chans[i].claimed && !strcmp(lowl_replay_chans[i].name, name))
+		{
+			chan = &lowl_replay_chans[i];
+			chan->claimed = true;
+			break;
+		}
+	mutex_unlock(&lowl_capture_mutex);
+	if (!chan)
+		return false;
+	*cur = (struct lowl_replay_cursor){
+		.chan = chan,
+		.next = 1,
+		.prev_us = chan->recs[0].us,
+	};
+	timer_set_now(&cur->tv_prev);
+	return true;
+}
+
+const struct lowl_capture_rec *lowl_replay_next(struct lowl_replay_cursor * const cur)
+{
+	if (cur->next >= cur->chan->count)
+		return NULL;
+	return &cur->chan->recs[cur->next++];
+}
+
+// How much longer to wait before the record, to keep the capture's pace
+int64_t lowl_replay_delay_us(const struct lowl_replay_cursor * const cur, const struct lowl_capture_rec * const rec)
+{
+	struct timeval tv_now;
+	
+	if (lowl_replay_speed <= 0 || rec->us <= cur->prev_us)
+		return 0;
+	timer_set_now(&tv_now);
+	const int64_t delay = (int64_t)((rec->us - cur->prev_us) / lowl_replay_speed) - timer_elapsed_us(&cur->tv_prev, &tv_now);
+	return (delay > 0) ? delay : 0;
+}
+
+void lowl_replay_done(struct lowl_replay_cursor * const cur, const struct lowl_capture_rec * const rec)
+{
+	cur->prev_us = rec->us;
+	timer_set_now(&cur->tv_prev);
+}
+
+void lowl_replay_check_host(struct lowl_replay_cursor * const cur, const struct lowl_capture_rec * const rec, const void * const data, const size_t sz)
+{
+	if (sz == rec->sz && !memcmp(data, rec->data, sz))
+		return;
+	++cur->divergences;
+	applog(LOG_DEBUG, "%s: Replay diverged at record %u (sent %lu bytes, captured %lu)",
+	       cur->chan->name, cur->next - 1, (unsigned long)sz, (unsigned long)rec->sz);
+}
+
+void lowl_replay_finish(struct lowl_replay_cursor * const cur)
+{
+	bool all;
+	
+	if (cur->divergences)
+		applog(LOG_WARNING, "%s: Driver sent %lu transfers differing from the capture",
+		       cur->chan->name, cur->divergences);
+	mutex_lock(&lowl_capture_mutex);
+	if (cur->chan->finished)
+		all = false;
+	else
+	{
+		cur->chan->finished = true;
+		all = !--lowl_replay_unfinished;
+	}
+	mutex_unlock(&lowl_capture_mutex);
+	if (all)
+		applog(LOG_DEBUG, "Replay finished");
+}
+
+void test_lowl_capture(void)
+{
+	static const uint64_t varint_tests[] = {0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 1000000, UINT32_MAX, UINT64_MAX};
+	uint8_t buf[0x40];
+	struct lowl_capture_rec rec, out;
+	struct lowl_replay_cursor cur, cur2;
+	const struct lowl_capture_rec *r;
+	uint64_t v;
+	FILE *F;
+	
+	for (unsigned i = 0; i < sizeof(varint_tests) / sizeof(*varint_tests); ++i)
+	{
+		const size_t n = lowl_capture_put_varint(buf, varint_tests[i]);
+		if (lowl_capture_get_varint(&v, buf, n) != n || v != varint_tests[i] || lowl_capture_get_varint(&v, buf, n - 1))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s %llu", "lowl_capture", "varint", (unsigned long long)varint_tests[i]);
+		}
+	}
+	
+	rec = (struct lowl_capture_rec){
+		.type = LCR_DEV,
+		.chan = 300,
+		.us = 1234567,
+		.sz = 4,
+		.data = (const uint8_t *)"\x00\x01\x87\xa2",
+	};
+	const size_t n = lowl_capture_encode(buf, &rec, 1000);
+	if (lowl_capture_decode(&out, buf, n, 1000) != n || out.type != rec.type || out.chan != rec.chan || out.us != rec.us || out.sz != rec.sz || memcmp(out.data, rec.data, rec.sz)
+	 || lowl_capture_decode(&out, buf, n - 1, 1000))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "lowl_capture", "record round trip");
+	}
+	
+	F = tmpfile();
+	if (!F)
+	{
+		applog(LOG_WARNING, "%s test skipped: %s", "lowl_capture", "no temporary file");
+		return;
+	}
+	
+	// Two openings of one device, the second reading back what the first wrote
+	lowl_capture_start(F);
+	const unsigned c1 = lowl_capture_open_chan("/dev/test");
+	lowl_capture_record(c1, LCR_HOST, "ping", 4);
+	const unsigned c2 = lowl_capture_open_chan("/dev/test");
+	lowl_capture_record(c1, LCR_DEV, "pong", 4);
+	lowl_capture_record(c1, LCR_CLOSE, NULL, 0);
+	lowl_capture_record(c2, LCR_ERR, NULL, 0);
+	lowl_capture_stop();
+	
+	rewind(F);
+	if (!lowl_replay_load(F))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "lowl_capture", "load");
+		fclose(F);
+		return;
+	}
+	fclose(F);
+	if (!(lowl_replay_claim(&cur, "/dev/test") && lowl_replay_claim(&cur2, "/dev/test")) || lowl_replay_claim(&cur2, "/dev/test") || lowl_replay_claim(&cur2, "/dev/other"))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "lowl_capture", "claim");
+	}
+	else
+	{
+		lowl_replay_speed = 0;
+		if (!((r = lowl_replay_next(&cur)) && r->type == LCR_HOST && lowl_replay_delay_us(&cur, r) == 0))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "lowl_capture", "first channel");
+		}
+		else
+		{
+			lowl_replay_check_host(&cur, r, "ping", 4);
+			lowl_replay_check_host(&cur, r, "pin", 3);
+			lowl_replay_done(&cur, r);
+		}
+		if (!((r = lowl_replay_next(&cur)) && r->type == LCR_DEV && r->sz == 4 && !memcmp(r->data, "pong", 4)
+		   && (r = lowl_replay_next(&cur)) && r->type == LCR_CLOSE && !lowl_replay_next(&cur)
+		   && cur.divergences == 1))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "lowl_capture", "first channel");
+		}
+		if (!((r = lowl_replay_next(&cur2)) && r->type == LCR_ERR && !lowl_replay_next(&cur2)))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "lowl_capture", "second channel");
+		}
+		
+		// At full speed, a record waits as long after the last as it did live
+		rec = (struct lowl_capture_rec){ .us = cur.prev_us + 1000000 };
+		lowl_replay_speed = 1;
+		v = lowl_replay_delay_us(&cur, &rec);
+		lowl_replay_speed = 4;
+		if (v < 900000 || v > 1000000 || lowl_replay_delay_us(&cur, &rec) > 250000)
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "lowl_capture", "pacing");
+		}
+		lowl_replay_speed = 1;
+	}
+	lowl_replay_unload();
+}
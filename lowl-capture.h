@@ -0,0 +1,78 @@
+#ifndef BFG_LOWL_CAPTURE_H
+#define BFG_LOWL_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+enum lowl_capture_mode {
+	LCM_OFF,
+	LCM_CAPTURE,
+	LCM_REPLAY,
+};
+
+enum lowl_capture_rectype {
+	// Data is the device path or port name the channel was opened as
+	LCR_OPEN,
+	// Sent to the device
+	LCR_HOST,
+	// Received from the device
+	LCR_DEV,
+	// The transfer failed
+	LCR_ERR,
+	LCR_CLOSE,
+};
+
+struct lowl_capture_rec {
+	enum lowl_capture_rectype type;
+	unsigned chan;
+	// Since the capture started
+	uint64_t us;
+	size_t sz;
+	const uint8_t *data;
+};
+
+// Every record of one opening of a device, in order, starting with its LCR_OPEN
+struct lowl_replay_chan {
+	const char *name;
+	struct lowl_capture_rec *recs;
+	unsigned count;
+	bool claimed;
+	bool finished;
+};
+
+struct lowl_replay_cursor {
+	struct lowl_replay_chan *chan;
+	unsigned next;
+	uint64_t prev_us;
+	struct timeval tv_prev;
+	unsigned long divergences;
+};
+
+extern enum lowl_capture_mode lowl_capture_mode;
+// 0 replays as fast as the driver takes it
+extern float lowl_replay_speed;
+
+extern size_t lowl_capture_encode(uint8_t *out, const struct lowl_capture_rec *, uint64_t prev_us);
+extern ssize_t lowl_capture_decode(struct lowl_capture_rec *out, const uint8_t *buf, size_t bufsz, uint64_t prev_us);
+
+extern bool lowl_capture_start(FILE *);
+extern unsigned lowl_capture_open_chan(const char *name);
+extern void lowl_capture_record(unsigned chan, enum lowl_capture_rectype, const void *, size_t);
+extern void lowl_capture_stop(void);
+
+extern bool lowl_replay_load(FILE *);
+extern bool lowl_replay_claim(struct lowl_replay_cursor *, const char *name);
+extern const struct lowl_capture_rec *lowl_replay_next(struct lowl_replay_cursor *);
+extern int64_t lowl_replay_delay_us(const struct lowl_replay_cursor *, const struct lowl_capture_rec *);
+extern void lowl_replay_done(struct lowl_replay_cursor *, const struct lowl_capture_rec *);
+extern void lowl_replay_check_host(struct lowl_replay_cursor *, const struct lowl_capture_rec *, const void *, size_t);
+extern void lowl_replay_finish(struct lowl_replay_cursor *);
+extern void lowl_replay_unload(void);
+
+extern void test_lowl_capture(void);
+
+#endif
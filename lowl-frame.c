@@ -0,0 +1,517 @@
+/*
+ * Copyright 2026 MassGridMiner developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "lowl-frame.h"
+#include "miner.h"
+#include "util.h"
+
+/* Incoming bytes are kept in one buffer of twice the largest frame, which is
+ * only compacted when the next frame might not fit after the data already
+ * there. Frames are therefore always contiguous, and are returned in place. */
+
+void lowl_framer_init(struct lowl_framer * const fr, const struct lowl_frame_desc * const desc)
+{
+	*fr = (struct lowl_framer){
+		.desc = desc,
+		.bufsz = (size_t)desc->maxsz * 2,
+	};
+	fr->buf = malloc(fr->bufsz);
+	if (unlikely(!fr->buf))
+		quithere(1, "OOM framer buffer");
+}
+
+void lowl_framer_free(struct lowl_framer * const fr)
+{
+	free(fr->buf);
+	fr->buf = NULL;
+}
+
+void lowl_framer_reset(struct lowl_framer * const fr)
+{
+	fr->head = fr->len = 0;
+}
+
+static
+void lowl_framer_skip(struct lowl_framer * const fr, const size_t n)
+{
+	fr->head += n;
+	fr->len -= n;
+	fr->discarded += n;
+	if (!fr->len)
+		fr->head = 0;
+}
+
+static
+size_t lowl_frame_size(const struct lowl_frame_desc * const desc, const uint8_t * const hdr)
+{
+	size_t v = 0;
+	
+	if (!desc->len_size)
+		return desc->hdrsz;
+	for (int i = 0; i < desc->len_size; ++i)
+		v = (v << 8) | hdr[desc->len_offset + (desc->len_be ? i : (desc->len_size - 1 - i))];
+	return desc->len_add + v * desc->len_mult;
+}
+
+static
+size_t lowl_frame_check_width(const struct lowl_frame_desc * const desc)
+{
+	switch (desc->check)
+	{
+		case LFC_NONE:
+			return 0;
+		case LFC_CRC16:
+			return 2;
+		default:
+			return 1;
+	}
+}
+
+// Position of the check field, or -1 if it does not fit in the frame
+static
+long lowl_frame_check_pos(const struct lowl_frame_desc * const desc, const size_t framesz)
+{
+	const long pos = (desc->check_offset >= 0) ? desc->check_offset : ((long)framesz + desc->check_offset);
+	if (pos < desc->check_start || pos + lowl_frame_check_width(desc) > framesz)
+		return -1;
+	return pos;
+}
+
+// Only reads the frame up to the end of its check field
+static
+bool lowl_frame_check_ok(const struct lowl_frame_desc * const desc, const uint8_t * const frame, const long pos)
+{
+	const uint8_t * const p = &frame[desc->check_start];
+	const size_t n = pos - desc->check_start;
+	
+	switch (desc->check)
+	{
+		case LFC_NONE:
+			return true;
+		case LFC_CRC5USB:
+			if (n > 31)
+				return false;
+			return (frame[pos] & 0x1f) == crc5usb((unsigned char *)p, (n * 8) + 3);
+		case LFC_CRC8CCITT:
+			return frame[pos] == crc8ccitt(p, n);
+		case LFC_CRC16:
+			return upk_u16be(frame, pos) == crc16(p, n, desc->crc16_init);
+	}
+	return false;
+}
+
+bool lowl_frame_valid(const struct lowl_frame_desc * const desc, const uint8_t * const frame, const size_t framesz)
+{
+	if (framesz < desc->hdrsz || framesz > desc->maxsz)
+		return false;
+	if (desc->magicsz && memcmp(frame, desc->magic, desc->magicsz))
+		return false;
+	if (lowl_frame_size(desc, frame) != framesz)
+		return false;
+	if (desc->check != LFC_NONE)
+	{
+		const long pos = lowl_frame_check_pos(desc, framesz);
+		if (pos < 0 || !lowl_frame_check_ok(desc, frame, pos))
+			return false;
+	}
+	if (desc->check_f && !desc->check_f(desc, frame, framesz))
+		return false;
+	return true;
+}
+
+// How many bytes to read so as not to go past the next frame
+size_t lowl_framer_want(const struct lowl_framer * const fr)
+{
+	const struct lowl_frame_desc * const desc = fr->desc;
+	size_t sz;
+	
+	if (fr->len < desc->hdrsz)
+		return desc->hdrsz - fr->len;
+	sz = lowl_frame_size(desc, &fr->buf[fr->head]);
+	if (sz > fr->len && sz <= desc->maxsz)
+		return sz - fr->len;
+	return 1;
+}
+
+// Room to read into directly, which always fits the rest of the next frame
+uint8_t *lowl_framer_space(struct lowl_framer * const fr, size_t * const out_space)
+{
+	if (fr->bufsz - (fr->head + fr->len) < fr->desc->maxsz && fr->head)
+	{
+		memmove(fr->buf, &fr->buf[fr->head], fr->len);
+		fr->head = 0;
+	}
+	*out_space = fr->bufsz - (fr->head + fr->len);
+	return &fr->buf[fr->head + fr->len];
+}
+
+void lowl_framer_commit(struct lowl_framer * const fr, const size_t n)
+{
+	fr->len += n;
+}
+
+// Returns how much was taken; the rest can be fed after reading frames out
+size_t lowl_framer_feed(struct lowl_framer * const fr, const void * const data, size_t datasz)
+{
+	size_t space;
+	uint8_t * const p = lowl_framer_space(fr, &space);
+	
+	if (datasz > space)
+		datasz = space;
+	memcpy(p, data, datasz);
+	lowl_framer_commit(fr, datasz);
+	return datasz;
+}
+
+ssize_t lowl_framer_fill(struct lowl_framer * const fr, const lowl_frame_read_func_t read_func, void * const userp)
+{
+	const size_t want = lowl_framer_want(fr);
+	size_t space;
+	uint8_t * const p = lowl_framer_space(fr, &space);
+	const ssize_t r = read_func(userp, p, want);
+	
+	if (r > 0)
+		lowl_framer_commit(fr, r);
+	return r;
+}
+
+bool lowl_framer_next(struct lowl_framer * const fr, struct lowl_frame * const out)
+{
+	const struct lowl_frame_desc * const desc = fr->desc;
+	uint8_t *p;
+	size_t sz, i;
+	long checkpos;
+	
+	while (true)
+	{
+		p = &fr->buf[fr->head];
+		if (desc->magicsz)
+		{
+			// Skip to the first magic, or what could be the start of one
+			for (i = 0; i < fr->len; ++i)
+				if (!memcmp(&p[i], desc->magic, (fr->len - i < desc->magicsz) ? (fr->len - i) : desc->magicsz))
+					break;
+			if (i)
+			{
+				lowl_framer_skip(fr, i);
+				p = &fr->buf[fr->head];
+			}
+		}
+		if (fr->len < desc->hdrsz)
+			return false;
+		
+		sz = lowl_frame_size(desc, p);
+		if (sz < desc->hdrsz || sz > desc->maxsz)
+			goto bad;
+		checkpos = -1;
+		if (desc->check != LFC_NONE && (checkpos = lowl_frame_check_pos(desc, sz)) < 0)
+			goto bad;
+		if (fr->len < sz)
+		{
+			// Reject a bad header without waiting for the rest of its frame
+			if (checkpos >= 0 && checkpos + lowl_frame_check_width(desc) <= fr->len && !lowl_frame_check_ok(desc, p, checkpos))
+				goto bad;
+			return false;
+		}
+		if (!lowl_frame_valid(desc, p, sz))
+			goto bad;
+		
+		*out = (struct lowl_frame){
+			.data = p,
+			.sz = sz,
+		};
+		fr->head += sz;
+		fr->len -= sz;
+		if (!fr->len)
+			fr->head = 0;
+		return true;
+
+bad:
+		lowl_framer_skip(fr, 1);
+	}
+}
+
+static const struct lowl_frame_desc test_frame_descs[] = {
+	// Like HashFast: CRC-8 over the header only, with the length in 32-bit words
+	{
+		.name = "crc8",
+		.magic = "\xaa",
+		.magicsz = 1,
+		.hdrsz = 8,
+		.maxsz = 8 + (0xff * 4),
+		.len_offset = 6,
+		.len_size = 1,
+		.len_mult = 4,
+		.len_add = 8,
+		.check = LFC_CRC8CCITT,
+		.check_start = 1,
+		.check_offset = 7,
+	},
+	// Like LittleFury: CRC-16 trailer over the whole frame after its magic
+	{
+		.name = "crc16",
+		.magic = "AV",
+		.magicsz = 2,
+		.hdrsz = 5,
+		.maxsz = 5 + 0x40 + 2,
+		.len_offset = 3,
+		.len_size = 2,
+		.len_be = true,
+		.len_mult = 1,
+		.len_add = 5 + 2,
+		.check = LFC_CRC16,
+		.check_start = 2,
+		.check_offset = -2,
+		.crc16_init = 0xffff,
+	},
+	// Like Antminer: fixed size with no magic, and a CRC-5 in the last byte
+	{
+		.name = "crc5",
+		.hdrsz = 5,
+		.maxsz = 5,
+		.check = LFC_CRC5USB,
+		.check_offset = 4,
+	},
+};
+
+static
+uint32_t test_frame_rand(uint32_t * const state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (*state = x);
+}
+
+// A random byte which cannot be mistaken for (part of) the magic
+static
+uint8_t test_frame_rand_byte(const struct lowl_frame_desc * const desc, uint32_t * const state)
+{
+	uint8_t b;
+	do {
+		b = test_frame_rand(state);
+	} while (memchr(desc->magic ?: "", b, desc->magicsz));
+	return b;
+}
+
+static
+size_t test_frame_build(const struct lowl_frame_desc * const desc, uint8_t * const frame, uint32_t * const state)
+{
+	size_t sz, len;
+	long pos;
+	
+	if (desc->len_size)
+	{
+		len = test_frame_rand(state) % (desc->len_mult == 4 ? 0x10 : 0x40);
+		sz = desc->len_add + len * desc->len_mult;
+	}
+	else
+		len = 0, sz = desc->hdrsz;
+	for (size_t i = 0; i < sz; ++i)
+		frame[i] = test_frame_rand_byte(desc, state);
+	memcpy(frame, desc->magic ?: "", desc->magicsz);
+	for (int i = 0; i < desc->len_size; ++i)
+		frame[desc->len_offset + (desc->len_be ? (desc->len_size - 1 - i) : i)] = len >> (8 * i);
+	pos = lowl_frame_check_pos(desc, sz);
+	switch (desc->check)
+	{
+		case LFC_NONE:
+			break;
+		case LFC_CRC5USB:
+			frame[pos] &= 0xe0;
+			frame[pos] |= crc5usb(&frame[desc->check_start], ((pos - desc->check_start) * 8) + 3);
+			break;
+		case LFC_CRC8CCITT:
+			frame[pos] = crc8ccitt(&frame[desc->check_start], pos - desc->check_start);
+			break;
+		case LFC_CRC16:
+			pk_u16be(frame, pos, crc16(&frame[desc->check_start], pos - desc->check_start, desc->crc16_init));
+			break;
+	}
+	return sz;
+}
+
+struct test_frame_reader {
+	const uint8_t *p;
+	size_t rem;
+	uint32_t *state;
+};
+
+// Serial-like: returns only part of what was asked for, at random
+static
+ssize_t test_frame_read(void * const userp, void * const buf, size_t bufsz)
+{
+	struct test_frame_reader * const rd = userp;
+	
+	bufsz = 1 + (test_frame_rand(rd->state) % bufsz);
+	if (bufsz > rd->rem)
+		bufsz = rd->rem;
+	memcpy(buf, rd->p, bufsz);
+	rd->p += bufsz;
+	rd->rem -= bufsz;
+	return bufsz;
+}
+
+// A stream of frames with garbage between some, and some frames corrupted
+static
+void _test_lowl_frame_stream(const struct lowl_frame_desc * const desc, const bool use_fill, uint32_t state)
+{
+	const int n_frames = 200;
+	uint8_t * const stream = malloc((size_t)n_frames * (desc->maxsz + 8));
+	uint8_t * const expect = malloc((size_t)n_frames * desc->maxsz);
+	size_t streamsz = 0, expectsz = 0, gotsz = 0, sz, n;
+	struct lowl_framer fr;
+	struct lowl_frame frame;
+	struct test_frame_reader rd;
+	bool ok = true;
+	uint8_t *f;
+	long pos;
+	
+	for (int i = 0; i < n_frames; ++i)
+	{
+		// Garbage between frames, which the framer must skip
+		if (desc->magicsz && !(test_frame_rand(&state) % 4))
+			for (n = 1 + test_frame_rand(&state) % 8; n; --n)
+				stream[streamsz++] = test_frame_rand_byte(desc, &state);
+		f = &stream[streamsz];
+		sz = test_frame_build(desc, f, &state);
+		streamsz += sz;
+		if (desc->magicsz && !(test_frame_rand(&state) % 8))
+		{
+			// Corrupt one byte that is covered by the check
+			pos = lowl_frame_check_pos(desc, sz);
+			n = test_frame_rand(&state) % (pos + lowl_frame_check_width(desc));
+			do {
+				f[n] ^= 1 + test_frame_rand(&state) % 0xff;
+			} while (memchr(desc->magic, f[n], desc->magicsz));
+			continue;
+		}
+		memcpy(&expect[expectsz], f, sz);
+		expectsz += sz;
+	}
+	
+	lowl_framer_init(&fr, desc);
+	rd = (struct test_frame_reader){
+		.p = stream,
+		.rem = streamsz,
+		.state = &state,
+	};
+	while (ok)
+	{
+		if (!lowl_framer_next(&fr, &frame))
+		{
+			if (!rd.rem)
+				break;
+			if (use_fill)
+				lowl_framer_fill(&fr, test_frame_read, &rd);
+			else
+			{
+				n = 1 + test_frame_rand(&state) % 300;
+				if (n > rd.rem)
+					n = rd.rem;
+				n = lowl_framer_feed(&fr, rd.p, n);
+				rd.p += n;
+				rd.rem -= n;
+			}
+			continue;
+		}
+		if (frame.data < fr.buf || &frame.data[frame.sz] > &fr.buf[fr.bufsz]
+		 || gotsz + frame.sz > expectsz || memcmp(&expect[gotsz], frame.data, frame.sz))
+			ok = false;
+		gotsz += frame.sz;
+	}
+	if (!ok || gotsz != expectsz || (desc->magicsz && !fr.discarded))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s %s (%s)", "lowl_frame", desc->name, "stream", use_fill ? "fill" : "feed");
+	}
+	
+	lowl_framer_free(&fr);
+	free(expect);
+	free(stream);
+}
+
+// Random bytes, biased toward the magic, must only ever produce valid frames
+static
+void _test_lowl_frame_noise(const struct lowl_frame_desc * const desc, uint32_t state)
+{
+	struct lowl_framer fr;
+	struct lowl_frame frame;
+	uint8_t chunk[0x80];
+	size_t n, off;
+	bool ok = true;
+	
+	lowl_framer_init(&fr, desc);
+	for (int i = 0; i < 0x400 && ok; ++i)
+	{
+		n = 1 + test_frame_rand(&state) % sizeof(chunk);
+		for (size_t j = 0; j < n; ++j)
+		{
+			chunk[j] = test_frame_rand(&state);
+			if (desc->magicsz && !(chunk[j] & 3))
+				chunk[j] = ((const uint8_t *)desc->magic)[chunk[j] % desc->magicsz];
+		}
+		for (off = 0; off < n; )
+		{
+			off += lowl_framer_feed(&fr, &chunk[off], n - off);
+			while (lowl_framer_next(&fr, &frame))
+				if (frame.data < fr.buf || &frame.data[frame.sz] > &fr.buf[fr.bufsz]
+				 || !lowl_frame_valid(desc, frame.data, frame.sz))
+					ok = false;
+		}
+	}
+	if (!ok || fr.len > fr.bufsz)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s %s", "lowl_frame", desc->name, "noise");
+	}
+	lowl_framer_free(&fr);
+}
+
+void test_lowl_frame(void)
+{
+	const struct lowl_frame_desc * const crc5 = &test_frame_descs[2];
+	uint8_t frame[5];
+	uint32_t state = 0x5eed;
+	
+	for (int i = 0; i < sizeof(test_frame_descs) / sizeof(*test_frame_descs); ++i)
+	{
+		_test_lowl_frame_stream(&test_frame_descs[i], true, 0x1234 + i);
+		_test_lowl_frame_stream(&test_frame_descs[i], false, 0x4321 + i);
+		_test_lowl_frame_noise(&test_frame_descs[i], 0xf00d + i);
+	}
+	
+	// Every single bit error is caught, including in the data sharing the CRC byte
+	test_frame_build(crc5, frame, &state);
+	if (!lowl_frame_valid(crc5, frame, sizeof(frame)))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "lowl_frame", "crc5 valid");
+	}
+	for (int bit = 0; bit < 40; ++bit)
+	{
+		frame[bit / 8] ^= 0x80 >> (bit % 8);
+		if (lowl_frame_valid(crc5, frame, sizeof(frame)))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s %d", "lowl_frame", "crc5 bit", bit);
+		}
+		frame[bit / 8] ^= 0x80 >> (bit % 8);
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef BFG_LOWL_FRAME_H
+#define BFG_LOWL_FRAME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+enum lowl_frame_check {
+	LFC_NONE,
+	// Low 5 bits of the byte at check_offset, over every bit before them from check_start
+	LFC_CRC5USB,
+	// Byte at check_offset, over check_start up to it
+	LFC_CRC8CCITT,
+	// Big endian at check_offset, over check_start up to it, starting with crc16_init
+	LFC_CRC16,
+};
+
+struct lowl_frame_desc {
+	const char *name;
+	const void *magic;
+	uint8_t magicsz;
+
+	// Bytes needed before the frame size is known, and the largest frame
+	uint16_t hdrsz;
+	uint16_t maxsz;
+
+	// With len_size 0, every frame is hdrsz bytes. Otherwise, it is len_add
+	// plus len_mult times the len_size byte field at len_offset.
+	uint8_t len_offset;
+	uint8_t len_size;
+	bool len_be;
+	uint16_t len_mult;
+	uint16_t len_add;
+
+	enum lowl_frame_check check;
+	uint16_t check_start;
+	// Negative counts from the end of the frame
+	int check_offset;
+	uint16_t crc16_init;
+	// Any further validation, such as a driver-specific checksum
+	bool (*check_f)(const struct lowl_frame_desc *, const uint8_t *frame, size_t framesz);
+};
+
+// A frame still in the framer's buffer, valid until it is next fed or read
+struct lowl_frame {
+	const uint8_t *data;
+	size_t sz;
+};
+
+struct lowl_framer {
+	const struct lowl_frame_desc *desc;
+	uint8_t *buf;
+	size_t bufsz;
+	size_t head;
+	size_t len;
+
+	// Bytes skipped while looking for a valid frame
+	unsigned long discarded;
+};
+
+typedef ssize_t (*lowl_frame_read_func_t)(void *userp, void *buf, size_t bufsz);
+
+extern void lowl_framer_init(struct lowl_framer *, const struct lowl_frame_desc *);
+extern void lowl_framer_free(struct lowl_framer *);
+extern void lowl_framer_reset(struct lowl_framer *);
+extern size_t lowl_framer_want(const struct lowl_framer *);
+extern uint8_t *lowl_framer_space(struct lowl_framer *, size_t *out_space);
+extern void lowl_framer_commit(struct lowl_framer *, size_t);
+extern size_t lowl_framer_feed(struct lowl_framer *, const void *, size_t);
+extern ssize_t lowl_framer_fill(struct lowl_framer *, lowl_frame_read_func_t, void *userp);
+extern bool lowl_framer_next(struct lowl_framer *, struct lowl_frame *out);
+extern bool lowl_frame_valid(const struct lowl_frame_desc *, const uint8_t *frame, size_t framesz);
+
+extern void test_lowl_frame(void);
+
+#endif
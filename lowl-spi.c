@@ -178,7 +178,7 @@ bool sys_spi_txrx(struct spi_port *port)
 	size_t bufsz = spi_getbufsz(port);
 	int fd;
 	int mode, bits, speed, rv, i, j;
-	struct spi_ioc_transfer tr[16];
+	struct spi_ioc_transfer tr[SPIMAXSZ / 4096];
 
 	memset(&tr,0,sizeof(tr));
 	mode = 0; bits = 8; speed = 4000000;
@@ -225,12 +225,13 @@ bool sys_spi_txrx(struct spi_port *port)
                 rv ++;
         }
 
-        i = rv;
-        for (j = 0; j < i; j++) {
-                rv = (int)ioctl(fd, SPI_IOC_MESSAGE(1), (intptr_t)&tr[j]);
+	// spidev rejects messages over its bufsiz (4096 by default), so each chunk is its own
+	i = rv;
+	for (j = 0; j < i; j++) {
+		rv = (int)ioctl(fd, SPI_IOC_MESSAGE(1), (intptr_t)&tr[j]);
 		if (rv < 0)
 			BAILOUT("WTF!");
-        }
+	}
 
 	close(fd);
 	spi_reset(4321);
@@ -345,6 +346,178 @@ void *spi_emit_data(struct spi_port *port, uint16_t addr, const void *buf, size_
 	return spi_emit_buf_reverse(port, buf, len*4);
 }
 
+bool spi_mock_txrx(struct spi_port * const port)
+{
+	struct spi_mock * const mock = port->userp;
+	const size_t bufsz = spi_getbufsz(port);
+	void * const rxbuf = spi_getrxbuf(port);
+	size_t rxsz = 0;
+	
+	if (mock->responses_count)
+	{
+		const struct spi_mock_response * const resp = &mock->responses[mock->next];
+		if (++mock->next >= mock->responses_count)
+			mock->next = 0;
+		rxsz = (resp->rxsz < bufsz) ? resp->rxsz : bufsz;
+		memcpy(rxbuf, resp->rx, rxsz);
+	}
+	memset(&((char *)rxbuf)[rxsz], 0, bufsz - rxsz);
+	++mock->txrx_count;
+	mock->tx_bytes += bufsz;
+	
+	if (port->speed)
+		cgsleep_us((uint64_t)bufsz * 8 * 1000000 / port->speed);
+	
+	return true;
+}
+
+/* With --capture, records each transfer on the port's channel around the real
+   txrx; with --replay, plays back the port's channel in its place, so the
+   driver above runs without the hardware */
+bool spi_capture_txrx(struct spi_port * const port)
+{
+	const char * const name = port->repr ?: "spi";
+	const size_t bufsz = spi_getbufsz(port);
+	const struct lowl_capture_rec *rec;
+	int64_t delay;
+	bool rv;
+	
+	if (lowl_capture_mode == LCM_CAPTURE)
+	{
+		if (port->capture_owner != port)
+		{
+			port->capture_chan = lowl_capture_open_chan(name);
+			port->capture_owner = port;
+		}
+		lowl_capture_record(port->capture_chan, LCR_HOST, spi_gettxbuf(port), bufsz);
+		rv = port->txrx(port);
+		if (rv)
+			lowl_capture_record(port->capture_chan, LCR_DEV, spi_getrxbuf(port), bufsz);
+		else
+			lowl_capture_record(port->capture_chan, LCR_ERR, NULL, 0);
+		return rv;
+	}
+	
+	if (port->capture_owner != port)
+	{
+		if (!lowl_replay_claim(&port->replay, name))
+			applogr(false, LOG_DEBUG, "%s: Not in replay capture", name);
+		port->capture_owner = port;
+	}
+	rec = lowl_replay_next(&port->replay);
+	if (!(rec && rec->type == LCR_HOST))
+		goto end;
+	lowl_replay_check_host(&port->replay, rec, spi_gettxbuf(port), bufsz);
+	lowl_replay_done(&port->replay, rec);
+	rec = lowl_replay_next(&port->replay);
+	if (!(rec && rec->type == LCR_DEV))
+		goto end;
+	delay = lowl_replay_delay_us(&port->replay, rec);
+	if (delay)
+		cgsleep_us(delay);
+	memcpy(spi_getrxbuf(port), rec->data, (rec->sz < bufsz) ? rec->sz : bufsz);
+	if (rec->sz < bufsz)
+		memset(&((char *)spi_getrxbuf(port))[rec->sz], 0, bufsz - rec->sz);
+	lowl_replay_done(&port->replay, rec);
+	return true;
+
+end:
+	// Anything more is past the end of the capture
+	lowl_replay_finish(&port->replay);
+	port->capture_owner = NULL;
+	return false;
+}
+
+struct spi_txrx_async {
+	pthread_t pth;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct spi_port *port;
+	bool busy;
+	bool rv;
+	bool quit;
+};
+
+static
+void *spi_txrx_async_thread(void * const userp)
+{
+	struct spi_txrx_async * const async = userp;
+	struct spi_port *port;
+	bool rv;
+	
+	RenameThread("spi_txrx");
+	mutex_lock(&async->mutex);
+	while (true)
+	{
+		while (!(async->port || async->quit))
+			pthread_cond_wait(&async->cond, &async->mutex);
+		if (async->quit)
+			break;
+		port = async->port;
+		mutex_unlock(&async->mutex);
+		
+		rv = spi_txrx(port);
+		
+		mutex_lock(&async->mutex);
+		async->port = NULL;
+		async->rv = rv;
+		async->busy = false;
+		pthread_cond_broadcast(&async->cond);
+	}
+	mutex_unlock(&async->mutex);
+	return NULL;
+}
+
+struct spi_txrx_async *spi_txrx_async_new(void)
+{
+	struct spi_txrx_async * const async = malloc(sizeof(*async));
+	*async = (struct spi_txrx_async){
+		.rv = true,
+	};
+	mutex_init(&async->mutex);
+	if (unlikely(pthread_cond_init(&async->cond, NULL)))
+		quithere(1, "Failed to pthread_cond_init");
+	if (unlikely(pthread_create(&async->pth, NULL, spi_txrx_async_thread, async)))
+		quithere(1, "Failed to create thread");
+	return async;
+}
+
+// Starts a transfer on the helper thread; the previous one must have been waited for
+void spi_txrx_async_start(struct spi_txrx_async * const async, struct spi_port * const port)
+{
+	mutex_lock(&async->mutex);
+	async->port = port;
+	async->busy = true;
+	pthread_cond_broadcast(&async->cond);
+	mutex_unlock(&async->mutex);
+}
+
+// Returns the result of the last transfer started, once it is complete (may be called again)
+bool spi_txrx_async_wait(struct spi_txrx_async * const async)
+{
+	bool rv;
+	
+	mutex_lock(&async->mutex);
+	while (async->busy)
+		pthread_cond_wait(&async->cond, &async->mutex);
+	rv = async->rv;
+	mutex_unlock(&async->mutex);
+	return rv;
+}
+
+void spi_txrx_async_free(struct spi_txrx_async * const async)
+{
+	spi_txrx_async_wait(async);
+	mutex_lock(&async->mutex);
+	async->quit = true;
+	pthread_cond_broadcast(&async->cond);
+	mutex_unlock(&async->mutex);
+	pthread_join(async->pth, NULL);
+	pthread_cond_destroy(&async->cond);
+	mutex_destroy(&async->mutex);
+	free(async);
+}
+
 #ifdef USE_BFSB
 void spi_bfsb_select_bank(int bank)
 {
@@ -5,6 +5,8 @@
 #include <stdint.h>
 #include <unistd.h>
 
+#include "lowl-capture.h"
+
 #define SPIMAXSZ (256*1024)
 
 /* Initialize SPI using this function */
@@ -38,6 +40,12 @@ struct spi_port {
 	uint8_t bits;
 	int chipselect;
 	int *chipselect_current;
+	
+	/* Capture or replay channel, if this port has done any txrx; ports copied
+	   from one another get their own */
+	const struct spi_port *capture_owner;
+	unsigned capture_chan;
+	struct lowl_replay_cursor replay;
 };
 
 extern struct spi_port *sys_spi;
@@ -82,12 +90,42 @@ extern void spi_emit_nop(struct spi_port *port, int n);
    transmission quantum is 32 bits */
 extern void *spi_emit_data(struct spi_port *port, uint16_t addr, const void *buf, size_t len);
 
+extern bool spi_capture_txrx(struct spi_port *);
+
 static inline
 bool spi_txrx(struct spi_port *port)
 {
+	if (lowl_capture_mode != LCM_OFF)
+		return spi_capture_txrx(port);
 	return port->txrx(port);
 }
 
+/* Mock backend, for testing and benchmarking without hardware: each txrx
+   replays the next of the recorded responses (cycling through them), and if
+   the port has a speed set, takes as long as the transfer would */
+struct spi_mock_response {
+	const void *rx;
+	size_t rxsz;
+};
+
+struct spi_mock {
+	const struct spi_mock_response *responses;
+	unsigned responses_count;
+	unsigned next;
+	unsigned txrx_count;
+	size_t tx_bytes;
+};
+
+extern bool spi_mock_txrx(struct spi_port *);  /* userp must be a struct spi_mock */
+
+/* Runs transfers on a helper thread, so the caller can work meanwhile.
+   Only one transfer may be in progress at a time. */
+struct spi_txrx_async;
+extern struct spi_txrx_async *spi_txrx_async_new(void);
+extern void spi_txrx_async_start(struct spi_txrx_async *, struct spi_port *);
+extern bool spi_txrx_async_wait(struct spi_txrx_async *);
+extern void spi_txrx_async_free(struct spi_txrx_async *);
+
 extern int spi_open(struct spi_port *, const char *);
 extern bool sys_spi_txrx(struct spi_port *);
 extern bool linux_spi_txrx(struct spi_port *);
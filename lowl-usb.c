@@ -9,13 +9,17 @@
 
 #include "config.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <libusb.h>
+#include <utlist.h>
 
 #include "logging.h"
 #include "lowlevel.h"
@@ -175,12 +179,39 @@ struct lowl_usb_endpoint {
 	unsigned char endpoint_w;
 	int packetsz_w;
 	unsigned timeout_ms_w;
+	
+	// Asynchronous transfers; everything below is protected by async_mutex
+	pthread_mutex_t async_mutex;
+	pthread_cond_t async_cond;
+	struct libusb_transfer **reads;
+	unsigned reads_count;
+	usb_async_cb_t read_cb;
+	void *read_userp;
+	int read_errno;
+	unsigned async_pending;
+	bool async_closing;
+	
+	// List of endpoints with asynchronous transfers, protected by usb_async_thread_mutex
+	bool async_listed;
+	struct lowl_usb_endpoint *prev;
+	struct lowl_usb_endpoint *next;
 };
 
+static
+void usb_ep_init_async(struct lowl_usb_endpoint * const ep)
+{
+	mutex_init(&ep->async_mutex);
+	if (unlikely(pthread_cond_init(&ep->async_cond, NULL)))
+		quithere(1, "Failed to pthread_cond_init");
+}
+
 struct lowl_usb_endpoint *usb_open_ep(struct libusb_device_handle * const devh, const uint8_t epid, const int pktsz)
 {
 	struct lowl_usb_endpoint * const ep = malloc(sizeof(*ep));
-	ep->devh = devh;
+	*ep = (struct lowl_usb_endpoint){
+		.devh = devh,
+	};
+	usb_ep_init_async(ep);
 	if (epid & 0x80)
 	{
 		// Read endpoint
@@ -209,6 +240,7 @@ struct lowl_usb_endpoint *usb_open_ep_pair(struct libusb_device_handle * const d
 		.endpoint_w = epid_w,
 		.packetsz_w = pktsz_w,
 	};
+	usb_ep_init_async(ep);
 	return ep;
 }
 
@@ -218,10 +250,56 @@ void usb_ep_set_timeouts_ms(struct lowl_usb_endpoint * const ep, const unsigned
 	ep->timeout_ms_w = timeout_ms_w;
 }
 
+// Reads data queued by pre-posted read transfers with no callback
+static
+ssize_t usb_read_async(struct lowl_usb_endpoint * const ep, void * const data, const size_t datasz)
+{
+	struct timespec ts_end;
+	ssize_t rv = datasz;
+	
+	if (ep->timeout_ms_r)
+	{
+		clock_gettime(CLOCK_REALTIME, &ts_end);
+		ts_end.tv_sec += ep->timeout_ms_r / 1000;
+		ts_end.tv_nsec += (long)(ep->timeout_ms_r % 1000) * 1000000;
+		if (ts_end.tv_nsec >= 1000000000)
+		{
+			++ts_end.tv_sec;
+			ts_end.tv_nsec -= 1000000000;
+		}
+	}
+	mutex_lock(&ep->async_mutex);
+	while (bytes_len(&ep->_buf_r) < datasz)
+	{
+		if (ep->read_errno)
+		{
+			errno = ep->read_errno;
+			rv = -1;
+			goto out;
+		}
+		if (!ep->timeout_ms_r)
+			pthread_cond_wait(&ep->async_cond, &ep->async_mutex);
+		else
+		if (pthread_cond_timedwait(&ep->async_cond, &ep->async_mutex, &ts_end) == ETIMEDOUT)
+		{
+			// Behaviour is like tcsetattr-style timeout
+			rv = 0;
+			goto out;
+		}
+	}
+	memcpy(data, bytes_buf(&ep->_buf_r), datasz);
+	bytes_shift(&ep->_buf_r, datasz);
+out:
+	mutex_unlock(&ep->async_mutex);
+	return rv;
+}
+
 ssize_t usb_read(struct lowl_usb_endpoint * const ep, void * const data, size_t datasz)
 {
 	unsigned timeout;
 	size_t xfer;
+	if (ep->reads_count)
+		return usb_read_async(ep, data, datasz);
 	if ( (xfer = bytes_len(&ep->_buf_r)) < datasz)
 	{
 		bytes_extend_buf(&ep->_buf_r, datasz + ep->packetsz_r - 1);
@@ -292,13 +370,356 @@ ssize_t usb_write(struct lowl_usb_endpoint * const ep, const void * const data,
 	return datasz;
 }
 
+/* All asynchronous transfers complete in a single thread handling libusb
+ * events, started with the first of them. Callbacks run in that thread, so
+ * they must not block or close their endpoint. */
+static pthread_mutex_t usb_async_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool usb_async_thread_started;
+static pthread_t usb_async_pth;
+static int usb_async_thread_quit;
+static struct lowl_usb_endpoint *usb_async_eps;
+
+static
+void *usb_async_thread(__maybe_unused void *userp)
+{
+	struct timeval tv;
+	
+	RenameThread("usb_async");
+	
+	while (!usb_async_thread_quit)
+	{
+		tv = (struct timeval){ .tv_sec = 1, };
+		libusb_handle_events_timeout_completed(NULL, &tv, &usb_async_thread_quit);
+	}
+	return NULL;
+}
+
+// Starts the event thread if needed, and lists ep for usb_async_shutdown
+static
+void usb_async_thread_start(struct lowl_usb_endpoint * const ep)
+{
+	mutex_lock(&usb_async_thread_mutex);
+	if (!usb_async_thread_started)
+	{
+		if (unlikely(pthread_create(&usb_async_pth, NULL, usb_async_thread, NULL)))
+			quithere(1, "Failed to create thread");
+		usb_async_thread_started = true;
+	}
+	if (!ep->async_listed)
+	{
+		DL_APPEND(usb_async_eps, ep);
+		ep->async_listed = true;
+	}
+	mutex_unlock(&usb_async_thread_mutex);
+}
+
+static
+int usb_transfer_errno(const enum libusb_transfer_status status)
+{
+	switch (status)
+	{
+		case LIBUSB_TRANSFER_COMPLETED:
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return 0;
+		case LIBUSB_TRANSFER_CANCELLED:
+			return ECANCELED;
+		case LIBUSB_TRANSFER_STALL:
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return EPIPE;
+		default:
+			return EIO;
+	}
+}
+
+// Called with async_mutex held when a transfer will not call back again
+static
+void usb_async_retire(struct lowl_usb_endpoint * const ep)
+{
+	--ep->async_pending;
+	pthread_cond_broadcast(&ep->async_cond);
+}
+
+static
+void LIBUSB_CALL usb_async_read_done(struct libusb_transfer * const xfer)
+{
+	struct lowl_usb_endpoint * const ep = xfer->user_data;
+	const int err = usb_transfer_errno(xfer->status);
+	
+	if (xfer->status == LIBUSB_TRANSFER_CANCELLED)
+		;
+	else
+	if (ep->read_cb)
+	{
+		if (err)
+		{
+			errno = err;
+			ep->read_cb(ep->read_userp, NULL, -1);
+		}
+		else
+		if (xfer->actual_length)
+			ep->read_cb(ep->read_userp, xfer->buffer, xfer->actual_length);
+	}
+	else
+	{
+		mutex_lock(&ep->async_mutex);
+		if (err)
+			ep->read_errno = err;
+		else
+			bytes_append(&ep->_buf_r, xfer->buffer, xfer->actual_length);
+		pthread_cond_broadcast(&ep->async_cond);
+		mutex_unlock(&ep->async_mutex);
+	}
+	
+	mutex_lock(&ep->async_mutex);
+	// Keep the read posted unless it failed or the endpoint is closing
+	if (err || ep->async_closing || libusb_submit_transfer(xfer))
+		usb_async_retire(ep);
+	mutex_unlock(&ep->async_mutex);
+}
+
+/* Keeps urbs read transfers of one packet each posted on the endpoint, until
+ * it is closed or a transfer fails. Each one's data is passed to cb as soon as
+ * it arrives; with no cb, it is queued for usb_read instead, which then never
+ * blocks for a device round trip of its own. */
+bool usb_submit_read(struct lowl_usb_endpoint * const ep, const unsigned urbs, const usb_async_cb_t cb, void * const userp)
+{
+	struct libusb_transfer *xfer;
+	unsigned char *buf;
+	int e;
+	
+	if (ep->packetsz_r == -1 || ep->reads_count || !urbs)
+		return false;
+	usb_async_thread_start(ep);
+	ep->read_cb = cb;
+	ep->read_userp = userp;
+	ep->reads = malloc(sizeof(*ep->reads) * urbs);
+	
+	mutex_lock(&ep->async_mutex);
+	for (unsigned i = 0; i < urbs; ++i)
+	{
+		xfer = libusb_alloc_transfer(0);
+		buf = malloc(ep->packetsz_r);
+		if (unlikely(!(xfer && buf)))
+			quithere(1, "OOM usb transfer");
+		libusb_fill_bulk_transfer(xfer, ep->devh, ep->endpoint_r, buf, ep->packetsz_r, usb_async_read_done, ep, 0);
+		e = libusb_submit_transfer(xfer);
+		if (unlikely(e))
+		{
+			applog(LOG_DEBUG, "%s: libusb_submit_transfer failed: %s", __func__, bfg_strerror(e, BST_LIBUSB));
+			free(buf);
+			libusb_free_transfer(xfer);
+			break;
+		}
+		ep->reads[ep->reads_count++] = xfer;
+		++ep->async_pending;
+	}
+	mutex_unlock(&ep->async_mutex);
+	
+	return ep->reads_count;
+}
+
+struct usb_async_write {
+	struct lowl_usb_endpoint *ep;
+	usb_async_cb_t cb;
+	void *userp;
+	unsigned char data[];
+};
+
+static
+void LIBUSB_CALL usb_async_write_done(struct libusb_transfer * const xfer)
+{
+	struct usb_async_write * const w = xfer->user_data;
+	struct lowl_usb_endpoint * const ep = w->ep;
+	const int err = usb_transfer_errno(xfer->status);
+	
+	if (w->cb)
+	{
+		errno = err;
+		w->cb(w->userp, w->data, (err && !xfer->actual_length) ? -1 : xfer->actual_length);
+	}
+	free(w);
+	
+	mutex_lock(&ep->async_mutex);
+	usb_async_retire(ep);
+	mutex_unlock(&ep->async_mutex);
+}
+
+/* Queues a copy of the data to be written, returning without waiting for the
+ * device. cb, if any, gets the number of bytes written, or -1 with errno. */
+bool usb_submit_write(struct lowl_usb_endpoint * const ep, const void * const data, const size_t datasz, const usb_async_cb_t cb, void * const userp)
+{
+	struct usb_async_write * const w = malloc(sizeof(*w) + datasz);
+	struct libusb_transfer * const xfer = libusb_alloc_transfer(0);
+	int e;
+	
+	if (unlikely(!(w && xfer)))
+		quithere(1, "OOM usb transfer");
+	*w = (struct usb_async_write){
+		.ep = ep,
+		.cb = cb,
+		.userp = userp,
+	};
+	memcpy(w->data, data, datasz);
+	usb_async_thread_start(ep);
+	libusb_fill_bulk_transfer(xfer, ep->devh, ep->endpoint_w, w->data, datasz, usb_async_write_done, w, ep->timeout_ms_w);
+	xfer->flags |= LIBUSB_TRANSFER_FREE_TRANSFER;
+	
+	mutex_lock(&ep->async_mutex);
+	e = libusb_submit_transfer(xfer);
+	if (likely(!e))
+		++ep->async_pending;
+	mutex_unlock(&ep->async_mutex);
+	
+	if (unlikely(e))
+	{
+		applog(LOG_DEBUG, "%s: libusb_submit_transfer failed: %s", __func__, bfg_strerror(e, BST_LIBUSB));
+		free(w);
+		libusb_free_transfer(xfer);
+		errno = (e == LIBUSB_ERROR_NO_DEVICE) ? EPIPE : EIO;
+		return false;
+	}
+	return true;
+}
+
+// Cancels posted reads, and waits for queued writes and callbacks to finish
+static
+void usb_async_cancel(struct lowl_usb_endpoint * const ep)
+{
+	mutex_lock(&ep->async_mutex);
+	if (!ep->async_closing)
+	{
+		ep->async_closing = true;
+		for (unsigned i = 0; i < ep->reads_count; ++i)
+			libusb_cancel_transfer(ep->reads[i]);
+	}
+	while (ep->async_pending)
+		pthread_cond_wait(&ep->async_cond, &ep->async_mutex);
+	mutex_unlock(&ep->async_mutex);
+}
+
+/* Must be called before libusb_exit. Endpoints still open are left with no
+ * transfers, and must not start any more. */
+void usb_async_shutdown()
+{
+	struct lowl_usb_endpoint *ep;
+	
+	mutex_lock(&usb_async_thread_mutex);
+	if (!usb_async_thread_started)
+	{
+		mutex_unlock(&usb_async_thread_mutex);
+		return;
+	}
+	DL_FOREACH(usb_async_eps, ep)
+		usb_async_cancel(ep);
+	usb_async_thread_quit = 1;
+	usb_async_thread_started = false;
+	mutex_unlock(&usb_async_thread_mutex);
+	
+	pthread_join(usb_async_pth, NULL);
+}
+
 void usb_close_ep(struct lowl_usb_endpoint * const ep)
 {
+	usb_async_cancel(ep);
+	if (ep->async_listed)
+	{
+		mutex_lock(&usb_async_thread_mutex);
+		DL_DELETE(usb_async_eps, ep);
+		mutex_unlock(&usb_async_thread_mutex);
+	}
+	for (unsigned i = 0; i < ep->reads_count; ++i)
+	{
+		free(ep->reads[i]->buffer);
+		libusb_free_transfer(ep->reads[i]);
+	}
+	free(ep->reads);
+	pthread_cond_destroy(&ep->async_cond);
+	pthread_mutex_destroy(&ep->async_mutex);
+	
 	if (ep->packetsz_r != -1)
 		bytes_free(&ep->_buf_r);
 	free(ep);
 }
 
+static
+void _test_usb_async_complete(struct libusb_transfer * const xfer, const enum libusb_transfer_status status, const char * const data)
+{
+	xfer->status = status;
+	xfer->actual_length = data ? strlen(data) : 0;
+	if (data)
+		memcpy(xfer->buffer, data, xfer->actual_length);
+	usb_async_read_done(xfer);
+}
+
+static bool _test_usb_async_late_cancelled;
+
+static
+void *_test_usb_async_late_cancel(void * const userp)
+{
+	struct libusb_transfer * const xfer = userp;
+	
+	cgsleep_ms(50);
+	_test_usb_async_late_cancelled = true;
+	_test_usb_async_complete(xfer, LIBUSB_TRANSFER_CANCELLED, NULL);
+	return NULL;
+}
+
+#define TEST_USB_ASYNC_FAIL(msg)  do {  \
+	++unittest_failures;  \
+	applog(LOG_WARNING, "%s test failed: %s", "usb_async", msg);  \
+} while (0)
+
+// Completions are faked by calling the transfer callback directly, so no device or libusb context is needed
+void test_usb_async()
+{
+	struct lowl_usb_endpoint * const ep = usb_open_ep(NULL, 0x81, 8);
+	struct libusb_transfer *xfer;
+	char buf[8];
+	pthread_t pth;
+	
+	usb_ep_set_timeouts_ms(ep, 20, 20);
+	ep->reads = malloc(sizeof(*ep->reads) * 3);
+	for (int i = 0; i < 3; ++i)
+	{
+		xfer = libusb_alloc_transfer(0);
+		libusb_fill_bulk_transfer(xfer, NULL, 0x81, malloc(8), 8, usb_async_read_done, ep, 0);
+		ep->reads[ep->reads_count++] = xfer;
+		++ep->async_pending;
+	}
+	// Retire each transfer as it completes, rather than resubmitting it
+	ep->async_closing = true;
+	
+	if (usb_read(ep, buf, 4) != 0)
+		TEST_USB_ASYNC_FAIL("empty read did not time out");
+	
+	_test_usb_async_complete(ep->reads[0], LIBUSB_TRANSFER_COMPLETED, "abcdef");
+	if (ep->async_pending != 2)
+		TEST_USB_ASYNC_FAIL("completed read not retired");
+	if (usb_read(ep, buf, 4) != 4 || memcmp(buf, "abcd", 4))
+		TEST_USB_ASYNC_FAIL("buffered read");
+	if (usb_read(ep, buf, 4) != 0)
+		TEST_USB_ASYNC_FAIL("short read did not time out");
+	
+	_test_usb_async_complete(ep->reads[1], LIBUSB_TRANSFER_STALL, NULL);
+	if (ep->async_pending != 1)
+		TEST_USB_ASYNC_FAIL("failed read not retired");
+	// Data queued before the error is still returned
+	if (usb_read(ep, buf, 2) != 2 || memcmp(buf, "ef", 2))
+		TEST_USB_ASYNC_FAIL("read remainder after error");
+	errno = 0;
+	if (usb_read(ep, buf, 1) != -1 || errno != EPIPE)
+		TEST_USB_ASYNC_FAIL("read error not reported");
+	
+	// usb_close_ep must wait for the last transfer to call back
+	_test_usb_async_late_cancelled = false;
+	if (unlikely(pthread_create(&pth, NULL, _test_usb_async_late_cancel, ep->reads[2])))
+		quithere(1, "Failed to create thread");
+	usb_close_ep(ep);
+	if (!_test_usb_async_late_cancelled)
+		TEST_USB_ASYNC_FAIL("close did not wait for pending transfer");
+	pthread_join(pth, NULL);
+}
+
 struct lowlevel_driver lowl_usb = {
 	.dname = "usb",
 	.devinfo_scan = usb_devinfo_scan,
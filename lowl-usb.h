@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #include <libusb.h>
 
@@ -19,6 +20,14 @@ extern struct lowl_usb_endpoint *usb_open_ep_pair(struct libusb_device_handle *,
 extern void usb_ep_set_timeouts_ms(struct lowl_usb_endpoint *, unsigned timeout_ms_r, unsigned timeout_ms_w);
 extern ssize_t usb_read(struct lowl_usb_endpoint *, void *, size_t);
 extern ssize_t usb_write(struct lowl_usb_endpoint *, const void *, size_t);
+
+// Completion callback for asynchronous transfers, run in the libusb event thread
+typedef void (*usb_async_cb_t)(void *userp, const void *buf, ssize_t len);
+extern bool usb_submit_read(struct lowl_usb_endpoint *, unsigned urbs, usb_async_cb_t, void *userp);
+extern bool usb_submit_write(struct lowl_usb_endpoint *, const void *, size_t, usb_async_cb_t, void *userp);
+extern void usb_async_shutdown();
 extern void usb_close_ep(struct lowl_usb_endpoint *);
 
+extern void test_usb_async();
+
 #endif
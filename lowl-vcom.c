@@ -34,11 +34,14 @@
 
 #ifndef WIN32
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include <termios.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <utlist.h>
 #ifndef O_CLOEXEC
 #define O_CLOEXEC 0
 #endif
@@ -86,6 +89,7 @@ enum {
 #endif
 
 #include "logging.h"
+#include "lowl-capture.h"
 #include "lowlevel.h"
 #include "miner.h"
 #include "util.h"
@@ -1073,6 +1077,281 @@ bool vcom_set_timeout_ms(const int fdDev, const unsigned timeout_ms)
 #endif
 }
 
+#ifndef WIN32
+/* With --capture or --replay, serial_open hands the driver the slave side of a
+ * pty in place of the device, so drivers reading and writing the fd directly
+ * work unchanged. A thread on the master side either relays to the device,
+ * recording both directions, or plays a capture back. Line settings made by
+ * serial_open go to the device before it is wrapped; later DTR/RTS/CTS access
+ * through get_serial_cts and set_serial_* is forwarded to the device too. */
+
+struct vcom_capture {
+	int fd;
+	int master;
+	// -1 when replaying
+	int devfd;
+	unsigned chan;
+	struct lowl_replay_cursor cursor;
+	pthread_t pth;
+	struct vcom_capture *next;
+};
+
+static struct vcom_capture *vcom_captures;
+static pthread_mutex_t vcom_captures_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static
+bool vcom_capture_write(const int fd, const uint8_t *buf, size_t sz)
+{
+	ssize_t r;
+	while (sz)
+	{
+		r = write(fd, buf, sz);
+		if (r <= 0)
+			return false;
+		buf += r;
+		sz -= r;
+	}
+	return true;
+}
+
+static
+void *vcom_capture_thread(void * const userp)
+{
+	struct vcom_capture * const vc = userp;
+	struct pollfd pfds[2] = {
+		{ .fd = vc->master, .events = POLLIN, },
+		{ .fd = vc->devfd, .events = POLLIN, },
+	};
+	uint8_t buf[0x1000];
+	ssize_t r;
+	
+	RenameThread("vcom_capture");
+	while (true)
+	{
+		if (poll(pfds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (pfds[0].revents)
+		{
+			r = read(vc->master, buf, sizeof(buf));
+			if (r <= 0)
+				// Driver closed it
+				break;
+			lowl_capture_record(vc->chan, LCR_HOST, buf, r);
+			if (!vcom_capture_write(vc->devfd, buf, r))
+			{
+				lowl_capture_record(vc->chan, LCR_ERR, NULL, 0);
+				break;
+			}
+		}
+		if (pfds[1].revents)
+		{
+			r = read(vc->devfd, buf, sizeof(buf));
+			if (r <= 0)
+			{
+				// Device unplugged
+				lowl_capture_record(vc->chan, LCR_ERR, NULL, 0);
+				break;
+			}
+			lowl_capture_record(vc->chan, LCR_DEV, buf, r);
+			if (!vcom_capture_write(vc->master, buf, r))
+				break;
+		}
+	}
+	lowl_capture_record(vc->chan, LCR_CLOSE, NULL, 0);
+	close(vc->devfd);
+	close(vc->master);
+	return NULL;
+}
+
+static
+void *vcom_replay_thread(void * const userp)
+{
+	struct vcom_capture * const vc = userp;
+	struct lowl_replay_cursor * const cur = &vc->cursor;
+	const struct lowl_capture_rec *rec;
+	struct pollfd pfd = { .fd = vc->master, };
+	uint8_t buf[0x1000];
+	int64_t delay;
+	size_t got;
+	ssize_t r;
+	
+	RenameThread("vcom_replay");
+	while ((rec = lowl_replay_next(cur)))
+	{
+		switch (rec->type)
+		{
+			case LCR_HOST:
+				// Wait as long as it takes for the driver to start sending, but not for a short write to finish
+				pfd.events = POLLIN;
+				for (got = 0; got < rec->sz && got < sizeof(buf); got += r)
+				{
+					if (poll(&pfd, 1, got ? 100 : -1) <= 0)
+						break;
+					r = read(vc->master, &buf[got], ((rec->sz < sizeof(buf)) ? rec->sz : sizeof(buf)) - got);
+					if (r <= 0)
+						goto out;
+				}
+				lowl_replay_check_host(cur, rec, buf, got);
+				break;
+			case LCR_DEV:
+				delay = lowl_replay_delay_us(cur, rec);
+				// Only a hangup ends the wait early
+				pfd.events = 0;
+				if (delay && poll(&pfd, 1, (delay + 999) / 1000) > 0)
+					goto out;
+				if (!vcom_capture_write(vc->master, rec->data, rec->sz))
+					goto out;
+				break;
+			case LCR_CLOSE:
+				// Driver closed it when captured; let it finish doing so now
+				pfd.events = POLLIN;
+				while (poll(&pfd, 1, -1) > 0 && read(vc->master, buf, sizeof(buf)) > 0)
+				{}
+				goto out;
+			default:
+				goto out;
+		}
+		lowl_replay_done(cur, rec);
+	}
+out:
+	lowl_replay_finish(cur);
+	close(vc->master);
+	return NULL;
+}
+
+static
+int vcom_capture_start(struct vcom_capture * const vc, const char * const devpath, const int master, const int slave, void *(*func)(void *))
+{
+	vc->fd = slave;
+	vc->master = master;
+	if (unlikely(pthread_create(&vc->pth, NULL, func, vc)))
+	{
+		applog(LOG_ERR, "%s: Failed to start %s thread", devpath, (func == vcom_replay_thread) ? "replay" : "capture");
+		close(master);
+		close(slave);
+		free(vc);
+		return -1;
+	}
+	mutex_lock(&vcom_captures_mutex);
+	LL_PREPEND(vcom_captures, vc);
+	mutex_unlock(&vcom_captures_mutex);
+	return slave;
+}
+
+static
+int vcom_capture_wrap(const char * const devpath, const int devfd)
+{
+	struct vcom_capture *vc;
+	struct termios tios;
+	unsigned chan;
+	int master, slave;
+	
+	if (!bfg_openpty(&master, &slave))
+	{
+		applog(LOG_WARNING, "%s: No pty available, not capturing", devpath);
+		return devfd;
+	}
+	// The driver's own read timeout now applies to the pty
+	if (!tcgetattr(devfd, &tios))
+		tcsetattr(slave, TCSANOW, &tios);
+	vc = malloc(sizeof(*vc));
+	if (unlikely(!vc))
+		quithere(1, "OOM vcom capture");
+	chan = lowl_capture_open_chan(devpath);
+	*vc = (struct vcom_capture){
+		.devfd = devfd,
+		.chan = chan,
+	};
+	if (vcom_capture_start(vc, devpath, master, slave, vcom_capture_thread) == -1)
+	{
+		lowl_capture_record(chan, LCR_CLOSE, NULL, 0);
+		return devfd;
+	}
+	return slave;
+}
+
+static
+int vcom_replay_open(const char * const devpath, const uint8_t timeout)
+{
+	struct vcom_capture *vc;
+	struct termios tios;
+	int master, slave;
+	
+	vc = malloc(sizeof(*vc));
+	if (unlikely(!vc))
+		quithere(1, "OOM vcom replay");
+	*vc = (struct vcom_capture){
+		.devfd = -1,
+	};
+	if (!lowl_replay_claim(&vc->cursor, devpath))
+	{
+		applog(LOG_DEBUG, "%s: Not in replay capture", devpath);
+		free(vc);
+		return -1;
+	}
+	if (!bfg_openpty(&master, &slave))
+	{
+		applog(LOG_ERR, "%s: No pty available to replay on", devpath);
+		lowl_replay_finish(&vc->cursor);
+		free(vc);
+		return -1;
+	}
+	if (!tcgetattr(slave, &tios))
+	{
+		tios.c_cc[VTIME] = (cc_t)timeout;
+		tios.c_cc[VMIN] = 0;
+		tcsetattr(slave, TCSANOW, &tios);
+	}
+	return vcom_capture_start(vc, devpath, master, slave, vcom_replay_thread);
+}
+
+// Closes fd if it was given out by capture or replay, once its thread is done
+static
+bool vcom_capture_close(const int fd)
+{
+	struct vcom_capture *vc;
+	
+	mutex_lock(&vcom_captures_mutex);
+	LL_FOREACH(vcom_captures, vc)
+		if (vc->fd == fd)
+		{
+			LL_DELETE(vcom_captures, vc);
+			break;
+		}
+	mutex_unlock(&vcom_captures_mutex);
+	if (!vc)
+		return false;
+	close(fd);
+	pthread_join(vc->pth, NULL);
+	free(vc);
+	return true;
+}
+
+// Modem control lines have no meaning on the pty, so act on the device behind it
+static
+int vcom_capture_devfd(const int fd)
+{
+	struct vcom_capture *vc;
+	int devfd = fd;
+	
+	if (likely(lowl_capture_mode != LCM_CAPTURE))
+		return fd;
+	mutex_lock(&vcom_captures_mutex);
+	LL_FOREACH(vcom_captures, vc)
+		if (vc->fd == fd)
+		{
+			devfd = vc->devfd;
+			break;
+		}
+	mutex_unlock(&vcom_captures_mutex);
+	return devfd;
+}
+#endif
+
 /* NOTE: Linux only supports uint8_t (decisecond) timeouts; limiting it in
  *       this interface buys us warnings when bad constants are passed in.
  */
@@ -1135,6 +1414,9 @@ int serial_open(const char *devpath, unsigned long baud, uint8_t timeout, bool p
 
 	return _open_osfhandle((intptr_t)hSerial, 0);
 #else
+	if (unlikely(lowl_capture_mode == LCM_REPLAY))
+		return vcom_replay_open(devpath, timeout);
+	
 	int fdDev = open(devpath, O_RDWR | O_CLOEXEC | O_NOCTTY);
 
 	if (unlikely(fdDev == -1))
@@ -1220,12 +1502,18 @@ int serial_open(const char *devpath, unsigned long baud, uint8_t timeout, bool p
 		if (tcflush(fdDev, TCIOFLUSH))
 			applog(LOG_WARNING, "%s: %s failed: %s", devpath, "tcflush", bfg_strerror(errno, BST_ERRNO));
 	}
+	if (unlikely(lowl_capture_mode == LCM_CAPTURE))
+		return vcom_capture_wrap(devpath, fdDev);
 	return fdDev;
 #endif
 }
 
 int serial_close(const int fd)
 {
+#ifndef WIN32
+	if (unlikely(lowl_capture_mode != LCM_OFF) && vcom_capture_close(fd))
+		return 0;
+#endif
 #if defined(LOCK_EX) && defined(LOCK_NB) && defined(LOCK_UN)
 	flock(fd, LOCK_UN);
 #endif
@@ -1256,6 +1544,7 @@ enum bfg_gpio_value get_serial_cts(int fd)
 
 	if (fd == -1)
 		return BGV_ERROR;
+	fd = vcom_capture_devfd(fd);
 
 	ioctl(fd, TIOCMGET, &flags);
 	return (flags & TIOCM_CTS) ? BGV_HIGH : BGV_LOW;
@@ -1268,6 +1557,7 @@ enum bfg_gpio_value _set_serial_cmflag(int fd, int flag, bool val)
 
 	if (fd == -1)
 		return BGV_ERROR;
+	fd = vcom_capture_devfd(fd);
 
 	ioctl(fd, TIOCMGET, &flags);
 	
@@ -1350,3 +1640,94 @@ struct lowlevel_driver lowl_vcom = {
 	.dname = "vcom",
 	.devinfo_scan = vcom_devinfo_scan,
 };
+
+#ifndef WIN32
+static
+ssize_t _test_vcom_read(const int fd, uint8_t * const buf, const size_t bufsz)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN, };
+	size_t got = 0;
+	ssize_t r;
+	
+	while (got < bufsz && poll(&pfd, 1, 1000) > 0 && (r = read(fd, &buf[got], bufsz - got)) > 0)
+		got += r;
+	return got;
+}
+#endif
+
+// A pty stands in for the device: a short exchange is captured, then replayed without it
+void test_vcom_capture(void)
+{
+#ifndef WIN32
+	const float speed = lowl_replay_speed;
+	const char *devpath;
+	uint8_t buf[4];
+	int devmaster, devslave, fd;
+	FILE *F;
+	
+	if (!bfg_openpty(&devmaster, &devslave))
+	{
+		applog(LOG_WARNING, "%s test skipped: %s", "vcom_capture", "no pty available");
+		return;
+	}
+	devpath = ptsname(devmaster);
+	F = tmpfile();
+	if (!(devpath && F))
+	{
+		applog(LOG_WARNING, "%s test skipped: %s", "vcom_capture", "no temporary file");
+		goto out;
+	}
+	devpath = strdup(devpath);
+	
+	lowl_capture_start(F);
+	fd = serial_open(devpath, 0, 1, false);
+	if (fd == -1 || write(fd, "ping", 4) != 4 || _test_vcom_read(devmaster, buf, 4) != 4 || memcmp(buf, "ping", 4)
+	 || write(devmaster, "pong", 4) != 4 || serial_read(fd, buf, 4) != 4 || memcmp(buf, "pong", 4))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "vcom_capture", "relay");
+	}
+	if (fd != -1)
+		serial_close(fd);
+	lowl_capture_stop();
+	
+	rewind(F);
+	if (!lowl_replay_load(F))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "vcom_capture", "load");
+		goto out2;
+	}
+	lowl_replay_speed = 0;
+	// The device is no longer involved
+	close(devmaster);
+	devmaster = -1;
+	fd = serial_open(devpath, 0, 1, false);
+	if (fd == -1 || write(fd, "ping", 4) != 4 || serial_read(fd, buf, 4) != 4 || memcmp(buf, "pong", 4))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "vcom_capture", "replay");
+	}
+	if (fd != -1)
+		serial_close(fd);
+	// It was only opened once
+	fd = serial_open(devpath, 0, 1, false);
+	if (fd != -1)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "vcom_capture", "replayed twice");
+		serial_close(fd);
+	}
+	lowl_replay_unload();
+	lowl_replay_speed = speed;
+
+out2:
+	free((void*)devpath);
+out:
+	if (F)
+		fclose(F);
+	if (devmaster != -1)
+		close(devmaster);
+	close(devslave);
+#endif
+}
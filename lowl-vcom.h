@@ -47,4 +47,6 @@ extern enum bfg_gpio_value set_serial_dtr(int fd, enum bfg_gpio_value dtr);
 extern enum bfg_gpio_value set_serial_rts(int fd, enum bfg_gpio_value rts);
 extern bool valid_baud(int baud);
 
+extern void test_vcom_capture(void);
+
 #endif
@@ -9,9 +9,12 @@
 
 #include "config.h"
 
+#include <math.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <utlist.h>
 
@@ -267,3 +270,506 @@ struct device_drv *bfg_claim_any2(struct device_drv * const api, const char * co
 	memcpy(&devpath[llnamesz+1], path, pathsz + 1);
 	return bfg_claim_any(api, verbose, devpath);
 }
+
+/* Devices no driver took are remembered by (vid, pid, serial), or by devid if
+ * they have no serial, so rescans skip them instead of sitting through every
+ * matching driver's serial timeouts again. A device is only skipped once it
+ * has failed LOWL_PROBE_CACHE_FAILURES scans in a row, so the immediate retry
+ * drv_detect_all does still happens. Hotplug events forget the entries for
+ * whatever was plugged or unplugged, and entries expire after a while in case
+ * a device just needed time. */
+
+#define LOWL_PROBE_CACHE_FAILURES  2
+#define LOWL_PROBE_CACHE_TTL  600
+
+struct lowlevel_probe_cache {
+	char *key;
+	char *devid;
+	char *serial;
+	unsigned failures;
+	time_t last_failure;
+	UT_hash_handle hh;
+};
+
+static struct lowlevel_probe_cache *probe_cache;
+static pthread_mutex_t probe_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static
+char *lowlevel_probe_cache_key(const struct lowlevel_device_info * const info)
+{
+	const char * const id = (info->serial && info->serial[0]) ? info->serial : (info->devid ?: "");
+	char * const key = malloc(10 + strlen(id) + 1);
+	sprintf(key, "%04x:%04x:%s", (unsigned)info->vid, (unsigned)info->pid, id);
+	return key;
+}
+
+static
+void _lowlevel_probe_cache_del(struct lowlevel_probe_cache * const pc)
+{
+	HASH_DEL(probe_cache, pc);
+	free(pc->key);
+	free(pc->devid);
+	free(pc->serial);
+	free(pc);
+}
+
+// Returns true if the device should not be probed again yet
+bool lowlevel_probe_cache_check(const struct lowlevel_device_info * const info, const time_t now)
+{
+	struct lowlevel_probe_cache *pc;
+	char * const key = lowlevel_probe_cache_key(info);
+	bool rv = false;
+	
+	mutex_lock(&probe_cache_mutex);
+	HASH_FIND_STR(probe_cache, key, pc);
+	if (pc)
+	{
+		if (now - pc->last_failure >= LOWL_PROBE_CACHE_TTL)
+			_lowlevel_probe_cache_del(pc);
+		else
+			rv = (pc->failures >= LOWL_PROBE_CACHE_FAILURES);
+	}
+	mutex_unlock(&probe_cache_mutex);
+	free(key);
+	return rv;
+}
+
+void lowlevel_probe_cache_failed(const struct lowlevel_device_info * const info, const time_t now)
+{
+	struct lowlevel_probe_cache *pc;
+	char * const key = lowlevel_probe_cache_key(info);
+	
+	mutex_lock(&probe_cache_mutex);
+	HASH_FIND_STR(probe_cache, key, pc);
+	if (pc)
+		free(key);
+	else
+	{
+		pc = malloc(sizeof(*pc));
+		*pc = (struct lowlevel_probe_cache){
+			.key = key,
+			.devid = maybe_strdup(info->devid),
+			.serial = (info->serial && info->serial[0]) ? strdup(info->serial) : NULL,
+		};
+		HASH_ADD_KEYPTR(hh, probe_cache, pc->key, strlen(pc->key), pc);
+	}
+	++pc->failures;
+	pc->last_failure = now;
+	mutex_unlock(&probe_cache_mutex);
+}
+
+// Drops entries for the devid or serial given (either may be NULL); returns how many
+int lowlevel_probe_cache_forget(const char * const devid, const char * const serial)
+{
+	struct lowlevel_probe_cache *pc, *tmp;
+	int count = 0;
+	
+	mutex_lock(&probe_cache_mutex);
+	HASH_ITER(hh, probe_cache, pc, tmp)
+	{
+		if (!((devid && pc->devid && !strcmp(devid, pc->devid)) || (serial && serial[0] && pc->serial && !strcmp(serial, pc->serial))))
+			continue;
+		_lowlevel_probe_cache_del(pc);
+		++count;
+	}
+	mutex_unlock(&probe_cache_mutex);
+	return count;
+}
+
+void lowlevel_probe_cache_clear()
+{
+	struct lowlevel_probe_cache *pc, *tmp;
+	
+	mutex_lock(&probe_cache_mutex);
+	HASH_ITER(hh, probe_cache, pc, tmp)
+		_lowlevel_probe_cache_del(pc);
+	mutex_unlock(&probe_cache_mutex);
+}
+
+void test_lowlevel_probe_cache()
+{
+	struct lowlevel_device_info a = {
+		.devid = "dev_t:0001",
+		.serial = "A1",
+		.vid = 0x0403,
+		.pid = 0x6001,
+	}, b = {
+		.devid = "usb:001:002",
+		.vid = 0x0403,
+		.pid = 0x6001,
+	}, anon = {
+		.vid = 0x0403,
+		.pid = 0x6001,
+	}, a_moved = a;
+	const time_t now = 1400000000;
+	
+	a_moved.devid = "dev_t:0002";
+	
+	lowlevel_probe_cache_failed(&a, now);
+	if (lowlevel_probe_cache_check(&a, now))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "probe cache", "skipped after one failure");
+	}
+	lowlevel_probe_cache_failed(&a, now);
+	lowlevel_probe_cache_failed(&b, now);
+	lowlevel_probe_cache_failed(&b, now);
+	if (!(lowlevel_probe_cache_check(&a, now + 1) && lowlevel_probe_cache_check(&a_moved, now + 1) && lowlevel_probe_cache_check(&b, now + 1)))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "probe cache", "not skipped");
+	}
+	
+	// Replugging the same serial forgets it, whatever its new devid
+	if (lowlevel_probe_cache_forget("usb:009:009", "A1") != 1 || lowlevel_probe_cache_check(&a, now + 1) || !lowlevel_probe_cache_check(&b, now + 1))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "probe cache", "forget by serial");
+	}
+	if (lowlevel_probe_cache_forget("usb:001:002", NULL) != 1 || lowlevel_probe_cache_check(&b, now + 1))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "probe cache", "forget by devid");
+	}
+	
+	lowlevel_probe_cache_failed(&b, now);
+	lowlevel_probe_cache_failed(&b, now);
+	if (lowlevel_probe_cache_check(&b, now + LOWL_PROBE_CACHE_TTL) || lowlevel_probe_cache_check(&b, now + LOWL_PROBE_CACHE_TTL + 1))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "probe cache", "expiry");
+	}
+	
+	// Devices with neither serial nor devid are still keyed on VID/PID
+	lowlevel_probe_cache_failed(&anon, now);
+	lowlevel_probe_cache_failed(&anon, now);
+	if (!lowlevel_probe_cache_check(&anon, now + 1))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "probe cache", "no serial or devid");
+	}
+	
+	lowlevel_probe_cache_clear();
+}
+
+/* Probe timings per (vid, pid, product) and driver. Drivers are tried on a
+ * device in priority order, but a driver that took this kind of device before
+ * goes first, and drivers that only ever failed on it go last, quickest
+ * failure first, so a known device no longer waits out every other driver's
+ * timeout. The stats are saved between runs. */
+
+struct lowlevel_probe_stats {
+	char *key;
+	unsigned successes;
+	unsigned failures;
+	double total_ms;
+	UT_hash_handle hh;
+};
+
+static struct lowlevel_probe_stats *probe_stats;
+static bool probe_stats_dirty;
+static pthread_mutex_t probe_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static
+char *lowlevel_probe_stats_key(const struct lowlevel_device_info * const info, const char * const dname)
+{
+	const char * const product = info->product ?: "";
+	char * const key = malloc(10 + strlen(product) + 1 + strlen(dname) + 1);
+	char *p;
+	
+	sprintf(key, "%04x:%04x:%s", (unsigned)info->vid, (unsigned)info->pid, product);
+	// Tabs separate fields in the saved file
+	for (p = key; *p; ++p)
+		if (*p == '\t' || *p == '\n' || *p == '\r')
+			*p = ' ';
+	*p++ = '\t';
+	strcpy(p, dname);
+	return key;
+}
+
+static
+struct lowlevel_probe_stats *_lowlevel_probe_stats_get(char * const key)
+{
+	struct lowlevel_probe_stats *ps;
+	
+	HASH_FIND_STR(probe_stats, key, ps);
+	if (ps)
+	{
+		free(key);
+		return ps;
+	}
+	ps = malloc(sizeof(*ps));
+	*ps = (struct lowlevel_probe_stats){
+		.key = key,
+	};
+	HASH_ADD_KEYPTR(hh, probe_stats, ps->key, strlen(key), ps);
+	return ps;
+}
+
+void lowlevel_probe_stats_record(const struct lowlevel_device_info * const info, const char * const dname, const bool success, const double ms)
+{
+	mutex_lock(&probe_stats_mutex);
+	struct lowlevel_probe_stats * const ps = _lowlevel_probe_stats_get(lowlevel_probe_stats_key(info, dname));
+	if (success)
+		++ps->successes;
+	else
+		++ps->failures;
+	ps->total_ms += ms;
+	probe_stats_dirty = true;
+	mutex_unlock(&probe_stats_mutex);
+}
+
+struct lowlevel_probe_order {
+	const struct device_drv *drv;
+	int rank;
+	unsigned successes;
+	double avg_ms;
+};
+
+static
+bool lowlevel_probe_order_before(const struct lowlevel_probe_order * const a, const struct lowlevel_probe_order * const b)
+{
+	// Never let stats override a driver's probe_priority
+	if (a->drv->probe_priority != b->drv->probe_priority)
+		return false;
+	if (a->rank != b->rank)
+		return a->rank < b->rank;
+	if (a->rank == 0)
+		return a->successes > b->successes;
+	if (a->rank == 2)
+		return a->avg_ms < b->avg_ms;
+	return false;
+}
+
+/* Expects drvs sorted by probe_priority, and only reorders drivers of equal
+ * priority. Stable, so drivers without stats keep their registration order. */
+void lowlevel_probe_stats_order(const struct lowlevel_device_info * const info, const struct device_drv ** const drvs, const int count)
+{
+	struct lowlevel_probe_order order[count], tmp;
+	struct lowlevel_probe_stats *ps;
+	int i, j;
+	
+	mutex_lock(&probe_stats_mutex);
+	for (i = 0; i < count; ++i)
+	{
+		char * const key = lowlevel_probe_stats_key(info, drvs[i]->dname);
+		HASH_FIND_STR(probe_stats, key, ps);
+		free(key);
+		order[i] = (struct lowlevel_probe_order){
+			.drv = drvs[i],
+			.rank = (!ps) ? 1 : (ps->successes ? 0 : 2),
+		};
+		if (ps)
+		{
+			order[i].successes = ps->successes;
+			order[i].avg_ms = ps->total_ms / (ps->successes + ps->failures);
+		}
+	}
+	mutex_unlock(&probe_stats_mutex);
+	
+	for (i = 1; i < count; ++i)
+	{
+		tmp = order[i];
+		for (j = i; j > 0 && lowlevel_probe_order_before(&tmp, &order[j - 1]); --j)
+			order[j] = order[j - 1];
+		order[j] = tmp;
+	}
+	for (i = 0; i < count; ++i)
+		drvs[i] = order[i].drv;
+}
+
+bool lowlevel_probe_stats_load(const char * const filename)
+{
+	char buf[0x400], *p, *dname;
+	unsigned successes, failures;
+	double avg_ms;
+	FILE * const F = fopen(filename, "r");
+	if (!F)
+		return false;
+	
+	mutex_lock(&probe_stats_mutex);
+	while (fgets(buf, sizeof(buf), F))
+	{
+		if (buf[0] == '#')
+			continue;
+		// vid:pid:product \t dname \t successes \t failures \t avg_ms
+		if (!(p = strchr(buf, '\t')))
+			continue;
+		dname = &p[1];
+		if (!(p = strchr(dname, '\t')))
+			continue;
+		*p++ = '\0';
+		if (sscanf(p, "%u\t%u\t%lf", &successes, &failures, &avg_ms) != 3)
+			continue;
+		// Nothing to learn from, and its average is NaN
+		if (!(successes || failures) || !isfinite(avg_ms))
+			continue;
+		dname[-1] = '\0';
+		const size_t keysz = strlen(buf) + 1 + strlen(dname) + 1;
+		char * const key = malloc(keysz);
+		snprintf(key, keysz, "%s\t%s", buf, dname);
+		struct lowlevel_probe_stats * const ps = _lowlevel_probe_stats_get(key);
+		ps->successes += successes;
+		ps->failures += failures;
+		ps->total_ms += avg_ms * (successes + failures);
+	}
+	mutex_unlock(&probe_stats_mutex);
+	fclose(F);
+	return true;
+}
+
+/* Only writes anything if a probe was recorded since the last save. Writes a
+ * temporary file first, so a crash never leaves the stats half written. */
+bool lowlevel_probe_stats_save(const char * const filename)
+{
+	struct lowlevel_probe_stats *ps, *tmp;
+	const size_t tmpfilenamesz = strlen(filename) + 5;
+	char *tmpfilename;
+	FILE *F;
+	bool rv;
+	
+	mutex_lock(&probe_stats_mutex);
+	if (!probe_stats_dirty)
+	{
+		mutex_unlock(&probe_stats_mutex);
+		return true;
+	}
+	tmpfilename = malloc(tmpfilenamesz);
+	if (unlikely(!tmpfilename))
+		quithere(1, "Failed to malloc %s", "tmpfilename");
+	snprintf(tmpfilename, tmpfilenamesz, "%s.tmp", filename);
+	F = fopen(tmpfilename, "w");
+	if (!F)
+	{
+		mutex_unlock(&probe_stats_mutex);
+		free(tmpfilename);
+		return false;
+	}
+	fprintf(F, "# vid:pid:product\tdriver\tsuccesses\tfailures\tavg_ms\n");
+	HASH_ITER(hh, probe_stats, ps, tmp)
+	{
+		if (!(ps->successes || ps->failures))
+			continue;
+		fprintf(F, "%s\t%u\t%u\t%.1f\n", ps->key, ps->successes, ps->failures, ps->total_ms / (ps->successes + ps->failures));
+	}
+	rv = !ferror(F);
+	rv = !fclose(F) && rv;
+#ifdef WIN32
+	// rename does not replace an existing file on Windows
+	if (rv)
+		unlink(filename);
+#endif
+	if (rv && rename(tmpfilename, filename))
+		rv = false;
+	if (rv)
+		probe_stats_dirty = false;
+	else
+		unlink(tmpfilename);
+	mutex_unlock(&probe_stats_mutex);
+	free(tmpfilename);
+	return rv;
+}
+
+static
+void lowlevel_probe_stats_clear()
+{
+	struct lowlevel_probe_stats *ps, *tmp;
+	
+	mutex_lock(&probe_stats_mutex);
+	HASH_ITER(hh, probe_stats, ps, tmp)
+	{
+		HASH_DEL(probe_stats, ps);
+		free(ps->key);
+		free(ps);
+	}
+	mutex_unlock(&probe_stats_mutex);
+}
+
+void test_lowlevel_probe_stats()
+{
+	static struct device_drv drv_a = { .dname = "a" }, drv_b = { .dname = "b" }, drv_c = { .dname = "c" }, drv_d = { .dname = "d" };
+	static struct device_drv drv_e = { .dname = "e", .probe_priority = -1 }, drv_f = { .dname = "f", .probe_priority = 1 };
+	const struct device_drv *drvs[6];
+	struct lowlevel_device_info info = {
+		.vid = 0x067b,
+		.pid = 0x2303,
+		.product = "USB-Serial\tController",
+	};
+	char filename[] = "/tmp/bfgtest-probestats-XXXXXX";
+	
+	// a failed slowly, b took it, c has no stats, d failed quickly
+	// e failed but has a higher priority, f took it but has a lower priority
+	lowlevel_probe_stats_record(&info, "a", false, 5000);
+	lowlevel_probe_stats_record(&info, "b", false, 100);
+	lowlevel_probe_stats_record(&info, "b", true, 100);
+	lowlevel_probe_stats_record(&info, "d", false, 200);
+	lowlevel_probe_stats_record(&info, "e", false, 100);
+	lowlevel_probe_stats_record(&info, "f", true, 100);
+	
+	for (int pass = 0; pass < 2; ++pass)
+	{
+		drvs[0] = &drv_e;
+		drvs[1] = &drv_a;
+		drvs[2] = &drv_b;
+		drvs[3] = &drv_c;
+		drvs[4] = &drv_d;
+		drvs[5] = &drv_f;
+		lowlevel_probe_stats_order(&info, drvs, 6);
+		if (drvs[0] != &drv_e || drvs[1] != &drv_b || drvs[2] != &drv_c || drvs[3] != &drv_d || drvs[4] != &drv_a || drvs[5] != &drv_f)
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s (pass %d)", "probe stats", "order", pass);
+		}
+		
+		if (pass)
+			break;
+		
+		// Same order after saving and loading
+		const int fd = mkstemp(filename);
+		if (fd == -1)
+		{
+			applog(LOG_WARNING, "%s test skipped: %s", "probe stats", "mkstemp");
+			break;
+		}
+		close(fd);
+		if (!lowlevel_probe_stats_save(filename))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "probe stats", "save");
+		}
+		char tmpfilename[sizeof(filename) + 4];
+		snprintf(tmpfilename, sizeof(tmpfilename), "%s.tmp", filename);
+		if (!access(tmpfilename, F_OK))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "probe stats", "temporary file left behind");
+			unlink(tmpfilename);
+		}
+		lowlevel_probe_stats_clear();
+		
+		// An entry without any probes has a NaN average, and must be skipped
+		FILE * const F = fopen(filename, "a");
+		if (F)
+		{
+			fprintf(F, "067b:2303:USB-Serial Controller\tg\t0\t0\tnan\n");
+			fclose(F);
+		}
+		if (!lowlevel_probe_stats_load(filename))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "probe stats", "load");
+		}
+		char * const key = lowlevel_probe_stats_key(&info, "g");
+		struct lowlevel_probe_stats *ps;
+		HASH_FIND_STR(probe_stats, key, ps);
+		free(key);
+		if (ps)
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s", "probe stats", "empty entry loaded");
+		}
+		unlink(filename);
+	}
+	
+	lowlevel_probe_stats_clear();
+}
@@ -3,6 +3,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 #include <pthread.h>
 
 #include <uthash.h>
@@ -61,6 +62,18 @@ extern struct lowlevel_device_info *lowlevel_ref(const struct lowlevel_device_in
 extern void lowlevel_devinfo_semicpy(struct lowlevel_device_info *dst, const struct lowlevel_device_info *src);
 extern void lowlevel_devinfo_free(struct lowlevel_device_info *);
 
+extern bool lowlevel_probe_cache_check(const struct lowlevel_device_info *, time_t now);
+extern void lowlevel_probe_cache_failed(const struct lowlevel_device_info *, time_t now);
+extern int lowlevel_probe_cache_forget(const char *devid, const char *serial);
+extern void lowlevel_probe_cache_clear();
+extern void test_lowlevel_probe_cache();
+
+extern void lowlevel_probe_stats_record(const struct lowlevel_device_info *, const char *dname, bool success, double ms);
+extern void lowlevel_probe_stats_order(const struct lowlevel_device_info *, const struct device_drv **, int count);
+extern bool lowlevel_probe_stats_load(const char *filename);
+extern bool lowlevel_probe_stats_save(const char *filename);
+extern void test_lowlevel_probe_stats();
+
 #ifdef NEED_BFG_LOWL_FTDI
 extern struct lowlevel_driver lowl_ft232r;
 #endif
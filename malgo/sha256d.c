@@ -10,13 +10,16 @@
 #include "config.h"
 
 #include <math.h>
+#include <stdint.h>
 #include <string.h>
 
 #include <uthash.h>
 
 #include "logging.h"
+#include "malgo/sha256d.h"
 #include "miner.h"
 #include "ocl.h"
+#include "sha2.h"
 #include "util.h"
 
 static
@@ -31,6 +34,186 @@ void hash_data(void *out_hash, const void *data)
 	//gen_hash(blkheader, out_hash, 80);
 }
 
+/* Nonce checks hash many headers sharing one midstate, so they run several
+ * lanes at once in GCC vector types, which the compiler maps to whatever SIMD
+ * the target has (SSE2, NEON, AltiVec), or to plain scalar code otherwise.
+ * On x86, an AVX2 build of the same code is picked at runtime if supported. */
+
+#define SHA256D_LANES  8
+
+typedef uint32_t sha256d_lanes_t __attribute__((vector_size(SHA256D_LANES * sizeof(uint32_t))));
+
+#define LROTR(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define LCH(x, y, z)  (((x) & (y)) ^ (~(x) & (z)))
+#define LMAJ(x, y, z)  (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define LF1(x)  (LROTR(x,  2) ^ LROTR(x, 13) ^ LROTR(x, 22))
+#define LF2(x)  (LROTR(x,  6) ^ LROTR(x, 11) ^ LROTR(x, 25))
+#define LF3(x)  (LROTR(x,  7) ^ LROTR(x, 18) ^ ((x) >>  3))
+#define LF4(x)  (LROTR(x, 17) ^ LROTR(x, 19) ^ ((x) >> 10))
+
+static const uint32_t sha256d_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static inline __attribute__((always_inline))
+void sha256_lanes_transform(sha256d_lanes_t * const state, sha256d_lanes_t * const W)
+{
+	sha256d_lanes_t a = state[0], b = state[1], c = state[2], d = state[3];
+	sha256d_lanes_t e = state[4], f = state[5], g = state[6], h = state[7];
+	sha256d_lanes_t t1, t2;
+	int i;
+	
+	for (i = 16; i < 64; ++i)
+		W[i] = LF4(W[i - 2]) + W[i - 7] + LF3(W[i - 15]) + W[i - 16];
+	for (i = 0; i < 64; ++i)
+	{
+		t1 = h + LF2(e) + LCH(e, f, g) + sha256_k[i] + W[i];
+		t2 = LF1(a) + LMAJ(a, b, c);
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+	state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+// Hashes up to SHA256D_LANES 80-byte headers, given as the midstate and tail words, into the final state words
+static inline __attribute__((always_inline))
+void _sha256d_lanes(uint32_t (* const out)[8], const uint32_t * const mid, const uint32_t (* const tails)[4], const unsigned count)
+{
+	sha256d_lanes_t state[8], W[64];
+	int i;
+	unsigned lane;
+	
+	for (i = 0; i < 8; ++i)
+		state[i] = (sha256d_lanes_t){0} + mid[i];
+	for (i = 0; i < 4; ++i)
+		for (lane = 0; lane < SHA256D_LANES; ++lane)
+			W[i][lane] = tails[(lane < count) ? lane : 0][i];
+	W[4] = (sha256d_lanes_t){0} + 0x80000000;
+	for (i = 5; i < 15; ++i)
+		W[i] = (sha256d_lanes_t){0};
+	W[15] = (sha256d_lanes_t){0} + (80 * 8);
+	sha256_lanes_transform(state, W);
+	
+	for (i = 0; i < 8; ++i)
+	{
+		W[i] = state[i];
+		state[i] = (sha256d_lanes_t){0} + sha256d_iv[i];
+	}
+	W[8] = (sha256d_lanes_t){0} + 0x80000000;
+	for (i = 9; i < 15; ++i)
+		W[i] = (sha256d_lanes_t){0};
+	W[15] = (sha256d_lanes_t){0} + (32 * 8);
+	sha256_lanes_transform(state, W);
+	
+	for (lane = 0; lane < count; ++lane)
+		for (i = 0; i < 8; ++i)
+			out[lane][i] = state[i][lane];
+}
+
+typedef void (*sha256d_lanes_func_t)(uint32_t (*)[8], const uint32_t *, const uint32_t (*)[4], unsigned);
+
+static
+void sha256d_lanes_generic(uint32_t (* const out)[8], const uint32_t * const mid, const uint32_t (* const tails)[4], const unsigned count)
+{
+	_sha256d_lanes(out, mid, tails, count);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+static __attribute__((target("avx2")))
+void sha256d_lanes_avx2(uint32_t (* const out)[8], const uint32_t * const mid, const uint32_t (* const tails)[4], const unsigned count)
+{
+	_sha256d_lanes(out, mid, tails, count);
+}
+#endif
+
+static
+sha256d_lanes_func_t sha256d_lanes_func(void)
+{
+	static sha256d_lanes_func_t func;
+	
+	if (likely(func))
+		return func;
+	func = sha256d_lanes_generic;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		func = sha256d_lanes_avx2;
+#endif
+	return func;
+}
+
+// Hashes count headers with the first 64 bytes given by midstate, and the last 16 by each of tails (both laid out as in struct work), into out_hashes
+static
+void _sha256d_hash_tails(uint32_t (* const out)[8], const void * const midstate, const void * const tails, const unsigned count)
+{
+	const uint32_t * const tail32 = tails;
+	uint32_t mid[8], W[count][4];
+	unsigned i;
+	
+	swap32tole(mid, midstate, 8);
+	for (i = 0; i < count * 4; ++i)
+		W[i / 4][i % 4] = le32toh(tail32[i]);
+	
+	if (count == 1)
+	{
+		// Not worth a whole set of lanes
+		sha256_ctx ctx = {
+			.tot_len = 64,
+		};
+		unsigned char tail[16], hash1[32];
+		
+		memcpy(ctx.h, mid, sizeof(mid));
+		swap32tobe(tail, W[0], 4);
+		sha256_update(&ctx, tail, sizeof(tail));
+		sha256_final(&ctx, hash1);
+		sha256(hash1, sizeof(hash1), (void *)out[0]);
+		swap32tobe(out[0], out[0], 8);
+		return;
+	}
+	
+	const sha256d_lanes_func_t func = sha256d_lanes_func();
+	for (i = 0; i < count; i += SHA256D_LANES)
+		func(&out[i], mid, &W[i], (count - i < SHA256D_LANES) ? (count - i) : SHA256D_LANES);
+}
+
+void sha256d_hash_tails(void * const out_hashes, const void * const midstate, const void * const tails, const unsigned count)
+{
+	uint32_t (* const out)[8] = out_hashes;
+	
+	_sha256d_hash_tails(out, midstate, tails, count);
+	// Digest bytes are the state words in big endian
+	swap32tobe(out, out, count * 8);
+}
+
+/* Returns a bit set for each of nonces (at most SHA256D_TEST_NONCES_MAX) that,
+ * in place of the nonce in tail, gives a hash with its last 32 bits zero */
+uint32_t sha256d_test_nonces(const void * const midstate, const void * const tail, const uint32_t * const nonces, const unsigned count)
+{
+	uint32_t tails[SHA256D_TEST_NONCES_MAX][4], out[SHA256D_TEST_NONCES_MAX][8];
+	uint32_t rv = 0;
+	unsigned i;
+	
+	if (unlikely(!count || count > SHA256D_TEST_NONCES_MAX))
+	{
+		if (count)
+			applog(LOG_ERR, "%s: %u nonces is over the maximum of %d",
+			       __func__, count, SHA256D_TEST_NONCES_MAX);
+		return 0;
+	}
+	
+	for (i = 0; i < count; ++i)
+	{
+		memcpy(tails[i], tail, 12);
+		tails[i][3] = htole32(nonces[i]);
+	}
+	_sha256d_hash_tails(out, midstate, tails, count);
+	for (i = 0; i < count; ++i)
+		if (!out[i][7])
+			rv |= (uint32_t)1 << i;
+	return rv;
+}
+
 #ifdef USE_OPENCL
 static
 float opencl_oclthreads_to_intensity_sha256d(const unsigned long oclthreads)
@@ -106,6 +289,75 @@ struct mining_algorithm malgo_sha256d = {
 #endif
 };
 
+void test_sha256d(void)
+{
+	unsigned char data[80], hash[32], blkheader[80];
+	uint32_t midstate[8], tails[19][4], out[19][8], lanes_out[SHA256D_LANES][8];
+	sha256_ctx ctx;
+	int i, j;
+	
+	for (i = 0; i < 80; ++i)
+		data[i] = i * 0x1d + 7;
+	swap32yes(blkheader, data, 64 / 4);
+	sha256_init(&ctx);
+	sha256_update(&ctx, blkheader, 64);
+	swap32tole(midstate, ctx.h, 8);
+	for (i = 0; i < 19; ++i)
+	{
+		memcpy(tails[i], &data[64], 16);
+		tails[i][3] = htole32(0x10000 * i + 0x1234);
+	}
+	
+	// Odd count: one full set of lanes, then a partial one, against the plain double-SHA256
+	sha256d_hash_tails(out, midstate, tails, 19);
+	for (i = 0; i < 19; ++i)
+	{
+		memcpy(&data[64], tails[i], 16);
+		swap32yes(blkheader, data, 80 / 4);
+		gen_hash(blkheader, hash, 80);
+		if (memcmp(hash, out[i], sizeof(hash)))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "%s test failed: %s %d", "sha256d", "hash_tails lane", i);
+		}
+	}
+	sha256d_hash_tails(out, midstate, tails[5], 1);
+	memcpy(&data[64], tails[5], 16);
+	swap32yes(blkheader, data, 80 / 4);
+	gen_hash(blkheader, hash, 80);
+	if (memcmp(hash, out[0], sizeof(hash)))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "sha256d", "hash_tails single");
+	}
+	
+	// The runtime choice must agree with the generic build
+	swap32tole(midstate, midstate, 8);
+	for (i = 0; i < 19; ++i)
+		for (j = 0; j < 4; ++j)
+			tails[i][j] = le32toh(tails[i][j]);
+	sha256d_lanes_generic(lanes_out, midstate, tails, SHA256D_LANES);
+	sha256d_lanes_func()(out, midstate, tails, SHA256D_LANES);
+	if (memcmp(out, lanes_out, sizeof(lanes_out)))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "sha256d", "lanes dispatch");
+	}
+	
+	// Genesis block, between two bad nonces
+	static const uint32_t nonces[] = {0x1dac2b7b, 0x1dac2b7c, 0x1dac2b7d};
+	hex2bin(blkheader, "0100000000000000000000000000000000000000000000000000000000000000000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4a29ab5f49ffff001d1dac2b7c", 80);
+	swap32yes(data, blkheader, 80 / 4);
+	sha256_init(&ctx);
+	sha256_update(&ctx, blkheader, 64);
+	swap32tole(midstate, ctx.h, 8);
+	if (sha256d_test_nonces(midstate, &data[64], nonces, 3) != 2 || sha256d_test_nonces(midstate, &data[64], nonces, 0))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "sha256d", "test_nonces");
+	}
+}
+
 static
 __attribute__((constructor))
 void init_sha256d(void)
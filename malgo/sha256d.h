@@ -0,0 +1,14 @@
+#ifndef BFG_MALGO_SHA256D_H
+#define BFG_MALGO_SHA256D_H
+
+#include <stdint.h>
+
+// Most candidates sha256d_test_nonces takes at once
+#define SHA256D_TEST_NONCES_MAX  32
+
+extern void sha256d_hash_tails(void *out_hashes, const void *midstate, const void *tails, unsigned count);
+extern uint32_t sha256d_test_nonces(const void *midstate, const void *tail, const uint32_t *nonces, unsigned count);
+
+extern void test_sha256d(void);
+
+#endif
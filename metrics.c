@@ -0,0 +1,338 @@
+/*
+ * Copyright 2026 MassGridMiner developers
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#include "config.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "logging.h"
+#include "metrics.h"
+#include "miner.h"
+#include "util.h"
+
+/* Snapshots copy the counters out of every processor without taking any
+ * device locks, the same way the devs API command reads them. One snapshot
+ * is shared by every consumer (API watchers, HTTP scrapes) until it is older
+ * than they want, so a busy monitoring setup costs one walk of the device
+ * list per interval rather than one per request. The lock below only guards
+ * the shared pointer and reference counts. */
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_snapshot *metrics_current;
+static unsigned long metrics_seq;
+
+static
+struct metrics_snapshot *metrics_snapshot_new(const int procs)
+{
+	struct metrics_snapshot * const snap = malloc(sizeof(*snap) + (sizeof(*snap->proc) * procs));
+	if (unlikely(!snap))
+		quithere(1, "OOM metrics_snapshot");
+	*snap = (struct metrics_snapshot){
+		.refs = 1,
+		.procs = procs,
+	};
+	return snap;
+}
+
+static
+struct metrics_snapshot *metrics_collect(const struct timeval * const tvp_now)
+{
+	struct metrics_snapshot *snap;
+	struct metrics_proc *mp;
+	struct cgpu_info *proc;
+	int procs;
+	
+	rd_lock(&devices_lock);
+	procs = total_devices;
+	snap = metrics_snapshot_new(procs);
+	snap->seq = ++metrics_seq;
+	snap->tv_taken = *tvp_now;
+	snap->when = time(NULL);
+	snap->elapsed = total_secs;
+	for (int i = 0; i < procs; ++i)
+	{
+		proc = devices[i];
+		mp = &snap->proc[i];
+		snprintf(mp->repr, sizeof(mp->repr), "%s", proc->proc_repr_ns);
+		mp->dname = proc->drv->dname;
+		mp->enabled = (proc->deven != DEV_DISABLED);
+		mp->status = proc->status;
+		mp->temp = proc->temp;
+		mp->total_mhashes = proc->total_mhashes;
+		mp->rolling = proc->drv->get_proc_rolling_hashrate ? proc->drv->get_proc_rolling_hashrate(proc) : proc->rolling;
+		mp->accepted = proc->accepted;
+		mp->rejected = proc->rejected;
+		mp->stale = proc->stale;
+		mp->hw_errors = proc->hw_errors;
+		mp->diff_accepted = proc->diff_accepted;
+		mp->diff_rejected = proc->diff_rejected;
+	}
+	rd_unlock(&devices_lock);
+	return snap;
+}
+
+static
+void __metrics_snapshot_put(struct metrics_snapshot * const snap)
+{
+	if (!--snap->refs)
+		free(snap);
+}
+
+// Returns a snapshot no older than max_age_ms; release it with metrics_snapshot_put
+struct metrics_snapshot *metrics_snapshot_get(const unsigned max_age_ms)
+{
+	struct metrics_snapshot *snap;
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	mutex_lock(&metrics_lock);
+	snap = metrics_current;
+	if (!(snap && snap->procs == total_devices && ms_tdiff(&tv_now, &snap->tv_taken) < max_age_ms))
+	{
+		snap = metrics_collect(&tv_now);
+		if (metrics_current)
+			__metrics_snapshot_put(metrics_current);
+		metrics_current = snap;
+	}
+	++snap->refs;
+	mutex_unlock(&metrics_lock);
+	return snap;
+}
+
+void metrics_snapshot_put(struct metrics_snapshot * const snap)
+{
+	if (!snap)
+		return;
+	mutex_lock(&metrics_lock);
+	__metrics_snapshot_put(snap);
+	mutex_unlock(&metrics_lock);
+}
+
+static
+void metrics_prometheus_label(bytes_t * const out, const char * const s)
+{
+	for (const char *p = s; *p; ++p)
+	{
+		if (*p == '\\' || *p == '"')
+			bytes_append(out, "\\", 1);
+		if (*p == '\n')
+			bytes_append(out, "\\n", 2);
+		else
+			bytes_append(out, p, 1);
+	}
+}
+
+static
+void metrics_prometheus_header(bytes_t * const out, const char * const name, const char * const type, const char * const help)
+{
+	bytes_appendf(out, "# HELP bfgminer_%s %s\n# TYPE bfgminer_%s %s\n", name, help, name, type);
+}
+
+static
+void metrics_prometheus_sample(bytes_t * const out, const char * const name, const struct metrics_proc * const mp, const double value)
+{
+	bytes_appendf(out, "bfgminer_%s{proc=\"", name);
+	metrics_prometheus_label(out, mp->repr);
+	bytes_append(out, "\",driver=\"", 10);
+	metrics_prometheus_label(out, mp->dname);
+	bytes_appendf(out, "\"} %.15g\n", value);
+}
+
+// Prometheus text exposition format (version 0.0.4)
+void metrics_prometheus(bytes_t * const out, const struct metrics_snapshot * const snap)
+{
+	const struct metrics_proc *mp;
+	int i;
+	
+	metrics_prometheus_header(out, "uptime_seconds", "gauge", "Seconds since mining started");
+	bytes_appendf(out, "bfgminer_uptime_seconds %.15g\n", snap->elapsed);
+	
+#define METRICS_EACH_PROC(name, type, help, expr)  do {  \
+	metrics_prometheus_header(out, name, type, help);  \
+	for (i = 0; i < snap->procs; ++i)  \
+	{  \
+		mp = &snap->proc[i];  \
+		metrics_prometheus_sample(out, name, mp, (expr));  \
+	}  \
+} while(0)
+	
+	METRICS_EACH_PROC("up", "gauge", "Whether the processor is enabled and working", (mp->enabled && mp->status == LIFE_WELL) ? 1 : 0);
+	METRICS_EACH_PROC("hashes_total", "counter", "Hashes performed", mp->total_mhashes * 1e6);
+	METRICS_EACH_PROC("hashrate", "gauge", "Rolling hashrate in hashes per second", mp->rolling * 1e6);
+	METRICS_EACH_PROC("shares_accepted_total", "counter", "Shares accepted by pools", mp->accepted);
+	METRICS_EACH_PROC("shares_rejected_total", "counter", "Shares rejected by pools", mp->rejected);
+	METRICS_EACH_PROC("shares_stale_total", "counter", "Shares found stale", mp->stale);
+	METRICS_EACH_PROC("hw_errors_total", "counter", "Hardware errors", mp->hw_errors);
+	METRICS_EACH_PROC("difficulty_accepted_total", "counter", "Sum of accepted share difficulty", mp->diff_accepted);
+	METRICS_EACH_PROC("difficulty_rejected_total", "counter", "Sum of rejected share difficulty", mp->diff_rejected);
+	
+#undef METRICS_EACH_PROC
+	
+	metrics_prometheus_header(out, "temperature_celsius", "gauge", "Processor temperature");
+	for (i = 0; i < snap->procs; ++i)
+	{
+		mp = &snap->proc[i];
+		if (mp->temp > 0)
+			metrics_prometheus_sample(out, "temperature_celsius", mp, mp->temp);
+	}
+}
+
+static
+bool metrics_delta_proc(bytes_t * const out, const struct metrics_proc * const old, const struct metrics_proc * const mp, bool first)
+{
+	const size_t startsz = bytes_len(out);
+	bool any = false;
+	
+	bytes_appendf(out, "%s{\"ID\":\"%s\"", first ? "" : ",", mp->repr);
+	
+#define METRICS_DELTA(cond, ...)  do {  \
+	if (!old || (cond))  \
+	{  \
+		bytes_appendf(out, __VA_ARGS__);  \
+		any = true;  \
+	}  \
+} while(0)
+	
+	METRICS_DELTA(strcmp(old->dname, mp->dname), ",\"Driver\":\"%s\"", mp->dname);
+	METRICS_DELTA(old->enabled != mp->enabled, ",\"Enabled\":%s", mp->enabled ? "true" : "false");
+	METRICS_DELTA(old->status != mp->status, ",\"Status\":\"%s\"", status2str(mp->status));
+	METRICS_DELTA(old->temp != mp->temp, ",\"Temperature\":%.2f", mp->temp);
+	METRICS_DELTA(old->total_mhashes != mp->total_mhashes, ",\"Total MH\":%.4f", mp->total_mhashes);
+	METRICS_DELTA(old->rolling != mp->rolling, ",\"MHS rolling\":%.3f", mp->rolling);
+	METRICS_DELTA(old->accepted != mp->accepted, ",\"Accepted\":%d", mp->accepted);
+	METRICS_DELTA(old->rejected != mp->rejected, ",\"Rejected\":%d", mp->rejected);
+	METRICS_DELTA(old->stale != mp->stale, ",\"Stale\":%d", mp->stale);
+	METRICS_DELTA(old->hw_errors != mp->hw_errors, ",\"Hardware Errors\":%d", mp->hw_errors);
+	METRICS_DELTA(old->diff_accepted != mp->diff_accepted, ",\"Difficulty Accepted\":%.8f", mp->diff_accepted);
+	METRICS_DELTA(old->diff_rejected != mp->diff_rejected, ",\"Difficulty Rejected\":%.8f", mp->diff_rejected);
+	
+#undef METRICS_DELTA
+	
+	if (!any)
+	{
+		bytes_resize(out, startsz);
+		return false;
+	}
+	bytes_append(out, "}", 1);
+	return true;
+}
+
+/* Appends one line of JSON with the fields that changed since the old
+ * snapshot, or every field if old is NULL or the device list changed.
+ * Returns false (appending nothing) if nothing changed. */
+bool metrics_delta_json(bytes_t * const out, const struct metrics_snapshot * const old, const struct metrics_snapshot * const snap)
+{
+	const size_t startsz = bytes_len(out);
+	const bool full = !(old && old->procs == snap->procs);
+	bool any = false;
+	
+	bytes_appendf(out, "{\"WATCH\":{\"Seq\":%lu,\"When\":%ld,\"Elapsed\":%.0f,\"Full\":%s,\"Procs\":[", snap->seq, (long)snap->when, snap->elapsed, full ? "true" : "false");
+	for (int i = 0; i < snap->procs; ++i)
+	{
+		const struct metrics_proc *oldmp = full ? NULL : &old->proc[i];
+		if (oldmp && strcmp(oldmp->repr, snap->proc[i].repr))
+			oldmp = NULL;
+		if (metrics_delta_proc(out, oldmp, &snap->proc[i], !any))
+			any = true;
+	}
+	if (!(any || full))
+	{
+		bytes_resize(out, startsz);
+		return false;
+	}
+	bytes_append(out, "]}}\n", 4);
+	return true;
+}
+
+static
+void _test_metrics_check(const bytes_t * const out, const char * const expect, const bool present)
+{
+	bytes_t b = BYTES_INIT;
+	bytes_cpy(&b, out);
+	bytes_nullterminate(&b);
+	if ((!strstr((const char *)bytes_buf(&b), expect)) == present)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s \"%s\" in: %s", "metrics", present ? "missing" : "unexpected", expect, (const char *)bytes_buf(&b));
+	}
+	bytes_free(&b);
+}
+
+void test_metrics()
+{
+	struct metrics_snapshot * const a = metrics_snapshot_new(2), * const b = metrics_snapshot_new(2);
+	bytes_t out = BYTES_INIT;
+	
+	a->seq = 1;
+	a->when = 1000;
+	a->elapsed = 10;
+	a->proc[0] = (struct metrics_proc){
+		.repr = "PGA0",
+		.dname = "icarus",
+		.enabled = true,
+		.status = LIFE_WELL,
+		.temp = 45,
+		.total_mhashes = 1000,
+		.rolling = 100,
+		.accepted = 3,
+	};
+	a->proc[1] = (struct metrics_proc){
+		.repr = "PGA1a",
+		.dname = "bifury",
+		.enabled = true,
+		.status = LIFE_SICK,
+	};
+	*b = *a;
+	b->proc[0] = a->proc[0];
+	b->proc[1] = a->proc[1];
+	b->seq = 2;
+	
+	metrics_prometheus(&out, a);
+	_test_metrics_check(&out, "# TYPE bfgminer_hashes_total counter\n", true);
+	_test_metrics_check(&out, "bfgminer_hashes_total{proc=\"PGA0\",driver=\"icarus\"} 1000000000\n", true);
+	_test_metrics_check(&out, "bfgminer_up{proc=\"PGA1a\",driver=\"bifury\"} 0\n", true);
+	_test_metrics_check(&out, "bfgminer_temperature_celsius{proc=\"PGA0\",driver=\"icarus\"} 45\n", true);
+	_test_metrics_check(&out, "bfgminer_temperature_celsius{proc=\"PGA1a\"", false);
+	bytes_reset(&out);
+	
+	if (!metrics_delta_json(&out, NULL, a))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "metrics", "no full update");
+	}
+	_test_metrics_check(&out, "\"Full\":true", true);
+	_test_metrics_check(&out, "{\"ID\":\"PGA1a\",\"Driver\":\"bifury\",\"Enabled\":true,\"Status\":\"Sick\"", true);
+	bytes_reset(&out);
+	
+	if (metrics_delta_json(&out, a, b) || bytes_len(&out))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "metrics", "update without changes");
+	}
+	
+	b->proc[1].accepted = 1;
+	b->proc[1].hw_errors = 2;
+	if (!metrics_delta_json(&out, a, b))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "metrics", "missing delta");
+	}
+	_test_metrics_check(&out, "\"Full\":false,\"Procs\":[{\"ID\":\"PGA1a\",\"Accepted\":1,\"Hardware Errors\":2}]}}\n", true);
+	_test_metrics_check(&out, "PGA0", false);
+	
+	bytes_free(&out);
+	free(a);
+	free(b);
+}
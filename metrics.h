@@ -0,0 +1,45 @@
+#ifndef BFG_METRICS_H
+#define BFG_METRICS_H
+
+#include <stdbool.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "miner.h"
+#include "util.h"
+
+struct metrics_proc {
+	char repr[9];
+	const char *dname;
+	bool enabled;
+	enum alive status;
+	float temp;
+	double total_mhashes;
+	double rolling;
+	int accepted;
+	int rejected;
+	int stale;
+	int hw_errors;
+	double diff_accepted;
+	double diff_rejected;
+};
+
+struct metrics_snapshot {
+	int refs;
+	unsigned long seq;
+	struct timeval tv_taken;
+	time_t when;
+	double elapsed;
+	int procs;
+	struct metrics_proc proc[];
+};
+
+extern struct metrics_snapshot *metrics_snapshot_get(unsigned max_age_ms);
+extern void metrics_snapshot_put(struct metrics_snapshot *);
+
+extern void metrics_prometheus(bytes_t *out, const struct metrics_snapshot *);
+extern bool metrics_delta_json(bytes_t *out, const struct metrics_snapshot *old, const struct metrics_snapshot *);
+
+extern void test_metrics();
+
+#endif
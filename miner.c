@@ -53,6 +53,7 @@
 #if defined(HAVE_LIBUDEV) && defined(HAVE_SYS_EPOLL_H)
 #include <libudev.h>
 #include <sys/epoll.h>
+#include <sys/sysmacros.h>
 #define HAVE_BFG_HOTPLUG
 #endif
 #else
@@ -80,6 +81,9 @@
 #include "adl.h"
 #include "driver-cpu.h"
 #include "driver-opencl.h"
+#include "history.h"
+#include "journal.h"
+#include "metrics.h"
 #include "util.h"
 
 #ifdef USE_AVALON
@@ -88,6 +92,16 @@
 
 #ifdef HAVE_BFG_LOWLEVEL
 #include "lowlevel.h"
+#include "lowl-capture.h"
+#include "lowl-frame.h"
+#endif
+
+#ifdef HAVE_LIBUSB
+#include "lowl-usb.h"
+#endif
+
+#ifdef NEED_DYNCLOCK
+#include "dynclock.h"
 #endif
 
 #if defined(unix) || defined(__APPLE__)
@@ -100,6 +114,10 @@
 #include "malgo/scrypt.h"
 #endif
 
+#ifdef USE_SHA256D
+#include "malgo/sha256d.h"
+#endif
+
 #if defined(USE_AVALON) || defined(USE_BITFORCE) || defined(USE_ICARUS) || defined(USE_MODMINER) || defined(USE_NANOFURY) || defined(USE_X6500) || defined(USE_ZTEX)
 #	define USE_FPGA
 #endif
@@ -125,6 +143,10 @@ struct strategies strategies[] = {
 bool opt_protocol;
 bool opt_dev_protocol;
 static bool opt_benchmark, opt_benchmark_intense;
+static bool opt_driver_bench;
+#ifdef NEED_DYNCLOCK
+static char *opt_dclk_state;
+#endif
 static bool want_longpoll = true;
 static bool want_gbt = true;
 static bool want_getwork = true;
@@ -186,6 +208,7 @@ bool opt_restart = true;
 #ifdef USE_LIBMICROHTTPD
 #include "httpsrv.h"
 int httpsrv_port = -1;
+bool opt_http_metrics;
 #endif
 #ifdef USE_LIBEVENT
 long stratumsrv_port = -1;
@@ -277,6 +300,8 @@ static pthread_mutex_t sshare_lock;
 
 pthread_rwlock_t netacc_lock;
 pthread_rwlock_t mining_thr_lock;
+// One wake reaches every mining thread waiting in do_notifier_select
+notifier_t work_restart_broadcast;
 pthread_rwlock_t devices_lock;
 
 static pthread_mutex_t lp_lock;
@@ -526,6 +551,17 @@ float drv_min_nonce_diff(const struct device_drv * const drv, struct cgpu_info *
 #endif
 }
 
+#ifndef WIN32
+static
+char *bfg_make_devid_devt(const dev_t devnum)
+{
+	char *devs = malloc(6 + (sizeof(dev_t) * 2) + 1);
+	memcpy(devs, "dev_t:", 6);
+	bin2hex(&devs[6], &devnum, sizeof(dev_t));
+	return devs;
+}
+#endif
+
 char *devpath_to_devid(const char *devpath)
 {
 #ifndef WIN32
@@ -534,9 +570,7 @@ char *devpath_to_devid(const char *devpath)
 	struct stat my_stat;
 	if (stat(devpath, &my_stat))
 		return NULL;
-	char *devs = malloc(6 + (sizeof(dev_t) * 2) + 1);
-	memcpy(devs, "dev_t:", 6);
-	bin2hex(&devs[6], &my_stat.st_rdev, sizeof(dev_t));
+	char * const devs = bfg_make_devid_devt(my_stat.st_rdev);
 #else
 	if (!strncmp(devpath, "\\\\.\\", 4))
 		devpath += 4;
@@ -897,6 +931,8 @@ int cgpu_search(const char * const pattern, const int first)
 
 static pthread_mutex_t sharelog_lock;
 static FILE *sharelog_file = NULL;
+static struct journal *sharelog_journal;
+static char *opt_sharelog_dump;
 
 struct thr_info *get_thread(int thr_id)
 {
@@ -929,77 +965,74 @@ struct cgpu_info *get_devices(int id)
 
 static pthread_mutex_t noncelog_lock = PTHREAD_MUTEX_INITIALIZER;
 static FILE *noncelog_file = NULL;
+static struct journal *noncelog_journal;
 
 static
-void noncelog(const struct work * const work)
+void noncelog2(const int thr_id, const void * const hash, const void * const data, const void * const midstate)
 {
-	const int thr_id = work->thr_id;
 	const struct cgpu_info *proc = get_thr_cgpu(thr_id);
-	char buf[0x200], hash[65], data[161], midstate[65];
-	int rv;
+	const struct journal_nonce jn = {
+		.timestamp = time(NULL),
+		.proc = proc->proc_repr_ns,
+		.hash = hash,
+		.data = data,
+		.midstate = midstate,
+	};
+	bytes_t csv = BYTES_INIT;
 	size_t ret;
 	
-	bin2hex(hash, work->hash, 32);
-	bin2hex(data, work->data, 80);
-	bin2hex(midstate, work->midstate, 32);
-	
-	// timestamp,proc,hash,data,midstate
-	rv = snprintf(buf, sizeof(buf), "%lu,%s,%s,%s,%s\n",
-	              (unsigned long)time(NULL), proc->proc_repr_ns,
-	              hash, data, midstate);
-	
-	if (unlikely(rv < 1))
-	{
-		applog(LOG_ERR, "noncelog printf error");
+	if (noncelog_journal)
+		journal_add_nonce(noncelog_journal, &jn);
+	if (!noncelog_file)
 		return;
-	}
+	
+	journal_nonce_csv(&csv, &jn);
 	
 	mutex_lock(&noncelog_lock);
-	ret = fwrite(buf, rv, 1, noncelog_file);
+	ret = fwrite(bytes_buf(&csv), bytes_len(&csv), 1, noncelog_file);
 	fflush(noncelog_file);
 	mutex_unlock(&noncelog_lock);
 	
+	bytes_free(&csv);
 	if (ret != 1)
 		applog(LOG_ERR, "noncelog fwrite error");
 }
 
 static void sharelog(const char*disposition, const struct work*work)
 {
-	char target[(sizeof(work->target) * 2) + 1];
-	char hash[(sizeof(work->hash) * 2) + 1];
-	char data[(sizeof(work->data) * 2) + 1];
 	struct cgpu_info *cgpu;
-	unsigned long int t;
-	struct pool *pool;
-	int thr_id, rv;
-	char s[1024];
+	struct journal_share js;
+	bytes_t csv = BYTES_INIT;
 	size_t ret;
 
-	if (!sharelog_file)
+	if (!(sharelog_file || sharelog_journal))
 		return;
 
-	thr_id = work->thr_id;
-	cgpu = get_thr_cgpu(thr_id);
-	pool = work->pool;
-	t = work->ts_getwork + timer_elapsed(&work->tv_getwork, &work->tv_work_found);
-	bin2hex(target, work->target, sizeof(work->target));
-	bin2hex(hash, work->hash, sizeof(work->hash));
-	bin2hex(data, work->data, sizeof(work->data));
-
-	// timestamp,disposition,target,pool,dev,thr,sharehash,sharedata
-	rv = snprintf(s, sizeof(s), "%lu,%s,%s,%s,%s,%u,%s,%s\n", t, disposition, target, pool->rpc_url, cgpu->proc_repr_ns, thr_id, hash, data);
-	if (rv >= (int)(sizeof(s)))
-		s[sizeof(s) - 1] = '\0';
-	else if (rv < 0) {
-		applog(LOG_ERR, "sharelog printf error");
+	cgpu = get_thr_cgpu(work->thr_id);
+	js = (struct journal_share){
+		.timestamp = work->ts_getwork + timer_elapsed(&work->tv_getwork, &work->tv_work_found),
+		.disposition = disposition,
+		.url = work->pool->rpc_url,
+		.proc = cgpu->proc_repr_ns,
+		.thr_id = work->thr_id,
+		.target = work->target,
+		.hash = work->hash,
+		.data = work->data,
+	};
+
+	if (sharelog_journal)
+		journal_add_share(sharelog_journal, &js);
+	if (!sharelog_file)
 		return;
-	}
+
+	journal_share_csv(&csv, &js);
 
 	mutex_lock(&sharelog_lock);
-	ret = fwrite(s, rv, 1, sharelog_file);
+	ret = fwrite(bytes_buf(&csv), bytes_len(&csv), 1, sharelog_file);
 	fflush(sharelog_file);
 	mutex_unlock(&sharelog_lock);
 
+	bytes_free(&csv);
 	if (ret != 1)
 		applog(LOG_ERR, "sharelog fwrite error");
 }
@@ -1021,7 +1054,13 @@ void goal_set_malgo(struct mining_goal_info * const goal, struct mining_algorith
 		// First time using a new mining algorithm may means we need to add mining hardware to support it
 		// api_thr_id is used as an ugly hack to determine if mining has started - if not, we do NOT want to try to hotplug anything (let the initial detect handle it)
 		if (opt_hotplug && api_thr_id)
+		{
+#ifdef HAVE_BFG_LOWLEVEL
+			// Devices no driver wanted before may be wanted for the new algorithm
+			lowlevel_probe_cache_clear();
+#endif
 			hotplug_trigger();
+		}
 	goal->malgo = malgo;
 }
 
@@ -2084,6 +2123,102 @@ static char *set_sharelog(char *arg)
 	return _bfgopt_set_file(arg, &sharelog_file, "a", "share log");
 }
 
+#ifdef HAVE_BFG_LOWLEVEL
+static
+char *set_lowl_capture(const char * const arg)
+{
+	FILE *F;
+	
+	if (lowl_capture_mode != LCM_OFF)
+		return "Only one --capture or --replay may be used";
+	F = fopen(arg, "wb");
+	if (!F)
+		return "Failed to open capture file";
+	if (!lowl_capture_start(F))
+	{
+		fclose(F);
+		return "Failed to write capture file";
+	}
+	return NULL;
+}
+
+static
+char *set_lowl_replay(const char * const arg)
+{
+	FILE *F;
+	bool rv;
+	
+	if (lowl_capture_mode != LCM_OFF)
+		return "Only one --capture or --replay may be used";
+	F = fopen(arg, "rb");
+	if (!F)
+		return "Failed to open replay file";
+	rv = lowl_replay_load(F);
+	fclose(F);
+	if (!rv)
+		return "Failed to load replay file";
+	return NULL;
+}
+#endif
+
+#ifdef NEED_DYNCLOCK
+static
+char *set_dclk_state(const char * const arg)
+{
+	FILE *F;
+	bool rv;
+	
+	free(opt_dclk_state);
+	opt_dclk_state = strdup(arg);
+	F = fopen(arg, "r");
+	// It is created at exit, the first time
+	if (!F)
+		return NULL;
+	rv = dclk_state_load(F);
+	fclose(F);
+	if (!rv)
+		return "Failed to load dynclock state file";
+	return NULL;
+}
+
+static
+void save_dclk_state(void)
+{
+	FILE *F;
+	
+	F = fopen(opt_dclk_state, "w");
+	if (!F || !dclk_state_save(F))
+		applog(LOG_ERR, "Failed to save dynclock state to %s", opt_dclk_state);
+	if (F)
+		fclose(F);
+}
+#endif
+
+static
+char *_bfgopt_set_journal(const char * const arg, struct journal ** const jp, const char * const purpose)
+{
+	static char err[0x100];
+	
+	journal_close(*jp);
+	*jp = journal_open(arg, purpose);
+	if (!*jp)
+	{
+		snprintf(err, sizeof(err), "Failed to open %s for %s", arg, purpose);
+		return err;
+	}
+	return NULL;
+}
+
+static char *set_noncelog_journal(char *arg)
+{
+	return _bfgopt_set_journal(arg, &noncelog_journal, "nonce journal");
+}
+
+static char *set_sharelog_journal(char *arg)
+{
+	return _bfgopt_set_journal(arg, &sharelog_journal, "share journal");
+}
+
 static
 void _add_set_device_option(const char * const func, const char * const buf)
 {
@@ -2364,6 +2499,11 @@ static struct opt_table opt_config_table[] = {
 					opt_set_bool, &opt_bfl_noncerange,
 					"Use nonce range on bitforce devices if supported"),
 #endif
+#ifdef HAVE_BFG_LOWLEVEL
+	OPT_WITH_ARG("--capture",
+				 set_lowl_capture, NULL, NULL,
+				 "Record all serial and SPI device traffic to file, for --replay"),
+#endif
 #ifdef HAVE_CHROOT
 	OPT_WITH_ARG("--chroot-dir",
 				 opt_set_charp, NULL, &chroot_dir,
@@ -2414,7 +2554,18 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--disable-rejecting",
 					opt_set_bool, &opt_disable_pool,
 					"Automatically disable pools that continually reject shares"),
+	OPT_WITHOUT_ARG("--driver-bench",
+					opt_set_bool, &opt_driver_bench,
+					"Report CPU time used by each driver per work and per nonce at exit"),
+#ifdef NEED_DYNCLOCK
+	OPT_WITH_ARG("--dynclock-state",
+				 set_dclk_state, NULL, NULL,
+				 "Keep per-chip dynamic clocking history in file across restarts"),
+#endif
 #ifdef USE_LIBMICROHTTPD
+	OPT_WITHOUT_ARG("--http-metrics",
+					opt_set_bool, &opt_http_metrics,
+					"Serve processor statistics at /metrics on the HTTP server, to anyone who can reach it"),
 	OPT_WITH_ARG("--http-port",
 				 opt_set_intval, opt_show_intval, &httpsrv_port,
 				 "Port number to listen on for HTTP getwork miners (-1 means disabled)"),
@@ -2501,6 +2652,9 @@ static struct opt_table opt_config_table[] = {
 				 set_intensity, NULL, NULL,
 				 opt_hidden),
 #endif
+	OPT_WITH_ARG("--journal-rotate",
+				 set_int_0_to_9999, opt_show_intval, &opt_journal_rotate_mb,
+				 "Rotate share and nonce journals once they reach N MiB (0 = never)"),
 #if defined(USE_OPENCL) || defined(USE_MODMINER) || defined(USE_X6500) || defined(USE_ZTEX)
 	OPT_WITH_ARG("--kernel-path",
 				 opt_set_charp, opt_show_charp, &opt_kernel_path,
@@ -2629,6 +2783,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--noncelog",
 				 set_noncelog, NULL, NULL,
 				 "Create log of all nonces found"),
+	OPT_WITH_ARG("--noncelog-journal",
+				 set_noncelog_journal, NULL, NULL,
+				 "Append binary journal of all nonces found to file"),
 	OPT_WITH_ARG("--pass|-p",
 				 set_pass, NULL, NULL,
 				 "Password for bitcoin JSON-RPC server"),
@@ -2668,9 +2825,20 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--quota|-U",
 				 set_quota, NULL, NULL,
 				 "quota;URL combination for server with load-balance strategy quotas"),
+	OPT_WITH_ARG("--reactor-threads",
+				 set_int_0_to_9999, opt_show_intval, &opt_reactor_threads,
+				 "Number of shared I/O threads for serial devices that support it (0 = one thread per device)"),
 	OPT_WITHOUT_ARG("--real-quiet",
 					opt_set_bool, &opt_realquiet,
 					"Disable all output"),
+#ifdef HAVE_BFG_LOWLEVEL
+	OPT_WITH_ARG("--replay",
+				 set_lowl_replay, NULL, NULL,
+				 "Stand in for serial and SPI devices using traffic recorded by --capture"),
+	OPT_WITH_ARG("--replay-speed",
+				 opt_set_floatval, NULL, &lowl_replay_speed,
+				 "Speed up --replay by this factor, or 0 to not wait at all (default: 1)"),
+#endif
 	OPT_WITH_ARG("--request-diff",
 				 set_request_diff, opt_show_floatval, &request_pdiff,
 				 "Request a specific difficulty from pools"),
@@ -2728,6 +2896,12 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--sharelog",
 				 set_sharelog, NULL, NULL,
 				 "Append share log to file"),
+	OPT_WITH_ARG("--sharelog-dump",
+				 opt_set_charp, NULL, &opt_sharelog_dump,
+				 "Convert a binary share or nonce journal to CSV on standard output, then exit"),
+	OPT_WITH_ARG("--sharelog-journal",
+				 set_sharelog_journal, NULL, NULL,
+				 "Append binary share journal to file"),
 	OPT_WITH_ARG("--shares",
 				 opt_set_floatval, NULL, &opt_shares,
 				 "Quit after mining 2^32 * N hashes worth of shares (default: unlimited)"),
@@ -3196,6 +3370,8 @@ static struct work *make_work(void)
  * cleaned to remove any dynamically allocated arrays within the struct */
 void clean_work(struct work *work)
 {
+	if (unlikely(work->queue_thr))
+		queue_work_released(work);
 	free(work->job_id);
 	bytes_free(&work->nonce2);
 	free(work->nonce1);
@@ -6202,6 +6378,68 @@ static void disable_curses(void)
 }
 #endif
 
+/* Thread CPU clocks must be read while the threads still exist, so each
+ * processor's is sampled just before shutting mining threads down. Devices run
+ * by the I/O reactor share its threads with others, and are not counted. */
+static
+void driver_bench_sample(void)
+{
+#ifdef _POSIX_THREAD_CPUTIME
+	struct thr_info *thr;
+	struct timespec ts;
+	clockid_t clk;
+	
+	for (int i = 0; i < mining_threads; ++i)
+	{
+		thr = get_thread(i);
+		if (!(thr && thr->cgpu && thr->has_pth))
+			continue;
+		if (pthread_getcpuclockid(thr->pth, &clk) || clock_gettime(clk, &ts))
+			continue;
+		thr->cgpu->cpu_time += ts.tv_sec + ts.tv_nsec / 1e9;
+	}
+#endif
+}
+
+static
+void driver_bench_print(void)
+{
+	const struct device_drv *drv;
+	const struct cgpu_info *cgpu;
+	double cpu_time, nonces;
+	unsigned long works;
+	int i, j;
+	
+	applog(LOG_WARNING, "Driver CPU time:\n");
+	for (i = 0; i < total_devices; ++i)
+	{
+		drv = get_devices(i)->drv;
+		for (j = 0; j < i; ++j)
+			if (get_devices(j)->drv == drv)
+				break;
+		if (j < i)
+			// Already reported with an earlier device
+			continue;
+		
+		cpu_time = nonces = 0;
+		works = 0;
+		for (j = i; j < total_devices; ++j)
+		{
+			cgpu = get_devices(j);
+			if (cgpu->drv != drv)
+				continue;
+			cpu_time += cgpu->cpu_time;
+			nonces += cgpu->diff1 + cgpu->hw_errors;
+			works += cgpu->cgminer_stats.getwork_calls;
+		}
+		applog(LOG_WARNING, " %s: %.3f s, %lu works (%.1f us/work), %.0f nonces (%.1f us/nonce)",
+		       drv->dname, cpu_time,
+		       works, works ? (cpu_time * 1e6 / works) : 0.,
+		       nonces, nonces ? (cpu_time * 1e6 / nonces) : 0.);
+	}
+	applog(LOG_WARNING, " ");
+}
+
 static void __kill_work(void)
 {
 	struct cgpu_info *cgpu;
@@ -6232,6 +6470,13 @@ static void __kill_work(void)
 	thr = &control_thr[watchdog_thr_id];
 	thr_info_cancel(thr);
 
+	if (opt_driver_bench)
+		driver_bench_sample();
+#ifdef NEED_DYNCLOCK
+	if (opt_dclk_state)
+		save_dclk_state();
+#endif
+	
 	applog(LOG_DEBUG, "Shutting down mining threads");
 	for (i = 0; i < mining_threads; i++) {
 		thr = get_thread(i);
@@ -6487,6 +6732,9 @@ static void _copy_work(struct work *work, const struct work *base_work, int noff
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
+	// Only the original is tracked in a processor's queue
+	work->queue_thr = NULL;
+	work->queued_indexed = work->queued_dup = false;
 	if (base_work->job_id)
 		work->job_id = strdup(base_work->job_id);
 	if (base_work->nonce1)
@@ -6702,12 +6950,13 @@ bool stale_work(struct work *work, bool share)
 	return false;
 }
 
-double share_diff(const struct work *work)
+static
+double _share_diff(const void * const hash, struct pool * const pool)
 {
 	double ret;
 	bool new_best = false;
 
-	ret = target_diff(work->hash);
+	ret = target_diff(hash);
 
 	cg_wlock(&control_lock);
 	if (unlikely(ret > best_diff)) {
@@ -6715,8 +6964,8 @@ double share_diff(const struct work *work)
 		best_diff = ret;
 		suffix_string(best_diff, best_share, sizeof(best_share), 0);
 	}
-	if (unlikely(ret > work->pool->best_diff))
-		work->pool->best_diff = ret;
+	if (unlikely(ret > pool->best_diff))
+		pool->best_diff = ret;
 	cg_wunlock(&control_lock);
 
 	if (unlikely(new_best))
@@ -6725,6 +6974,11 @@ double share_diff(const struct work *work)
 	return ret;
 }
 
+double share_diff(const struct work *work)
+{
+	return _share_diff(work->hash, work->pool);
+}
+
 static
 void work_check_for_block(struct work * const work)
 {
@@ -6890,6 +7144,55 @@ static bool retry_submission(struct submit_work_state *sws)
 	return true;
 }
 
+// Returns false if the share cannot be expressed as a "bfg.batch" record
+static bool stratum_batch_add_share(struct pool * const pool, const struct work * const work, const int sshare_id)
+{
+	const size_t n2len = bytes_len(&work->nonce2);
+	uint8_t rec[BFG_BATCH_SHARE_HDRSZ + n2len];
+	uint32_t nonce;
+	
+	if (!work->batch_job)
+		return false;
+	
+	nonce = *((uint32_t *)(work->data + 76));
+	nonce = swab32(nonce);
+	pk_u32le(rec, 0, sshare_id);
+	pk_u32le(rec, 4, work->batch_handle);
+	memcpy(&rec[8], &work->data[68], 4);
+	memcpy(&rec[0xc], &nonce, 4);
+	memcpy(&rec[BFG_BATCH_SHARE_HDRSZ], bytes_buf(&work->nonce2), n2len);
+	bytes_append(&pool->stratum_batch_shares, rec, sizeof(rec));
+	return true;
+}
+
+static void stratum_batch_flush(struct pool * const pool)
+{
+	bytes_t * const b = &pool->stratum_batch_shares;
+	const size_t len = bytes_len(b);
+	const size_t userlen = strlen(pool->rpc_user);
+	// Leave room for stratum_send to add a newline
+	char s[2 + userlen + 1 + (len * 2) + 2];
+	
+	s[0] = '!';
+	s[1] = BBLT_SHARES;
+	memcpy(&s[2], pool->rpc_user, userlen);
+	s[2 + userlen] = ' ';
+	bin2hex(&s[3 + userlen], bytes_buf(b), len);
+	bytes_reset(b);
+	
+	applog(LOG_DEBUG, "DBG: sending %s batched submit: %s", pool->stratum_url, s);
+	if (likely(stratum_send(pool, s, strlen(s)))) {
+		if (pool_tclear(pool, &pool->submit_fail))
+			applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
+	} else {
+		// Shares remain in stratum_shares, to be resubmitted or cleared by the stratum thread when it notices the disconnect
+		pool_tset(pool, &pool->submit_fail);
+		applog(LOG_WARNING, "Pool %d stratum batched share submission failure", pool->pool_no);
+		total_ro++;
+		pool->remotefail_occasions++;
+	}
+}
+
 static void free_sws(struct submit_work_state *sws)
 {
 	free(sws->s);
@@ -7046,6 +7349,17 @@ next_write_sws_del:
 			sshare_id =
 			sshare->id = swork_id++;
 			HASH_ADD_INT(stratum_shares, id, sshare);
+			if (pool->stratum_batch && stratum_batch_add_share(pool, work, sshare_id))
+			{
+				mutex_unlock(&sshare_lock);
+				if (bytes_len(&pool->stratum_batch_shares) >= BFG_BATCH_MAX_RECORDS * (BFG_BATCH_SHARE_HDRSZ + bytes_len(&work->nonce2)))
+					stratum_batch_flush(pool);
+				// Batching doesn't block, so leave the fd for more submissions to the same pool
+				*swsp = sws->next;
+				free_sws(sws);
+				--wip;
+				continue;
+			}
 			snprintf(s, 1024, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
 				pool->rpc_user, work->job_id, nonce2hex, ntimehex, noncehex, sshare->id);
 			mutex_unlock(&sshare_lock);
@@ -7082,6 +7396,11 @@ next_write_sws_del:
 			}
 		}
 		
+		// Send any batched stratum shares
+		for (int i = 0; i < total_pools; ++i)
+			if (bytes_len(&pools[i]->stratum_batch_shares))
+				stratum_batch_flush(pools[i]);
+		
 		// Handle any cURL activities
 		curl_multi_perform(curlm, &n);
 		while( (cm = curl_multi_info_read(curlm, &n)) ) {
@@ -7457,10 +7776,12 @@ static void restart_threads(void)
 		thr->work_restart = true;
 	}
 	
+	notifier_wake(work_restart_broadcast);
 	for (i = 0; i < mining_threads; i++)
 	{
 		thr = mining_thr[i];
-		notifier_wake(thr->work_restart_notifier);
+		if (!thr->work_restart_broadcast)
+			notifier_wake(thr->work_restart_notifier);
 	}
 	
 	rd_unlock(&mining_thr_lock);
@@ -8099,6 +8420,7 @@ void zero_stats(void)
 		struct cgpu_info *cgpu = get_devices(i);
 
 		mutex_lock(&hash_lock);
+		++cgpu->hash_counter_epoch;
 		cgpu->total_mhashes = 0;
 		cgpu->accepted = 0;
 		cgpu->rejected = 0;
@@ -8518,7 +8840,7 @@ retry:
 }
 #endif
 
-void default_save_file(char *filename)
+void default_state_file(char * const filename, const char * const name)
 {
 #if defined(unix) || defined(__APPLE__)
 	if (getenv("HOME") && *getenv("HOME")) {
@@ -8532,7 +8854,12 @@ void default_save_file(char *filename)
 #else
 	strcpy(filename, "");
 #endif
-	strcat(filename, def_conf);
+	strcat(filename, name);
+}
+
+void default_save_file(char *filename)
+{
+	default_state_file(filename, def_conf);
 }
 
 #ifdef HAVE_CURSES
@@ -9003,6 +9330,48 @@ void thread_reportout(struct thr_info *thr)
 	thr->getwork = time(NULL);
 }
 
+static
+void thr_hash_counter_add(struct thr_info * const thr, const double mhashes)
+{
+	struct thr_hash_counter * const hc = &thr->hash_counter;
+	const unsigned epoch = thr->cgpu->hash_counter_epoch;
+	
+	++hc->seq;
+	__sync_synchronize();
+	if (hc->epoch != epoch)
+	{
+		// The processor's stats were zeroed since this thread last counted
+		hc->epoch = epoch;
+		hc->total_mhashes = 0;
+	}
+	hc->total_mhashes += mhashes;
+	__sync_synchronize();
+	++hc->seq;
+}
+
+static
+double cgpu_hash_counter_total(const struct cgpu_info * const cgpu)
+{
+	const int threadobj = cgpu->threads ?: 1;
+	const unsigned epoch = cgpu->hash_counter_epoch;
+	const struct thr_hash_counter *hc;
+	double total = 0, mhashes;
+	unsigned seq;
+	
+	for (int i = 0; i < threadobj; ++i)
+	{
+		hc = &cgpu->thr[i]->hash_counter;
+		do {
+			seq = hc->seq;
+			__sync_synchronize();
+			mhashes = (hc->epoch == epoch) ? hc->total_mhashes : 0;
+			__sync_synchronize();
+		} while ((seq & 1) || seq != hc->seq);
+		total += mhashes;
+	}
+	return total;
+}
+
 static void hashmeter(int thr_id, struct timeval *diff,
 		      uint64_t hashes_done)
 {
@@ -9010,7 +9379,8 @@ static void hashmeter(int thr_id, struct timeval *diff,
 	struct timeval temp_tv_end, total_diff;
 	double secs;
 	double local_secs;
-	static double local_mhashes_done = 0;
+	static double status_mhashes_done = 0;
+	double local_mhashes_done;
 	double local_mhashes = (double)hashes_done / 1000000.0;
 	bool showlog = false;
 	char cHr[ALLOC_H2B_NOUNIT+1], aHr[ALLOC_H2B_NOUNIT+1], uHr[ALLOC_H2B_SPACED+3+1];
@@ -9039,13 +9409,16 @@ static void hashmeter(int thr_id, struct timeval *diff,
 
 		/* Rolling average for each thread and each device */
 		decay_time(&thr->rolling, local_mhashes / secs, secs);
-		for (i = 0; i < threadobj; i++)
-			thread_rolling += cgpu->thr[i]->rolling;
-
-		mutex_lock(&hash_lock);
-		decay_time(&cgpu->rolling, thread_rolling, secs);
-		cgpu->total_mhashes += local_mhashes;
-		mutex_unlock(&hash_lock);
+		thr_hash_counter_add(thr, local_mhashes);
+		
+		// Only the first thread writes the processor totals, so no lock is needed
+		if (thr == cgpu->thr[0])
+		{
+			for (i = 0; i < threadobj; i++)
+				thread_rolling += cgpu->thr[i]->rolling;
+			decay_time(&cgpu->rolling, thread_rolling, secs);
+			cgpu->total_mhashes = cgpu_hash_counter_total(cgpu);
+		}
 
 		// If needed, output detailed, per-device stats
 		if (want_per_device_stats) {
@@ -9071,21 +9444,37 @@ static void hashmeter(int thr_id, struct timeval *diff,
 		}
 	}
 
-	/* Totals are updated by all threads so can race without locking */
-	mutex_lock(&hash_lock);
+	/* Totals are collected from every processor by the watchdog, or by a
+	 * mining thread once the status line is due. Mining threads never wait
+	 * for another thread to finish doing so. */
 	cgtime(&temp_tv_end);
+	if (thr_id >= 0)
+	{
+		timersub(&temp_tv_end, &total_tv_end, &total_diff);
+		if (total_diff.tv_sec < opt_log_interval)
+			return;
+		if (mutex_trylock(&hash_lock))
+			return;
+	}
+	else
+		mutex_lock(&hash_lock);
 	
 	timersub(&temp_tv_end, &total_tv_start, &total_diff);
 	total_secs = (double)total_diff.tv_sec + ((double)total_diff.tv_usec / 1000000.0);
 	
 	timersub(&temp_tv_end, &total_tv_end, &total_diff);
 
-	total_mhashes_done += local_mhashes;
-	local_mhashes_done += local_mhashes;
+	total_mhashes_done = 0;
+	for (int i = 0; i < total_devices; ++i)
+		total_mhashes_done += get_devices(i)->total_mhashes;
 	/* Only update with opt_log_interval */
 	if (total_diff.tv_sec < opt_log_interval)
 		goto out_unlock;
 	showlog = true;
+	local_mhashes_done = total_mhashes_done - status_mhashes_done;
+	if (local_mhashes_done < 0)
+		// Stats were zeroed
+		local_mhashes_done = total_mhashes_done;
 	cgtime(&total_tv_end);
 
 	local_secs = (double)total_diff.tv_sec + ((double)total_diff.tv_usec / 1000000.0);
@@ -9205,7 +9594,7 @@ static void hashmeter(int thr_id, struct timeval *diff,
 	);
 
 
-	local_mhashes_done = 0;
+	status_mhashes_done = total_mhashes_done;
 out_unlock:
 	mutex_unlock(&hash_lock);
 
@@ -9251,6 +9640,73 @@ void hashmeter2(struct thr_info *thr)
 	}
 }
 
+#define TEST_HASH_COUNTER_THREADS  4
+#define TEST_HASH_COUNTER_ADDS  100000
+
+static
+void *_test_hash_counter_thread(void * const userp)
+{
+	struct thr_info * const thr = userp;
+	for (int i = 0; i < TEST_HASH_COUNTER_ADDS; ++i)
+		thr_hash_counter_add(thr, 1);
+	return NULL;
+}
+
+// Hammers one processor from several threads while reading its total
+static
+void test_hash_counter()
+{
+	struct cgpu_info cgpu = {
+		.threads = TEST_HASH_COUNTER_THREADS,
+	};
+	struct thr_info *thrs = calloc(TEST_HASH_COUNTER_THREADS, sizeof(*thrs));
+	struct thr_info *thrp[TEST_HASH_COUNTER_THREADS];
+	pthread_t pth[TEST_HASH_COUNTER_THREADS];
+	double total, prev = 0;
+	bool bad = false;
+	
+	for (int i = 0; i < TEST_HASH_COUNTER_THREADS; ++i)
+	{
+		thrs[i].cgpu = &cgpu;
+		thrp[i] = &thrs[i];
+	}
+	cgpu.thr = thrp;
+	
+	for (int i = 0; i < TEST_HASH_COUNTER_THREADS; ++i)
+		if (unlikely(pthread_create(&pth[i], NULL, _test_hash_counter_thread, &thrs[i])))
+			quit(1, "%s: pthread_create failed", __func__);
+	do {
+		total = cgpu_hash_counter_total(&cgpu);
+		// Each counter only grows by whole hashes, so any torn read shows up here
+		if (total < prev || total != floor(total))
+			bad = true;
+		prev = total;
+	} while (total < TEST_HASH_COUNTER_THREADS * TEST_HASH_COUNTER_ADDS && !bad);
+	for (int i = 0; i < TEST_HASH_COUNTER_THREADS; ++i)
+		pthread_join(pth[i], NULL);
+	total = cgpu_hash_counter_total(&cgpu);
+	if (bad || total != TEST_HASH_COUNTER_THREADS * TEST_HASH_COUNTER_ADDS)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s (got %f)", "hash_counter", "concurrent total", total);
+	}
+	
+	++cgpu.hash_counter_epoch;
+	if (cgpu_hash_counter_total(&cgpu))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "hash_counter", "zeroed total");
+	}
+	thr_hash_counter_add(&thrs[1], 5);
+	if (cgpu_hash_counter_total(&cgpu) != 5)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "hash_counter", "count after zero");
+	}
+	
+	free(thrs);
+}
+
 static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 				 struct stratum_share *sshare)
 {
@@ -9259,33 +9715,179 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 	share_result(val, res_val, err_val, work, false, "");
 }
 
-/* Parses stratum json responses and tries to find the id that the request
- * matched to and treat it accordingly. */
-bool parse_stratum_response(struct pool *pool, char *s)
+static void stratum_untracked_share_result(struct pool * const pool, const bool accepted)
 {
-	json_t *val = NULL, *err_val, *res_val, *id_val;
-	struct stratum_share *sshare;
-	json_error_t err;
-	bool ret = false;
-	int id;
+	double pool_diff;
 
-	val = JSON_LOADS(s, &err);
-	if (!val) {
-		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
-		goto out;
-	}
+	/* Since the share is untracked, we can only guess at what the
+	 * work difficulty is based on the current pool diff. */
+	cg_rlock(&pool->data_lock);
+	pool_diff = target_diff(pool->swork.target);
+	cg_runlock(&pool->data_lock);
 
-	res_val = json_object_get(val, "result");
-	err_val = json_object_get(val, "error");
-	id_val = json_object_get(val, "id");
+	if (accepted) {
+		struct mining_goal_info * const goal = pool->goal;
+		
+		applog(LOG_NOTICE, "Accepted untracked stratum share from pool %d", pool->pool_no);
 
-	if (json_is_null(id_val) || !id_val) {
-		char *ss;
+		/* We don't know what device this came from so we can't
+		 * attribute the work to the relevant cgpu */
+		mutex_lock(&stats_lock);
+		total_accepted++;
+		pool->accepted++;
+		total_diff_accepted += pool_diff;
+		pool->diff_accepted += pool_diff;
+		goal->diff_accepted += pool_diff;
+		mutex_unlock(&stats_lock);
+	} else {
+		applog(LOG_NOTICE, "Rejected untracked stratum share from pool %d", pool->pool_no);
 
-		if (err_val)
-			ss = json_dumps(err_val, JSON_INDENT(3));
-		else
-			ss = strdup("(unknown reason)");
+		mutex_lock(&stats_lock);
+		total_rejected++;
+		pool->rejected++;
+		total_diff_rejected += pool_diff;
+		pool->diff_rejected += pool_diff;
+		mutex_unlock(&stats_lock);
+	}
+}
+
+static const struct {
+	int code;
+	const char *msg;
+} bfg_batch_result_errors[] = {
+	[BBR_STALE] = {21, "stale"},
+	[BBR_JOB_NOT_FOUND] = {21, "Job not found"},
+	[BBR_HIGH_HASH] = {23, "H-not-zero"},
+	[BBR_OTHER] = {20, "Other/Unknown"},
+};
+
+/* Parses a "bfg.batch" results line (with the leading "!R" already skipped),
+ * handling each result as if it were an individual stratum response. */
+static bool parse_bfg_batch_results(struct pool * const pool, const char * const hex)
+{
+	const size_t hexlen = strspn(hex, "0123456789abcdefABCDEF");
+	if (hex[hexlen] || hexlen % (BFG_BATCH_RESULT_SZ * 2))
+		return false;
+	
+	// Decoded one record at a time, since the line can be any length
+	uint8_t rec[BFG_BATCH_RESULT_SZ];
+	for (const char *p = hex; *p; p += BFG_BATCH_RESULT_SZ * 2)
+	{
+		hex2bin(rec, p, BFG_BATCH_RESULT_SZ);
+		
+		struct stratum_share *sshare;
+		int id = upk_u32le(rec, 0);
+		enum bfg_batch_result result = rec[4];
+		if (result > BBR_OTHER)
+			result = BBR_OTHER;
+		
+		mutex_lock(&sshare_lock);
+		HASH_FIND_INT(stratum_shares, &id, sshare);
+		if (sshare)
+			HASH_DEL(stratum_shares, sshare);
+		mutex_unlock(&sshare_lock);
+		
+		if (!sshare)
+		{
+			stratum_untracked_share_result(pool, result == BBR_ACCEPTED);
+			continue;
+		}
+		
+		mutex_lock(&submitting_lock);
+		--total_submitting;
+		mutex_unlock(&submitting_lock);
+		
+		json_t * const val = json_object();
+		json_t *res_val, *err_val;
+		if (result == BBR_ACCEPTED)
+		{
+			res_val = json_true();
+			err_val = json_null();
+		}
+		else
+		{
+			res_val = json_false();
+			err_val = json_array();
+			json_array_append_new(err_val, json_integer(bfg_batch_result_errors[result].code));
+			json_array_append_new(err_val, json_string(bfg_batch_result_errors[result].msg));
+			json_array_append_new(err_val, json_null());
+		}
+		json_object_set_new(val, "result", res_val);
+		json_object_set_new(val, "error", err_val);
+		json_object_set_new(val, "id", json_integer(id));
+		
+		stratum_share_result(val, res_val, err_val, sshare);
+		free_work(sshare->work);
+		free(sshare);
+		json_decref(val);
+	}
+	
+	return true;
+}
+
+static void stratum_share_response(struct pool * const pool, const int id, json_t * const val, json_t * const res_val, json_t * const err_val)
+{
+	struct stratum_share *sshare;
+
+	mutex_lock(&sshare_lock);
+	HASH_FIND_INT(stratum_shares, &id, sshare);
+	if (sshare)
+		HASH_DEL(stratum_shares, sshare);
+	mutex_unlock(&sshare_lock);
+
+	if (!sshare) {
+		stratum_untracked_share_result(pool, json_is_true(res_val));
+		return;
+	}
+
+	mutex_lock(&submitting_lock);
+	--total_submitting;
+	mutex_unlock(&submitting_lock);
+
+	stratum_share_result(val, res_val, err_val, sshare);
+	free_work(sshare->work);
+	free(sshare);
+}
+
+/* Parses stratum json responses and tries to find the id that the request
+ * matched to and treat it accordingly. */
+bool parse_stratum_response(struct pool *pool, char *s)
+{
+	json_t *val = NULL, *err_val, *res_val, *id_val;
+	struct stratum_fast_msg fmsg;
+	json_error_t err;
+	bool ret = false;
+	long long fid;
+
+	if (s[0] == '!')
+		return (s[1] == BBLT_RESULTS) && parse_bfg_batch_results(pool, &s[2]);
+	
+	/* Accepted shares are by far the most common response, and need
+	 * nothing from jansson */
+	if (stratum_fast_parse(&fmsg, s) && fmsg.result.type == SFT_TRUE
+	 && (fmsg.error.type == SFT_MISSING || fmsg.error.type == SFT_NULL)
+	 && stratum_fast_int(&fmsg.id, &fid)) {
+		stratum_share_response(pool, fid, NULL, json_true(), json_null());
+		return true;
+	}
+	
+	val = JSON_LOADS(s, &err);
+	if (!val) {
+		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
+		goto out;
+	}
+
+	res_val = json_object_get(val, "result");
+	err_val = json_object_get(val, "error");
+	id_val = json_object_get(val, "id");
+
+	if (json_is_null(id_val) || !id_val) {
+		char *ss;
+
+		if (err_val)
+			ss = json_dumps(err_val, JSON_INDENT(3));
+		else
+			ss = strdup("(unknown reason)");
 
 		applog(LOG_INFO, "JSON-RPC non method decode failed: %s", ss);
 
@@ -9337,57 +9939,7 @@ fishy:
 		goto out;
 	}
 
-	id = json_integer_value(id_val);
-
-	mutex_lock(&sshare_lock);
-	HASH_FIND_INT(stratum_shares, &id, sshare);
-	if (sshare)
-		HASH_DEL(stratum_shares, sshare);
-	mutex_unlock(&sshare_lock);
-
-	if (!sshare) {
-		double pool_diff;
-
-		/* Since the share is untracked, we can only guess at what the
-		 * work difficulty is based on the current pool diff. */
-		cg_rlock(&pool->data_lock);
-		pool_diff = target_diff(pool->swork.target);
-		cg_runlock(&pool->data_lock);
-
-		if (json_is_true(res_val)) {
-			struct mining_goal_info * const goal = pool->goal;
-			
-			applog(LOG_NOTICE, "Accepted untracked stratum share from pool %d", pool->pool_no);
-
-			/* We don't know what device this came from so we can't
-			 * attribute the work to the relevant cgpu */
-			mutex_lock(&stats_lock);
-			total_accepted++;
-			pool->accepted++;
-			total_diff_accepted += pool_diff;
-			pool->diff_accepted += pool_diff;
-			goal->diff_accepted += pool_diff;
-			mutex_unlock(&stats_lock);
-		} else {
-			applog(LOG_NOTICE, "Rejected untracked stratum share from pool %d", pool->pool_no);
-
-			mutex_lock(&stats_lock);
-			total_rejected++;
-			pool->rejected++;
-			total_diff_rejected += pool_diff;
-			pool->diff_rejected += pool_diff;
-			mutex_unlock(&stats_lock);
-		}
-		goto out;
-	}
-	else {
-		mutex_lock(&submitting_lock);
-		--total_submitting;
-		mutex_unlock(&submitting_lock);
-	}
-	stratum_share_result(val, res_val, err_val, sshare);
-	free_work(sshare->work);
-	free(sshare);
+	stratum_share_response(pool, json_integer_value(id_val), val, res_val, err_val);
 
 	ret = true;
 out:
@@ -10457,6 +11009,8 @@ void gen_stratum_work3(struct work * const work, struct stratum_work * const swo
 	/* Copy parameters required for share submission */
 	memcpy(work->target, swork->target, sizeof(work->target));
 	work->job_id = maybe_strdup(swork->job_id);
+	work->batch_job = swork->batch_job;
+	work->batch_handle = swork->batch_handle;
 	work->nonce1 = maybe_strdup(swork->nonce1);
 	if (data_lock_p)
 		cg_runlock(data_lock_p);
@@ -10498,7 +11052,8 @@ void request_work(struct thr_info *thr)
 }
 
 // FIXME: Make this non-blocking (and remove HACK above)
-struct work *get_work(struct thr_info *thr)
+static
+struct work *_get_work(struct thr_info * const thr, const bool reportin)
 {
 	const int thr_id = thr->id;
 	struct cgpu_info *cgpu = thr->cgpu;
@@ -10522,6 +11077,12 @@ struct work *get_work(struct thr_info *thr)
 	       cgpu->proc_repr, work->id, thr_id);
 
 	work->thr_id = thr_id;
+	work->mined = true;
+	work->blk.nonce = 0;
+	
+	if (!reportin)
+		goto out;
+	
 	thread_reportin(thr);
 	
 	// HACK: Since get_work still blocks, reportin all processors dependent on this thread
@@ -10531,9 +11092,6 @@ struct work *get_work(struct thr_info *thr)
 			break;
 		thread_reportin(proc->thr[0]);
 	}
-	
-	work->mined = true;
-	work->blk.nonce = 0;
 
 	cgtime(&tv_get);
 	timersub(&tv_get, &dev_stats->_get_start, &tv_get);
@@ -10553,6 +11111,7 @@ struct work *get_work(struct thr_info *thr)
 		pool_stats->getwork_wait_min = tv_get;
 	++pool_stats->getwork_calls;
 	
+out:
 	if (work->work_difficulty < 1)
 	{
 		const float min_nonce_diff = drv_min_nonce_diff(cgpu->drv, cgpu, work_mining_algorithm(work));
@@ -10572,6 +11131,17 @@ struct work *get_work(struct thr_info *thr)
 	return work;
 }
 
+struct work *get_work(struct thr_info *thr)
+{
+	return _get_work(thr, true);
+}
+
+// Like get_work, but for helper threads fetching on thr's behalf: leaves thr's watchdog heartbeat and getwork stats alone
+struct work *get_work_for(struct thr_info * const thr)
+{
+	return _get_work(thr, false);
+}
+
 struct dupe_hash_elem {
 	uint8_t hash[0x20];
 	struct timeval tv_prune;
@@ -10648,6 +11218,88 @@ static void submit_work_async2(struct work *work, struct timeval *tv_work_found)
 	_submit_work_async(work);
 }
 
+/* Nonce statistics are counted in the reporting thread first, and folded into
+ * the processor, pool and global totals only when stats_lock is free, so a
+ * thread reporting many nonces never waits on other threads for each one. */
+static
+void __nonce_stats_add(struct cgpu_info * const cgpu, struct pool * const pool, const double diff1, const int hw_errs, const double bad_diff1)
+{
+	if (pool)
+	{
+		total_diff1 += diff1;
+		cgpu->diff1 += diff1;
+		pool->diff1 += diff1;
+	}
+	hw_errors += hw_errs;
+	cgpu->hw_errors += hw_errs;
+	total_bad_diff1 += bad_diff1;
+	cgpu->bad_diff1 += bad_diff1;
+}
+
+static
+void __thr_nonce_stats_flush(struct thr_info * const thr)
+{
+	__nonce_stats_add(thr->cgpu, thr->_pending_diff1_pool, thr->_pending_diff1, thr->_pending_hw_errors, thr->_pending_bad_diff1);
+	thr->_pending_diff1_pool = NULL;
+	thr->_pending_diff1 = 0;
+	thr->_pending_hw_errors = 0;
+	thr->_pending_bad_diff1 = 0;
+}
+
+static
+void thr_nonce_stats_add(struct thr_info * const thr, struct pool * const pool, const double diff1, const int hw_errs, const double bad_diff1)
+{
+	if (__sync_lock_test_and_set(&thr->_nonce_stats_busy, 1))
+	{
+		// Another thread is reporting for thr right now, so count directly
+		mutex_lock(&stats_lock);
+		__nonce_stats_add(thr->cgpu, pool, diff1, hw_errs, bad_diff1);
+		mutex_unlock(&stats_lock);
+		return;
+	}
+	
+	if (pool && thr->_pending_diff1_pool != pool)
+	{
+		if (thr->_pending_diff1_pool)
+		{
+			// Only one pool's diff1 is kept pending at a time
+			mutex_lock(&stats_lock);
+			__thr_nonce_stats_flush(thr);
+			mutex_unlock(&stats_lock);
+		}
+		thr->_pending_diff1_pool = pool;
+	}
+	thr->_pending_diff1 += diff1;
+	thr->_pending_hw_errors += hw_errs;
+	thr->_pending_bad_diff1 += bad_diff1;
+	
+	if (!mutex_trylock(&stats_lock))
+	{
+		__thr_nonce_stats_flush(thr);
+		mutex_unlock(&stats_lock);
+	}
+	__sync_lock_release(&thr->_nonce_stats_busy);
+}
+
+// Folds anything still pending into the totals; if wait is false, only when stats_lock is free
+void thr_nonce_stats_flush(struct thr_info * const thr, const bool wait)
+{
+	if (!(thr->_pending_diff1_pool || thr->_pending_hw_errors))
+		return;
+	if (__sync_lock_test_and_set(&thr->_nonce_stats_busy, 1))
+		// Whoever is reporting flushes it
+		return;
+	if (wait)
+		mutex_lock(&stats_lock);
+	else
+	if (mutex_trylock(&stats_lock))
+		goto out;
+	__thr_nonce_stats_flush(thr);
+	mutex_unlock(&stats_lock);
+out:
+	__sync_lock_release(&thr->_nonce_stats_busy);
+}
+
 void inc_hw_errors3(struct thr_info *thr, const struct work *work, const uint32_t *bad_nonce_p, float nonce_diff)
 {
 	struct cgpu_info * const cgpu = thr->cgpu;
@@ -10662,15 +11314,7 @@ void inc_hw_errors3(struct thr_info *thr, const struct work *work, const uint32_
 			       cgpu->proc_repr, (unsigned long)be32toh(*bad_nonce_p));
 	}
 	
-	mutex_lock(&stats_lock);
-	hw_errors++;
-	++cgpu->hw_errors;
-	if (bad_nonce_p)
-	{
-		total_bad_diff1 += nonce_diff;
-		cgpu->bad_diff1 += nonce_diff;
-	}
-	mutex_unlock(&stats_lock);
+	thr_nonce_stats_add(thr, NULL, 0, 1, bad_nonce_p ? nonce_diff : 0);
 
 	if (thr->cgpu->drv->hw_error)
 		thr->cgpu->drv->hw_error(thr);
@@ -10699,6 +11343,31 @@ bool test_hash(const void * const phash, const float diff)
 	return (tmp_hash7 <= Htarg);
 }
 
+// For a hash already known to meet nonce_diff, checks the share target (or the pool's newer one, setting *work_difficulty_p)
+static
+enum test_nonce2_result test_hash_target(const void * const hash, const struct work * const work, double * const work_difficulty_p)
+{
+	if (hash_target_check_v(hash, work->target))
+		return TNR_GOOD;
+	
+	struct pool * const pool = work->pool;
+	if (pool_diff_effective_retroactively(pool))
+	{
+		// Some stratum pools are buggy and expect difficulty changes to be immediate retroactively, so if the target has changed, check and submit just in case
+		if (memcmp(pool->next_target, work->target, sizeof(work->target)))
+		{
+			applog(LOG_DEBUG, "Stratum pool %u target has changed since work job issued, checking that too",
+			       pool->pool_no);
+			if (hash_target_check_v(hash, pool->next_target))
+			{
+				*work_difficulty_p = target_diff(pool->next_target);
+				return TNR_GOOD;
+			}
+		}
+	}
+	return TNR_HIGH;
+}
+
 enum test_nonce2_result _test_nonce2(struct work *work, uint32_t nonce, bool checktarget)
 {
 	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
@@ -10709,31 +11378,49 @@ enum test_nonce2_result _test_nonce2(struct work *work, uint32_t nonce, bool che
 	if (!test_hash(work->hash, work->nonce_diff))
 		return TNR_BAD;
 	
-	if (checktarget && !hash_target_check_v(work->hash, work->target))
-	{
-		bool high_hash = true;
-		struct pool * const pool = work->pool;
-		if (pool_diff_effective_retroactively(pool))
-		{
-			// Some stratum pools are buggy and expect difficulty changes to be immediate retroactively, so if the target has changed, check and submit just in case
-			if (memcmp(pool->next_target, work->target, sizeof(work->target)))
-			{
-				applog(LOG_DEBUG, "Stratum pool %u target has changed since work job issued, checking that too",
-				       pool->pool_no);
-				if (hash_target_check_v(work->hash, pool->next_target))
-				{
-					high_hash = false;
-					work->work_difficulty = target_diff(pool->next_target);
-				}
-			}
-		}
-		if (high_hash)
-			return TNR_HIGH;
-	}
+	if (checktarget)
+		return test_hash_target(work->hash, work, &work->work_difficulty);
 	
 	return TNR_GOOD;
 }
 
+/* Hashes the header of work with nonce and an ntime offset applied, into data
+ * and out_hash, without touching (or copying) the work itself. out_hash starts
+ * as the work's hash, as a copy of the work would, for hash_data_f that leave
+ * it alone (SHA256d does here). */
+static
+void work_nonce_hash(void * const out_hash, unsigned char * const data, const struct work * const work, const uint32_t nonce, const int noffset)
+{
+	const struct mining_algorithm * const malgo = work_mining_algorithm(work);
+	uint32_t * const data_ntime = (uint32_t *)(data + 68);
+	uint32_t * const data_nonce = (uint32_t *)(data + 64 + 12);
+	
+	memcpy(data, work->data, sizeof(work->data));
+	if (noffset)
+		*data_ntime = htobe32(be32toh(*data_ntime) + noffset);
+	*data_nonce = htole32(nonce);
+	memcpy(out_hash, work->hash, sizeof(work->hash));
+	
+	malgo->hash_data_f(out_hash, data);
+}
+
+/* Returns a bit set for each of nonces (at most 32) meeting the work's
+ * nonce_diff, by the algorithm's hash_data_f. SHA256d work does not go through
+ * sha256d_test_nonces here, since its hash_data_f is left disabled. */
+uint32_t test_nonces(const struct work * const work, const uint32_t * const nonces, const unsigned count)
+{
+	unsigned char data[sizeof(work->data)], hash[sizeof(work->hash)];
+	uint32_t rv = 0;
+	
+	for (unsigned i = 0; i < count; ++i)
+	{
+		work_nonce_hash(hash, data, work, nonces[i], 0);
+		if (test_hash(hash, work->nonce_diff))
+			rv |= (uint32_t)1 << i;
+	}
+	return rv;
+}
+
 /* Returns true if nonce for work was a valid share */
 bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 {
@@ -10747,60 +11434,188 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t nonce,
 			  int noffset)
 {
-	struct work *work = make_work();
-	_copy_work(work, work_in, noffset);
-	
-	uint32_t *work_nonce = (uint32_t *)(work->data + 64 + 12);
+	struct work *work;
+	unsigned char data[sizeof(work_in->data)], hash[sizeof(work_in->hash)];
+	double work_difficulty = work_in->work_difficulty;
 	struct timeval tv_work_found;
-	enum test_nonce2_result res;
 	bool ret = true;
-
+	
+	if (work_in->queue_thr)
+		queue_work_nonce_found(work_in);
+	
 	thread_reportout(thr);
 
 	cgtime(&tv_work_found);
-	*work_nonce = htole32(nonce);
-	work->thr_id = thr->id;
 
 	/* Do one last check before attempting to submit the work */
-	/* Side effect: sets work->data and work->hash for us */
-	res = test_nonce2(work, nonce);
+	/* Only the header is hashed here: the work is copied only for shares */
+	work_nonce_hash(hash, data, work_in, nonce, noffset);
 	
-	if (unlikely(res == TNR_BAD))
+	if (unlikely(!test_hash(hash, work_in->nonce_diff)))
 		{
-			inc_hw_errors(thr, work, nonce);
+			inc_hw_errors(thr, work_in, nonce);
 			ret = false;
 			goto out;
 		}
 	
-	mutex_lock(&stats_lock);
-	total_diff1       += work->nonce_diff;
-	thr ->cgpu->diff1 += work->nonce_diff;
-	work->pool->diff1 += work->nonce_diff;
+	thr_nonce_stats_add(thr, work_in->pool, work_in->nonce_diff, 0, 0);
 	thr->cgpu->last_device_valid_work = time(NULL);
-	mutex_unlock(&stats_lock);
 	
-	if (noncelog_file)
-		noncelog(work);
+	if (noncelog_file || noncelog_journal)
+		noncelog2(thr->id, hash, data, work_in->midstate);
 	
-	if (res == TNR_HIGH)
+	if (test_hash_target(hash, work_in, &work_difficulty) == TNR_HIGH)
 	{
 			// Share above target, normal
 			/* Check the diff of the share, even if it didn't reach the
 			 * target, just to set the best share value if it's higher. */
-			share_diff(work);
+			_share_diff(hash, work_in->pool);
 			goto out;
 	}
 	
+	work = make_work();
+	_copy_work(work, work_in, noffset);
+	memcpy(work->data, data, sizeof(work->data));
+	memcpy(work->hash, hash, sizeof(work->hash));
+	work->work_difficulty = work_difficulty;
+	work->thr_id = thr->id;
+	
 	submit_work_async2(work, &tv_work_found);
-	work = NULL;  // Taken by submit_work_async2
 out:
-	if (work)
-		free_work(work);
 	thread_reportin(thr);
 
 	return ret;
 }
 
+#ifdef USE_SHA256D
+// Full double-SHA256, standing in for the sha256d hash_data_f left disabled
+static
+void _test_work_nonce_hash_data(void * const out_hash, const void * const data)
+{
+	unsigned char blkheader[80];
+	
+	swap32yes(blkheader, data, 80 / 4);
+	gen_hash(blkheader, out_hash, 80);
+}
+
+void test_work_nonce_hash()
+{
+	struct mining_goal_info goal = {
+		.malgo = &malgo_sha256d,
+	};
+	struct pool pool = {
+		.goal = &goal,
+	};
+	struct work work = {
+		.pool = &pool,
+		.nonce_diff = 1.,
+	}, ref;
+	unsigned char data[sizeof(work.data)], hash[sizeof(work.hash)];
+	uint32_t *ref_ntime;
+	
+	// Genesis block header
+	hex2bin(data, "0100000000000000000000000000000000000000000000000000000000000000000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa4b1e5e4a29ab5f49ffff001d1dac2b7c", 80);
+	swap32yes(work.data, data, 80 / 4);
+	calc_midstate(&work);
+	memset(work.hash, 0x5a, sizeof(work.hash));
+	
+	work_nonce_hash(hash, data, &work, 0x1dac2b7c, 0);
+	if (memcmp(data, work.data, 80))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "work_nonce_hash", "genesis block");
+	}
+	
+	// Must match hashing a full copy of the work
+	ref = work;
+	ref_ntime = (uint32_t *)(ref.data + 68);
+	*ref_ntime = htobe32(be32toh(*ref_ntime) + 7);
+	_test_nonce2(&ref, 0x12345678, false);
+	work_nonce_hash(hash, data, &work, 0x12345678, 7);
+	if (memcmp(data, ref.data, 80) || memcmp(hash, ref.hash, sizeof(hash)))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "work_nonce_hash", "noffset");
+	}
+	
+	// With a real hash, the genesis nonce must be accepted and its neighbour rejected
+	struct mining_algorithm malgo_test = {
+		.name = "SHA256d",
+		.algo = POW_SHA256D,
+		.hash_data_f = _test_work_nonce_hash_data,
+	};
+	struct device_drv drv = {
+		.dname = "test",
+		.name = "TST",
+	};
+	struct cgpu_info cgpu = {
+		.drv = &drv,
+		.proc_repr = "TST 0",
+	};
+	struct thr_info thr = {
+		.cgpu = &cgpu,
+	};
+	double work_difficulty;
+	
+	goal.malgo = &malgo_test;
+	// Difficulty 1, the genesis block's target
+	memset(work.target, 0, sizeof(work.target));
+	work.target[26] = work.target[27] = 0xff;
+	work_nonce_hash(hash, data, &work, 0x1dac2b7c, 0);
+	if (test_hash_target(hash, &work, &work_difficulty) != TNR_GOOD)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "work_nonce_hash", "genesis nonce above target");
+	}
+	work_nonce_hash(hash, data, &work, 0x1dac2b7d, 0);
+	if (test_hash_target(hash, &work, &work_difficulty) != TNR_HIGH)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "work_nonce_hash", "bad nonce below target");
+	}
+	
+	// A zero target keeps the good nonce from being submitted as a share
+	memset(work.target, 0, sizeof(work.target));
+	mutex_lock(&stats_lock);
+	const int saved_hw_errors = hw_errors;
+	const double saved_total_diff1 = total_diff1, saved_total_bad_diff1 = total_bad_diff1;
+	mutex_unlock(&stats_lock);
+	cg_rlock(&control_lock);
+	const double saved_best_diff = best_diff;
+	char saved_best_share[sizeof(best_share)];
+	memcpy(saved_best_share, best_share, sizeof(best_share));
+	cg_runlock(&control_lock);
+	
+	if (!submit_noffset_nonce(&thr, &work, 0x1dac2b7c, 0))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "submit_noffset_nonce", "good nonce rejected");
+	}
+	if (submit_noffset_nonce(&thr, &work, 0x1dac2b7d, 0))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "submit_noffset_nonce", "bad nonce accepted");
+	}
+	thr_nonce_stats_flush(&thr, true);
+	if (cgpu.diff1 != 1. || cgpu.hw_errors != 1)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "submit_noffset_nonce", "stats");
+	}
+	
+	// Leave the global stats as they were
+	mutex_lock(&stats_lock);
+	hw_errors = saved_hw_errors;
+	total_diff1 = saved_total_diff1;
+	total_bad_diff1 = saved_total_bad_diff1;
+	mutex_unlock(&stats_lock);
+	cg_wlock(&control_lock);
+	best_diff = saved_best_diff;
+	memcpy(best_share, saved_best_share, sizeof(best_share));
+	cg_wunlock(&control_lock);
+}
+#endif
+
 // return true of we should stop working on this piece of work
 // returning false means we will keep scanning for a nonce
 // assumptions: work->blk.nonce is the number of nonces completed in the work
@@ -10878,11 +11693,31 @@ static void fill_queue(struct thr_info *mythr, struct cgpu_info *cgpu, struct de
 	} while (drv->queue_full && !drv->queue_full(cgpu));
 }
 
+static
+void work_queued_key(unsigned char * const key, const void * const midstate, const void * const data)
+{
+	memcpy(key, midstate, 32);
+	memcpy(&key[32], data, 12);
+}
+
 /* Add a work item to a cgpu's queued hashlist */
 void __add_queued(struct cgpu_info *cgpu, struct work *work)
 {
+	struct work *dup;
+	
 	cgpu->queued_count++;
 	HASH_ADD_INT(cgpu->queued_work, id, work);
+	
+	/* Only the oldest of works with the same key is indexed, and lookups go
+	 * back to scanning the queue as long as any others are in it */
+	work_queued_key(work->queued_key, work->midstate, &work->data[64]);
+	HASH_FIND(hh_bymidstate, cgpu->queued_work_bymidstate, work->queued_key, sizeof(work->queued_key), dup);
+	work->queued_indexed = !dup;
+	work->queued_dup = dup;
+	if (dup)
+		++cgpu->queued_bymidstate_dups;
+	else
+		HASH_ADD(hh_bymidstate, cgpu->queued_work_bymidstate, queued_key, sizeof(work->queued_key), work);
 }
 
 /* This function is for retrieving one work item from the unqueued pointer and
@@ -10944,6 +11779,32 @@ struct work *__find_work_bymidstate(struct work *que, char *midstate, size_t mid
 	return ret;
 }
 
+/* Uses the queued_work_bymidstate index for the common key (32, 64, 12), as
+ * long as it covers the whole queue; otherwise scans it */
+static
+struct work *__find_queued_work_bymidstate(struct cgpu_info * const cgpu, char * const midstate, const size_t midstatelen, char * const data, const int offset, const size_t datalen)
+{
+	unsigned char key[sizeof(((struct work *)NULL)->queued_key)];
+	struct work *work;
+	
+	if (midstatelen != 32 || offset != 64 || datalen != 12 || cgpu->queued_bymidstate_dups
+	 || HASH_CNT(hh_bymidstate, cgpu->queued_work_bymidstate) != HASH_COUNT(cgpu->queued_work))
+		return __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	
+	work_queued_key(key, midstate, data);
+	HASH_FIND(hh_bymidstate, cgpu->queued_work_bymidstate, key, sizeof(key), work);
+	
+	if (unlikely(opt_debug))
+	{
+		struct work * const scanned = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+		if (unlikely(scanned != work))
+			applog(LOG_ERR, "%s: Queued work index found %d, but scanning found %d",
+			       cgpu->dev_repr, work ? work->id : -1, scanned ? scanned->id : -1);
+	}
+	
+	return work;
+}
+
 /* This function is for finding an already queued work item in the
  * device's queued_work hashtable. Code using this function must be able
  * to handle NULL as a return which implies there is no matching work.
@@ -10953,7 +11814,7 @@ struct work *find_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate,
 	struct work *ret;
 
 	rd_lock(&cgpu->qlock);
-	ret = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	ret = __find_queued_work_bymidstate(cgpu, midstate, midstatelen, data, offset, datalen);
 	rd_unlock(&cgpu->qlock);
 
 	return ret;
@@ -10964,7 +11825,7 @@ struct work *clone_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate
 	struct work *work, *ret = NULL;
 
 	rd_lock(&cgpu->qlock);
-	work = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	work = __find_queued_work_bymidstate(cgpu, midstate, midstatelen, data, offset, datalen);
 	if (work)
 		ret = copy_work(work);
 	rd_unlock(&cgpu->qlock);
@@ -10976,6 +11837,12 @@ void __work_completed(struct cgpu_info *cgpu, struct work *work)
 {
 	cgpu->queued_count--;
 	HASH_DEL(cgpu->queued_work, work);
+	if (work->queued_indexed)
+		HASH_DELETE(hh_bymidstate, cgpu->queued_work_bymidstate, work);
+	else
+	if (work->queued_dup)
+		--cgpu->queued_bymidstate_dups;
+	work->queued_indexed = work->queued_dup = false;
 }
 
 /* This iterates over a queued hashlist finding work started more than secs
@@ -11019,7 +11886,7 @@ struct work *take_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate,
 	struct work *work;
 
 	wr_lock(&cgpu->qlock);
-	work = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	work = __find_queued_work_bymidstate(cgpu, midstate, midstatelen, data, offset, datalen);
 	if (work)
 		__work_completed(cgpu, work);
 	wr_unlock(&cgpu->qlock);
@@ -11027,6 +11894,74 @@ struct work *take_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate,
 	return work;
 }
 
+void test_queued_work_bymidstate()
+{
+	struct cgpu_info cgpu = {
+		.dev_repr = "TST0",
+	};
+	struct work *works[5], *work;
+	char midstate[32], data[12];
+	int i;
+	
+	rwlock_init(&cgpu.qlock);
+	for (i = 0; i < 5; ++i)
+	{
+		works[i] = make_work();
+		// works[3] has the same key as works[1]
+		memset(works[i]->midstate, (i == 3) ? 1 : i, sizeof(works[i]->midstate));
+		memset(&works[i]->data[64], 0x80 | ((i == 3) ? 1 : i), 12);
+	}
+	for (i = 0; i < 3; ++i)
+		add_queued(&cgpu, works[i]);
+	
+#define CHECK_FIND(find, key, expected, desc)  do {  \
+	memset(midstate, key, sizeof(midstate));  \
+	memset(data, 0x80 | key, sizeof(data));  \
+	work = find(&cgpu, midstate, 32, data, 64, 12);  \
+	if (work != (expected))  \
+	{  \
+		++unittest_failures;  \
+		applog(LOG_WARNING, "%s test failed: %s", "queued_work_bymidstate", desc);  \
+	}  \
+} while(0)
+	
+	CHECK_FIND(find_queued_work_bymidstate, 1, works[1], "indexed");
+	CHECK_FIND(find_queued_work_bymidstate, 7, NULL, "missing");
+	
+	// Duplicates are found oldest first, as by scanning
+	add_queued(&cgpu, works[3]);
+	CHECK_FIND(find_queued_work_bymidstate, 1, works[1], "duplicate");
+	CHECK_FIND(take_queued_work_bymidstate, 1, works[1], "take duplicate");
+	CHECK_FIND(find_queued_work_bymidstate, 1, works[3], "remaining duplicate");
+	CHECK_FIND(take_queued_work_bymidstate, 1, works[3], "take remaining duplicate");
+	CHECK_FIND(find_queued_work_bymidstate, 1, NULL, "taken");
+	if (cgpu.queued_bymidstate_dups || HASH_CNT(hh_bymidstate, cgpu.queued_work_bymidstate) != 2)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queued_work_bymidstate", "index count");
+	}
+	CHECK_FIND(find_queued_work_bymidstate, 2, works[2], "indexed after duplicates");
+	
+	// Works added to queued_work directly are still found
+	HASH_ADD_INT(cgpu.queued_work, id, works[4]);
+	++cgpu.queued_count;
+	CHECK_FIND(find_queued_work_bymidstate, 4, works[4], "unindexed");
+	
+#undef CHECK_FIND
+	
+	free_work(works[1]);
+	free_work(works[3]);
+	for (i = 0; i < 5; ++i)
+		if (i != 1 && i != 3)
+			work_completed(&cgpu, works[i]);
+	if (cgpu.queued_work || cgpu.queued_work_bymidstate || cgpu.queued_count)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "%s test failed: %s", "queued_work_bymidstate", "empty");
+	}
+	pthread_rwlock_destroy(&cgpu.qlock);
+}
+
 void flush_queue(struct cgpu_info *cgpu)
 {
 	struct work *work = NULL;
@@ -11960,6 +12895,9 @@ void print_summary(void)
 		}
 	}
 
+	if (opt_driver_bench)
+		driver_bench_print();
+
 	if (opt_shares) {
 		applog(LOG_WARNING, "Mined %g accepted shares of %g requested\n", total_diff_accepted, opt_shares);
 		if (opt_shares > total_diff_accepted)
@@ -11973,12 +12911,21 @@ void print_summary(void)
 
 void _bfg_clean_up(bool restarting)
 {
+	journal_close(sharelog_journal);
+	sharelog_journal = NULL;
+	journal_close(noncelog_journal);
+	noncelog_journal = NULL;
+	logging_async_stop();
+	
 #ifdef USE_OPENCL
 	clear_adl(nDevs);
 #endif
 #ifdef HAVE_LIBUSB
 	if (likely(have_libusb))
-        libusb_exit(NULL);
+	{
+		usb_async_shutdown();
+		libusb_exit(NULL);
+	}
 #endif
 
 	cgtime(&total_tv_end);
@@ -12525,10 +13472,42 @@ bool bfg_need_detect_rescan;
 extern void probe_device(struct lowlevel_device_info *);
 static void schedule_rescan(const struct timeval *);
 
+#ifdef HAVE_BFG_LOWLEVEL
+static const char probe_stats_file[] = "probe-stats";
+
+// Probe timings from earlier runs decide which drivers are tried first
+static
+void probe_stats_load()
+{
+	static bool loaded;
+	char filename[PATH_MAX];
+	
+	if (loaded)
+		return;
+	loaded = true;
+	default_state_file(filename, probe_stats_file);
+	if (lowlevel_probe_stats_load(filename))
+		applog(LOG_DEBUG, "Loaded probe stats from %s", filename);
+}
+
+static
+void probe_stats_save()
+{
+	char filename[PATH_MAX];
+	
+	default_state_file(filename, probe_stats_file);
+	if (!lowlevel_probe_stats_save(filename))
+		applog(LOG_DEBUG, "Failed to save probe stats to %s", filename);
+}
+#endif
+
 static
 void drv_detect_all()
 {
 	bool rescanning = false;
+#ifdef HAVE_BFG_LOWLEVEL
+	probe_stats_load();
+#endif
 rescan:
 	bfg_need_detect_rescan = false;
 	
@@ -12553,6 +13532,7 @@ rescan:
 
 #ifdef HAVE_BFG_LOWLEVEL
 	lowlevel_scan_free();
+	probe_stats_save();
 #endif
 	
 	if (bfg_need_detect_rescan)
@@ -12618,6 +13598,7 @@ void allocate_cgpu(struct cgpu_info *cgpu, unsigned int *kp)
 		thr->device_thread = j;
 		thr->work_restart_notifier[1] = INVSOCK;
 		thr->mutex_request[1] = INVSOCK;
+		thr->_notifier_epollfd = thr->_notifier_epoll_mutex_request = thr->_notifier_epoll_devfd = -1;
 		thr->_job_transition_in_progress = true;
 		timerclear(&thr->tv_morework);
 
@@ -12669,6 +13650,11 @@ void start_cgpu(struct cgpu_info *cgpu)
 		proc_enable(cgpu);
 }
 
+#ifdef HAVE_BFG_LOWLEVEL
+// Set while scanning for a device the user asked for by name, which is always probed
+static bool probe_cache_bypass;
+#endif
+
 static
 void _scan_serial(void *p)
 {
@@ -12682,12 +13668,18 @@ void _scan_serial(void *p)
 		scan_devices = NULL;
 		string_elist_add("noauto", &scan_devices);
 		add_serial(s);
+#ifdef HAVE_BFG_LOWLEVEL
+		probe_cache_bypass = true;
+#endif
 	}
 	
 	drv_detect_all();
 	
 	if (s)
 	{
+#ifdef HAVE_BFG_LOWLEVEL
+		probe_cache_bypass = false;
+#endif
 		DL_FOREACH_SAFE(scan_devices, iter, tmp)
 		{
 			string_elist_del(&scan_devices, iter);
@@ -12720,8 +13712,17 @@ bool _probe_device_match(const struct lowlevel_device_info * const info, const c
 static
 bool _probe_device_do_probe(const struct device_drv * const drv, const struct lowlevel_device_info * const info, bool * const request_rescan_p)
 {
+	struct timeval tv_start, tv_end;
+	
 	bfg_probe_result_flags = 0;
-	if (drv->lowl_probe(info))
+	timer_set_now(&tv_start);
+	const bool found = drv->lowl_probe(info);
+	timer_set_now(&tv_end);
+	const double ms = timer_elapsed_us(&tv_start, &tv_end) / 1e3;
+	applog(LOG_DEBUG, "%s: %s probe of %s %s after %.0f ms",
+	       __func__, drv->dname, info->devid, found ? "succeeded" : "failed", ms);
+	lowlevel_probe_stats_record(info, drv->dname, found, ms);
+	if (found)
 	{
 		if (!(bfg_probe_result_flags & BPR_CONTINUE_PROBES))
 			return true;
@@ -12732,10 +13733,21 @@ bool _probe_device_do_probe(const struct device_drv * const drv, const struct lo
 	return false;
 }
 
+static
+int probe_driver_count()
+{
+	struct driver_registration *dreg;
+	int count = 0;
+	
+	BFG_FOREACH_DRIVER_BY_PRIORITY(dreg)
+		++count;
+	return count;
+}
+
 bool dummy_check_never_true = false;
 
 static
-void *probe_device_thread(void *p)
+void *_probe_device_thread(void *p)
 {
 	struct lowlevel_device_info * const infolist = p;
 	struct lowlevel_device_info *info = infolist;
@@ -12752,6 +13764,23 @@ void *probe_device_thread(void *p)
 		applogr(NULL, LOG_DEBUG, "%s: \"%s\" already in use",
 		        __func__, info->product);
 	
+	// Only automatic probes skip devices that failed before; user assignments are always tried
+	const bool probe_cached = (!probe_cache_bypass) && lowlevel_probe_cache_check(infolist, time(NULL));
+	if (probe_cached)
+		applog(LOG_DEBUG, "%s: \"%s\" (%s) failed probing before, skipping automatic probes",
+		       __func__, info->product, info->devid);
+	
+	// Among drivers of equal priority, automatic probes try those most likely to take this kind of device first
+	const int drvcount = probe_driver_count();
+	const struct device_drv *drvs[drvcount];
+	int drvi = 0;
+	{
+		struct driver_registration *dreg;
+		BFG_FOREACH_DRIVER_BY_PRIORITY(dreg)
+			drvs[drvi++] = dreg->drv;
+	}
+	lowlevel_probe_stats_order(infolist, drvs, drvcount);
+	
 	// if lowlevel device matches specific user assignment, probe requested driver(s)
 	struct string_elist *sd_iter, *sd_tmp;
 	struct driver_registration *dreg;
@@ -12785,9 +13814,9 @@ void *probe_device_thread(void *p)
 	}
 	
 	// probe driver(s) with auto enabled and matching VID/PID/Product/etc of device
-	BFG_FOREACH_DRIVER_BY_PRIORITY(dreg)
+	for (drvi = 0; !probe_cached && drvi < drvcount; ++drvi)
 	{
-		const struct device_drv * const drv = dreg->drv;
+		const struct device_drv * const drv = drvs[drvi];
 		
 		if (!drv_algo_check(drv))
 			continue;
@@ -12865,9 +13894,9 @@ void *probe_device_thread(void *p)
 					_probe_device_match(info, (dname[0] == '@') ? &dname[1] : dname))
 				{
 					bool dont_rescan = false;
-					BFG_FOREACH_DRIVER_BY_PRIORITY(dreg)
+					for (drvi = 0; drvi < drvcount; ++drvi)
 					{
-						const struct device_drv * const drv = dreg->drv;
+						const struct device_drv * const drv = drvs[drvi];
 						if (!drv_algo_check(drv))
 							continue;
 						if (drv->lowl_probe_by_name_only)
@@ -12909,6 +13938,9 @@ void *probe_device_thread(void *p)
 		}
 	}
 	
+	if (!probe_cached)
+		lowlevel_probe_cache_failed(infolist, time(NULL));
+	
 	// Only actually request a rescan if we never found any cgpu
 	if (request_rescan)
 		bfg_need_detect_rescan = true;
@@ -12916,8 +13948,63 @@ void *probe_device_thread(void *p)
 	return NULL;
 }
 
+/* Bounds how many devices are probed at once, however many turn up together,
+ * and how many of those share a lowlevel bus. Each device is only ever probed
+ * by one thread, which tries its drivers in turn. */
+#define MAX_CONCURRENT_PROBES  0x20
+#define MAX_CONCURRENT_PROBES_PER_BUS  0x10
+#define MAX_PROBE_BUSES  0x10
+static pthread_mutex_t probe_threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_threads_cond = PTHREAD_COND_INITIALIZER;
+static int probe_threads;
+static struct {
+	const struct lowlevel_driver *lowl;
+	int threads;
+} probe_buses[MAX_PROBE_BUSES];
+
+static
+int *probe_bus_threads(const struct lowlevel_driver * const lowl)
+{
+	int i;
+	
+	for (i = 0; i < MAX_PROBE_BUSES && probe_buses[i].lowl; ++i)
+		if (probe_buses[i].lowl == lowl)
+			return &probe_buses[i].threads;
+	if (i == MAX_PROBE_BUSES)
+		// Only bounded by the total
+		return NULL;
+	probe_buses[i].lowl = lowl;
+	return &probe_buses[i].threads;
+}
+
+static
+void *probe_device_thread(void *p)
+{
+	struct lowlevel_device_info * const info = p;
+	
+	_probe_device_thread(info);
+	
+	mutex_lock(&probe_threads_mutex);
+	int * const bus_threads = probe_bus_threads(info->lowl);
+	if (bus_threads)
+		--*bus_threads;
+	--probe_threads;
+	pthread_cond_broadcast(&probe_threads_cond);
+	mutex_unlock(&probe_threads_mutex);
+	return NULL;
+}
+
 void probe_device(struct lowlevel_device_info * const info)
 {
+	mutex_lock(&probe_threads_mutex);
+	int * const bus_threads = probe_bus_threads(info->lowl);
+	while (probe_threads >= MAX_CONCURRENT_PROBES || (bus_threads && *bus_threads >= MAX_CONCURRENT_PROBES_PER_BUS))
+		pthread_cond_wait(&probe_threads_cond, &probe_threads_mutex);
+	if (bus_threads)
+		++*bus_threads;
+	++probe_threads;
+	mutex_unlock(&probe_threads_mutex);
+	
 	pthread_create(&info->probe_pth, NULL, probe_device_thread, info);
 }
 #endif
@@ -13016,6 +14103,48 @@ static pthread_mutex_t rescan_mutex = PTHREAD_MUTEX_INITIALIZER;
 static bool rescan_active;
 static struct timeval tv_rescan;
 static notifier_t rescan_notifier;
+#ifdef HAVE_BFG_LOWLEVEL
+// Devices hotplug wants probed; skipped in favour of a full rescan if one is also due
+static struct string_elist *rescan_devids;
+static bool rescan_full;
+
+static
+bool hotplug_devid_listed(struct string_elist * const devids, const char * const devid)
+{
+	struct string_elist *iter;
+	
+	DL_FOREACH(devids, iter)
+		if (!strcmp(iter->string, devid))
+			return true;
+	return false;
+}
+
+// Probes only the devices hotplug events named, instead of everything lowlevel_scan finds
+static
+void _hotplug_scan(void * const p)
+{
+	struct string_elist * const devids = p;
+	struct lowlevel_device_info * const infolist = lowlevel_scan(), *info, *infotmp;
+	
+	bfg_need_detect_rescan = false;
+	LL_FOREACH_SAFE(infolist, info, infotmp)
+		if (hotplug_devid_listed(devids, info->devid))
+			probe_device(info);
+	LL_FOREACH_SAFE(infolist, info, infotmp)
+		if (hotplug_devid_listed(devids, info->devid))
+			pthread_join(info->probe_pth, NULL);
+	lowlevel_scan_free();
+	probe_stats_save();
+	
+	if (bfg_need_detect_rescan)
+	{
+		applog(LOG_DEBUG, "%s: Device rescan requested, delaying", __func__);
+		struct timeval tv_when;
+		timer_set_delay_from_now(&tv_when, rescan_delay_ms * 1000);
+		schedule_rescan(&tv_when);
+	}
+}
+#endif
 
 static
 void *rescan_thread(__maybe_unused void *p)
@@ -13050,9 +14179,29 @@ void *rescan_thread(__maybe_unused void *p)
 		if (timer_passed(&tv_rescan, NULL))
 		{
 			timer_unset(&tv_rescan);
+#ifdef HAVE_BFG_LOWLEVEL
+			struct string_elist *devids = rescan_devids, *iter, *tmp;
+			const bool full = rescan_full || !devids;
+			rescan_devids = NULL;
+			rescan_full = false;
+#endif
 			mutex_unlock(&rescan_mutex);
-			applog(LOG_DEBUG, "Rescan timer expired, triggering");
-			scan_serial(NULL);
+#ifdef HAVE_BFG_LOWLEVEL
+			if (!full)
+			{
+				applog(LOG_DEBUG, "Rescan timer expired, probing only the devices hotplug added");
+				create_new_cgpus(_hotplug_scan, devids);
+			}
+			else
+#endif
+			{
+				applog(LOG_DEBUG, "Rescan timer expired, triggering");
+				scan_serial(NULL);
+			}
+#ifdef HAVE_BFG_LOWLEVEL
+			DL_FOREACH_SAFE(devids, iter, tmp)
+				string_elist_del(&devids, iter);
+#endif
 		}
 		else
 			mutex_unlock(&rescan_mutex);
@@ -13061,7 +14210,7 @@ void *rescan_thread(__maybe_unused void *p)
 }
 
 static
-void _schedule_rescan(const struct timeval * const tvp_when)
+void _schedule_rescan_timer(const struct timeval * const tvp_when)
 {
 	if (rescan_active)
 	{
@@ -13084,6 +14233,15 @@ void _schedule_rescan(const struct timeval * const tvp_when)
 		applog(LOG_ERR, "Failed to start rescan thread");
 }
 
+static
+void _schedule_rescan(const struct timeval * const tvp_when)
+{
+#ifdef HAVE_BFG_LOWLEVEL
+	rescan_full = true;
+#endif
+	_schedule_rescan_timer(tvp_when);
+}
+
 static
 void schedule_rescan(const struct timeval * const tvp_when)
 {
@@ -13103,6 +14261,55 @@ void hotplug_trigger()
 
 #if defined(HAVE_LIBUDEV) && defined(HAVE_SYS_EPOLL_H)
 
+#ifdef HAVE_BFG_LOWLEVEL
+// Hands devids over to the rescan thread, so probing never blocks the udev reader
+static
+void schedule_rescan_devids(struct string_elist * const devids)
+{
+	struct timeval tv_now;
+	
+	timer_set_now(&tv_now);
+	mutex_lock(&rescan_mutex);
+	DL_CONCAT(rescan_devids, devids);
+	_schedule_rescan_timer(&tv_now);
+	mutex_unlock(&rescan_mutex);
+}
+
+/* Adds the devids lowlevel_scan would give the event's device to devids (if
+ * not NULL), and forgets any failed probes of it, since replugging is how
+ * users retry a device. Only uses properties from the event itself, which
+ * remove events still carry after sysfs is gone. Returns false if the device
+ * cannot be identified. */
+static
+bool hotplug_udev_devids(struct udev_device * const device, struct string_elist ** const devids)
+{
+	const char * const serial = udev_device_get_property_value(device, "ID_SERIAL_SHORT");
+	const dev_t devt = udev_device_get_devnum(device);
+	char *devid[2] = {NULL, NULL};
+	
+#if defined(HAVE_LIBUSB) || defined(NEED_BFG_LOWL_HID)
+	const char * const busnum = udev_device_get_property_value(device, "BUSNUM");
+	const char * const devnum = udev_device_get_property_value(device, "DEVNUM");
+	if (busnum && devnum)
+		devid[0] = bfg_make_devid_usb(atoi(busnum), atoi(devnum));
+#endif
+	if (major(devt))
+		devid[1] = bfg_make_devid_devt(devt);
+	lowlevel_probe_cache_forget(NULL, serial);
+	for (int i = 0; i < 2; ++i)
+	{
+		if (!devid[i])
+			continue;
+		lowlevel_probe_cache_forget(devid[i], NULL);
+		applog(LOG_DEBUG, "%s: %s event for %s", __func__, udev_device_get_action(device), devid[i]);
+		if (devids && !hotplug_devid_listed(*devids, devid[i]))
+			string_elist_add(devid[i], devids);
+		free(devid[i]);
+	}
+	return (devid[0] || devid[1]);
+}
+#endif
+
 static
 void *hotplug_thread(__maybe_unused void *p)
 {
@@ -13132,7 +14339,8 @@ void *hotplug_thread(__maybe_unused void *p)
 	
 	struct epoll_event ev;
 	int rv;
-	bool pending = false;
+	bool pending = false, full_rescan = false;
+	struct string_elist *devids = NULL, *iter, *tmp;
 	while (true)
 	{
 		rv = epoll_wait(epfd, &ev, 1, pending ? hotplug_delay_ms : -1);
@@ -13144,8 +14352,22 @@ void *hotplug_thread(__maybe_unused void *p)
 		}
 		if (!rv)
 		{
-			hotplug_trigger();
-			pending = false;
+#ifdef HAVE_BFG_LOWLEVEL
+			if (!full_rescan)
+			{
+				if (devids)
+				{
+					applog(LOG_DEBUG, "%s: Probing only the devices added", __func__);
+					schedule_rescan_devids(devids);
+					devids = NULL;
+				}
+			}
+			else
+#endif
+				hotplug_trigger();
+			DL_FOREACH_SAFE(devids, iter, tmp)
+				string_elist_del(&devids, iter);
+			pending = full_rescan = false;
 			continue;
 		}
 		struct udev_device * const device = udev_monitor_receive_device(mon);
@@ -13154,7 +14376,25 @@ void *hotplug_thread(__maybe_unused void *p)
 		const char * const action = udev_device_get_action(device);
 		applog(LOG_DEBUG, "%s: Received %s event", __func__, action);
 		if (!strcmp(action, "add"))
+		{
 			pending = true;
+#ifdef HAVE_BFG_LOWLEVEL
+			if (!hotplug_udev_devids(device, &devids))
+			{
+				// Interfaces come with their USB device's own event
+				const char * const devtype = udev_device_get_devtype(device);
+				if (!(devtype && !strcmp(devtype, "usb_interface")))
+					full_rescan = true;
+			}
+#else
+			full_rescan = true;
+#endif
+		}
+#ifdef HAVE_BFG_LOWLEVEL
+		else
+		if (!strcmp(action, "remove"))
+			hotplug_udev_devids(device, NULL);
+#endif
 		udev_device_unref(device);
 	}
 	
@@ -13278,6 +14518,10 @@ void bfg_atexit(void)
 extern void bfg_init_threadlocal();
 extern bool stratumsrv_change_port(unsigned);
 extern void test_aan_pll(void);
+extern void test_icarus_reactor(void);
+extern void test_sim(void);
+extern void test_vcom_capture(void);
+extern void test_bitfury_spi_sched(void);
 
 int main(int argc, char *argv[])
 {
@@ -13342,6 +14586,7 @@ int main(int argc, char *argv[])
 		quit(1, "Failed to pthread_cond_init gws_cond");
 
 	notifier_init(submit_waiting_notifier);
+	notifier_init_broadcast(work_restart_broadcast);
 	timer_unset(&tv_rescan);
 	notifier_init(rescan_notifier);
 
@@ -13459,6 +14704,9 @@ int main(int argc, char *argv[])
 	if (argc != 1)
 		quit(1, "Unexpected extra commandline arguments");
 	
+	if (opt_sharelog_dump)
+		exit(journal_dump(opt_sharelog_dump, stdout) ? 0 : 1);
+	
 	if (rearrange_pools && rearrange_pools < total_pools)
 	{
 		// Prioritise commandline pools before default-config pools
@@ -13523,10 +14771,50 @@ int main(int argc, char *argv[])
 		test_scrypt();
 #endif
 		test_target();
+		test_crc();
 		test_uri_get_param();
+		test_stratum_fast();
+		test_metrics();
+		test_logring();
+		test_journal();
+		test_bfg_reactor();
+		test_notifier();
+		test_queue_stats();
+		test_queue_prefetch();
+		test_history();
+		test_hash_counter();
+		test_queued_work_bymidstate();
+#ifdef USE_SHA256D
+		test_sha256d();
+		test_work_nonce_hash();
+#endif
+#ifdef HAVE_BFG_LOWLEVEL
+		test_lowlevel_probe_cache();
+		test_lowlevel_probe_stats();
+		test_lowl_frame();
+		test_lowl_capture();
+#endif
+#ifdef HAVE_LIBUSB
+		test_usb_async();
+#endif
+#if defined(NEED_BFG_LOWL_VCOM) && !defined(WIN32)
+		test_vcom_capture();
+#endif
+#ifdef NEED_DYNCLOCK
+		test_dclk_chip();
+#endif
+#ifdef USE_ICARUS
+		test_icarus_reactor();
+#endif
+#ifdef USE_BITFURY
+		test_bitfury_spi_sched();
+#endif
 		utf8_test();
 #ifdef USE_JINGTIAN
 		test_aan_pll();
+#endif
+#ifdef USE_SIM
+		test_sim();
 #endif
 		if (unittest_failures)
 			quit(1, "Unit tests failed");
@@ -13541,6 +14829,8 @@ int main(int argc, char *argv[])
 		enable_curses();
 #endif
 
+	logging_async_start();
+
 #ifdef HAVE_LIBUSB
 	int err = libusb_init(NULL);
 	if (err)
@@ -13754,6 +15044,7 @@ begin_bench:
 	for (i = 0; i < total_devices; i++) {
 		struct cgpu_info *cgpu = devices[i];
 
+		++cgpu->hash_counter_epoch;
 		cgpu->rolling = cgpu->total_mhashes = 0;
 	}
 	
@@ -294,6 +294,7 @@ enum pow_algorithm {
 };
 
 struct api_data;
+struct bfg_reactor_client;
 struct thr_info;
 struct work;
 struct lowlevel_device_info;
@@ -367,10 +368,14 @@ struct device_drv {
 	void (*job_start)(struct thr_info*);
 	void (*job_get_results)(struct thr_info*, struct work*);
 	int64_t (*job_process_results)(struct thr_info*, struct work*, bool stopping);
+	// device_fd is readable (minerloop_async/minerloop_reactor); must consume the data
+	void (*reactor_read)(struct thr_info *);
 
 	// === Implemented by minerloop_queue ===
 	bool (*queue_append)(struct thr_info *, struct work *);
 	void (*queue_flush)(struct thr_info *);
+	// Works per processor that minerloop_queue fetches ahead on a helper thread
+	int queue_prefetch;
 };
 
 enum dev_enable {
@@ -541,7 +546,10 @@ struct cgpu_info {
 	double bad_diff1;
 	int hw_errors;
 	double rolling;
+	// Sum of the threads' hash counters, kept by the first thread
 	double total_mhashes;
+	// Incremented to zero the threads' hash counters
+	unsigned hash_counter_epoch;
 	double utility;
 	double utility_diff1;
 	enum alive status;
@@ -560,6 +568,13 @@ struct cgpu_info {
 	int targettemp;
 	bool targettemp_user;
 
+	int queue_prefetch;
+	bool queue_prefetch_user;
+	// Prefetch helper thread state, kept on the device
+	bool _prefetch_started;
+	pthread_mutex_t _prefetch_mutex;
+	pthread_cond_t _prefetch_cond;
+
 	double diff1;
 	double diff_accepted;
 	double diff_rejected;
@@ -586,9 +601,15 @@ struct cgpu_info {
 	int dev_throttle_count;
 
 	struct cgminer_stats cgminer_stats;
+	struct history *history;
+	// CPU time of the processor's own threads, sampled at shutdown by --driver-bench
+	double cpu_time;
 
 	pthread_rwlock_t qlock;
 	struct work *queued_work;
+	// queued_work indexed by midstate and data tail, and how many works were left out of it as duplicates
+	struct work *queued_work_bymidstate;
+	unsigned queued_bymidstate_dups;
 	struct work *unqueued_work;
 	unsigned int queued_count;
 
@@ -610,12 +631,44 @@ struct thread_q {
 	pthread_cond_t		cond;
 };
 
+#define QUEUE_LATENCY_BUCKETS  17
+
+struct queue_latency_histogram {
+	// Bucket i counts latencies under 2^i ms; the last bucket is open ended
+	uint32_t buckets[QUEUE_LATENCY_BUCKETS];
+	uint32_t count;
+	uint64_t total_ms;
+};
+
+// Time from queue_append to first nonce and to release, kept by minerloop_queue
+struct queue_stats {
+	bool enabled;
+	pthread_mutex_t lock;
+	int outstanding;
+	uint32_t flushed;
+	struct timeval tv_flushed;
+	struct timeval tv_last_done;
+	struct queue_latency_histogram first_nonce;
+	struct queue_latency_histogram done;
+	// Moving averages used for autotuning
+	double idle_latency_ms;
+	double done_interval_ms;
+	int autotune_depth;
+};
+
 enum thr_busy_state {
 	TBS_IDLE,
 	TBS_GETTING_RESULTS,
 	TBS_STARTING_JOB,
 };
 
+// Written only by its own thread, so hashmeter needs no lock; read it under seq
+struct thr_hash_counter {
+	volatile unsigned seq;
+	unsigned epoch;
+	double total_mhashes;
+};
+
 struct thr_info {
 	int		id;
 	int		device_thread;
@@ -638,6 +691,13 @@ struct thr_info {
 	bool	pause;
 	time_t	getwork;
 	double	rolling;
+	struct thr_hash_counter hash_counter;
+	// Nonce statistics not yet folded into the totals; see thr_nonce_stats_flush
+	volatile int _nonce_stats_busy;
+	struct pool *_pending_diff1_pool;
+	double _pending_diff1;
+	int _pending_hw_errors;
+	double _pending_bad_diff1;
 
 	// Used by minerloop_async
 	struct work *prev_work;
@@ -657,13 +717,36 @@ struct thr_info {
 	bool starting_next_work;
 	uint32_t _max_nonce;
 	notifier_t mutex_request;
+	// Bumped by cgpu_release_control, under the device_mutex
+	unsigned _mutex_releases;
+	// Used by minerloop_reactor to hand over the device without blocking
+	bool _mutex_request_pending;
+	bool _mutex_request_granted;
+	unsigned _mutex_request_releases;
+	struct bfg_reactor_client *reactor_client;
+	// Processor shares its device's job; minerloop_async only polls it
+	bool async_passive;
 
 	// Used by minerloop_queue
 	struct work *work_list;
 	bool queue_full;
+	// Set by drivers that want minerloop_queue to size the queue for them
+	bool queue_autotune;
+	struct queue_stats queue_stats;
+	// Fetched ahead by the device's prefetch thread, under its _prefetch_mutex
+	struct work *_prefetch_list;
+	int _prefetch_count;
 
 	bool	work_restart;
 	notifier_t work_restart_notifier;
+	// Set while the thread also waits on work_restart_broadcast, so restart_threads need not wake it directly
+	bool work_restart_broadcast;
+
+	// Used by do_notifier_select: the thread's own epoll set, or -1 until it is built
+	int _notifier_epollfd;
+	bool _notifier_select;
+	int _notifier_epoll_mutex_request;
+	int _notifier_epoll_devfd;
 };
 
 struct string_elist {
@@ -985,6 +1068,7 @@ extern int last_logstatusline_len;
 extern bool have_libusb;
 #endif
 extern int httpsrv_port;
+extern bool opt_http_metrics;
 extern long stratumsrv_port;
 extern char *opt_api_allow;
 extern bool opt_api_mcast;
@@ -1037,6 +1121,7 @@ extern pthread_mutex_t console_lock;
 extern cglock_t ch_lock;
 extern pthread_rwlock_t mining_thr_lock;
 extern pthread_rwlock_t devices_lock;
+extern notifier_t work_restart_broadcast;
 
 
 extern bool _bfg_console_cancel_disabled;
@@ -1103,6 +1188,7 @@ extern int set_memoryclock(int gpu, int iMemoryClock);
 #endif
 
 extern void api(int thr_id);
+extern const char *status2str(enum alive);
 
 extern struct pool *current_pool(void);
 extern int enabled_pools;
@@ -1284,6 +1370,9 @@ struct stratum_work {
 	struct bfg_tmpl_ref *tr;
 	char *job_id;
 	bool clean;
+	// Set when the job arrived as a "bfg.batch" job line
+	bool batch_job;
+	uint32_t batch_handle;
 	
 	bytes_t coinbase;
 	size_t nonce2_offset;
@@ -1436,6 +1525,10 @@ struct pool {
 	bool stratum_active;
 	bool stratum_init;
 	bool stratum_notify;
+	// Negotiated "bfg.batch" version, or 0 if not in use
+	int stratum_batch;
+	// Share records waiting to be sent as one batch; only used by the submit_work thread
+	bytes_t stratum_batch_shares;
 	struct stratum_work swork;
 	char *goalname;
 	char *next_goalname;
@@ -1497,6 +1590,8 @@ struct work {
 
 	bool		stratum;
 	char 		*job_id;
+	bool		batch_job;
+	uint32_t	batch_handle;
 	bytes_t		nonce2;
 	char		*nonce1;
 
@@ -1504,6 +1599,11 @@ struct work {
 	int		id;
 	work_device_id_t device_id;
 	UT_hash_handle hh;
+	// Used while in a processor's queued_work; see __add_queued
+	UT_hash_handle hh_bymidstate;
+	unsigned char queued_key[32 + 12];
+	bool queued_indexed;
+	bool queued_dup;
 	
 	// Please don't use this if it's at all possible, I'd like to get rid of it eventually.
 	void *device_data;
@@ -1532,6 +1632,12 @@ struct work {
 	struct timeval	tv_work_found;
 	char		getwork_mode;
 
+	// Set while queued to a processor by minerloop_queue
+	struct thr_info	*queue_thr;
+	struct timeval	tv_queued;
+	bool		queued_idle;
+	bool		queue_nonce_found;
+
 	/* Used to queue shares in submit_waiting */
 	struct work *prev;
 	struct work *next;
@@ -1545,6 +1651,7 @@ extern void stratum_work_clean(struct stratum_work *);
 extern bool pool_has_usable_swork(const struct pool *);
 extern void gen_stratum_work2(struct work *, struct stratum_work *);
 extern void gen_stratum_work3(struct work *, struct stratum_work *, cglock_t *data_lock_p);
+extern void thr_nonce_stats_flush(struct thr_info *, bool wait);
 extern void inc_hw_errors3(struct thr_info *thr, const struct work *work, const uint32_t *bad_nonce_p, float nonce_diff);
 static inline
 void inc_hw_errors2(struct thr_info * const thr, const struct work * const work, const uint32_t *bad_nonce_p)
@@ -1566,6 +1673,7 @@ enum test_nonce2_result {
 extern enum test_nonce2_result _test_nonce2(struct work *, uint32_t nonce, bool checktarget);
 #define test_nonce(work, nonce, checktarget)  (_test_nonce2(work, nonce, checktarget) == TNR_GOOD)
 #define test_nonce2(work, nonce)  (_test_nonce2(work, nonce, true))
+extern uint32_t test_nonces(const struct work *, const uint32_t *nonces, unsigned count);
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
 extern bool submit_noffset_nonce(struct thr_info *thr, struct work *work, uint32_t nonce,
 			  int noffset);
@@ -1604,6 +1712,7 @@ extern void remove_pool(struct pool *pool);
 extern void write_config(FILE *fcfg);
 extern void zero_bestshare(void);
 extern void zero_stats(void);
+extern void default_state_file(char *filename, const char *name);
 extern void default_save_file(char *filename);
 extern bool _log_curses_only(int prio, const char *datetime, const char *str);
 extern void clear_logwin(void);
@@ -39,6 +39,9 @@
 #endif
 #ifndef WIN32
 #include <fcntl.h>
+# ifdef HAVE_SYS_EVENTFD_H
+#  include <sys/eventfd.h>
+# endif
 # ifdef __linux
 #  include <sys/prctl.h>
 # endif
@@ -2610,39 +2613,11 @@ incomplete_cb:
 	return true;
 }
 
-static bool parse_notify(struct pool *pool, json_t *val)
+// Takes ownership of job_id and leaves data_lock write-locked
+// Caller must then fill in header1, ntime, diffbits, the coinbase outside of the extranonces, and merkle_bin, before calling stratum_notify_end
+static
+uint8_t *stratum_notify_begin(struct pool * const pool, char * const job_id, const bool clean, const size_t cb1_len, const size_t cb2_len, const int merkles)
 {
-	const char *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit, *ntime;
-	char *job_id;
-	bool clean, ret = false;
-	int merkles, i;
-	size_t cb1_len, cb2_len;
-	json_t *arr;
-
-	arr = json_array_get(val, 4);
-	if (!arr || !json_is_array(arr))
-		goto out;
-
-	merkles = json_array_size(arr);
-	for (i = 0; i < merkles; i++)
-		if (!json_is_string(json_array_get(arr, i)))
-			goto out;
-
-	prev_hash = __json_array_string(val, 1);
-	coinbase1 = __json_array_string(val, 2);
-	coinbase2 = __json_array_string(val, 3);
-	bbversion = __json_array_string(val, 5);
-	nbit = __json_array_string(val, 6);
-	ntime = __json_array_string(val, 7);
-	clean = json_is_true(json_array_get(val, 8));
-
-	if (!prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime)
-		goto out;
-	
-	job_id = json_array_string(val, 0);
-	if (!job_id)
-		goto out;
-
 	cg_wlock(&pool->data_lock);
 	cgtime(&pool->swork.tv_received);
 	free(pool->swork.job_id);
@@ -2654,6 +2629,7 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	}
 	pool->submit_old = !clean;
 	pool->swork.clean = true;
+	pool->swork.batch_job = false;
 	
 	// stratum_set_goal ensures these are the same pointer if they match
 	if (pool->goalname != pool->next_goalname)
@@ -2681,65 +2657,575 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	pool->nonce2off = (n2size < sizeof(pool->nonce2)) ? (sizeof(pool->nonce2) - n2size) : 0;
 #endif
 	
-	hex2bin(&pool->swork.header1[0], bbversion,  4);
-	hex2bin(&pool->swork.header1[4], prev_hash, 32);
-	hex2bin((void*)&pool->swork.ntime, ntime, 4);
-	pool->swork.ntime = be32toh(pool->swork.ntime);
-	hex2bin(&pool->swork.diffbits[0], nbit, 4);
-	
-	/* Nominally allow a driver to ntime roll 60 seconds */
-	set_simple_ntime_roll_limit(&pool->swork.ntime_roll_limits, pool->swork.ntime, 60, &pool->swork.tv_received);
-	
-	cb1_len = strlen(coinbase1) / 2;
 	pool->swork.nonce2_offset = cb1_len + pool->n1_len;
-	cb2_len = strlen(coinbase2) / 2;
-
+	
 	bytes_resize(&pool->swork.coinbase, pool->swork.nonce2_offset + pool->swork.n2size + cb2_len);
 	uint8_t *coinbase = bytes_buf(&pool->swork.coinbase);
-	hex2bin(coinbase, coinbase1, cb1_len);
 	hex2bin(&coinbase[cb1_len], pool->swork.nonce1, pool->n1_len);
 	// NOTE: gap for nonce2, filled at work generation time
-	hex2bin(&coinbase[pool->swork.nonce2_offset + pool->swork.n2size], coinbase2, cb2_len);
 	
 	bytes_resize(&pool->swork.merkle_bin, 32 * merkles);
-	for (i = 0; i < merkles; i++)
-		hex2bin(&bytes_buf(&pool->swork.merkle_bin)[i * 32], json_string_value(json_array_get(arr, i)), 32);
 	pool->swork.merkles = merkles;
 	pool->nonce2 = 0;
 	
+	return coinbase;
+}
+
+static
+void stratum_notify_end(struct pool * const pool)
+{
+	/* Nominally allow a driver to ntime roll 60 seconds */
+	set_simple_ntime_roll_limit(&pool->swork.ntime_roll_limits, pool->swork.ntime, 60, &pool->swork.tv_received);
+	
 	memcpy(pool->swork.target, pool->next_target, 0x20);
 	
-	pool_check_coinbase(pool, coinbase, bytes_len(&pool->swork.coinbase));
+	pool_check_coinbase(pool, bytes_buf(&pool->swork.coinbase), bytes_len(&pool->swork.coinbase));
+	
+	const int merkles = pool->swork.merkles;
 	
 	cg_wunlock(&pool->data_lock);
+	
+	/* A notify message is the closest stratum gets to a getwork */
+	pool->getwork_requested++;
+	total_getworks++;
+
+	if ((merkles && (!pool->swork.transparency_probed || rand() <= RAND_MAX / (opt_skip_checks + 1))) || timer_isset(&pool->swork.tv_transparency))
+		if (pool->probed)
+			stratum_probe_transparency(pool);
+}
+
+static inline
+const char *_sfp_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+		++p;
+	return p;
+}
+
+static
+const char *_sfp_digits(const char *p, const int maxdigits)
+{
+	const char * const s = p;
+	while (isdigit(*p))
+		++p;
+	if (p == s || p - s > maxdigits)
+		return NULL;
+	return p;
+}
+
+static
+const char *_sfp_scalar(struct stratum_fast_tok * const tok, const char *p)
+{
+	static const struct {
+		const char *s;
+		enum stratum_fast_type type;
+	} literals[] = {
+		{"null" , SFT_NULL },
+		{"true" , SFT_TRUE },
+		{"false", SFT_FALSE},
+	};
+	
+	tok->s = p;
+	if (*p == '"')
+	{
+		tok->s = ++p;
+		for ( ; *p != '"'; ++p)
+			// Escapes, non-ASCII, control characters, and the end of the string all need jansson
+			if (*p == '\\' || (unsigned char)*p < 0x20 || (unsigned char)*p >= 0x80)
+				return NULL;
+		tok->type = SFT_STRING;
+		tok->len = p - tok->s;
+		return p + 1;
+	}
+	for (int i = 0; i < sizeof(literals) / sizeof(*literals); ++i)
+	{
+		const size_t len = strlen(literals[i].s);
+		if (strncmp(p, literals[i].s, len))
+			continue;
+		tok->type = literals[i].type;
+		tok->len = len;
+		return p + len;
+	}
+	
+	// Numbers are limited in size so they can never overflow
+	if (*p == '-')
+		++p;
+	if (*p == '0')
+		++p;
+	else
+	if (!(p = _sfp_digits(p, 18)))
+		return NULL;
+	if (*p == '.' && !(p = _sfp_digits(&p[1], 18)))
+		return NULL;
+	if (*p == 'e' || *p == 'E')
+	{
+		++p;
+		if (*p == '+' || *p == '-')
+			++p;
+		if (!(p = _sfp_digits(p, 2)))
+			return NULL;
+	}
+	tok->type = SFT_NUMBER;
+	tok->len = p - tok->s;
+	return p;
+}
+
+static
+const char *_sfp_array(struct stratum_fast_msg * const msg, struct stratum_fast_tok * const tok, const char *p, const bool toplevel)
+{
+	struct stratum_fast_tok * const elems = toplevel ? msg->_params : &msg->_subtoks[msg->_subtoks_used];
+	const size_t maxelems = toplevel ? STRATUM_FAST_MAX_PARAMS : (STRATUM_FAST_MAX_SUBTOKS - msg->_subtoks_used);
+	
+	tok->type = SFT_ARRAY;
+	tok->s = p;
+	tok->len = 0;
+	tok->elems = elems;
+	p = _sfp_ws(&p[1]);
+	if (*p == ']')
+		return p + 1;
+	while (true)
+	{
+		if (tok->len >= maxelems)
+			return NULL;
+		struct stratum_fast_tok * const elem = &elems[tok->len++];
+		if (*p == '[')
+		{
+			if (!toplevel)
+				return NULL;
+			p = _sfp_array(msg, elem, p, false);
+		}
+		else
+			p = _sfp_scalar(elem, p);
+		if (!p)
+			return NULL;
+		p = _sfp_ws(p);
+		if (*p == ']')
+			break;
+		if (*p != ',')
+			return NULL;
+		p = _sfp_ws(&p[1]);
+	}
+	if (!toplevel)
+		msg->_subtoks_used += tok->len;
+	return p + 1;
+}
+
+static inline
+bool _sfp_keyeq(const struct stratum_fast_tok * const key, const char * const s)
+{
+	return strlen(s) == key->len && !memcmp(key->s, s, key->len);
+}
+
+bool stratum_fast_parse(struct stratum_fast_msg * const msg, const char *p)
+{
+	struct stratum_fast_tok key, ignored, *tok;
+	
+	msg->method.type = msg->id.type = msg->params.type = msg->result.type = msg->error.type = SFT_MISSING;
+	msg->_subtoks_used = 0;
+	
+	p = _sfp_ws(p);
+	if (*p != '{')
+		return false;
+	p = _sfp_ws(&p[1]);
+	if (*p != '}')
+		while (true)
+		{
+			if (*p != '"' || !(p = _sfp_scalar(&key, p)))
+				return false;
+			p = _sfp_ws(p);
+			if (*p != ':')
+				return false;
+			p = _sfp_ws(&p[1]);
+			
+			if (_sfp_keyeq(&key, "method"))
+				tok = &msg->method;
+			else
+			if (_sfp_keyeq(&key, "id"))
+				tok = &msg->id;
+			else
+			if (_sfp_keyeq(&key, "params"))
+				tok = &msg->params;
+			else
+			if (_sfp_keyeq(&key, "result"))
+				tok = &msg->result;
+			else
+			if (_sfp_keyeq(&key, "error"))
+				tok = &msg->error;
+			else
+			{
+				ignored.type = SFT_MISSING;
+				tok = &ignored;
+			}
+			// Leave duplicate keys to jansson
+			if (tok->type != SFT_MISSING)
+				return false;
+			
+			if (*p == '[')
+			{
+				if (tok != &msg->params)
+					return false;
+				p = _sfp_array(msg, tok, p, true);
+			}
+			else
+				p = _sfp_scalar(tok, p);
+			if (!p)
+				return false;
+			
+			p = _sfp_ws(p);
+			if (*p == '}')
+				break;
+			if (*p != ',')
+				return false;
+			p = _sfp_ws(&p[1]);
+		}
+	
+	p = _sfp_ws(&p[1]);
+	return !*p;
+}
+
+bool stratum_fast_strcaseeq(const struct stratum_fast_tok * const tok, const char * const s)
+{
+	return tok->type == SFT_STRING && strlen(s) == tok->len && !strncasecmp(tok->s, s, tok->len);
+}
+
+bool stratum_fast_int(const struct stratum_fast_tok * const tok, long long * const out)
+{
+	if (tok->type != SFT_NUMBER)
+		return false;
+	for (size_t i = 0; i < tok->len; ++i)
+		if (tok->s[i] == '.' || tok->s[i] == 'e' || tok->s[i] == 'E')
+			return false;
+	*out = strtoll(tok->s, NULL, 10);
+	return true;
+}
+
+// Returns params[i] if it exists and is of the given type (SFT_MISSING matches any type)
+const struct stratum_fast_tok *stratum_fast_param(const struct stratum_fast_msg * const msg, const unsigned i, const enum stratum_fast_type type)
+{
+	if (msg->params.type != SFT_ARRAY || i >= msg->params.len)
+		return NULL;
+	const struct stratum_fast_tok * const tok = &msg->params.elems[i];
+	if (type != SFT_MISSING && tok->type != type)
+		return NULL;
+	return tok;
+}
+
+static
+bool _test_sfp_equal(const struct stratum_fast_tok * const tok, json_t * const j)
+{
+	long long ll;
+	
+	switch (tok->type)
+	{
+		case SFT_MISSING:
+			return !j;
+		case SFT_NULL:
+			return json_is_null(j);
+		case SFT_TRUE:
+			return json_is_true(j);
+		case SFT_FALSE:
+			return json_is_false(j);
+		case SFT_NUMBER:
+			if (stratum_fast_int(tok, &ll))
+				return json_is_integer(j) && json_integer_value(j) == ll;
+			return json_is_real(j) && json_real_value(j) == strtod(tok->s, NULL);
+		case SFT_STRING:
+			return json_is_string(j) && strlen(json_string_value(j)) == tok->len && !memcmp(json_string_value(j), tok->s, tok->len);
+		case SFT_ARRAY:
+			if (!(json_is_array(j) && json_array_size(j) == tok->len))
+				return false;
+			for (size_t i = 0; i < tok->len; ++i)
+				if (!_test_sfp_equal(&tok->elems[i], json_array_get(j, i)))
+					return false;
+			return true;
+	}
+	return false;
+}
+
+// Anything the fast path accepts must be understood identically by jansson
+static
+bool _test_stratum_fast_equiv(const char * const s)
+{
+	struct stratum_fast_msg msg;
+	json_error_t jerr;
+	
+	if (!stratum_fast_parse(&msg, s))
+		return true;
+	json_t * const j = JSON_LOADS(s, &jerr);
+	const bool rv = json_is_object(j)
+	             && _test_sfp_equal(&msg.method, json_object_get(j, "method"))
+	             && _test_sfp_equal(&msg.id, json_object_get(j, "id"))
+	             && _test_sfp_equal(&msg.params, json_object_get(j, "params"))
+	             && _test_sfp_equal(&msg.result, json_object_get(j, "result"))
+	             && _test_sfp_equal(&msg.error, json_object_get(j, "error"));
+	if (j)
+		json_decref(j);
+	return rv;
+}
+
+static
+void _test_stratum_fast(const char * const s, const bool expect_fast)
+{
+	struct stratum_fast_msg msg;
+	
+	if (stratum_fast_parse(&msg, s) != expect_fast)
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "stratum_fast_parse \"%s\" test failed; expected %s",
+		       s, expect_fast ? "success" : "fallback");
+	}
+	if (!_test_stratum_fast_equiv(s))
+	{
+		++unittest_failures;
+		applog(LOG_WARNING, "stratum_fast_parse \"%s\" test failed; disagrees with jansson", s);
+	}
+}
+
+void test_stratum_fast()
+{
+	static const char * const fast[] = {
+		"{\"params\": [\"bf\", \"4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000\", \"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008\", \"072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000\", [\"e3e4ab8d0e1bba1c10fb8b7ac5fed28b1b2d0a9c1d5fd1a1f1db0b2a7d3c4e5f\", \"1d2c3b4a59687766554433221100ffeeddccbbaa99887766554433221100ffee\"], \"00000002\", \"1c2ac4af\", \"504e86b9\", false], \"id\": null, \"method\": \"mining.notify\"}",
+		"{\"id\":null,\"method\":\"mining.set_difficulty\",\"params\":[1024]}",
+		"{\"id\":null,\"method\":\"mining.set_difficulty\",\"params\":[0.5]}",
+		"{\"id\":4,\"result\":true,\"error\":null}",
+		"{\"method\":\"mining.submit\",\"params\":[\"user.1\",\"5a1b2c3d-3c\",\"00000001\",\"504e86ed\",\"b2957c02\"],\"id\":12}",
+		" { \"jsonrpc\" : \"2.0\" , \"id\" : -0 , \"result\" : 1.5e-07 } \r\n",
+		"{\"id\":\"x\",\"params\":[[],[1,\"a\",null,true],-12.5E+3]}",
+		"{}",
+	};
+	static const char * const slow[] = {
+		"{\"id\":1,\"result\":[[\"mining.notify\",\"ae6812eb4cd7735a302a8a9dd95cf71f\"],\"08000002\",4],\"error\":null}",
+		"{\"id\":5,\"result\":null,\"error\":[23,\"Low difficulty share\",null]}",
+		"{\"id\":1,\"method\":\"mining.authorize\",\"params\":[\"us\\u0065r\",\"x\"]}",
+		"{\"method\":\"caf\xc3\xa9\"}",
+		"{\"id\":1,\"id\":2}",
+		"{\"id\":1} x",
+		"{\"id\":01}",
+		"{\"id\":12345678901234567890}",
+		"{\"id\":1,\"error\":{\"code\":1}}",
+		"{\"id\":1,}",
+		"{\"id\":1,\"params\":[1,]}",
+		"{\"id\":1,\"params\":[[[]]]}",
+		"[\"a\"]",
+		"",
+	};
+	static const char mutchars[] = "{}[],:\"\\ 0123456789-+.eEtrufalsn";
+	char *buf;
+	size_t bufsz = 0;
+	uint32_t seed = 1;
+	
+	for (int i = 0; i < sizeof(fast) / sizeof(*fast); ++i)
+	{
+		_test_stratum_fast(fast[i], true);
+		if (strlen(fast[i]) >= bufsz)
+			bufsz = strlen(fast[i]) + 1;
+	}
+	for (int i = 0; i < sizeof(slow) / sizeof(*slow); ++i)
+		_test_stratum_fast(slow[i], false);
+	
+	// Fuzz with damaged copies of the good messages
+	buf = malloc(bufsz);
+	if (!buf)
+		quithere(1, "Failed to malloc %s", "buf");
+	for (int i = 0; i < 0x4000; ++i)
+	{
+		// bufsz fits the longest of the good messages
+		size_t len = strlen(fast[i % (sizeof(fast) / sizeof(*fast))]);
+		memcpy(buf, fast[i % (sizeof(fast) / sizeof(*fast))], len + 1);
+		for (int j = 0; j <= (i & 3) && len; ++j)
+		{
+			seed = (seed * 1103515245) + 12345;
+			const size_t pos = (seed >> 8) % len;
+			switch ((seed >> 4) & 7)
+			{
+				case 0:
+					buf[len = pos] = '\0';
+					break;
+				case 1:
+					memmove(&buf[pos], &buf[pos + 1], len-- - pos);
+					break;
+				default:
+					buf[pos] = mutchars[(seed >> 16) % (sizeof(mutchars) - 1)];
+			}
+		}
+		if (!_test_stratum_fast_equiv(buf))
+		{
+			++unittest_failures;
+			applog(LOG_WARNING, "stratum_fast_parse fuzz test failed; disagrees with jansson: %s", buf);
+		}
+	}
+	free(buf);
+}
+
+// Common to the jansson and stratum_fast paths
+static
+bool parse_notify_toks(struct pool * const pool, const struct stratum_fast_tok * const params, const size_t nparams)
+{
+	const struct stratum_fast_tok *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit, *ntime, *arr;
+	char *job_id;
+	bool clean;
+	int merkles, i;
+	size_t cb1_len, cb2_len;
+	
+	if (nparams < 8)
+		return false;
+	
+	arr = &params[4];
+	if (arr->type != SFT_ARRAY)
+		return false;
+	
+	merkles = arr->len;
+	for (i = 0; i < merkles; i++)
+		if (arr->elems[i].type != SFT_STRING)
+			return false;
+	
+	prev_hash = &params[1];
+	coinbase1 = &params[2];
+	coinbase2 = &params[3];
+	bbversion = &params[5];
+	nbit = &params[6];
+	ntime = &params[7];
+	clean = (nparams > 8 && params[8].type == SFT_TRUE);
+	
+	if (params[0].type != SFT_STRING || prev_hash->type != SFT_STRING || coinbase1->type != SFT_STRING || coinbase2->type != SFT_STRING || bbversion->type != SFT_STRING || nbit->type != SFT_STRING || ntime->type != SFT_STRING)
+		return false;
+	
+	job_id = malloc(params[0].len + 1);
+	memcpy(job_id, params[0].s, params[0].len);
+	job_id[params[0].len] = '\0';
+	
+	cb1_len = coinbase1->len / 2;
+	cb2_len = coinbase2->len / 2;
+	uint8_t * const coinbase = stratum_notify_begin(pool, job_id, clean, cb1_len, cb2_len, merkles);
+	
+	hex2bin(&pool->swork.header1[0], bbversion->s,  4);
+	hex2bin(&pool->swork.header1[4], prev_hash->s, 32);
+	hex2bin((void*)&pool->swork.ntime, ntime->s, 4);
+	pool->swork.ntime = be32toh(pool->swork.ntime);
+	hex2bin(&pool->swork.diffbits[0], nbit->s, 4);
+	
+	hex2bin(coinbase, coinbase1->s, cb1_len);
+	hex2bin(&coinbase[pool->swork.nonce2_offset + pool->swork.n2size], coinbase2->s, cb2_len);
+	
+	for (i = 0; i < merkles; i++)
+		hex2bin(&bytes_buf(&pool->swork.merkle_bin)[i * 32], arr->elems[i].s, 32);
+	
+	stratum_notify_end(pool);
 
 	applog(LOG_DEBUG, "Received stratum notify from pool %u with job_id=%s",
 	       pool->pool_no, job_id);
 	if (opt_debug && opt_protocol)
 	{
 		applog(LOG_DEBUG, "job_id: %s", job_id);
-		applog(LOG_DEBUG, "prev_hash: %s", prev_hash);
-		applog(LOG_DEBUG, "coinbase1: %s", coinbase1);
-		applog(LOG_DEBUG, "coinbase2: %s", coinbase2);
+		applog(LOG_DEBUG, "prev_hash: %.*s", (int)prev_hash->len, prev_hash->s);
+		applog(LOG_DEBUG, "coinbase1: %.*s", (int)coinbase1->len, coinbase1->s);
+		applog(LOG_DEBUG, "coinbase2: %.*s", (int)coinbase2->len, coinbase2->s);
 		for (i = 0; i < merkles; i++)
-			applog(LOG_DEBUG, "merkle%d: %s", i, json_string_value(json_array_get(arr, i)));
-		applog(LOG_DEBUG, "bbversion: %s", bbversion);
-		applog(LOG_DEBUG, "nbit: %s", nbit);
-		applog(LOG_DEBUG, "ntime: %s", ntime);
+			applog(LOG_DEBUG, "merkle%d: %.*s", i, (int)arr->elems[i].len, arr->elems[i].s);
+		applog(LOG_DEBUG, "bbversion: %.*s", (int)bbversion->len, bbversion->s);
+		applog(LOG_DEBUG, "nbit: %.*s", (int)nbit->len, nbit->s);
+		applog(LOG_DEBUG, "ntime: %.*s", (int)ntime->len, ntime->s);
 		applog(LOG_DEBUG, "clean: %s", clean ? "yes" : "no");
 	}
 
-	/* A notify message is the closest stratum gets to a getwork */
-	pool->getwork_requested++;
-	total_getworks++;
+	return true;
+}
 
-	if ((merkles && (!pool->swork.transparency_probed || rand() <= RAND_MAX / (opt_skip_checks + 1))) || timer_isset(&pool->swork.tv_transparency))
-		if (pool->probed)
-			stratum_probe_transparency(pool);
+// Describes the jansson value as much as parse_notify_toks needs
+static
+void _json_to_stratum_fast_tok(struct stratum_fast_tok * const tok, json_t * const j)
+{
+	if (json_is_string(j))
+	{
+		tok->type = SFT_STRING;
+		tok->s = json_string_value(j);
+		tok->len = strlen(tok->s);
+	}
+	else
+	if (json_is_true(j))
+		tok->type = SFT_TRUE;
+	else
+		tok->type = SFT_NULL;
+}
 
-	ret = true;
-out:
-	return ret;
+static bool parse_notify(struct pool *pool, json_t *val)
+{
+	json_t * const arr = json_array_get(val, 4);
+	const size_t nparams = json_array_size(val);
+	const size_t merkles = json_array_size(arr);
+	struct stratum_fast_tok params[nparams ?: 1], merkle_toks[merkles ?: 1];
+	size_t i;
+	
+	for (i = 0; i < nparams; ++i)
+		_json_to_stratum_fast_tok(&params[i], json_array_get(val, i));
+	if (json_is_array(arr))
+	{
+		for (i = 0; i < merkles; ++i)
+			_json_to_stratum_fast_tok(&merkle_toks[i], json_array_get(arr, i));
+		params[4] = (struct stratum_fast_tok){
+			.type = SFT_ARRAY,
+			.len = merkles,
+			.elems = merkle_toks,
+		};
+	}
+	
+	return parse_notify_toks(pool, params, nparams);
+}
+
+// Parses a "bfg.batch" job line (with the leading "!J" already skipped)
+static
+bool parse_bfg_batch_job(struct pool * const pool, const char * const hex)
+{
+	const size_t hexlen = strlen(hex);
+	if (hexlen % 2 || hexlen < BFG_BATCH_JOB_HDRSZ * 2)
+		return false;
+	
+	// Sized by the pool, so too big for the stack
+	const size_t binlen = hexlen / 2;
+	uint8_t * const bin = malloc(binlen);
+	if (unlikely(!bin))
+		quithere(1, "Failed to malloc %s", "bin");
+	if (!hex2bin(bin, hex, binlen))
+		goto err;
+	
+	const uint32_t handle = upk_u32le(bin, 0);
+	const bool clean = bin[4];
+	const int merkles = bin[0x31];
+	const size_t cb1_len = upk_u16le(bin, 0x32);
+	const size_t cb2_len = upk_u16le(bin, 0x34);
+	if (binlen != BFG_BATCH_JOB_HDRSZ + (merkles * 32) + cb1_len + cb2_len)
+		goto err;
+	
+	char * const job_id = malloc(9);
+	snprintf(job_id, 9, "%08lx", (unsigned long)handle);
+	
+	const uint8_t *p = &bin[BFG_BATCH_JOB_HDRSZ];
+	uint8_t * const coinbase = stratum_notify_begin(pool, job_id, clean, cb1_len, cb2_len, merkles);
+	
+	pool->swork.batch_job = true;
+	pool->swork.batch_handle = handle;
+	memcpy(&pool->swork.header1[0], &bin[5], 4);
+	memcpy(&pool->swork.diffbits[0], &bin[9], 4);
+	pool->swork.ntime = upk_u32be(bin, 0xd);
+	memcpy(&pool->swork.header1[4], &bin[0x11], 32);
+	
+	memcpy(bytes_buf(&pool->swork.merkle_bin), p, merkles * 32);
+	p += merkles * 32;
+	memcpy(coinbase, p, cb1_len);
+	p += cb1_len;
+	memcpy(&coinbase[pool->swork.nonce2_offset + pool->swork.n2size], p, cb2_len);
+	
+	stratum_notify_end(pool);
+	free(bin);
+	
+	applog(LOG_DEBUG, "Received batched job from pool %u with job_id=%s",
+	       pool->pool_no, job_id);
+	
+	return true;
+
+err:
+	free(bin);
+	return false;
 }
 
 static bool parse_diff(struct pool *pool, json_t *val,double e)
@@ -3018,6 +3504,35 @@ static bool stratum_show_message(struct pool *pool, json_t *val, json_t *params)
 	return true;
 }
 
+// Handles the common cases of parse_method without jansson; returns false to fall back to it
+static
+bool parse_method_fast(struct pool * const pool, const char * const s, bool * const ret)
+{
+	struct stratum_fast_msg msg;
+	const struct stratum_fast_tok *tok;
+	
+	if (!stratum_fast_parse(&msg, s))
+		return false;
+	if (!(msg.error.type == SFT_MISSING || msg.error.type == SFT_NULL))
+		return false;
+	
+	if (stratum_fast_strcaseeq(&msg.method, "mining.notify"))
+	{
+		if (msg.params.type != SFT_ARRAY || !parse_notify_toks(pool, msg.params.elems, msg.params.len))
+			return false;
+		pool->stratum_notify = *ret = true;
+		return true;
+	}
+	
+	if (stratum_fast_strcaseeq(&msg.method, "mining.set_difficulty") && (tok = stratum_fast_param(&msg, 0, SFT_NUMBER)))
+	{
+		*ret = parse_diff(pool, NULL, strtod(tok->s, NULL));
+		return true;
+	}
+	
+	return false;
+}
+
 bool parse_method(struct pool *pool, char *s)
 {
 	json_t *val = NULL, *method, *err_val, *params;
@@ -3027,7 +3542,16 @@ bool parse_method(struct pool *pool, char *s)
 
 	if (!s)
 		goto out;
+	if (s[0] == '!')
+	{
+		// "bfg.batch" lines; results are handled by parse_stratum_response
+		if (pool->stratum_batch && s[1] == BBLT_JOB && parse_bfg_batch_job(pool, &s[2]))
+			pool->stratum_notify = ret = true;
+		goto out;
+	}
         applog(LOG_INFO, "JSON Receive Data: %s",s);
+	if (parse_method_fast(pool, s, &ret))
+		goto out;
         val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
@@ -3100,6 +3624,15 @@ bool parse_method(struct pool *pool, char *s)
 		goto out;
 	}
 	
+	if (!strncasecmp(buf, "mining.bfg_batch", 16))
+	{
+		if (json_integer_value(json_array_get(params, 0)) != BFG_BATCH_VERSION)
+			goto out;
+		applog(LOG_DEBUG, "Pool %u: Using batched share submission", pool->pool_no);
+		pool->stratum_batch = BFG_BATCH_VERSION;
+		return_via(out, ret = true);
+	}
+	
 	// Usage: mining.set_goal("goal name", {"malgo":"SHA256d", ...})
 	if (!strncasecmp(buf, "mining.set_goal", 15) && stratum_set_goal(pool, val, params))
 		return_via(out, ret = true);
@@ -3381,6 +3914,7 @@ resend:
 	sockd = true;
 
 	clear_sock(pool);
+	pool->stratum_batch = 0;
 	
 	if (trysuggest)
 	{
@@ -3393,17 +3927,26 @@ resend:
 		recvd = true;
 	}
 	
-	if (uri_get_param_bool(pool->rpc_url, "goalreset", false))
+	const bool goalreset = uri_get_param_bool(pool->rpc_url, "goalreset", false);
+	// Opt-in, since only other BFGMiner instances understand batched shares
+	const bool want_batch = uri_get_param_bool(pool->rpc_url, "batch", false);
+	if (goalreset || want_batch)
 	{
 		// Default: ["notify", "set_difficulty"] (but these must be explicit if mining.capabilities is used)
-		snprintf(s, sizeof(s), "{\"id\":null,\"method\":\"mining.capabilities\",\"params\":[{\"notify\":[],\"set_difficulty\":{},\"set_goal\":[],\"malgo\":{");
-		struct mining_algorithm *malgo;
-		LL_FOREACH(mining_algorithms, malgo)
+		snprintf(s, sizeof(s), "{\"id\":null,\"method\":\"mining.capabilities\",\"params\":[{\"notify\":[],\"set_difficulty\":{}");
+		if (want_batch)
+			tailsprintf(s, sizeof(s), ",\"bfg.batch\":{\"version\":%d}", BFG_BATCH_VERSION);
+		if (goalreset)
 		{
-			tailsprintf(s, sizeof(s), "\"%s\":{}%c", malgo->name, malgo->next ? ',' : '}');
+			tailsprintf(s, sizeof(s), ",\"set_goal\":[],\"malgo\":{");
+			struct mining_algorithm *malgo;
+			LL_FOREACH(mining_algorithms, malgo)
+			{
+				tailsprintf(s, sizeof(s), "\"%s\":{}%c", malgo->name, malgo->next ? ',' : '}');
+			}
+			if (request_target_str)
+				tailsprintf(s, sizeof(s), ",\"suggested_target\":\"%s\"", request_target_str);
 		}
-		if (request_target_str)
-			tailsprintf(s, sizeof(s), ",\"suggested_target\":\"%s\"", request_target_str);
 		tailsprintf(s, sizeof(s), "}]}");
 		_stratum_send(pool, s, strlen(s), true);
 	}
@@ -3913,6 +4456,15 @@ void notifier_init(notifier_t pipefd)
 	pipefd[0] = connecter;
 	pipefd[1] = acceptor;
 #else
+#ifdef HAVE_SYS_EVENTFD_H
+	// One eventfd serves as both ends: wakes add to its counter, and a read clears it
+	const int efd = eventfd(0, EFD_CLOEXEC);
+	if (efd != -1)
+	{
+		pipefd[0] = pipefd[1] = efd;
+		return;
+	}
+#endif
 	if (pipe(pipefd))
 		quithere(1, "Failed to create pipe");
 #endif
@@ -3955,6 +4507,15 @@ void notifier_wake(notifier_t fd)
 {
 	if (fd[1] == INVSOCK)
 		return;
+#ifdef HAVE_SYS_EVENTFD_H
+	if (fd[0] == fd[1])
+	{
+		static const uint64_t one = 1;
+		if (sizeof(one) != write(fd[1], &one, sizeof(one)))
+			applog(LOG_WARNING, "Error trying to wake notifier");
+		return;
+	}
+#endif
 	if (1 !=
 #ifdef WIN32
 	send(fd[1], "\0", 1, 0)
@@ -3967,6 +4528,7 @@ void notifier_wake(notifier_t fd)
 
 void notifier_read(notifier_t fd)
 {
+	// Large enough for an eventfd's 8-byte counter too
 	char buf[0x10];
 #ifdef WIN32
 	IGNORE_RETURN_VALUE(recv(fd[0], buf, sizeof(buf), 0));
@@ -4016,6 +4578,24 @@ void notifier_init_invalid(notifier_t fd)
 	fd[0] = fd[1] = INVSOCK;
 }
 
+/* A notifier any number of threads can watch with edge-triggered epoll: every
+ * wake is a new edge for all of them, and nobody ever reads it, so none can
+ * consume a wake meant for the others. Its counter doubles as a generation
+ * count of wakes. Where eventfd is missing, it is left invalid. */
+bool notifier_init_broadcast(notifier_t fd)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	const int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd != -1)
+	{
+		fd[0] = fd[1] = efd;
+		return true;
+	}
+#endif
+	notifier_init_invalid(fd);
+	return false;
+}
+
 void notifier_destroy(notifier_t fd)
 {
 #ifdef WIN32
@@ -4023,7 +4603,8 @@ void notifier_destroy(notifier_t fd)
 	closesocket(fd[1]);
 #else
 	close(fd[0]);
-	close(fd[1]);
+	if (fd[1] != fd[0])
+		close(fd[1]);
 #endif
 	fd[0] = fd[1] = INVSOCK;
 }
@@ -4033,6 +4614,34 @@ void _bytes_alloc_failure(size_t sz)
 	quit(1, "bytes_resize failed to allocate %lu bytes", (unsigned long)sz);
 }
 
+void bytes_vappendf(bytes_t * const b, const char * const fmt, va_list ap)
+{
+	size_t bufsz = 0x40;
+	va_list ap2;
+	int n;
+	
+	while (true)
+	{
+		char * const buf = bytes_preappend(b, bufsz);
+		va_copy(ap2, ap);
+		n = vsnprintf(buf, bufsz, fmt, ap2);
+		va_end(ap2);
+		if (n < bufsz)
+			break;
+		bufsz = n + 1;
+	}
+	bytes_postappend(b, n);
+}
+
+void bytes_appendf(bytes_t * const b, const char * const fmt, ...)
+{
+	va_list ap;
+	
+	va_start(ap, fmt);
+	bytes_vappendf(b, fmt, ap);
+	va_end(ap);
+}
+
 
 char *trimmed_strdup(const char *s)
 {
@@ -4125,130 +4734,3 @@ bool bm1382_freq_to_reg_data(uint8_t * const out_reg_data, float mhz)
 	return true;
 }
 #endif
-
-
-uint8_t crc5usb(unsigned char *ptr, uint8_t len)
-{
-    uint8_t i, j, k;
-    uint8_t crc = 0x1f;
-	
-    uint8_t crcin[5] = {1, 1, 1, 1, 1};
-    uint8_t crcout[5] = {1, 1, 1, 1, 1};
-    uint8_t din = 0;
-	
-    j = 0x80;
-    k = 0;
-	
-    for (i = 0; i < len; i++)
-    {
-    	if (*ptr & j)
-    		din = 1;
-    	else
-    		din = 0;
-		
-    	crcout[0] = crcin[4] ^ din;
-    	crcout[1] = crcin[0];
-    	crcout[2] = crcin[1] ^ crcin[4] ^ din;
-    	crcout[3] = crcin[2];
-    	crcout[4] = crcin[3];
-		
-        j = j >> 1;
-        k++;
-        if (k == 8)
-        {
-            j = 0x80;
-            k = 0;
-            ptr++;
-        }
-        memcpy(crcin, crcout, 5);
-    }
-	
-    crc = 0;
-    if(crcin[4])
-    	crc |= 0x10;
-	
-    if(crcin[3])
-    	crc |= 0x08;
-	
-    if(crcin[2])
-    	crc |= 0x04;
-	
-    if(crcin[1])
-    	crc |= 0x02;
-	
-    if(crcin[0])
-    	crc |= 0x01;
-	
-    return crc;
-}
-
-static uint8_t _crc8ccitt_table[0x100];
-
-void bfg_init_checksums(void)
-{
-	for (int i = 0; i < 0x100; ++i)
-	{
-		uint8_t crc = i;
-		for (int j = 0; j < 8; ++j)
-			crc = (crc << 1) ^ ((crc & 0x80) ? 7 : 0);
-		_crc8ccitt_table[i] = crc & 0xff;
-	}
-}
-
-uint8_t crc8ccitt(const void * const buf, const size_t buflen)
-{
-	const uint8_t *p = buf;
-	uint8_t crc = 0xff;
-	for (int i = 0; i < buflen; ++i)
-		crc = _crc8ccitt_table[crc ^ *p++];
-	return crc;
-}
-
-static uint16_t crc16tab[] = {
-	0x0000,0x1021,0x2042,0x3063,0x4084,0x50a5,0x60c6,0x70e7,
-	0x8108,0x9129,0xa14a,0xb16b,0xc18c,0xd1ad,0xe1ce,0xf1ef,
-	0x1231,0x0210,0x3273,0x2252,0x52b5,0x4294,0x72f7,0x62d6,
-	0x9339,0x8318,0xb37b,0xa35a,0xd3bd,0xc39c,0xf3ff,0xe3de,
-	0x2462,0x3443,0x0420,0x1401,0x64e6,0x74c7,0x44a4,0x5485,
-	0xa56a,0xb54b,0x8528,0x9509,0xe5ee,0xf5cf,0xc5ac,0xd58d,
-	0x3653,0x2672,0x1611,0x0630,0x76d7,0x66f6,0x5695,0x46b4,
-	0xb75b,0xa77a,0x9719,0x8738,0xf7df,0xe7fe,0xd79d,0xc7bc,
-	0x48c4,0x58e5,0x6886,0x78a7,0x0840,0x1861,0x2802,0x3823,
-	0xc9cc,0xd9ed,0xe98e,0xf9af,0x8948,0x9969,0xa90a,0xb92b,
-	0x5af5,0x4ad4,0x7ab7,0x6a96,0x1a71,0x0a50,0x3a33,0x2a12,
-	0xdbfd,0xcbdc,0xfbbf,0xeb9e,0x9b79,0x8b58,0xbb3b,0xab1a,
-	0x6ca6,0x7c87,0x4ce4,0x5cc5,0x2c22,0x3c03,0x0c60,0x1c41,
-	0xedae,0xfd8f,0xcdec,0xddcd,0xad2a,0xbd0b,0x8d68,0x9d49,
-	0x7e97,0x6eb6,0x5ed5,0x4ef4,0x3e13,0x2e32,0x1e51,0x0e70,
-	0xff9f,0xefbe,0xdfdd,0xcffc,0xbf1b,0xaf3a,0x9f59,0x8f78,
-	0x9188,0x81a9,0xb1ca,0xa1eb,0xd10c,0xc12d,0xf14e,0xe16f,
-	0x1080,0x00a1,0x30c2,0x20e3,0x5004,0x4025,0x7046,0x6067,
-	0x83b9,0x9398,0xa3fb,0xb3da,0xc33d,0xd31c,0xe37f,0xf35e,
-	0x02b1,0x1290,0x22f3,0x32d2,0x4235,0x5214,0x6277,0x7256,
-	0xb5ea,0xa5cb,0x95a8,0x8589,0xf56e,0xe54f,0xd52c,0xc50d,
-	0x34e2,0x24c3,0x14a0,0x0481,0x7466,0x6447,0x5424,0x4405,
-	0xa7db,0xb7fa,0x8799,0x97b8,0xe75f,0xf77e,0xc71d,0xd73c,
-	0x26d3,0x36f2,0x0691,0x16b0,0x6657,0x7676,0x4615,0x5634,
-	0xd94c,0xc96d,0xf90e,0xe92f,0x99c8,0x89e9,0xb98a,0xa9ab,
-	0x5844,0x4865,0x7806,0x6827,0x18c0,0x08e1,0x3882,0x28a3,
-	0xcb7d,0xdb5c,0xeb3f,0xfb1e,0x8bf9,0x9bd8,0xabbb,0xbb9a,
-	0x4a75,0x5a54,0x6a37,0x7a16,0x0af1,0x1ad0,0x2ab3,0x3a92,
-	0xfd2e,0xed0f,0xdd6c,0xcd4d,0xbdaa,0xad8b,0x9de8,0x8dc9,
-	0x7c26,0x6c07,0x5c64,0x4c45,0x3ca2,0x2c83,0x1ce0,0x0cc1,
-	0xef1f,0xff3e,0xcf5d,0xdf7c,0xaf9b,0xbfba,0x8fd9,0x9ff8,
-	0x6e17,0x7e36,0x4e55,0x5e74,0x2e93,0x3eb2,0x0ed1,0x1ef0,
-};
-
-static
-uint16_t crc16_floating(uint16_t next_byte, uint16_t seed)
-{
-	return ((seed << 8) ^ crc16tab[(seed >> 8) ^ next_byte]) & 0xFFFF;
-}
-
-uint16_t crc16(const void *p, size_t sz, uint16_t crc)
-{
-	const uint8_t * const s = p;
-	for (size_t i = 0; i < sz; ++i)
-		crc = crc16_floating(s[i], crc);
-	return crc;
-}
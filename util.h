@@ -13,6 +13,7 @@
 #ifndef BFG_UTIL_H
 #define BFG_UTIL_H
 
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
@@ -22,6 +23,7 @@
 #include <jansson.h>
 
 #include "compat.h"
+#include "crc.h"
 
 #define INVALID_TIMESTAMP ((time_t)-1)
 
@@ -242,6 +244,71 @@ bool auth_stratum(struct pool *pool);
 bool initiate_stratum(struct pool *pool);
 bool restart_stratum(struct pool *pool);
 void suspend_stratum(struct pool *pool);
+
+// "bfg.batch" stratum extension, negotiated between BFGMiner peers with mining.capabilities
+// Each line is '!', a bfg_batch_line_type, and hex-encoded fixed-width records
+// Share lines also carry the username, followed by a space, before the records
+#define BFG_BATCH_VERSION  1
+#define BFG_BATCH_MAX_RECORDS  0x40
+
+enum bfg_batch_line_type {
+	BBLT_SHARES  = 'S',  // Username, a space, then share records
+	BBLT_RESULTS = 'R',  // Result records
+	BBLT_JOB     = 'J',  // One job header, then merkle links, coinbase1, and coinbase2
+};
+
+// Share record: id (LE32), job handle (LE32), ntime (BE32), nonce (LE32), then xnonce2
+#define BFG_BATCH_SHARE_HDRSZ  0x10
+// Result record: id (LE32), bfg_batch_result
+#define BFG_BATCH_RESULT_SZ  5
+// Job header: handle (LE32), clean, version, nbits, ntime (BE32), prevhash, merkle count, coinbase1 length (LE16), coinbase2 length (LE16)
+#define BFG_BATCH_JOB_HDRSZ  0x36
+
+enum bfg_batch_result {
+	BBR_ACCEPTED,
+	BBR_STALE,
+	BBR_JOB_NOT_FOUND,
+	BBR_HIGH_HASH,
+	BBR_OTHER,
+};
+
+// Allocation-free scanner for the flat shapes of common stratum messages
+// Accepts only an object of scalars, where "params" may also be an array of scalars or arrays of scalars
+// Anything else (including strings with escapes or non-ASCII) is rejected, and should be handled by jansson
+enum stratum_fast_type {
+	SFT_MISSING,
+	SFT_NULL,
+	SFT_TRUE,
+	SFT_FALSE,
+	SFT_NUMBER,
+	SFT_STRING,
+	SFT_ARRAY,
+};
+
+struct stratum_fast_tok {
+	enum stratum_fast_type type;
+	const char *s;  // Strings: contents without quotes; others: raw JSON text (not NUL-terminated)
+	size_t len;     // Arrays: number of elems
+	const struct stratum_fast_tok *elems;
+};
+
+#define STRATUM_FAST_MAX_PARAMS   0x10
+#define STRATUM_FAST_MAX_SUBTOKS  0x40
+
+struct stratum_fast_msg {
+	struct stratum_fast_tok method, id, params, result, error;
+
+	struct stratum_fast_tok _params[STRATUM_FAST_MAX_PARAMS];
+	struct stratum_fast_tok _subtoks[STRATUM_FAST_MAX_SUBTOKS];
+	int _subtoks_used;
+};
+
+extern bool stratum_fast_parse(struct stratum_fast_msg *, const char *);
+extern bool stratum_fast_strcaseeq(const struct stratum_fast_tok *, const char *);
+extern bool stratum_fast_int(const struct stratum_fast_tok *, long long *out);
+extern const struct stratum_fast_tok *stratum_fast_param(const struct stratum_fast_msg *, unsigned i, enum stratum_fast_type);
+extern void test_stratum_fast();
+
 extern void dev_error_update(struct cgpu_info *, enum dev_reason);
 void dev_error(struct cgpu_info *dev, enum dev_reason reason);
 void *realloc_strcat(char *ptr, char *s);
@@ -266,6 +333,7 @@ extern bool notifier_wait(notifier_t, const struct timeval *);
 extern bool notifier_wait_us(notifier_t, unsigned long long usecs);
 extern void notifier_reset(notifier_t);
 extern void notifier_init_invalid(notifier_t);
+extern bool notifier_init_broadcast(notifier_t);
 extern void notifier_destroy(notifier_t);
 
 /* Align a size_t to 4 byte boundaries for fussy arches */
@@ -646,6 +714,9 @@ void bytes_free(bytes_t *b)
 	bytes_init(b);
 }
 
+extern void bytes_vappendf(bytes_t *, const char *fmt, va_list);
+extern void bytes_appendf(bytes_t *, const char *fmt, ...) FORMAT_SYNTAX_CHECK(printf, 2, 3);
+
 
 static inline
 void set_maxfd(int *p_maxfd, int fd)
@@ -833,12 +904,4 @@ extern void run_cmd(const char *cmd);
 extern bool bm1382_freq_to_reg_data(uint8_t *out_reg_data, float mhz);
 
 
-extern uint8_t crc5usb(unsigned char *ptr, uint8_t len);
-extern void bfg_init_checksums(void);
-extern uint8_t crc8ccitt(const void *, size_t);
-
-extern uint16_t crc16(const void *, size_t, uint16_t init);
-#define crc16ffff(  DATA, SZ)  crc16(DATA, SZ, 0xffff)
-#define crc16xmodem(DATA, SZ)  crc16(DATA, SZ, 0)
-
 #endif /* __UTIL_H__ */